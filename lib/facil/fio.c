@@ -21,6 +21,12 @@ Feel free to copy, use and enjoy according to the license provided.
 #include <sys/mman.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -140,6 +146,12 @@ struct fio_packet_s {
   } data;
   uintptr_t offset;
   uintptr_t length;
+  /* bytes charged to the connection's memory budget */
+  uintptr_t charged;
+  /* message key, used by the `FIO_QUEUE_KEEP_LATEST` policy */
+  uintptr_t key;
+  /* the packet contains a complete message that might be dropped */
+  uint8_t droppable;
 };
 
 /** Connection data (fd_data) */
@@ -150,6 +162,14 @@ typedef struct {
   fio_packet_s **packet_last;
   /** The number of pending packets that are in the queue. */
   size_t packet_count;
+  /** Bytes charged to the connection (see `fio_uuid_mem_charge`). */
+  size_t mem;
+  /** The number of buffered bytes in the queue. */
+  size_t packet_bytes;
+  /** Send queue limits (see `fio_queue_limit_set`). */
+  size_t queue_limit;
+  uint32_t queue_limit_count;
+  uint8_t queue_policy;
   /* Data sent so far */
   size_t sent;
   /* fd protocol */
@@ -170,6 +190,8 @@ typedef struct {
   uint8_t open;
   /** indicated that the connection should be closed. */
   uint8_t close;
+  /** indicates the connection was scheduled for eviction (memory budget). */
+  uint8_t evicted;
   /** peer address length */
   uint8_t addr_len;
   /** peer address length */
@@ -206,6 +228,22 @@ typedef struct {
   uint32_t max_protocol_fd;
   /* timer handler */
   pid_t parent;
+  /* connection data chunks that were initialized (see `fio_fd_commit`) */
+  uint8_t *committed;
+  /* one past the highest fd in an initialized chunk */
+  uint32_t committed_end;
+  /* connection data initialization lock */
+  fio_lock_i commit_lock;
+  /* eviction policy (see `fio_mem_budget_set`) */
+  uint8_t mem_policy;
+  /* eviction task lock */
+  fio_lock_i mem_evict_lock;
+  /* bytes charged to all connections */
+  size_t mem_charged;
+  /* per connection memory budget (0 == none) */
+  size_t mem_limit;
+  /* process wide memory ceiling (0 == none) */
+  size_t mem_ceiling;
 #if FIO_ENGINE_POLL
   struct pollfd *poll;
 #endif
@@ -232,7 +270,16 @@ union protocol_metadata_union_u {
   protocol_metadata_s meta;
 };
 
+/*
+ * Connection data is initialized lazily, in chunks of fds, when an fd is first
+ * used. Untouched chunks remain uncommitted (zero) memory, so memory use (and
+ * `fork` overhead) follows the number of connections, not the fd limit.
+ */
+#define FIO_FD_CHUNK_LOG 8
+
 #define fd_data(fd) (fio_data->info[(uintptr_t)(fd)])
+#define fd_is_committed(fd)                                                    \
+  (fio_data->committed[(uintptr_t)(fd) >> FIO_FD_CHUNK_LOG])
 #define uuid_data(uuid) fd_data(fio_uuid2fd((uuid)))
 #define fd2uuid(fd)                                                            \
   ((intptr_t)((((uintptr_t)(fd)) << 8) | fd_data((fd)).counter))
@@ -290,6 +337,47 @@ static void fio_max_fd_shrink(void) {
   fio_unlock(&fio_data->lock);
 }
 
+/* initializes the connection data chunk containing `fd`. */
+static void fio_fd_commit_chunk(uintptr_t fd) {
+  const size_t chunk = fd >> FIO_FD_CHUNK_LOG;
+  size_t start = chunk << FIO_FD_CHUNK_LOG;
+  size_t end = start + ((size_t)1 << FIO_FD_CHUNK_LOG);
+  if (end > fio_data->capa)
+    end = fio_data->capa;
+  fio_lock(&fio_data->commit_lock);
+  if (fio_data->committed[chunk])
+    goto finish;
+#if FIO_ENGINE_POLL
+  /* `fio_poll` scans the committed range, so chunks are committed in order */
+  start = fio_data->committed_end;
+#endif
+  for (size_t i = start; i < end; ++i) {
+    /* locks might be held (i.e., the `protocol_lock` when opening the fd) */
+    fd_data(i) = (fio_fd_data_s){
+        .sock_lock = fd_data(i).sock_lock,
+        .protocol_lock = fd_data(i).protocol_lock,
+        .rw_hooks = (fio_rw_hook_s *)&FIO_DEFAULT_RW_HOOKS,
+        .counter = 1,
+        .packet_last = &fd_data(i).packet,
+    };
+#if FIO_ENGINE_POLL
+    fio_data->poll[i].fd = -1;
+#endif
+  }
+  if (fio_data->committed_end < end)
+    fio_data->committed_end = end;
+  for (size_t i = start >> FIO_FD_CHUNK_LOG; i <= chunk; ++i)
+    fio_atomic_xchange(fio_data->committed + i, 1);
+finish:
+  fio_unlock(&fio_data->commit_lock);
+}
+
+/* makes sure the connection data for `fd` was initialized. */
+static inline void fio_fd_commit(intptr_t fd) {
+  if (!fd_is_committed(fd))
+    fio_fd_commit_chunk((uintptr_t)fd);
+}
+
 /* resets connection data, marking it as either open or closed. */
 static inline int fio_clear_fd(intptr_t fd, uint8_t is_open) {
   fio_packet_s *packet;
@@ -297,12 +385,15 @@ static inline int fio_clear_fd(intptr_t fd, uint8_t is_open) {
   fio_rw_hook_s *rw_hooks;
   void *rw_udata;
   fio_uuid_links_s links;
+  fio_fd_commit(fd);
   fio_lock(&(fd_data(fd).sock_lock));
   links = fd_data(fd).links;
   packet = fd_data(fd).packet;
   protocol = fd_data(fd).protocol;
   rw_hooks = fd_data(fd).rw_hooks;
   rw_udata = fd_data(fd).rw_udata;
+  if (fd_data(fd).mem)
+    fio_atomic_sub(&fio_data->mem_charged, fd_data(fd).mem);
   fd_data(fd) = (fio_fd_data_s){
       .open = is_open,
       .sock_lock = fd_data(fd).sock_lock,
@@ -380,6 +471,7 @@ inline static void protocol_unlock(fio_protocol_s *pr,
 #define uuid_is_valid(uuid)                                                    \
   ((intptr_t)(uuid) != -1 &&                                                   \
    ((uint32_t)fio_uuid2fd((uuid))) < fio_data->capa &&                         \
+   fd_is_committed(fio_uuid2fd((uuid))) &&                                     \
    ((uintptr_t)(uuid)&0xFF) == uuid_data((uuid)).counter)
 
 /* public API. */
@@ -405,6 +497,7 @@ UUID validation and state
 intptr_t fio_fd2uuid(int fd) {
   if (fd < 0 || (size_t)fd >= fio_data->capa)
     return -1;
+  fio_fd_commit(fd);
   if (!fd_data(fd).open) {
     fio_lock(&fd_data(fd).protocol_lock);
     fio_clear_fd(fd, 1);
@@ -535,6 +628,270 @@ invalid:
   return -1;
 }
 
+/* *****************************************************************************
+Connection Memory Budgets
+***************************************************************************** */
+
+static void fio_mem_evict_task(void *ignr1, void *ignr2);
+
+/* closes a connection that exceeded its memory budget. */
+static void fio_mem_evict_uuid_task(void *uuid_, void *mem_) {
+  intptr_t uuid = (intptr_t)uuid_;
+  if (!uuid_is_valid(uuid))
+    return;
+  FIO_LOG_WARNING("(%d) evicting connection %p (%zu bytes charged).",
+                  (int)getpid(), uuid_, (size_t)mem_);
+  fio_force_close(uuid);
+}
+
+/* schedules a connection's eviction (once). */
+static inline void fio_mem_evict_uuid(intptr_t uuid) {
+  if (uuid_data(uuid).evicted)
+    return;
+  uuid_data(uuid).evicted = 1;
+  fio_defer(fio_mem_evict_uuid_task, (void *)uuid,
+            (void *)uuid_data(uuid).mem);
+}
+
+/* updates the memory charged to a valid connection. */
+static inline size_t fio_mem_charge_unsafe(intptr_t uuid, ssize_t bytes) {
+  size_t ret;
+  if (bytes < 0) {
+    fio_atomic_sub(&fio_data->mem_charged, (size_t)(0 - bytes));
+    return fio_atomic_sub(&uuid_data(uuid).mem, (size_t)(0 - bytes));
+  }
+  ret = fio_atomic_add(&uuid_data(uuid).mem, (size_t)bytes);
+  size_t total = fio_atomic_add(&fio_data->mem_charged, (size_t)bytes);
+  if (fio_data->mem_limit && ret > fio_data->mem_limit)
+    fio_mem_evict_uuid(uuid);
+  if (fio_data->mem_ceiling && total > fio_data->mem_ceiling &&
+      !fio_trylock(&fio_data->mem_evict_lock))
+    fio_defer(fio_mem_evict_task, NULL, NULL);
+  return ret;
+}
+
+/* an eviction candidate */
+typedef struct {
+  size_t fd;
+  size_t mem;
+  time_t active;
+} fio_mem_victim_s;
+
+/* tests if `a` should be evicted before `b`. */
+static inline int fio_mem_victim_first(fio_mem_victim_s *a,
+                                       fio_mem_victim_s *b) {
+  if (fio_data->mem_policy == FIO_MEM_EVICT_IDLE)
+    return a->active < b->active;
+  return a->mem > b->mem;
+}
+
+/* restores the heap below `i`, so the next victim is at the top. */
+static void fio_mem_victim_sift(fio_mem_victim_s *heap, size_t count,
+                                size_t i) {
+  for (;;) {
+    size_t top = i;
+    const size_t child = (i << 1) + 1;
+    if (child < count && fio_mem_victim_first(heap + child, heap + top))
+      top = child;
+    if (child + 1 < count && fio_mem_victim_first(heap + child + 1, heap + top))
+      top = child + 1;
+    if (top == i)
+      return;
+    fio_mem_victim_s tmp = heap[i];
+    heap[i] = heap[top];
+    heap[top] = tmp;
+    i = top;
+  }
+}
+
+/*
+ * Closes connections until the memory ceiling is respected.
+ *
+ * The candidates are collected in a single pass over the fd table and placed
+ * in a heap, so only the victims are ordered.
+ */
+static void fio_mem_evict_task(void *ignr1, void *ignr2) {
+  size_t total = fio_data->mem_charged;
+  fio_mem_victim_s *heap = NULL;
+  size_t count = 0;
+  size_t capa = 0;
+  if (!fio_data->mem_ceiling || total <= fio_data->mem_ceiling)
+    goto finish;
+  const size_t limit = fio_data->committed_end;
+  for (size_t i = 0; i < limit; ++i) {
+    if (!fd_is_committed(i)) {
+      i |= ((size_t)1 << FIO_FD_CHUNK_LOG) - 1; /* skip to the next chunk */
+      continue;
+    }
+    if (!fd_data(i).open || !fd_data(i).mem || fd_data(i).evicted)
+      continue;
+    if (count == capa) {
+      capa = (capa ? capa << 1 : 64);
+      heap = realloc(heap, sizeof(*heap) * capa);
+      FIO_ASSERT_ALLOC(heap);
+    }
+    heap[count++] = (fio_mem_victim_s){
+        .fd = i, .mem = fd_data(i).mem, .active = fd_data(i).active};
+  }
+  for (size_t i = count >> 1; i--;)
+    fio_mem_victim_sift(heap, count, i);
+  while (count && total > fio_data->mem_ceiling) {
+    total = (total > heap[0].mem ? total - heap[0].mem : 0);
+    fio_mem_evict_uuid(fd2uuid(heap[0].fd));
+    heap[0] = heap[--count];
+    fio_mem_victim_sift(heap, count, 0);
+  }
+  free(heap);
+finish:
+  fio_unlock(&fio_data->mem_evict_lock);
+  (void)ignr1;
+  (void)ignr2;
+}
+
+/* public API. */
+size_t fio_uuid_mem_charge(intptr_t uuid, ssize_t bytes) {
+  if (!uuid_is_valid(uuid)) {
+    errno = EBADF;
+    return 0;
+  }
+  if (!bytes)
+    return uuid_data(uuid).mem;
+  return fio_mem_charge_unsafe(uuid, bytes);
+}
+
+/* public API. */
+size_t fio_uuid_mem(intptr_t uuid) {
+  if (!uuid_is_valid(uuid))
+    return 0;
+  return uuid_data(uuid).mem;
+}
+
+/* public API. */
+size_t fio_mem_charged(void) { return fio_data->mem_charged; }
+
+/* public API. */
+void fio_mem_budget_set(size_t connection_limit, size_t ceiling,
+                        fio_mem_evict_e policy) {
+  fio_data->mem_limit = connection_limit;
+  fio_data->mem_ceiling = ceiling;
+  fio_data->mem_policy = (uint8_t)policy;
+}
+
+/* *****************************************************************************
+Send Queue Limits
+***************************************************************************** */
+
+/* frees a list of packets. */
+static void fio_packet_free_list(fio_packet_s *packet) {
+  while (packet) {
+    fio_packet_s *tmp = packet;
+    packet = packet->next;
+    fio_packet_free(tmp);
+  }
+}
+
+/* accounts for a buffer packet entering (1) or leaving (-1) the queue. */
+static inline void fio_packet_account_unsafe(intptr_t uuid,
+                                             fio_packet_s *packet, int dir) {
+  if (!packet->charged)
+    return;
+  if (dir > 0) {
+    uuid_data(uuid).packet_bytes += packet->charged;
+    fio_mem_charge_unsafe(uuid, (ssize_t)packet->charged);
+  } else {
+    uuid_data(uuid).packet_bytes -= packet->charged;
+    fio_mem_charge_unsafe(uuid, 0 - (ssize_t)packet->charged);
+  }
+}
+
+/* tests if adding `packet` would exceed the connection's send queue limits. */
+static inline int fio_queue_over_limit(intptr_t uuid, fio_packet_s *packet) {
+  return (uuid_data(uuid).queue_limit &&
+          uuid_data(uuid).packet_bytes + packet->charged >
+              uuid_data(uuid).queue_limit) ||
+         (uuid_data(uuid).queue_limit_count &&
+          uuid_data(uuid).packet_count >= uuid_data(uuid).queue_limit_count);
+}
+
+/*
+ * Removes a queued packet (at `pos`), placing it in the `dropped` list.
+ *
+ * Only complete (droppable) messages that weren't partially sent are removed.
+ */
+static inline int fio_queue_drop_unsafe(intptr_t uuid, fio_packet_s **pos,
+                                        fio_packet_s **dropped) {
+  fio_packet_s *packet = *pos;
+  if (!packet->droppable || packet->length != packet->charged)
+    return -1;
+  *pos = packet->next;
+  if (uuid_data(uuid).packet_last == &packet->next)
+    uuid_data(uuid).packet_last = pos;
+  fio_atomic_sub(&uuid_data(uuid).packet_count, 1);
+  fio_packet_account_unsafe(uuid, packet, -1);
+  packet->next = *dropped;
+  *dropped = packet;
+  return 0;
+}
+
+/*
+ * Enforces the connection's send queue limits before `packet` is queued.
+ *
+ * Returns 1 if the new packet should be dropped. Queued packets that were
+ * dropped are placed in the `dropped` list (to be freed after unlocking).
+ */
+static int fio_queue_limit_unsafe(intptr_t uuid, fio_packet_s *packet,
+                                  fio_packet_s **dropped) {
+  fio_packet_s **pos;
+  if (!fio_queue_over_limit(uuid, packet))
+    return 0;
+  switch ((fio_queue_policy_e)uuid_data(uuid).queue_policy) {
+  case FIO_QUEUE_DISCONNECT:
+    fio_mem_evict_uuid(uuid);
+    return 1;
+  case FIO_QUEUE_KEEP_LATEST:
+    pos = &uuid_data(uuid).packet;
+    while (packet->key && *pos) {
+      if ((*pos)->key != packet->key ||
+          fio_queue_drop_unsafe(uuid, pos, dropped))
+        pos = &(*pos)->next;
+    }
+    if (!fio_queue_over_limit(uuid, packet))
+      return 0;
+    return packet->droppable;
+  case FIO_QUEUE_DROP_OLDEST:
+    pos = &uuid_data(uuid).packet;
+    while (*pos && fio_queue_over_limit(uuid, packet)) {
+      if (fio_queue_drop_unsafe(uuid, pos, dropped))
+        pos = &(*pos)->next;
+    }
+    return 0;
+  case FIO_QUEUE_DROP_NEWEST: /* fallthrough */
+  default:
+    return packet->droppable;
+  }
+}
+
+/* public API. */
+int fio_queue_limit_set(intptr_t uuid, size_t bytes, size_t packets,
+                        fio_queue_policy_e policy) {
+  if (!uuid_is_valid(uuid))
+    goto invalid;
+  fio_lock(&uuid_data(uuid).sock_lock);
+  if (!uuid_is_valid(uuid))
+    goto locked_invalid;
+  uuid_data(uuid).queue_limit = bytes;
+  uuid_data(uuid).queue_limit_count =
+      (packets > (uint32_t)-1 ? (uint32_t)-1 : (uint32_t)packets);
+  uuid_data(uuid).queue_policy = (uint8_t)policy;
+  fio_unlock(&uuid_data(uuid).sock_lock);
+  return 0;
+locked_invalid:
+  fio_unlock(&uuid_data(uuid).sock_lock);
+invalid:
+  errno = EBADF;
+  return -1;
+}
+
 /* *****************************************************************************
 Section Start Marker
 
@@ -1310,6 +1667,409 @@ int fio_run_every(size_t milliseconds, size_t repetitions, void (*task)(void *),
   return 0;
 }
 
+/* *****************************************************************************
+Futures / Promises (combinators over fio_defer)
+***************************************************************************** */
+
+typedef struct fio_future_link_s fio_future_link_s;
+
+struct fio_future_s {
+  /* continuations waiting for the future to settle (LIFO) */
+  fio_future_link_s *links;
+  void *result;
+  uintptr_t ref;
+  /* inputs still pending (used by `all` / `any`) */
+  uintptr_t pending;
+  int error;
+  fio_lock_i lock;
+  uint8_t state;
+};
+
+typedef enum {
+  FIO_FUTURE_LINK_THEN,
+  FIO_FUTURE_LINK_ALL,
+  FIO_FUTURE_LINK_ANY,
+  FIO_FUTURE_LINK_FOLLOW,
+  FIO_FUTURE_LINK_WEAK,
+} fio_future_link_type_e;
+
+struct fio_future_link_s {
+  fio_future_link_s *next;
+  /* the dependent future (the link owns a reference) */
+  fio_future_s *target;
+  void *(*task)(fio_future_s *, void *);
+  void *udata;
+  uint8_t type;
+};
+
+/* a weak reference, cleared once the future settles (or is freed) */
+typedef struct {
+  fio_future_s *future;
+  uintptr_t ref;
+  fio_lock_i lock;
+} fio_future_weak_s;
+
+/* futures, links and weak references share the same slab allocated node */
+typedef union fio_future_node_u fio_future_node_u;
+union fio_future_node_u {
+  fio_future_node_u *next;
+  fio_future_s future;
+  fio_future_link_s link;
+  fio_future_weak_s weak;
+};
+
+/* about a page of memory per slab */
+#define FIO_FUTURE_SLAB_COUNT                                                  \
+  ((4096 - sizeof(void *)) / sizeof(fio_future_node_u))
+
+typedef struct fio_future_slab_s fio_future_slab_s;
+struct fio_future_slab_s {
+  fio_future_slab_s *next;
+  fio_future_node_u nodes[FIO_FUTURE_SLAB_COUNT];
+};
+
+static struct {
+  fio_future_node_u *available;
+  fio_future_slab_s *slabs;
+  size_t in_use;
+  fio_lock_i lock;
+} fio_future_pool = {.lock = FIO_LOCK_INIT};
+
+/* Use `malloc` for slabs, since they are never returned before cleanup. */
+static void *fio_future_node_alloc(void) {
+  fio_future_node_u *node;
+  fio_lock(&fio_future_pool.lock);
+  if (!fio_future_pool.available) {
+    fio_future_slab_s *slab = malloc(sizeof(*slab));
+    if (!slab) {
+      fio_unlock(&fio_future_pool.lock);
+      return NULL;
+    }
+    slab->next = fio_future_pool.slabs;
+    fio_future_pool.slabs = slab;
+    for (size_t i = 0; i < FIO_FUTURE_SLAB_COUNT; ++i) {
+      slab->nodes[i].next = fio_future_pool.available;
+      fio_future_pool.available = slab->nodes + i;
+    }
+  }
+  node = fio_future_pool.available;
+  fio_future_pool.available = node->next;
+  ++fio_future_pool.in_use;
+  fio_unlock(&fio_future_pool.lock);
+  *node = (fio_future_node_u){.next = NULL};
+  return node;
+}
+
+static void fio_future_node_free(void *node_) {
+  fio_future_node_u *node = node_;
+  fio_lock(&fio_future_pool.lock);
+  node->next = fio_future_pool.available;
+  fio_future_pool.available = node;
+  --fio_future_pool.in_use;
+  fio_unlock(&fio_future_pool.lock);
+}
+
+static void fio_future_pool_destroy(void) {
+  while (fio_future_pool.slabs) {
+    fio_future_slab_s *slab = fio_future_pool.slabs;
+    fio_future_pool.slabs = slab->next;
+    free(slab);
+  }
+  if (fio_future_pool.in_use)
+    FIO_LOG_DEBUG("(fio) %zu future objects weren't released.",
+                  fio_future_pool.in_use);
+  fio_future_pool.available = NULL;
+  fio_future_pool.in_use = 0;
+}
+
+static void fio_future_on_fork(void) {
+  fio_future_pool.lock = FIO_LOCK_INIT;
+}
+
+/** Creates a new (pending) future. Returns NULL on error. */
+fio_future_s *fio_future_new(void) {
+  fio_future_s *f = fio_future_node_alloc();
+  if (!f)
+    return NULL;
+  *f = (fio_future_s){.ref = 1, .lock = FIO_LOCK_INIT};
+  return f;
+}
+
+/** Increases the future's reference count, returning the future. */
+fio_future_s *fio_future_dup(fio_future_s *f) {
+  if (f)
+    fio_atomic_add(&f->ref, 1);
+  return f;
+}
+
+/* releases a weak reference (see `fio_future_timeout`). */
+static void fio_future_weak_free(fio_future_weak_s *w) {
+  if (!fio_atomic_sub(&w->ref, 1))
+    fio_future_node_free(w);
+}
+
+/* clears a weak reference and releases the link's reference to it. */
+static void fio_future_weak_clear(fio_future_weak_s *w) {
+  fio_lock(&w->lock);
+  w->future = NULL;
+  fio_unlock(&w->lock);
+  fio_future_weak_free(w);
+}
+
+/* returns a new reference to the weakly referenced future (or NULL). */
+static fio_future_s *fio_future_weak_dup(fio_future_weak_s *w) {
+  fio_future_s *f;
+  uintptr_t ref;
+  fio_lock(&w->lock);
+  f = w->future;
+  /* the future might be freed (the reference is cleared before recycling) */
+  do {
+    ref = f ? f->ref : 0;
+  } while (ref && !__sync_bool_compare_and_swap(&f->ref, ref, ref + 1));
+  fio_unlock(&w->lock);
+  return (ref ? f : NULL);
+}
+
+/** Releases a reference to the future (see `fio_future_new`). */
+void fio_future_free(fio_future_s *f) {
+  if (!f || fio_atomic_sub(&f->ref, 1))
+    return;
+  /* a pending future could still hold links if it was never settled */
+  while (f->links) {
+    fio_future_link_s *link = f->links;
+    f->links = link->next;
+    if (link->type == FIO_FUTURE_LINK_WEAK)
+      fio_future_weak_clear(link->udata);
+    fio_future_free(link->target);
+    fio_future_node_free(link);
+  }
+  fio_future_node_free(f);
+}
+
+/** Returns the future's state. */
+fio_future_state_e fio_future_state(fio_future_s *f) {
+  if (!f)
+    return FIO_FUTURE_PENDING;
+  return (fio_future_state_e)f->state;
+}
+
+/** Returns the result of a fulfilled future (NULL if not fulfilled). */
+void *fio_future_result(fio_future_s *f) {
+  if (!f || f->state != FIO_FUTURE_FULFILLED)
+    return NULL;
+  return f->result;
+}
+
+/** Returns the error code of a rejected future (0 if not rejected). */
+int fio_future_error(fio_future_s *f) {
+  if (!f || f->state != FIO_FUTURE_REJECTED)
+    return 0;
+  return f->error;
+}
+
+static int fio_future_settle(fio_future_s *f, uint8_t state, void *result,
+                             int error);
+
+/* performs a `then` continuation - runs as a deferred task */
+static void fio_future_then_task(void *f_, void *link_) {
+  fio_future_s *f = f_;
+  fio_future_link_s *link = link_;
+  void *result = f->result;
+  if (link->task)
+    result = link->task(f, link->udata);
+  fio_future_settle(link->target, f->state,
+                    (f->state == FIO_FUTURE_FULFILLED ? result : NULL),
+                    f->error);
+  fio_future_free(link->target);
+  fio_future_node_free(link);
+  fio_future_free(f);
+}
+
+/* reacts to a settled future - called outside of the future's lock */
+static void fio_future_link_perform(fio_future_s *f, fio_future_link_s *link) {
+  switch ((fio_future_link_type_e)link->type) {
+  case FIO_FUTURE_LINK_THEN:
+    fio_defer_push_task(fio_future_then_task, fio_future_dup(f), link);
+    return;
+  case FIO_FUTURE_LINK_ALL:
+    if (f->state == FIO_FUTURE_REJECTED)
+      fio_future_settle(link->target, FIO_FUTURE_REJECTED, NULL, f->error);
+    else if (!fio_atomic_sub(&link->target->pending, 1))
+      fio_future_settle(link->target, FIO_FUTURE_FULFILLED, NULL, 0);
+    break;
+  case FIO_FUTURE_LINK_ANY:
+    if (f->state == FIO_FUTURE_FULFILLED)
+      fio_future_settle(link->target, FIO_FUTURE_FULFILLED, f->result, 0);
+    else if (!fio_atomic_sub(&link->target->pending, 1))
+      fio_future_settle(link->target, FIO_FUTURE_REJECTED, NULL, f->error);
+    break;
+  case FIO_FUTURE_LINK_FOLLOW:
+    fio_future_settle(link->target, f->state, f->result, f->error);
+    break;
+  case FIO_FUTURE_LINK_WEAK:
+    fio_future_weak_clear(link->udata);
+    break;
+  }
+  fio_future_free(link->target);
+  fio_future_node_free(link);
+}
+
+/* settles a future, the first call wins */
+static int fio_future_settle(fio_future_s *f, uint8_t state, void *result,
+                             int error) {
+  fio_future_link_s *links;
+  fio_future_link_s *ordered = NULL;
+  fio_lock(&f->lock);
+  if (f->state) {
+    fio_unlock(&f->lock);
+    return -1;
+  }
+  f->result = result;
+  f->error = error;
+  f->state = state;
+  links = f->links;
+  f->links = NULL;
+  fio_unlock(&f->lock);
+  /* links are collected in reverse, perform them in the order of attachment */
+  while (links) {
+    fio_future_link_s *tmp = links;
+    links = links->next;
+    tmp->next = ordered;
+    ordered = tmp;
+  }
+  while (ordered) {
+    fio_future_link_s *tmp = ordered;
+    ordered = ordered->next;
+    fio_future_link_perform(f, tmp);
+  }
+  return 0;
+}
+
+/* attaches a link to a future, performing it immediately if settled */
+static void fio_future_link_attach(fio_future_s *f, fio_future_link_s *link) {
+  fio_lock(&f->lock);
+  if (!f->state) {
+    link->next = f->links;
+    f->links = link;
+    fio_unlock(&f->lock);
+    return;
+  }
+  fio_unlock(&f->lock);
+  fio_future_link_perform(f, link);
+}
+
+/* creates a link to the target future (adding a reference) */
+static fio_future_link_s *fio_future_link_new(fio_future_s *target,
+                                              uint8_t type) {
+  fio_future_link_s *link = fio_future_node_alloc();
+  FIO_ASSERT_ALLOC(link);
+  *link = (fio_future_link_s){.target = fio_future_dup(target), .type = type};
+  return link;
+}
+
+/** Fulfills the future with the `result` provided. */
+int fio_future_fulfill(fio_future_s *f, void *result) {
+  if (!f)
+    return -1;
+  return fio_future_settle(f, FIO_FUTURE_FULFILLED, result, 0);
+}
+
+/** Rejects the future with the `error` code provided. */
+int fio_future_reject(fio_future_s *f, int error) {
+  if (!f)
+    return -1;
+  return fio_future_settle(f, FIO_FUTURE_REJECTED, NULL, error);
+}
+
+/** Schedules `task` (using `fio_defer`) to be performed once `f` is settled. */
+fio_future_s *fio_future_then(fio_future_s *f,
+                              void *(*task)(fio_future_s *settled, void *udata),
+                              void *udata) {
+  if (!f)
+    return NULL;
+  fio_future_s *target = fio_future_new();
+  if (!target)
+    return NULL;
+  fio_future_link_s *link = fio_future_link_new(target, FIO_FUTURE_LINK_THEN);
+  link->task = task;
+  link->udata = udata;
+  fio_future_link_attach(f, link);
+  return target;
+}
+
+/* common code for `all` and `any` */
+static fio_future_s *fio_future_combine(fio_future_s **futures, size_t count,
+                                        uint8_t type) {
+  if (!futures && count)
+    return NULL;
+  for (size_t i = 0; i < count; ++i) {
+    if (!futures[i])
+      return NULL;
+  }
+  fio_future_s *target = fio_future_new();
+  if (!target)
+    return NULL;
+  if (!count) {
+    if (type == FIO_FUTURE_LINK_ALL)
+      fio_future_settle(target, FIO_FUTURE_FULFILLED, NULL, 0);
+    else
+      fio_future_settle(target, FIO_FUTURE_REJECTED, NULL, ECANCELED);
+    return target;
+  }
+  target->pending = count;
+  for (size_t i = 0; i < count; ++i) {
+    fio_future_link_attach(futures[i], fio_future_link_new(target, type));
+  }
+  return target;
+}
+
+/** Returns a future that's fulfilled once all the `futures` are fulfilled. */
+fio_future_s *fio_future_all(fio_future_s **futures, size_t count) {
+  return fio_future_combine(futures, count, FIO_FUTURE_LINK_ALL);
+}
+
+/** Returns a future that's fulfilled by the first fulfilled future. */
+fio_future_s *fio_future_any(fio_future_s **futures, size_t count) {
+  return fio_future_combine(futures, count, FIO_FUTURE_LINK_ANY);
+}
+
+/* timer task - rejects the future unless it was already settled (or freed) */
+static void fio_future_timeout_task(void *w) {
+  fio_future_s *f = fio_future_weak_dup(w);
+  if (!f)
+    return;
+  fio_future_settle(f, FIO_FUTURE_REJECTED, NULL, ETIMEDOUT);
+  fio_future_free(f);
+}
+
+/** Returns a future that's rejected if `f` isn't settled in time. */
+fio_future_s *fio_future_timeout(fio_future_s *f, size_t milliseconds) {
+  if (!f)
+    return NULL;
+  fio_future_s *target = fio_future_new();
+  if (!target)
+    return NULL;
+  fio_future_link_attach(f, fio_future_link_new(target, FIO_FUTURE_LINK_FOLLOW));
+  if (target->state)
+    return target;
+  /*
+   * The timer holds a weak reference (released by `on_finish`), so a settled
+   * (or discarded) future isn't kept alive until the timer expires.
+   */
+  fio_future_weak_s *w = fio_future_node_alloc();
+  FIO_ASSERT_ALLOC(w);
+  *w = (fio_future_weak_s){.future = target, .ref = 2, .lock = FIO_LOCK_INIT};
+  fio_future_link_s *link = fio_future_link_new(NULL, FIO_FUTURE_LINK_WEAK);
+  link->udata = w;
+  fio_future_link_attach(target, link);
+  if (fio_run_every(milliseconds, 1, fio_future_timeout_task, w,
+                    (void (*)(void *))fio_future_weak_free) == -1) {
+    fio_future_weak_free(w);
+    fio_future_settle(target, FIO_FUTURE_REJECTED, NULL, EINVAL);
+  }
+  return target;
+}
+
 /* *****************************************************************************
 Section Start Marker
 
@@ -1366,20 +2126,56 @@ void fio_reap_children(void) {
   }
 }
 
-/* handles the SIGUSR1, SIGINT and SIGTERM signals. */
-static void sig_int_handler(int sig) {
-  switch (sig) {
-#if !FIO_DISABLE_HOT_RESTART
-  case SIGUSR1:
-    fio_signal_children_flag = 1;
-    break;
-#endif
-  case SIGINT:  /* fallthrough */
-  case SIGTERM: /* fallthrough */
-    fio_stop();
-    break;
-  default:
-    break;
+/* memory allocator statistics printing (see `fio_malloc_stats_dump`) */
+static volatile uint8_t fio_malloc_stats_flag = 0;
+static int fio_malloc_stats_signal = 0;
+
+static void fio_malloc_stats_signal_handler(int sig) {
+  fio_malloc_stats_flag = 1;
+  (void)sig;
+}
+
+static void fio_malloc_stats_task(void *ignr_) {
+  fio_malloc_stats_print();
+  (void)ignr_;
+}
+
+/**
+ * Prints the memory allocator's statistics every `milliseconds` (if not 0) and
+ * whenever the process receives `signal` (if not 0, i.e., `SIGUSR2`).
+ */
+void fio_malloc_stats_dump(size_t milliseconds, int signal) {
+  if (milliseconds)
+    fio_run_every(milliseconds, 0, fio_malloc_stats_task, NULL, NULL);
+  if (!signal)
+    return;
+  struct sigaction act, old;
+  memset(&act, 0, sizeof(act));
+  memset(&old, 0, sizeof(old));
+  act.sa_handler = fio_malloc_stats_signal_handler;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = SA_RESTART;
+  if (sigaction(signal, &act, &old)) {
+    perror("couldn't set signal handler");
+    return;
+  }
+  fio_malloc_stats_signal = signal;
+}
+
+/* handles the SIGUSR1, SIGINT and SIGTERM signals. */
+static void sig_int_handler(int sig) {
+  switch (sig) {
+#if !FIO_DISABLE_HOT_RESTART
+  case SIGUSR1:
+    fio_signal_children_flag = 1;
+    break;
+#endif
+  case SIGINT:  /* fallthrough */
+  case SIGTERM: /* fallthrough */
+    fio_stop();
+    break;
+  default:
+    break;
   }
 }
 
@@ -1428,6 +2224,10 @@ static void fio_signal_handler_reset(void) {
   sigaction(SIGUSR1, &act, &old);
 #endif
   sigaction(SIGPIPE, &act, &old);
+  if (fio_malloc_stats_signal) {
+    sigaction(fio_malloc_stats_signal, &act, &old);
+    fio_malloc_stats_signal = 0;
+  }
 }
 
 /**
@@ -1946,7 +2746,7 @@ static inline void fio_poll_remove_write(int fd) {
 /** returns non-zero if events were scheduled, 0 if idle */
 static size_t fio_poll(void) {
   /* shrink fd poll range */
-  size_t end = fio_data->capa;
+  size_t end = fio_data->committed_end;
   size_t start = 0;
   struct pollfd *list = NULL;
   fio_lock(&fio_data->lock);
@@ -2582,10 +3382,10 @@ static inline void fio_sock_packet_rotate_unsafe(uintptr_t fd) {
   if (!packet->next) {
     fd_data(fd).packet_last = &fd_data(fd).packet;
     fd_data(fd).packet_count = 0;
-  } else if (&packet->next == fd_data(fd).packet_last) {
-    fd_data(fd).packet_last = &fd_data(fd).packet;
+  } else {
     fio_atomic_sub(&fd_data(fd).packet_count, 1);
   }
+  fio_packet_account_unsafe(fd2uuid(fd), packet, -1);
   fio_packet_free(packet);
 }
 
@@ -2778,13 +3578,21 @@ ssize_t fio_write2_fn(intptr_t uuid, fio_write_args_s options) {
   } else {
     packet->write_func = fio_sock_write_buffer;
     packet->dealloc = (options.after.dealloc ? options.after.dealloc : free);
+    packet->charged = options.length;
+    packet->key = options.key;
+    packet->droppable = options.droppable;
   }
   /* add packet to outgoing list */
   uint8_t was_empty = 1;
+  fio_packet_s *dropped = NULL;
   fio_lock(&uuid_data(uuid).sock_lock);
   if (!uuid_is_valid(uuid)) {
     goto locked_error;
   }
+  if ((uuid_data(uuid).queue_limit || uuid_data(uuid).queue_limit_count) &&
+      !options.urgent && fio_queue_limit_unsafe(uuid, packet, &dropped)) {
+    goto locked_dropped;
+  }
   if (uuid_data(uuid).packet)
     was_empty = 0;
   if (options.urgent == 0) {
@@ -2801,13 +3609,21 @@ ssize_t fio_write2_fn(intptr_t uuid, fio_write_args_s options) {
     }
   }
   fio_atomic_add(&uuid_data(uuid).packet_count, 1);
+  fio_packet_account_unsafe(uuid, packet, 1);
   fio_unlock(&uuid_data(uuid).sock_lock);
+  fio_packet_free_list(dropped);
 
   if (was_empty) {
     touchfd(fio_uuid2fd(uuid));
     fio_defer_push_urgent(deferred_on_ready, (void *)uuid, NULL);
   }
   return 0;
+locked_dropped:
+  fio_unlock(&uuid_data(uuid).sock_lock);
+  fio_packet_free_list(dropped);
+  fio_packet_free(packet);
+  errno = ENOBUFS;
+  return -1;
 locked_error:
   fio_unlock(&uuid_data(uuid).sock_lock);
   fio_packet_free(packet);
@@ -2874,12 +3690,12 @@ void fio_force_close(intptr_t uuid) {
   uuid_data(uuid).packet = NULL;
   uuid_data(uuid).packet_last = &uuid_data(uuid).packet;
   uuid_data(uuid).sent = 0;
-  fio_unlock(&uuid_data(uuid).sock_lock);
-  while (packet) {
-    fio_packet_s *tmp = packet;
-    packet = packet->next;
-    fio_packet_free(tmp);
+  uuid_data(uuid).packet_count = 0;
+  for (fio_packet_s *pos = packet; pos; pos = pos->next) {
+    fio_packet_account_unsafe(uuid, pos, -1);
   }
+  fio_unlock(&uuid_data(uuid).sock_lock);
+  fio_packet_free_list(packet);
   /* check for rw-hooks termination packet */
   if (uuid_data(uuid).open && (uuid_data(uuid).close & 1) &&
       uuid_data(uuid).rw_hooks->before_close(uuid, uuid_data(uuid).rw_udata)) {
@@ -3431,9 +4247,16 @@ static void fio_on_fork(void) {
   fio_state_callback_on_fork();
   fio_pubsub_on_fork();
   fio_timer_lock = FIO_LOCK_INIT;
+  fio_future_on_fork();
   fio_max_fd_shrink();
-  const size_t limit = fio_data->capa;
+  fio_data->commit_lock = FIO_LOCK_INIT;
+  fio_data->mem_evict_lock = FIO_LOCK_INIT;
+  const size_t limit = fio_data->committed_end;
   for (size_t i = 0; i < limit; ++i) {
+    if (!fd_is_committed(i)) {
+      i |= ((size_t)1 << FIO_FD_CHUNK_LOG) - 1; /* skip to the next chunk */
+      continue;
+    }
     fd_data(i).sock_lock = FIO_LOCK_INIT;
     fd_data(i).protocol_lock = FIO_LOCK_INIT;
     if (fd_data(i).protocol) {
@@ -3459,6 +4282,7 @@ static void __attribute__((destructor)) fio_lib_destroy(void) {
   fio_defer_perform();
   fio_poll_close();
   fio_timer_clear_all();
+  fio_future_pool_destroy();
   fio_free(fio_data);
   /* memory library destruction must be last */
   fio_mem_destroy();
@@ -3468,11 +4292,13 @@ static void __attribute__((destructor)) fio_lib_destroy(void) {
 }
 
 static void fio_mem_init(void);
+static void fio_mem_decay_init(void);
 static void fio_cluster_init(void);
 static void fio_pubsub_initialize(void);
 static void __attribute__((constructor)) fio_lib_init(void) {
   /* initialize memory allocator */
   fio_mem_init();
+  fio_mem_decay_init();
   /* initialize polling engine */
   fio_poll_init();
   /* initialize the cluster engine */
@@ -3527,31 +4353,29 @@ static void __attribute__((constructor)) fio_lib_init(void) {
 #endif
   }
 
+  /* connection data is initialized lazily (see `fio_fd_commit`) */
+  const size_t chunks = (capa >> FIO_FD_CHUNK_LOG) + 1;
 #if FIO_ENGINE_POLL
   /* allocate and initialize main data structures by detected capacity */
   fio_data = fio_mmap(sizeof(*fio_data) + (capa * (sizeof(*fio_data->poll))) +
-                      (capa * (sizeof(*fio_data->info))));
+                      (capa * (sizeof(*fio_data->info))) + chunks);
   FIO_ASSERT_ALLOC(fio_data);
   fio_data->capa = capa;
   fio_data->poll =
       (void *)((uintptr_t)(fio_data + 1) + (sizeof(fio_data->info[0]) * capa));
+  fio_data->committed = (uint8_t *)(fio_data->poll + capa);
 #else
   /* allocate and initialize main data structures by detected capacity */
-  fio_data = fio_mmap(sizeof(*fio_data) + (capa * (sizeof(*fio_data->info))));
+  fio_data = fio_mmap(sizeof(*fio_data) + (capa * (sizeof(*fio_data->info))) +
+                      chunks);
   FIO_ASSERT_ALLOC(fio_data);
   fio_data->capa = capa;
+  fio_data->committed = (uint8_t *)(fio_data->info + capa);
 #endif
   fio_data->parent = getpid();
   fio_data->connection_count = 0;
   fio_mark_time();
 
-  for (ssize_t i = 0; i < capa; ++i) {
-    fio_clear_fd(i, 0);
-#if FIO_ENGINE_POLL
-    fio_data->poll[i].fd = -1;
-#endif
-  }
-
   /* call initialization callbacks */
   fio_state_callback_force(FIO_CALL_ON_INITIALIZE);
   fio_state_callback_clear(FIO_CALL_ON_INITIALIZE);
@@ -3638,6 +4462,10 @@ static void fio_cycle_schedule_events(void) {
     fio_signal_children_flag = 0;
     fio_cluster_signal_children();
   }
+  if (fio_malloc_stats_flag) {
+    fio_malloc_stats_flag = 0;
+    fio_malloc_stats_print();
+  }
   int events = fio_poll();
   if (events < 0) {
     return;
@@ -5005,6 +5833,72 @@ Section Start Marker
  * Data Structures - Channel / Subscriptions data
  **************************************************************************** */
 
+#ifndef FIO_PUBSUB_CHUNK
+/**
+ * The number of subscriptions handled by a single delivery task when a message
+ * is published to a channel (fan-out is scheduled in slices of this size).
+ */
+#define FIO_PUBSUB_CHUNK 64
+#endif
+
+#ifndef FIO_PUBSUB_MAILBOX_BATCH
+/**
+ * The maximal number of queued messages a subscription performs in a row
+ * before yielding the thread to other tasks (the rest are performed later).
+ */
+#define FIO_PUBSUB_MAILBOX_BATCH 64
+#endif
+
+#ifndef FIO_PUBSUB_STATS
+/**
+ * If true (1), channels and subscriptions count their messages (see
+ * `fio_pubsub_stats`). This adds atomic operations to every publication and
+ * callback, so it's disabled by default.
+ */
+#define FIO_PUBSUB_STATS 0
+#endif
+
+#ifndef FIO_PUBSUB_STATS_LATENCY
+/**
+ * If true (1), the time between publishing a message and performing its
+ * callback is measured as well. This reads the clock once per message and once
+ * per callback, so it's disabled by default.
+ */
+#define FIO_PUBSUB_STATS_LATENCY 0
+#endif
+
+#if !FIO_PUBSUB_STATS
+#undef FIO_PUBSUB_STATS_LATENCY
+#define FIO_PUBSUB_STATS_LATENCY 0
+#endif
+
+#ifndef FIO_PUBSUB_STATS_TIMEOUT
+/**
+ * The number of milliseconds `fio_pubsub_stats_cluster` waits for the other
+ * processes before reporting the statistics collected so far.
+ */
+#define FIO_PUBSUB_STATS_TIMEOUT 1000
+#endif
+
+#ifndef FIO_PUBSUB_HISTORY_BUCKETS
+/**
+ * The number of history sequence counters shared by all the processes (a power
+ * of 2). Channels share counters by hash, so a channel's sequence numbers grow
+ * with each message but might skip values.
+ */
+#define FIO_PUBSUB_HISTORY_BUCKETS 256
+#endif
+
+#if (FIO_PUBSUB_HISTORY_BUCKETS & (FIO_PUBSUB_HISTORY_BUCKETS - 1))
+#error FIO_PUBSUB_HISTORY_BUCKETS must be a power of 2
+#endif
+
+#if __has_builtin(__builtin_prefetch)
+#define FIO_PUBSUB_PREFETCH(ptr) __builtin_prefetch((ptr))
+#else
+#define FIO_PUBSUB_PREFETCH(ptr) ((void)(ptr))
+#endif
+
 typedef enum fio_cluster_message_type_e {
   FIO_CLUSTER_MSG_FORWARD,
   FIO_CLUSTER_MSG_JSON,
@@ -5017,8 +5911,22 @@ typedef enum fio_cluster_message_type_e {
   FIO_CLUSTER_MSG_SHUTDOWN,
   FIO_CLUSTER_MSG_ERROR,
   FIO_CLUSTER_MSG_PING,
+  FIO_CLUSTER_MSG_RING,
+  FIO_CLUSTER_MSG_MESH,
+  FIO_CLUSTER_MSG_MESH_JOIN,
+  FIO_CLUSTER_MSG_STATS,
+  FIO_CLUSTER_MSG_STATS_REPLY,
+  FIO_CLUSTER_MSG_RING_BOUND,
 } fio_cluster_message_type_e;
 
+/* set in a message's type when the data references a shared payload */
+#define FIO_CLUSTER_MSG_SHARED 0x100
+/* set in a message's type when the data starts with its history sequence */
+#define FIO_CLUSTER_MSG_SEQUENCED 0x200
+/* the flags that might be set in a pub/sub message's type */
+#define FIO_CLUSTER_MSG_FLAGS                                                  \
+  (FIO_CLUSTER_MSG_SHARED | FIO_CLUSTER_MSG_SEQUENCED)
+
 typedef struct fio_collection_s fio_collection_s;
 
 #pragma pack(1)
@@ -5029,6 +5937,14 @@ typedef struct {
   fio_ls_embd_s subscriptions;
   fio_collection_s *parent;
   fio_match_fn match;
+  /** (patterns) the node in the pattern index bucket, if indexed. */
+  fio_ls_embd_s pattern;
+#if FIO_PUBSUB_STATS
+  /** the number of messages published to the channel (channel lock). */
+  uint64_t messages;
+  /** the number of message data bytes published to the channel. */
+  uint64_t bytes;
+#endif
   fio_lock_i lock;
 } channel_s;
 #pragma pack()
@@ -5042,7 +5958,23 @@ struct subscription_s {
   void *udata2;
   /** reference counter. */
   uintptr_t ref;
-  /** prevents the callback from running concurrently for multiple messages. */
+  /** (conflating subscriptions) the pending messages, one per channel. */
+  struct fio_conflate_s *conflate;
+  /** (other subscriptions) messages waiting for the callback, in order. */
+  struct fio_mailbox_s *mailbox;
+  /** the last history sequence number replayed to the subscription. */
+  uint64_t replayed;
+#if FIO_PUBSUB_STATS
+  /** (other subscriptions) messages scheduled but not yet performed. */
+  uintptr_t pending;
+  /** the number of (live) messages performed. */
+  uint64_t delivered;
+  /** the sum of the publish to callback times, in nanoseconds. */
+  uint64_t latency_total;
+  /** the longest publish to callback time, in nanoseconds. */
+  uint64_t latency_max;
+#endif
+  /** prevents the callback from running while the subscription is canceled. */
   fio_lock_i lock;
   fio_lock_i unsubscribed;
 };
@@ -5061,7 +5993,12 @@ static channel_s *fio_channel_copy(channel_s *src) {
     memcpy(dest->name, src->name, src->name_len);
   dest->name[src->name_len] = 0;
   dest->subscriptions = (fio_ls_embd_s)FIO_LS_INIT(dest->subscriptions);
+  dest->pattern = (fio_ls_embd_s){.prev = NULL, .next = NULL};
   dest->ref = 1;
+#if FIO_PUBSUB_STATS
+  dest->messages = 0;
+  dest->bytes = 0;
+#endif
   dest->lock = FIO_LOCK_INIT;
   return dest;
 }
@@ -5104,13 +6041,38 @@ static int fio_channel_cmp(channel_s *ch1, channel_s *ch2) {
 #define FIO_SET_OBJ_COMPARE(k1, k2) ((k1) == (k2))
 #include <fio.h>
 
-struct fio_collection_s {
+#ifndef FIO_PUBSUB_SHARDS
+/**
+ * The number of independently locked shards in each channel collection.
+ *
+ * Channels are assigned to a shard by their hash, so subscriptions and
+ * publications to different channels rarely contend for the same lock.
+ *
+ * Must be a power of 2 (up to 256).
+ */
+#define FIO_PUBSUB_SHARDS 16
+#endif
+
+#if FIO_PUBSUB_SHARDS < 1 || FIO_PUBSUB_SHARDS > 256 ||                        \
+    (FIO_PUBSUB_SHARDS & (FIO_PUBSUB_SHARDS - 1))
+#error FIO_PUBSUB_SHARDS must be a power of 2 between 1 and 256
+#endif
+
+typedef struct {
   fio_ch_set_s channels;
   fio_lock_i lock;
+} fio_collection_shard_s;
+
+struct fio_collection_s {
+  fio_collection_shard_s shards[FIO_PUBSUB_SHARDS];
 };
 
 #define COLLECTION_INIT                                                        \
-  { .channels = FIO_SET_INIT, .lock = FIO_LOCK_INIT }
+  {                                                                            \
+    .shards = {                                                                \
+      { .channels = FIO_SET_INIT, .lock = FIO_LOCK_INIT }                      \
+    }                                                                          \
+  }
 
 static struct {
   fio_collection_s filters;
@@ -5132,6 +6094,56 @@ static struct {
     .meta.lock = FIO_LOCK_INIT,
 };
 
+/* selects a collection's shard using the (mixed) high bits of the hash. */
+static inline fio_collection_shard_s *
+fio_collection_shard(fio_collection_s *c, uint64_t hashed) {
+  return c->shards +
+         (((hashed * 0x9E3779B97F4A7C15ULL) >> 56) & (FIO_PUBSUB_SHARDS - 1));
+}
+
+#ifndef FIO_PUBSUB_FILTER_DIRECT
+/**
+ * The number of filter values (starting at `FIO_PUBSUB_FILTER_MIN`) that are
+ * found using a direct lookup table rather than the filter collection's hash.
+ *
+ * Small filter values are often used for RPC style routing, so publishing to
+ * these filters skips the hash lookup and the channel comparison.
+ *
+ * Set to 0 to disable.
+ */
+#define FIO_PUBSUB_FILTER_DIRECT 2048
+#endif
+
+#ifndef FIO_PUBSUB_FILTER_MIN
+/** The first filter value in the direct lookup table. */
+#define FIO_PUBSUB_FILTER_MIN (-1024)
+#endif
+
+#if FIO_PUBSUB_FILTER_DIRECT
+/* filter channels, protected by the filter collection's shard locks */
+static channel_s *fio_filter_table[FIO_PUBSUB_FILTER_DIRECT];
+#endif
+
+/* returns the filter's slot in the direct lookup table (or NULL). */
+static inline channel_s **fio_filter_slot(uint32_t filter) {
+#if FIO_PUBSUB_FILTER_DIRECT
+  const uint32_t i = filter - (uint32_t)(FIO_PUBSUB_FILTER_MIN);
+  if (i < FIO_PUBSUB_FILTER_DIRECT)
+    return fio_filter_table + i;
+#endif
+  return NULL;
+  (void)filter;
+}
+
+/* removes a filter channel from the lookup table (shard lock must be held). */
+static inline void fio_filter_slot_clear(channel_s *ch) {
+  uint32_t filter;
+  memcpy(&filter, ch->name, sizeof(filter));
+  channel_s **slot = fio_filter_slot(filter);
+  if (slot && *slot == ch)
+    *slot = NULL;
+}
+
 /** used to contain the message before it's passed to the handler */
 typedef struct {
   fio_msg_s msg;
@@ -5147,10 +6159,116 @@ typedef struct {
   uintptr_t ref; /* internal reference counter */
   int32_t filter;
   int8_t is_json;
+  /* the sequence number in the channel's history (0 if none) */
+  uint64_t sequence;
+  /* the shared memory payload `data` points to (cluster messages) */
+  struct fio_cluster_shm_s *shared;
+  /* the process's reference holder index for `shared` */
+  int32_t shared_holder;
+#if FIO_PUBSUB_STATS_LATENCY
+  /* the time the message was created (published or received), see below */
+  uint64_t created;
+#endif
   size_t meta_len;
   fio_msg_metadata_s meta[];
 } fio_msg_internal_s;
 
+#if FIO_PUBSUB_STATS_LATENCY
+/* a monotonic nanosecond timestamp, used to measure the delivery latency */
+static inline uint64_t fio_pubsub_stats_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((uint64_t)t.tv_sec * 1000000000) + (uint64_t)t.tv_nsec;
+}
+#endif
+
+#define FIO_ARY_NAME fio_msg_ary
+#define FIO_ARY_TYPE fio_msg_internal_s *
+#include <fio.h>
+
+/** The undelivered messages of a conflating subscription. */
+typedef struct fio_conflate_s {
+  fio_msg_ary_s pending;
+  fio_lock_i lock;
+  /** set while a delivery task is scheduled for the subscription. */
+  uint8_t scheduled;
+  /** changed on fork, invalidating delivery tasks scheduled before the fork */
+  uint8_t epoch;
+} fio_conflate_s;
+
+/**
+ * The messages published to a subscription while its callback was busy.
+ *
+ * Only the thread that is `draining` the mailbox performs the callback, other
+ * threads add their messages to the mailbox and move on.
+ */
+typedef struct fio_mailbox_s {
+  fio_msg_ary_s pending;
+  fio_lock_i lock;
+  /** set while a thread is performing the subscription's messages. */
+  uint8_t draining;
+  /** changed on fork, invalidating drain tasks scheduled before the fork */
+  uint8_t epoch;
+} fio_mailbox_s;
+
+/* cluster statistics collections waiting for replies (see
+ * `fio_pubsub_stats_cluster`), protected by the lock */
+static struct {
+  fio_ls_s requests;
+  int32_t counter;
+  fio_lock_i lock;
+} fio_stats_requests = {
+    .requests = FIO_LS_INIT(fio_stats_requests.requests),
+    .lock = FIO_LOCK_INIT,
+};
+
+/** A channel's message history (see `fio_pubsub_history_set`). */
+typedef struct {
+  fio_msg_ary_s msgs;
+  size_t max_messages;
+  size_t max_bytes;
+  size_t bytes;
+  size_t name_len;
+  char *name;
+} fio_history_s;
+
+/**
+ * The history sequence counters, shared by all the processes. A message is
+ * numbered once, by the publishing process, and the number is sent along with
+ * the message, so every process keeps the same number for the same message.
+ */
+typedef struct {
+  /* set once any process kept a history (buckets are only tested then) */
+  volatile size_t kept;
+  struct {
+    /* set once a process kept a history for a channel in the bucket */
+    volatile size_t kept;
+    /* the last sequence number assigned to a message in the bucket */
+    volatile uint64_t sequence;
+  } buckets[FIO_PUBSUB_HISTORY_BUCKETS];
+} fio_history_sequences_s;
+
+/* mapped by the root process (before any fork), see `fio_pubsub_initialize` */
+static fio_history_sequences_s *fio_history_sequences;
+
+static inline int fio_history_cmp(fio_history_s *h1, fio_history_s *h2) {
+  return h1->name_len == h2->name_len &&
+         !memcmp(h1->name, h2->name, h1->name_len);
+}
+
+#define FIO_FORCE_MALLOC_TMP 1
+#define FIO_SET_NAME fio_history_set
+#define FIO_SET_OBJ_TYPE fio_history_s *
+#define FIO_SET_OBJ_COMPARE(o1, o2) fio_history_cmp((o1), (o2))
+#include <fio.h>
+
+static struct {
+  fio_history_set_s set;
+  /* the number of histories, updated under the lock but read without it */
+  volatile size_t count;
+  fio_lock_i lock;
+} fio_history = {.set = FIO_SET_INIT, .lock = FIO_LOCK_INIT};
+
 /** The default engine (settable). */
 fio_pubsub_engine_s *FIO_PUBSUB_DEFAULT = FIO_PUBSUB_CLUSTER;
 
@@ -5213,6 +6331,9 @@ fio_pubsub_create_message(int32_t filter, fio_str_info_s ch,
     }
   }
   fio_postoffice_meta_copy_free(t);
+#if FIO_PUBSUB_STATS_LATENCY
+  m->created = fio_pubsub_stats_now();
+#endif
   return m;
 }
 
@@ -5281,6 +6402,9 @@ fio_pubsub_create_message(int32_t filter, fio_str_info_s ch,
         m->meta[meta_len] = cb(m->channel, m->data, is_json);
     }
   }
+#if FIO_PUBSUB_STATS_LATENCY
+  m->created = fio_pubsub_stats_now();
+#endif
   return m;
 }
 
@@ -5299,57 +6423,254 @@ static void fio_pubsub_create_message_update_meta(fio_msg_internal_s *m) {
 #endif
 
 /* *****************************************************************************
-Cluster forking handler
+Pattern channel index
 ***************************************************************************** */
 
-static void fio_pubsub_on_fork(void) {
-  fio_postoffice.filters.lock = FIO_LOCK_INIT;
-  fio_postoffice.pubsub.lock = FIO_LOCK_INIT;
-  fio_postoffice.patterns.lock = FIO_LOCK_INIT;
-  fio_postoffice.engines.lock = FIO_LOCK_INIT;
-  fio_postoffice.meta.lock = FIO_LOCK_INIT;
-  FIO_SET_FOR_LOOP(&fio_postoffice.filters.channels, pos) {
-    if (!pos->hash)
-      continue;
-    pos->obj->lock = FIO_LOCK_INIT;
-    FIO_LS_EMBD_FOR(&pos->obj->subscriptions, n) {
-      FIO_LS_EMBD_OBJ(subscription_s, node, n)->lock = FIO_LOCK_INIT;
+/*
+ * Pattern channels are indexed by the literal prefix and the literal suffix of
+ * their glob pattern (the bytes before the first and after the last wildcard).
+ *
+ * A channel name can only match a glob pattern if it starts with the prefix
+ * and ends with the suffix, so publishing performs a single bucket lookup per
+ * shape (a distinct prefix / suffix length pair) and only tests the patterns
+ * in the buckets that were found.
+ *
+ * Custom `match` functions can't be indexed and are placed in the empty
+ * shape's bucket, which is tested for every channel (the linear path).
+ *
+ * The index is protected by the `fio_postoffice.patterns` lock.
+ */
+
+static int fio_glob_match(fio_str_info_s pat, fio_str_info_s ch);
+
+typedef struct {
+  fio_ls_embd_s channels;
+  char *prefix;
+  char *suffix;
+  uint32_t prefix_len;
+  uint32_t suffix_len;
+} fio_pattern_bucket_s;
+
+typedef struct {
+  uint32_t prefix_len;
+  uint32_t suffix_len;
+  /** the number of buckets with this shape. */
+  size_t count;
+} fio_pattern_shape_s;
+
+static inline int fio_pattern_bucket_cmp(fio_pattern_bucket_s *b1,
+                                         fio_pattern_bucket_s *b2) {
+  return b1->prefix_len == b2->prefix_len &&
+         b1->suffix_len == b2->suffix_len &&
+         !memcmp(b1->prefix, b2->prefix, b1->prefix_len) &&
+         !memcmp(b1->suffix, b2->suffix, b1->suffix_len);
+}
+
+#define FIO_FORCE_MALLOC_TMP 1
+#define FIO_SET_NAME fio_pattern_set
+#define FIO_SET_OBJ_TYPE fio_pattern_bucket_s *
+#define FIO_SET_OBJ_COMPARE(o1, o2) fio_pattern_bucket_cmp((o1), (o2))
+#include <fio.h>
+
+#define FIO_FORCE_MALLOC_TMP 1
+#define FIO_ARY_NAME fio_pattern_shape_ary
+#define FIO_ARY_TYPE fio_pattern_shape_s
+#define FIO_ARY_COMPARE(s1, s2)                                                \
+  ((s1).prefix_len == (s2).prefix_len && (s1).suffix_len == (s2).suffix_len)
+#include <fio.h>
+
+static struct {
+  fio_pattern_set_s buckets;
+  fio_pattern_shape_ary_s shapes;
+  fio_lock_i lock;
+} fio_pattern_index = {
+    .buckets = FIO_SET_INIT,
+    .shapes = FIO_ARY_INIT,
+    .lock = FIO_LOCK_INIT,
+};
+
+static inline uint64_t fio_pattern_bucket_hash(fio_pattern_bucket_s *b) {
+  uint64_t h = fio_risky_hash(b->prefix, b->prefix_len, b->suffix_len) ^
+               fio_risky_hash(b->suffix, b->suffix_len, b->prefix_len + 1);
+  return h ? h : 1;
+}
+
+static inline int fio_pattern_is_wildcard(char c) {
+  return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+/* sets the bucket key (prefix and suffix) for a pattern channel. */
+static void fio_pattern_bucket_key(fio_pattern_bucket_s *b, channel_s *ch) {
+  size_t len = ch->name_len, prefix = 0, suffix = len;
+  *b = (fio_pattern_bucket_s){.prefix = ch->name, .suffix = ch->name + len};
+  if (ch->match != fio_glob_match)
+    return;
+  while (prefix < len && !fio_pattern_is_wildcard(ch->name[prefix]))
+    ++prefix;
+  b->prefix_len = (uint32_t)prefix;
+  if (prefix == len)
+    return;
+  while (suffix > prefix && !fio_pattern_is_wildcard(ch->name[suffix - 1]))
+    --suffix;
+  /* character classes and escapes make the suffix ambiguous */
+  for (size_t i = prefix; i < suffix; ++i) {
+    if (ch->name[i] == '[' || ch->name[i] == '\\')
+      return;
+  }
+  b->suffix = ch->name + suffix;
+  b->suffix_len = (uint32_t)(len - suffix);
+}
+
+/* adds a pattern channel to the index (index lock must be held). */
+static void fio_pattern_index_add(channel_s *ch) {
+  if (ch->pattern.next)
+    return;
+  fio_pattern_bucket_s key;
+  fio_pattern_bucket_key(&key, ch);
+  uint64_t hashed = fio_pattern_bucket_hash(&key);
+  fio_pattern_bucket_s *b =
+      fio_pattern_set_find(&fio_pattern_index.buckets, hashed, &key);
+  if (!b) {
+    b = malloc(sizeof(*b) + key.prefix_len + key.suffix_len);
+    FIO_ASSERT_ALLOC(b);
+    *b = key;
+    b->channels = (fio_ls_embd_s)FIO_LS_INIT(b->channels);
+    b->prefix = (char *)(b + 1);
+    b->suffix = b->prefix + key.prefix_len;
+    memcpy(b->prefix, key.prefix, key.prefix_len);
+    memcpy(b->suffix, key.suffix, key.suffix_len);
+    fio_pattern_set_insert(&fio_pattern_index.buckets, hashed, b);
+    FIO_ARY_FOR(&fio_pattern_index.shapes, pos) {
+      if (pos->prefix_len == key.prefix_len &&
+          pos->suffix_len == key.suffix_len) {
+        ++pos->count;
+        goto indexed;
+      }
     }
+    fio_pattern_shape_ary_push(
+        &fio_pattern_index.shapes,
+        (fio_pattern_shape_s){.prefix_len = key.prefix_len,
+                              .suffix_len = key.suffix_len,
+                              .count = 1});
   }
-  FIO_SET_FOR_LOOP(&fio_postoffice.pubsub.channels, pos) {
-    if (!pos->hash)
-      continue;
-    pos->obj->lock = FIO_LOCK_INIT;
-    FIO_LS_EMBD_FOR(&pos->obj->subscriptions, n) {
-      FIO_LS_EMBD_OBJ(subscription_s, node, n)->lock = FIO_LOCK_INIT;
+indexed:
+  fio_ls_embd_push(&b->channels, &ch->pattern);
+}
+
+/* removes a pattern channel from the index (index lock must be held). */
+static void fio_pattern_index_remove(channel_s *ch) {
+  if (!ch->pattern.next)
+    return;
+  fio_ls_embd_remove(&ch->pattern);
+  ch->pattern = (fio_ls_embd_s){.prev = NULL, .next = NULL};
+  fio_pattern_bucket_s key;
+  fio_pattern_bucket_key(&key, ch);
+  uint64_t hashed = fio_pattern_bucket_hash(&key);
+  fio_pattern_bucket_s *b =
+      fio_pattern_set_find(&fio_pattern_index.buckets, hashed, &key);
+  if (!b || fio_ls_embd_any(&b->channels))
+    return;
+  fio_pattern_set_remove(&fio_pattern_index.buckets, hashed, b, NULL);
+  free(b);
+  intptr_t i = 0;
+  FIO_ARY_FOR(&fio_pattern_index.shapes, pos) {
+    if (pos->prefix_len == key.prefix_len &&
+        pos->suffix_len == key.suffix_len) {
+      if (!--pos->count)
+        fio_pattern_shape_ary_remove(&fio_pattern_index.shapes, i, NULL);
+      break;
     }
+    ++i;
   }
-  FIO_SET_FOR_LOOP(&fio_postoffice.patterns.channels, pos) {
-    if (!pos->hash)
-      continue;
-    pos->obj->lock = FIO_LOCK_INIT;
-    FIO_LS_EMBD_FOR(&pos->obj->subscriptions, n) {
-      FIO_LS_EMBD_OBJ(subscription_s, node, n)->lock = FIO_LOCK_INIT;
+}
+
+/* frees the index (the pattern channels should be removed first). */
+static void fio_pattern_index_free(void) {
+  FIO_SET_FOR_LOOP(&fio_pattern_index.buckets, pos) {
+    if (pos->hash)
+      free(pos->obj);
+  }
+  fio_pattern_set_free(&fio_pattern_index.buckets);
+  fio_pattern_shape_ary_free(&fio_pattern_index.shapes);
+}
+
+/* *****************************************************************************
+Cluster forking handler
+***************************************************************************** */
+
+/* defined later - resets the subscription's delivery state after forking */
+static void fio_mailbox_on_fork(subscription_s *s);
+static void fio_conflate_on_fork(subscription_s *s);
+
+static void fio_collection_on_fork(fio_collection_s *c) {
+  for (size_t i = 0; i < FIO_PUBSUB_SHARDS; ++i) {
+    c->shards[i].lock = FIO_LOCK_INIT;
+    FIO_SET_FOR_LOOP(&c->shards[i].channels, pos) {
+      if (!pos->hash)
+        continue;
+      pos->obj->lock = FIO_LOCK_INIT;
+      FIO_LS_EMBD_FOR(&pos->obj->subscriptions, n) {
+        subscription_s *s = FIO_LS_EMBD_OBJ(subscription_s, node, n);
+        s->lock = FIO_LOCK_INIT;
+        fio_mailbox_on_fork(s);
+        fio_conflate_on_fork(s);
+      }
     }
   }
 }
 
+static void fio_pubsub_on_fork(void) {
+  fio_history.lock = FIO_LOCK_INIT;
+  fio_pattern_index.lock = FIO_LOCK_INIT;
+  fio_postoffice.engines.lock = FIO_LOCK_INIT;
+  fio_postoffice.meta.lock = FIO_LOCK_INIT;
+  fio_stats_requests.lock = FIO_LOCK_INIT;
+  fio_collection_on_fork(&fio_postoffice.filters);
+  fio_collection_on_fork(&fio_postoffice.pubsub);
+  fio_collection_on_fork(&fio_postoffice.patterns);
+}
+
 /* *****************************************************************************
 Channel Subscription Management
 ***************************************************************************** */
 
 static void pubsub_on_channel_create(channel_s *ch);
 static void pubsub_on_channel_destroy(channel_s *ch);
+/* the root's subscriptions on behalf of workers (not counted by the mesh) */
+static void fio_mock_on_message(fio_msg_s *msg);
+/* counts local subscriptions for the cluster's subscription registry */
+static void fio_cluster_mesh_count(channel_s *ch, int add);
+
+/* the hash used to store a channel in its collection */
+static inline uint64_t fio_channel_hash(channel_s *ch) {
+  if (ch->parent == &fio_postoffice.filters) {
+    uint32_t filter;
+    memcpy(&filter, ch->name, sizeof(filter));
+    return filter;
+  }
+  return FIO_HASH_FN(ch->name, ch->name_len, &fio_postoffice.pubsub,
+                     &fio_postoffice.pubsub);
+}
 
 /* some comon tasks extracted */
 static inline channel_s *fio_filter_dup_lock_internal(channel_s *ch,
                                                       uint64_t hashed,
                                                       fio_collection_s *c) {
-  fio_lock(&c->lock);
-  ch = fio_ch_set_insert(&c->channels, hashed, ch);
+  fio_collection_shard_s *sh = fio_collection_shard(c, hashed);
+  fio_lock(&sh->lock);
+  ch = fio_ch_set_insert(&sh->channels, hashed, ch);
+  if (c == &fio_postoffice.filters) {
+    channel_s **slot = fio_filter_slot((uint32_t)hashed);
+    if (slot)
+      *slot = ch;
+  } else if (c == &fio_postoffice.patterns) {
+    fio_lock(&fio_pattern_index.lock);
+    fio_pattern_index_add(ch);
+    fio_unlock(&fio_pattern_index.lock);
+  }
   fio_channel_dup(ch);
   fio_lock(&ch->lock);
-  fio_unlock(&c->lock);
+  fio_unlock(&sh->lock);
   return ch;
 }
 
@@ -5402,6 +6723,12 @@ static channel_s *fio_channel_match_dup_lock(fio_str_info_s name,
   return ch_p;
 }
 
+/* frees the pending messages of a conflating subscription */
+static void fio_conflate_free(fio_conflate_s *c);
+static void fio_mailbox_free(fio_mailbox_s *mb);
+/* replays the channel's history (channel lock must be held) */
+static void fio_history_replay(subscription_s *s, uint64_t since);
+
 /* to be used for reference counting (subtructing) */
 static inline void fio_subscription_free(subscription_s *s) {
   if (fio_atomic_sub(&s->ref, 1)) {
@@ -5410,6 +6737,8 @@ static inline void fio_subscription_free(subscription_s *s) {
   if (s->on_unsubscribe) {
     s->on_unsubscribe(s->udata1, s->udata2);
   }
+  fio_conflate_free(s->conflate);
+  fio_mailbox_free(s->mailbox);
   fio_channel_free(s->parent);
   fio_free(s);
 }
@@ -5429,6 +6758,17 @@ subscription_s *fio_subscribe FIO_IGNORE_MACRO(subscribe_args_s args) {
       .ref = 1,
       .lock = FIO_LOCK_INIT,
   };
+  if (args.conflate) {
+    s->conflate = fio_malloc(sizeof(*s->conflate));
+    FIO_ASSERT_ALLOC(s->conflate);
+    *s->conflate = (fio_conflate_s){.pending = FIO_ARY_INIT,
+                                    .lock = FIO_LOCK_INIT};
+  } else {
+    s->mailbox = fio_malloc(sizeof(*s->mailbox));
+    FIO_ASSERT_ALLOC(s->mailbox);
+    *s->mailbox = (fio_mailbox_s){.pending = FIO_ARY_INIT,
+                                  .lock = FIO_LOCK_INIT};
+  }
   if (args.filter) {
     ch = fio_filter_dup_lock(args.filter);
   } else if (args.match) {
@@ -5438,7 +6778,11 @@ subscription_s *fio_subscribe FIO_IGNORE_MACRO(subscribe_args_s args) {
   }
   s->parent = ch;
   fio_ls_embd_push(&ch->subscriptions, &s->node);
+  if (args.replay_since && !args.filter && !args.match)
+    fio_history_replay(s, args.replay_since);
   fio_unlock((&ch->lock));
+  if (s->on_message != fio_mock_on_message)
+    fio_cluster_mesh_count(ch, 1);
   return s;
 error:
   if (args.on_unsubscribe)
@@ -5460,21 +6804,30 @@ void fio_unsubscribe(subscription_s *s) {
   /* check if channel is done for */
   if (fio_ls_embd_is_empty(&ch->subscriptions)) {
     fio_collection_s *c = ch->parent;
-    uint64_t hashed = FIO_HASH_FN(
-        ch->name, ch->name_len, &fio_postoffice.pubsub, &fio_postoffice.pubsub);
-    /* lock collection */
-    fio_lock(&c->lock);
+    uint64_t hashed = fio_channel_hash(ch);
+    fio_collection_shard_s *sh = fio_collection_shard(c, hashed);
+    /* lock collection shard */
+    fio_lock(&sh->lock);
     /* test again within lock */
     if (fio_ls_embd_is_empty(&ch->subscriptions)) {
-      fio_ch_set_remove(&c->channels, hashed, ch, NULL);
+      if (c == &fio_postoffice.filters) {
+        fio_filter_slot_clear(ch);
+      } else if (c == &fio_postoffice.patterns) {
+        fio_lock(&fio_pattern_index.lock);
+        fio_pattern_index_remove(ch);
+        fio_unlock(&fio_pattern_index.lock);
+      }
+      fio_ch_set_remove(&sh->channels, hashed, ch, NULL);
       removed = (c != &fio_postoffice.filters);
     }
-    fio_unlock(&c->lock);
+    fio_unlock(&sh->lock);
   }
   fio_unlock(&ch->lock);
   if (removed) {
     pubsub_on_channel_destroy(ch);
   }
+  if (s->on_message != fio_mock_on_message)
+    fio_cluster_mesh_count(ch, 0);
 
   /* promise the subscription will be inactive */
   s->on_message = NULL;
@@ -5581,26 +6934,32 @@ int fio_pubsub_is_attached(fio_pubsub_engine_s *engine) {
  * exclusive subscription process.
  */
 void fio_pubsub_reattach(fio_pubsub_engine_s *eng) {
-  fio_lock(&fio_postoffice.pubsub.lock);
-  FIO_SET_FOR_LOOP(&fio_postoffice.pubsub.channels, pos) {
-    if (!pos->hash)
-      continue;
-    eng->subscribe(
-        eng,
-        (fio_str_info_s){.data = pos->obj->name, .len = pos->obj->name_len},
-        NULL);
-  }
-  fio_unlock(&fio_postoffice.pubsub.lock);
-  fio_lock(&fio_postoffice.patterns.lock);
-  FIO_SET_FOR_LOOP(&fio_postoffice.patterns.channels, pos) {
-    if (!pos->hash)
-      continue;
-    eng->subscribe(
-        eng,
-        (fio_str_info_s){.data = pos->obj->name, .len = pos->obj->name_len},
-        pos->obj->match);
+  for (size_t i = 0; i < FIO_PUBSUB_SHARDS; ++i) {
+    fio_collection_shard_s *sh = fio_postoffice.pubsub.shards + i;
+    fio_lock(&sh->lock);
+    FIO_SET_FOR_LOOP(&sh->channels, pos) {
+      if (!pos->hash)
+        continue;
+      eng->subscribe(
+          eng,
+          (fio_str_info_s){.data = pos->obj->name, .len = pos->obj->name_len},
+          NULL);
+    }
+    fio_unlock(&sh->lock);
+  }
+  for (size_t i = 0; i < FIO_PUBSUB_SHARDS; ++i) {
+    fio_collection_shard_s *sh = fio_postoffice.patterns.shards + i;
+    fio_lock(&sh->lock);
+    FIO_SET_FOR_LOOP(&sh->channels, pos) {
+      if (!pos->hash)
+        continue;
+      eng->subscribe(
+          eng,
+          (fio_str_info_s){.data = pos->obj->name, .len = pos->obj->name_len},
+          pos->obj->match);
+    }
+    fio_unlock(&sh->lock);
   }
-  fio_unlock(&fio_postoffice.patterns.lock);
 }
 
 /* *****************************************************************************
@@ -5638,19 +6997,30 @@ void *fio_message_metadata(fio_msg_s *msg, intptr_t type_id) {
 static channel_s *fio_channel_find_dup_internal(channel_s *ch_tmp,
                                                 uint64_t hashed,
                                                 fio_collection_s *c) {
-  fio_lock(&c->lock);
-  channel_s *ch = fio_ch_set_find(&c->channels, hashed, ch_tmp);
+  fio_collection_shard_s *sh = fio_collection_shard(c, hashed);
+  fio_lock(&sh->lock);
+  channel_s *ch = fio_ch_set_find(&sh->channels, hashed, ch_tmp);
   if (!ch) {
-    fio_unlock(&c->lock);
+    fio_unlock(&sh->lock);
     return NULL;
   }
   fio_channel_dup(ch);
-  fio_unlock(&c->lock);
+  fio_unlock(&sh->lock);
   return ch;
 }
 
 /** Finds a filter channel, increasing it's reference count if it exists. */
 static channel_s *fio_filter_find_dup(uint32_t filter) {
+  channel_s **slot = fio_filter_slot(filter);
+  if (slot) {
+    fio_collection_shard_s *sh =
+        fio_collection_shard(&fio_postoffice.filters, filter);
+    fio_lock(&sh->lock);
+    channel_s *ch = *slot;
+    fio_channel_dup(ch);
+    fio_unlock(&sh->lock);
+    return ch;
+  }
   channel_s tmp = {.name = (char *)(&filter), .name_len = sizeof(filter)};
   channel_s *ch =
       fio_channel_find_dup_internal(&tmp, filter, &fio_postoffice.filters);
@@ -5667,6 +7037,9 @@ static channel_s *fio_channel_find_dup(fio_str_info_s name) {
   return ch;
 }
 
+/* releases the shared payload referenced by a message's data */
+static void fio_cluster_shm_detach(fio_msg_internal_s *msg);
+
 /** frees the internal message data */
 static inline void fio_msg_internal_free(fio_msg_internal_s *msg) {
   if (fio_atomic_sub(&msg->ref, 1))
@@ -5682,6 +7055,8 @@ static inline void fio_msg_internal_free(fio_msg_internal_s *msg) {
                                          msg->meta[msg->meta_len].metadata);
     }
   }
+  if (msg->shared)
+    fio_cluster_shm_detach(msg);
   fio_free(msg);
 }
 /* add reference count to fio_msg_internal_s */
@@ -5690,20 +7065,44 @@ static inline fio_msg_internal_s *fio_msg_internal_dup(fio_msg_internal_s *m) {
   return m;
 }
 
-/* defers the callback (mark only) */
-void fio_message_defer(fio_msg_s *msg_) {
-  fio_msg_client_s *cl = (fio_msg_client_s *)msg_;
-  cl->marker = 1;
-}
+/**
+ * Returns a message that doesn't reference a shared payload, copying the
+ * message if required. Used before a message is kept (so it doesn't pin the
+ * shared segment's blocks).
+ *
+ * Consumes the message reference.
+ */
+static fio_msg_internal_s *fio_msg_internal_unshare(fio_msg_internal_s *m) {
+  if (!m->shared)
+    return m;
+  fio_msg_internal_s *cpy = fio_pubsub_create_message(
+      m->filter, m->channel, m->data, m->is_json, 1);
+  cpy->sequence = m->sequence;
+#if FIO_PUBSUB_STATS_LATENCY
+  cpy->created = m->created;
+#endif
+  fio_msg_internal_free(m);
+  return cpy;
+}
 
-/* performs the actual callback */
-static void fio_perform_subscription_callback(void *s_, void *msg_) {
-  subscription_s *s = s_;
-  if (fio_trylock(&s->lock)) {
-    fio_defer_push_task(fio_perform_subscription_callback, s_, msg_);
-    return;
-  }
-  fio_msg_internal_s *msg = (fio_msg_internal_s *)msg_;
+/* defers the callback (mark only) */
+void fio_message_defer(fio_msg_s *msg_) {
+  fio_msg_client_s *cl = (fio_msg_client_s *)msg_;
+  cl->marker = 1;
+}
+
+/**
+ * Performs the callback, returning -1 if the callback should be performed
+ * again later (the message was deferred).
+ *
+ * The reference counts are left untouched.
+ */
+static inline int fio_subscription_perform(subscription_s *s,
+                                           fio_msg_internal_s *msg) {
+  fio_lock(&s->lock);
+#if FIO_PUBSUB_STATS_LATENCY
+  const uint64_t start = fio_pubsub_stats_now();
+#endif
   fio_msg_client_s m = {
       .msg =
           {
@@ -5712,6 +7111,7 @@ static void fio_perform_subscription_callback(void *s_, void *msg_) {
               .filter = msg->filter,
               .udata1 = s->udata1,
               .udata2 = s->udata2,
+              .sequence = msg->sequence,
           },
       .meta_len = msg->meta_len,
       .meta = msg->meta,
@@ -5721,26 +7121,321 @@ static void fio_perform_subscription_callback(void *s_, void *msg_) {
     /* the on_message callback is removed when a subscription is canceled. */
     s->on_message(&m.msg);
   }
+#if FIO_PUBSUB_STATS
+  /* replayed (history) messages aren't counted, they're not live messages */
+  if (!m.marker && (!msg->sequence || msg->sequence > s->replayed)) {
+    ++s->delivered;
+#if FIO_PUBSUB_STATS_LATENCY
+    const uint64_t lag = (start > msg->created) ? (start - msg->created) : 0;
+    s->latency_total += lag;
+    if (lag > s->latency_max)
+      s->latency_max = lag;
+#endif
+  }
+#endif
   fio_unlock(&s->lock);
-  if (m.marker) {
-    fio_defer_push_task(fio_perform_subscription_callback, s_, msg_);
+  return 0 - (m.marker != 0);
+}
+
+static void fio_perform_subscription_mailbox(void *s_, void *epoch_);
+
+/**
+ * Performs the message and then any messages queued in the mailbox meanwhile,
+ * in order. The thread must own the mailbox (`draining`).
+ *
+ * Consumes a subscription reference and the message reference.
+ */
+static void fio_subscription_drain(subscription_s *s, fio_msg_internal_s *msg) {
+  fio_mailbox_s *mb = s->mailbox;
+  size_t limit = FIO_PUBSUB_MAILBOX_BATCH;
+  for (;;) {
+    if (fio_subscription_perform(s, msg)) {
+      /* deferred - keep the message first in line */
+      msg = fio_msg_internal_unshare(msg);
+      fio_lock(&mb->lock);
+      fio_msg_ary_unshift(&mb->pending, msg);
+      fio_unlock(&mb->lock);
+      break;
+    }
+#if FIO_PUBSUB_STATS
+    fio_atomic_sub(&s->pending, 1);
+#endif
+    fio_msg_internal_free(msg);
+    fio_lock(&mb->lock);
+    if (!fio_msg_ary_count(&mb->pending)) {
+      mb->draining = 0;
+      fio_unlock(&mb->lock);
+      fio_subscription_free(s);
+      return;
+    }
+    if (!--limit) {
+      fio_unlock(&mb->lock);
+      break;
+    }
+    fio_msg_ary_shift(&mb->pending, &msg);
+    fio_unlock(&mb->lock);
+  }
+  /* the mailbox stays owned, the task will pick up where we stopped */
+  fio_defer_push_task(fio_perform_subscription_mailbox, s,
+                      (void *)(uintptr_t)mb->epoch);
+}
+
+/* resumes draining a subscription's mailbox */
+static void fio_perform_subscription_mailbox(void *s_, void *epoch_) {
+  subscription_s *s = s_;
+  fio_msg_internal_s *msg = NULL;
+  fio_lock(&s->mailbox->lock);
+  if ((uintptr_t)epoch_ != s->mailbox->epoch ||
+      fio_msg_ary_shift(&s->mailbox->pending, &msg)) {
+    /* scheduled before a fork, the mailbox was reset since */
+    fio_unlock(&s->mailbox->lock);
+    fio_subscription_free(s);
+    return;
+  }
+  fio_unlock(&s->mailbox->lock);
+  fio_subscription_drain(s, msg);
+}
+
+/**
+ * Performs the message, or queues it if another thread is performing the
+ * subscription's callback (that thread will perform the message).
+ *
+ * Consumes a subscription reference and the message reference.
+ */
+static void fio_subscription_deliver(subscription_s *s,
+                                     fio_msg_internal_s *msg) {
+  fio_mailbox_s *mb = s->mailbox;
+  fio_lock(&mb->lock);
+  if (mb->draining) {
+    fio_msg_ary_push(&mb->pending, msg);
+    fio_unlock(&mb->lock);
+    /* the draining thread holds a reference of its own */
+    fio_subscription_free(s);
     return;
   }
+  mb->draining = 1;
+  fio_unlock(&mb->lock);
+  fio_subscription_drain(s, msg);
+}
+
+/* performs the actual callback */
+static void fio_perform_subscription_callback(void *s_, void *msg_) {
+  fio_subscription_deliver(s_, msg_);
+}
+
+/** A slice of a channel's subscriptions, sharing a single message reference */
+typedef struct {
+  fio_msg_internal_s *msg;
+  size_t count;
+  subscription_s *subs[];
+} fio_publish_chunk_s;
+
+/* performs the callbacks for a slice of subscriptions */
+static void fio_perform_subscription_chunk(void *c_, void *ignr_) {
+  fio_publish_chunk_s *c = c_;
+  fio_msg_internal_s *msg = c->msg;
+  for (size_t i = 0; i < c->count; ++i) {
+    subscription_s *s = c->subs[i];
+    if (i + 1 < c->count)
+      FIO_PUBSUB_PREFETCH(c->subs[i + 1]);
+    fio_subscription_deliver(s, fio_msg_internal_dup(msg));
+  }
   fio_msg_internal_free(msg);
-  fio_subscription_free(s);
+  fio_free(c);
+  (void)ignr_;
+}
+
+/* schedules the callbacks for `count` subscriptions (references taken) */
+static void fio_publish2chunk(subscription_s **subs, size_t count,
+                              fio_msg_internal_s *msg) {
+  if (count == 1) {
+    fio_defer_push_task(fio_perform_subscription_callback, subs[0],
+                        fio_msg_internal_dup(msg));
+    return;
+  }
+  fio_publish_chunk_s *c = fio_malloc(sizeof(*c) + (count * sizeof(*subs)));
+  FIO_ASSERT_ALLOC(c);
+  c->msg = fio_msg_internal_dup(msg);
+  c->count = count;
+  memcpy(c->subs, subs, count * sizeof(*subs));
+  fio_defer_push_task(fio_perform_subscription_chunk, c, NULL);
+}
+
+/* tests if two messages were published to the same channel (or filter) */
+static inline int fio_msg_internal_same_channel(fio_msg_internal_s *m1,
+                                                fio_msg_internal_s *m2) {
+  return m1->filter == m2->filter && m1->channel.len == m2->channel.len &&
+         !memcmp(m1->channel.data, m2->channel.data, m1->channel.len);
+}
+
+/* performs the callbacks for a conflating subscription's pending messages */
+static void fio_perform_subscription_conflated(void *s_, void *epoch_) {
+  subscription_s *s = s_;
+  fio_conflate_s *c = s->conflate;
+  fio_msg_internal_s *msg = NULL;
+  fio_lock(&c->lock);
+  if ((uintptr_t)epoch_ != c->epoch) {
+    /* scheduled before a fork, the pending messages were reset since */
+    fio_unlock(&c->lock);
+    fio_subscription_free(s);
+    return;
+  }
+  if (fio_msg_ary_shift(&c->pending, &msg)) {
+    c->scheduled = 0;
+    fio_unlock(&c->lock);
+    fio_subscription_free(s);
+    return;
+  }
+  fio_unlock(&c->lock);
+  if (fio_subscription_perform(s, msg)) {
+    /* deferred - keep the message unless it was already replaced */
+    msg = fio_msg_internal_unshare(msg);
+    fio_lock(&c->lock);
+    FIO_ARY_FOR(&c->pending, pos) {
+      if (fio_msg_internal_same_channel(*pos, msg)) {
+        fio_msg_internal_free(msg);
+        msg = NULL;
+        break;
+      }
+    }
+    if (msg)
+      fio_msg_ary_unshift(&c->pending, msg);
+    fio_unlock(&c->lock);
+  } else {
+    fio_msg_internal_free(msg);
+  }
+  fio_lock(&c->lock);
+  if (!fio_msg_ary_count(&c->pending)) {
+    c->scheduled = 0;
+    fio_unlock(&c->lock);
+    fio_subscription_free(s);
+    return;
+  }
+  fio_unlock(&c->lock);
+  fio_defer_push_task(fio_perform_subscription_conflated, s_, epoch_);
+}
+
+/**
+ * Schedules a message for a conflating subscription, replacing any pending
+ * (undelivered) message that was published to the same channel.
+ */
+static void fio_subscription_conflate(subscription_s *s,
+                                      fio_msg_internal_s *msg) {
+  fio_conflate_s *c = s->conflate;
+  fio_msg_internal_s *old = NULL;
+  uint8_t schedule = 0;
+  fio_msg_internal_dup(msg);
+  fio_lock(&c->lock);
+  FIO_ARY_FOR(&c->pending, pos) {
+    if (fio_msg_internal_same_channel(*pos, msg)) {
+      old = *pos;
+      *pos = msg;
+      goto finish;
+    }
+  }
+  fio_msg_ary_push(&c->pending, msg);
+  schedule = !c->scheduled;
+  c->scheduled = 1;
+finish:
+  fio_unlock(&c->lock);
+  if (old)
+    fio_msg_internal_free(old);
+  if (schedule) {
+    fio_atomic_add(&s->ref, 1);
+    fio_defer_push_task(fio_perform_subscription_conflated, s,
+                        (void *)(uintptr_t)c->epoch);
+  }
+}
+
+static void fio_conflate_free(fio_conflate_s *c) {
+  if (!c)
+    return;
+  FIO_ARY_FOR(&c->pending, pos) { fio_msg_internal_free(*pos); }
+  fio_msg_ary_free(&c->pending);
+  fio_free(c);
+}
+
+/* frees a subscription's mailbox */
+static void fio_mailbox_free(fio_mailbox_s *mb) {
+  if (!mb)
+    return;
+  FIO_ARY_FOR(&mb->pending, pos) { fio_msg_internal_free(*pos); }
+  fio_msg_ary_free(&mb->pending);
+  fio_free(mb);
+}
+
+/* frees the messages pending for a subscription, returning their number */
+static size_t fio_pending_msgs_free(fio_msg_ary_s *ary) {
+  size_t count = fio_msg_ary_count(ary);
+  FIO_ARY_FOR(ary, pos) { fio_msg_internal_free(*pos); }
+  fio_msg_ary_free(ary);
+  *ary = (fio_msg_ary_s)FIO_ARY_INIT;
+  return count;
+}
+
+/*
+ * The thread draining the mailbox (or the task that would continue) might not
+ * exist after forking. The messages were published to the parent process, so
+ * they're dropped, and tasks scheduled before the fork are invalidated.
+ */
+static void fio_mailbox_on_fork(subscription_s *s) {
+  fio_mailbox_s *mb = s->mailbox;
+  if (!mb)
+    return;
+  mb->lock = FIO_LOCK_INIT;
+  mb->draining = 0;
+  ++mb->epoch;
+#if FIO_PUBSUB_STATS
+  s->pending -= fio_pending_msgs_free(&mb->pending);
+#else
+  fio_pending_msgs_free(&mb->pending);
+#endif
+}
+
+/* see `fio_mailbox_on_fork` */
+static void fio_conflate_on_fork(subscription_s *s) {
+  fio_conflate_s *c = s->conflate;
+  if (!c)
+    return;
+  c->lock = FIO_LOCK_INIT;
+  c->scheduled = 0;
+  ++c->epoch;
+  fio_pending_msgs_free(&c->pending);
 }
 
 /** UNSAFE! publishes a message to a channel, managing the reference counts */
 static void fio_publish2channel(channel_s *ch, fio_msg_internal_s *msg) {
+  subscription_s *subs[FIO_PUBSUB_CHUNK];
+  size_t count = 0;
+#if FIO_PUBSUB_STATS
+  ++ch->messages;
+  ch->bytes += msg->data.len;
+#endif
   FIO_LS_EMBD_FOR(&ch->subscriptions, pos) {
     subscription_s *s = FIO_LS_EMBD_OBJ(subscription_s, node, pos);
     if (!s) {
       continue;
     }
+    if (msg->sequence && msg->sequence <= s->replayed) {
+      /* already delivered by the history replay */
+      continue;
+    }
+    if (s->conflate) {
+      fio_subscription_conflate(s, msg);
+      continue;
+    }
+#if FIO_PUBSUB_STATS
+    fio_atomic_add(&s->pending, 1);
+#endif
     fio_atomic_add(&s->ref, 1);
-    fio_atomic_add(&msg->ref, 1);
-    fio_defer_push_task(fio_perform_subscription_callback, s, msg);
+    subs[count++] = s;
+    if (count == FIO_PUBSUB_CHUNK) {
+      fio_publish2chunk(subs, count, msg);
+      count = 0;
+    }
   }
+  if (count)
+    fio_publish2chunk(subs, count, msg);
   fio_msg_internal_free(msg);
 }
 static void fio_publish2channel_task(void *ch_, void *msg) {
@@ -5759,6 +7454,179 @@ finish:
   fio_channel_free(ch);
 }
 
+/* *****************************************************************************
+ * Channel history
+ **************************************************************************** */
+
+/*
+ * A channel's history holds references to the published messages (the same
+ * objects used for live delivery), so it doesn't copy any data. Messages that
+ * reference a shared cluster payload are the exception - these are copied, so
+ * the history doesn't pin the shared segment.
+ *
+ * The histories (and their messages) are protected by the history lock.
+ *
+ * Messages are numbered by the publishing process (see
+ * `fio_history_sequences_s`) and only numbered messages are kept, so a message
+ * has the same sequence number in every process's history.
+ */
+
+static inline uint64_t fio_history_hash(char *name, size_t len) {
+  return FIO_HASH_FN(name, len, &fio_history, &fio_history);
+}
+
+/* maps the shared sequence counters (falls back to process local counters) */
+static void fio_history_sequences_init(void) {
+  static fio_history_sequences_s local;
+  if (fio_history_sequences)
+    return;
+  void *mem = mmap(NULL, sizeof(*fio_history_sequences),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    FIO_LOG_WARNING("(%d) couldn't map the pub/sub history sequences, "
+                    "workers will number messages separately.",
+                    getpid());
+    mem = &local;
+  }
+  fio_history_sequences = mem;
+}
+
+static inline size_t fio_history_bucket(fio_str_info_s ch) {
+  return (size_t)(fio_risky_hash(ch.data, ch.len, 0) &
+                  (FIO_PUBSUB_HISTORY_BUCKETS - 1));
+}
+
+/* returns a message's sequence number, 0 if no history is kept for it */
+static inline uint64_t fio_history_sequence(int32_t filter, fio_str_info_s ch) {
+  fio_history_sequences_s *t = fio_history_sequences;
+  if (filter || !t || !t->kept)
+    return 0;
+  const size_t bucket = fio_history_bucket(ch);
+  if (!t->buckets[bucket].kept)
+    return 0;
+  return fio_atomic_add(&t->buckets[bucket].sequence, 1);
+}
+
+/* makes sure messages published to the channel are numbered from now on */
+static inline void fio_history_sequence_keep(fio_str_info_s ch) {
+  fio_history_sequences_s *t = fio_history_sequences;
+  if (!t)
+    return;
+  fio_atomic_xchange(&t->buckets[fio_history_bucket(ch)].kept, 1);
+  fio_atomic_xchange(&t->kept, 1);
+}
+
+/* evicts the oldest messages until the limits are met (lock must be held) */
+static void fio_history_trim(fio_history_s *h) {
+  fio_msg_internal_s *m = NULL;
+  while (((h->max_messages && fio_msg_ary_count(&h->msgs) > h->max_messages) ||
+          (h->max_bytes && h->bytes > h->max_bytes)) &&
+         !fio_msg_ary_shift(&h->msgs, &m)) {
+    h->bytes -= m->channel.len + m->data.len;
+    fio_msg_internal_free(m);
+  }
+}
+
+static void fio_history_free(fio_history_s *h) {
+  FIO_ARY_FOR(&h->msgs, pos) { fio_msg_internal_free(*pos); }
+  fio_msg_ary_free(&h->msgs);
+  free(h);
+}
+
+void fio_pubsub_history_set(fio_str_info_s channel, size_t max_messages,
+                            size_t max_bytes) {
+  fio_history_s tmp = {.name = channel.data, .name_len = channel.len};
+  uint64_t hashed = fio_history_hash(channel.data, channel.len);
+  channel_s ch = {.name = channel.data, .name_len = channel.len};
+  int8_t counted = 0;
+  fio_lock(&fio_history.lock);
+  fio_history_s *h = fio_history_set_find(&fio_history.set, hashed, &tmp);
+  if (!max_messages && !max_bytes) {
+    if (h) {
+      fio_history_set_remove(&fio_history.set, hashed, h, NULL);
+      fio_history_free(h);
+      --fio_history.count;
+      counted = -1;
+    }
+  } else {
+    if (!h) {
+      h = malloc(sizeof(*h) + channel.len + 1);
+      FIO_ASSERT_ALLOC(h);
+      *h = (fio_history_s){.msgs = FIO_ARY_INIT,
+                           .name = (char *)(h + 1),
+                           .name_len = channel.len};
+      memcpy(h->name, channel.data, channel.len);
+      h->name[channel.len] = 0;
+      fio_history_sequence_keep(channel);
+      fio_history_set_insert(&fio_history.set, hashed, h);
+      ++fio_history.count;
+      counted = 1;
+    }
+    h->max_messages = max_messages;
+    h->max_bytes = max_bytes;
+    fio_history_trim(h);
+  }
+  fio_unlock(&fio_history.lock);
+  /* the process should receive the channel's messages using the mesh */
+  if (counted)
+    fio_cluster_mesh_count(&ch, counted > 0);
+}
+
+/* adds a message to the channel's history, if it keeps one */
+static void fio_history_push(fio_msg_internal_s *m) {
+  fio_history_s tmp = {.name = m->channel.data, .name_len = m->channel.len};
+  uint64_t hashed = fio_history_hash(m->channel.data, m->channel.len);
+  fio_lock(&fio_history.lock);
+  fio_history_s *h = fio_history_set_find(&fio_history.set, hashed, &tmp);
+  /* messages published before the history was set aren't numbered */
+  if (h && m->sequence) {
+    fio_msg_ary_push(&h->msgs,
+                     fio_msg_internal_unshare(fio_msg_internal_dup(m)));
+    h->bytes += m->channel.len + m->data.len;
+    fio_history_trim(h);
+  }
+  fio_unlock(&fio_history.lock);
+}
+
+static void fio_history_replay(subscription_s *s, uint64_t since) {
+  channel_s *ch = s->parent;
+  fio_history_s tmp = {.name = ch->name, .name_len = ch->name_len};
+  uint64_t hashed = fio_history_hash(ch->name, ch->name_len);
+  fio_lock(&fio_history.lock);
+  fio_history_s *h = fio_history_set_find(&fio_history.set, hashed, &tmp);
+  if (h) {
+    FIO_ARY_FOR(&h->msgs, pos) {
+      fio_msg_internal_s *m = *pos;
+      if (m->sequence < since)
+        continue;
+      /* messages from different publishers might arrive out of order */
+      if (m->sequence > s->replayed)
+        s->replayed = m->sequence;
+      if (s->conflate) {
+        fio_subscription_conflate(s, m);
+        continue;
+      }
+#if FIO_PUBSUB_STATS
+      fio_atomic_add(&s->pending, 1);
+#endif
+      fio_atomic_add(&s->ref, 1);
+      fio_defer_push_task(fio_perform_subscription_callback, s,
+                          fio_msg_internal_dup(m));
+    }
+  }
+  fio_unlock(&fio_history.lock);
+}
+
+/* frees all histories (called during cleanup) */
+static void fio_history_free_all(void) {
+  FIO_SET_FOR_LOOP(&fio_history.set, pos) {
+    if (pos->hash)
+      fio_history_free(pos->obj);
+  }
+  fio_history_set_free(&fio_history.set);
+  fio_history.count = 0;
+}
+
 /** Publishes the message to the current process and frees the strings. */
 static void fio_publish2process(fio_msg_internal_s *m) {
   channel_s *ch;
@@ -5768,6 +7636,9 @@ static void fio_publish2process(fio_msg_internal_s *m) {
       goto finish;
     }
   } else {
+    /* a stale count is harmless, the history is looked up under the lock */
+    if (fio_history.count)
+      fio_history_push(m);
     ch = fio_channel_find_dup(m->channel);
   }
   /* exact match */
@@ -5776,22 +7647,32 @@ static void fio_publish2process(fio_msg_internal_s *m) {
                           fio_msg_internal_dup(m));
   }
   if (m->filter == 0) {
-    /* pattern matching match */
-    fio_lock(&fio_postoffice.patterns.lock);
-    FIO_SET_FOR_LOOP(&fio_postoffice.patterns.channels, p) {
-      if (!p->hash) {
+    /* pattern matching match (only the buckets matching the channel name) */
+    fio_lock(&fio_pattern_index.lock);
+    FIO_ARY_FOR(&fio_pattern_index.shapes, shape) {
+      if ((size_t)shape->prefix_len + shape->suffix_len > m->channel.len)
         continue;
-      }
-
-      if (p->obj->match(
-              (fio_str_info_s){.data = p->obj->name, .len = p->obj->name_len},
-              m->channel)) {
-        fio_channel_dup(p->obj);
-        fio_defer_push_urgent(fio_publish2channel_task, p->obj,
-                              fio_msg_internal_dup(m));
+      fio_pattern_bucket_s key = {
+          .prefix = m->channel.data,
+          .suffix = m->channel.data + m->channel.len - shape->suffix_len,
+          .prefix_len = shape->prefix_len,
+          .suffix_len = shape->suffix_len,
+      };
+      fio_pattern_bucket_s *b = fio_pattern_set_find(
+          &fio_pattern_index.buckets, fio_pattern_bucket_hash(&key), &key);
+      if (!b)
+        continue;
+      FIO_LS_EMBD_FOR(&b->channels, n) {
+        channel_s *p = FIO_LS_EMBD_OBJ(channel_s, pattern, n);
+        if (p->match((fio_str_info_s){.data = p->name, .len = p->name_len},
+                     m->channel)) {
+          fio_channel_dup(p);
+          fio_defer_push_urgent(fio_publish2channel_task, p,
+                                fio_msg_internal_dup(m));
+        }
       }
     }
-    fio_unlock(&fio_postoffice.patterns.lock);
+    fio_unlock(&fio_pattern_index.lock);
   }
 finish:
   fio_msg_internal_free(m);
@@ -5803,6 +7684,17 @@ finish:
 
 #define CLUSTER_READ_BUFFER 16384
 
+#ifndef FIO_CLUSTER_BATCH_LIMIT
+/**
+ * Pub/sub messages written to a cluster socket are collected into batches of
+ * up to this many bytes, written once full or after the pending tasks ran.
+ */
+#define FIO_CLUSTER_BATCH_LIMIT CLUSTER_READ_BUFFER
+#endif
+
+/* the number of full socket reads performed for each `on_data` event */
+#define CLUSTER_READ_ROUNDS 8
+
 #define FIO_SET_NAME fio_sub_hash
 #define FIO_SET_OBJ_TYPE subscription_s *
 #define FIO_SET_KEY_TYPE fio_str_s
@@ -5816,6 +7708,196 @@ finish:
 
 #define FIO_CLUSTER_NAME_LIMIT 255
 
+/* *****************************************************************************
+ * Cluster shared memory rings - data structures
+ **************************************************************************** */
+
+#ifndef FIO_CLUSTER_RINGS
+/**
+ * When set, cluster messages are exchanged using shared memory rings (one pair
+ * per worker), using the Unix sockets for long messages or when a ring is full.
+ */
+#define FIO_CLUSTER_RINGS 1
+#endif
+
+#ifndef FIO_CLUSTER_RING_SIZE
+/** The size of each shared memory ring, must be a power of 2. */
+#define FIO_CLUSTER_RING_SIZE (1UL << 17)
+#endif
+
+#if (FIO_CLUSTER_RING_SIZE & (FIO_CLUSTER_RING_SIZE - 1)) ||                   \
+    FIO_CLUSTER_RING_SIZE < 4096
+#error FIO_CLUSTER_RING_SIZE must be a power of 2 (4096 or more)
+#endif
+
+/* ring record kinds (stored in the second half of each record header) */
+#define FIO_CLUSTER_RING_FRAME 1  /* a wrapped cluster message */
+#define FIO_CLUSTER_RING_SWITCH 2 /* following messages use the socket */
+#define FIO_CLUSTER_RING_WRAP 3   /* the next record is at offset 0 */
+
+#ifndef FIO_CLUSTER_MESH
+/**
+ * When set (and the rings are available), workers publish messages directly to
+ * the processes subscribed to the channel, using a shared subscription registry
+ * and a ring for each pair of workers. Requires less than 32 workers.
+ */
+#define FIO_CLUSTER_MESH 1
+#endif
+
+#ifndef FIO_CLUSTER_MESH_RING_SIZE
+/** The size of each worker-to-worker ring, must be a power of 2. */
+#define FIO_CLUSTER_MESH_RING_SIZE (1UL << 15)
+#endif
+
+#if (FIO_CLUSTER_MESH_RING_SIZE & (FIO_CLUSTER_MESH_RING_SIZE - 1)) ||         \
+    FIO_CLUSTER_MESH_RING_SIZE < 4096
+#error FIO_CLUSTER_MESH_RING_SIZE must be a power of 2 (4096 or more)
+#endif
+
+#ifndef FIO_CLUSTER_MESH_BUCKETS
+/** The number of channel hash buckets in the subscription registry. */
+#define FIO_CLUSTER_MESH_BUCKETS 4096
+#endif
+
+#if (FIO_CLUSTER_MESH_BUCKETS & (FIO_CLUSTER_MESH_BUCKETS - 1))
+#error FIO_CLUSTER_MESH_BUCKETS must be a power of 2
+#endif
+
+/* the registry bit of the root process (workers use their slot's index) */
+#define FIO_CLUSTER_MESH_ROOT ((uint64_t)1 << 63)
+
+#ifndef FIO_CLUSTER_SHM_SIZE
+/**
+ * The size of the shared memory segment used for long pub/sub payloads, which
+ * are sent to the other processes by reference (0 disables the segment).
+ */
+#define FIO_CLUSTER_SHM_SIZE (1UL << 24)
+#endif
+
+#ifndef FIO_CLUSTER_SHM_MIN
+/** Payloads of this many bytes (or more) are placed in the shared segment. */
+#define FIO_CLUSTER_SHM_MIN 4096
+#endif
+
+/* the shared segment's allocation unit */
+#define FIO_CLUSTER_SHM_BLOCK 4096
+
+#if FIO_CLUSTER_SHM_SIZE & ((FIO_CLUSTER_SHM_BLOCK << 6) - 1)
+#error FIO_CLUSTER_SHM_SIZE must be a multiple of 256Kb
+#endif
+
+/* record header length (u32 length + u32 kind) */
+#define FIO_CLUSTER_RING_HEADER 8
+/* messages longer than a quarter of the ring always use the socket */
+#define FIO_CLUSTER_RING_MSG_LIMIT(r) ((r)->size >> 2)
+
+/**
+ * A single producer, single consumer ring, placed in shared memory.
+ *
+ * The producer owns `tail`, `mode` and `lock` (which serializes the
+ * producer's threads), the consumer owns `head`.
+ */
+typedef struct {
+  volatile size_t tail;
+  uint8_t pad_tail_[64 - sizeof(size_t)];
+  volatile size_t head;
+  uint8_t pad_head_[64 - sizeof(size_t)];
+  fio_lock_i lock;
+  /* set by the producer while messages are written to the ring */
+  uint8_t mode;
+  /* doorbell: fd[0] is polled by the consumer, fd[1] written by the producer */
+  int fd[2];
+  /* the ring's size (a power of 2) and buffer (in the same shared mapping) */
+  size_t size;
+  uint8_t *buffer;
+} fio_cluster_ring_s;
+
+/** A per-worker ring pair, claimed by a worker process when it connects. */
+typedef struct {
+  fio_cluster_ring_s r2w; /* root -> worker */
+  fio_cluster_ring_s w2r; /* worker -> root */
+  /* locked by the worker that claimed the slot, released by the root */
+  fio_lock_i claim;
+  /* (root) the cluster connection bound to the slot */
+  intptr_t uuid;
+  /* signals the slot's worker about messages in its mesh rings */
+  int mesh_bell[2];
+} fio_cluster_slot_s;
+
+/** The processes subscribed to each channel hash bucket (a bit each). */
+typedef struct {
+  /* processes with pattern subscriptions */
+  volatile uint64_t patterns;
+  volatile uint64_t buckets[FIO_CLUSTER_MESH_BUCKETS];
+} fio_cluster_registry_s;
+
+static struct {
+  fio_cluster_slot_s *slots;
+  size_t count;
+  /* the length of the shared mapping */
+  size_t length;
+  /* (worker) the slot claimed by this process, or NULL */
+  fio_cluster_slot_s *self;
+  /* the worker-to-worker rings, ordered by [origin * count + target] */
+  fio_cluster_ring_s *mesh;
+  /* the shared subscription registry (NULL if the mesh is unavailable) */
+  fio_cluster_registry_s *registry;
+} fio_cluster_rings;
+
+/** The process's (local) mesh state. */
+static struct {
+  /* serializes publishing using the mesh (the producer state) */
+  fio_lock_i lock;
+  /* serializes reading the mesh rings (the consumer state) */
+  fio_lock_i read_lock;
+  /* set while messages are published using the mesh rings */
+  uint8_t mode;
+  /* (consumer) origins that route their messages through the root */
+  uint8_t paused[64];
+  /* the number of local subscriptions (patterns and per bucket), atomic */
+  volatile uint32_t patterns;
+  volatile uint32_t counts[FIO_CLUSTER_MESH_BUCKETS];
+} fio_cluster_mesh;
+
+/**
+ * The shared payload segment's allocation map, placed in shared memory.
+ *
+ * The map is protected by `lock`, which also protects the reference counts.
+ */
+typedef struct {
+  /* 0 or the holder's reference holder index + 1 (for crash recovery) */
+  volatile uint32_t lock;
+  /* where the next search for free blocks starts */
+  size_t hint;
+  size_t blocks;
+  /* a bit per block, set while the block is allocated */
+  uint64_t used[];
+} fio_cluster_shm_map_s;
+
+/**
+ * A shared payload, placed at the start of its first block.
+ *
+ * References are counted per process, so the root can release the references
+ * held by (or sent to) a worker that was lost. Workers use their slot's index
+ * and the root uses the slot count.
+ */
+typedef struct fio_cluster_shm_s {
+  size_t total;
+  uint32_t blocks;
+  uint32_t len;
+  uint32_t refs[];
+} fio_cluster_shm_s;
+
+static struct {
+  fio_cluster_shm_map_s *map;
+  /* the first block */
+  uint8_t *blocks;
+  /* the length of the shared mapping */
+  size_t length;
+  /* the payload's offset within its first block */
+  size_t offset;
+} fio_cluster_shm;
+
 typedef struct cluster_pr_s {
   fio_protocol_s protocol;
   fio_msg_internal_s *msg;
@@ -5830,11 +7912,29 @@ typedef struct cluster_pr_s {
   int32_t filter;
   uint32_t length;
   fio_lock_i lock;
+  /* the ring pair used by this connection (NULL if none) */
+  fio_cluster_slot_s *slot;
+  /* the ring read by this connection */
+  fio_cluster_ring_s *ring;
+  /* the doorbell connection for `ring` */
+  intptr_t bell;
+  /* set while messages should be read from `ring` */
+  uint8_t ring_mode;
+  /* (worker) set once the root bound the ring pair, enabling `slot->w2r` */
+  uint8_t ring_bound;
+  /* set while a batch flushing task is scheduled */
+  uint8_t batch_scheduled;
+  fio_lock_i batch_lock;
+  /* messages waiting to be written to the socket (as a single packet) */
+  fio_str_s *batch;
   uint8_t buffer[CLUSTER_READ_BUFFER];
 } cluster_pr_s;
 
 static struct cluster_data_s {
   intptr_t uuid;
+  /* (worker) the connection to the root process, once connected */
+  cluster_pr_s *pr;
+  /* (root) the worker connections (`cluster_pr_s` objects) */
   fio_ls_s clients;
   fio_lock_i lock;
   char name[FIO_CLUSTER_NAME_LIMIT + 1];
@@ -5849,12 +7949,13 @@ static void fio_cluster_data_cleanup(int delete_file) {
     unlink(cluster_data.name);
   }
   while (fio_ls_any(&cluster_data.clients)) {
-    intptr_t uuid = (intptr_t)fio_ls_pop(&cluster_data.clients);
-    if (uuid > 0) {
-      fio_close(uuid);
+    cluster_pr_s *c = fio_ls_pop(&cluster_data.clients);
+    if (c->uuid > 0) {
+      fio_close(c->uuid);
     }
   }
   cluster_data.uuid = 0;
+  cluster_data.pr = NULL;
   cluster_data.lock = FIO_LOCK_INIT;
   cluster_data.clients = (fio_ls_s)FIO_LS_INIT(cluster_data.clients);
 }
@@ -5929,34 +8030,1027 @@ fio_cluster_wrap_message(uint32_t ch_len, uint32_t msg_len, uint32_t type,
   return buf;
 }
 
+/* wraps a pub/sub message, prefixing the data with its sequence number (if) */
+static fio_str_s *fio_cluster_wrap_publication(uint32_t type, int32_t filter,
+                                               fio_str_info_s ch,
+                                               fio_str_info_s msg,
+                                               uint64_t sequence) {
+  if (!sequence)
+    return fio_cluster_wrap_message((uint32_t)ch.len, (uint32_t)msg.len, type,
+                                    filter, ch.data, msg.data);
+  fio_str_s *buf =
+      fio_cluster_wrap_message((uint32_t)ch.len, (uint32_t)msg.len + 8,
+                               type | FIO_CLUSTER_MSG_SEQUENCED, filter,
+                               ch.data, NULL);
+  char *pos = fio_str_data(buf) + 16 + ch.len;
+  fio_u2str64(pos, sequence);
+  if (msg.len)
+    memcpy(pos + 8, msg.data, msg.len);
+  return buf;
+}
+
 static inline void fio_cluster_protocol_free(void *pr) { fio_free(pr); }
 
-static uint8_t fio_cluster_on_shutdown(intptr_t uuid, fio_protocol_s *pr_) {
-  cluster_pr_s *p = (cluster_pr_s *)pr_;
-  p->sender(
-      fio_cluster_wrap_message(0, 0, FIO_CLUSTER_MSG_SHUTDOWN, 0, NULL, NULL),
-      -1);
-  return 255;
-  (void)pr_;
-  (void)uuid;
+/* writes the connection's batch (batch lock must be held). */
+static void fio_cluster_flush_unsafe(cluster_pr_s *c) {
+  if (!c->batch)
+    return;
+  fio_str_send_free2(c->uuid, c->batch);
+  c->batch = NULL;
+}
+
+static void fio_cluster_flush_task(intptr_t uuid, fio_protocol_s *pr,
+                                   void *ignr) {
+  cluster_pr_s *c = (cluster_pr_s *)pr;
+  fio_lock(&c->batch_lock);
+  c->batch_scheduled = 0;
+  fio_cluster_flush_unsafe(c);
+  fio_unlock(&c->batch_lock);
+  (void)uuid;
+  (void)ignr;
+}
+
+/**
+ * Writes a wrapped cluster message to the connection's socket, taking
+ * ownership of `data`.
+ *
+ * Short pub/sub messages are copied to the connection's batch, which is
+ * written when it fills up or once the pending tasks were performed. Other
+ * messages are written after the batch.
+ */
+static void fio_cluster_write(cluster_pr_s *c, fio_str_s *data) {
+  fio_str_info_s i = fio_str_info(data);
+  /* FIO_CLUSTER_MSG_FORWARD, _JSON, _ROOT and _ROOT_JSON */
+  const uint8_t batch =
+      i.len >= 16 && i.len <= (FIO_CLUSTER_BATCH_LIMIT >> 2) &&
+      (fio_str2u32(i.data + 8) & ~(uint32_t)FIO_CLUSTER_MSG_FLAGS) <=
+          FIO_CLUSTER_MSG_ROOT_JSON;
+  fio_lock(&c->batch_lock);
+  if (c->batch &&
+      (!batch || fio_str_len(c->batch) + i.len > FIO_CLUSTER_BATCH_LIMIT))
+    fio_cluster_flush_unsafe(c);
+  if (!batch) {
+    fio_str_send_free2(c->uuid, data);
+    goto finish;
+  }
+  if (!c->batch) {
+    c->batch = fio_str_new2();
+    fio_str_capa_assert(c->batch, FIO_CLUSTER_BATCH_LIMIT);
+  }
+  fio_str_write(c->batch, i.data, i.len);
+  fio_str_free2(data);
+  if (!c->batch_scheduled) {
+    c->batch_scheduled = 1;
+    fio_defer_io_task(c->uuid, .type = FIO_PR_LOCK_WRITE,
+                      .task = fio_cluster_flush_task);
+  }
+finish:
+  fio_unlock(&c->batch_lock);
+}
+
+/* *****************************************************************************
+ * Cluster shared payloads (long messages are sent by reference)
+ **************************************************************************** */
+
+/* returns the process's reference holder index, or -1 if it has none. */
+static int32_t fio_cluster_shm_holder(void) {
+  if (!fio_cluster_shm.map)
+    return -1;
+  if (!fio_data->is_worker)
+    return (int32_t)fio_cluster_rings.count;
+  if (!fio_cluster_rings.self)
+    return -1;
+  return (int32_t)(fio_cluster_rings.self - fio_cluster_rings.slots);
+}
+
+/*
+ * Locks the allocation map. The holder's index is stored in the lock word
+ * itself, so a lock held by a lost worker is always recognized.
+ */
+static void fio_cluster_shm_lock(int32_t holder) {
+  const uint32_t owner = (holder < 0 ? ~(uint32_t)0 : (uint32_t)holder + 1);
+  while (!__sync_bool_compare_and_swap(&fio_cluster_shm.map->lock, 0, owner))
+    fio_reschedule_thread();
+}
+
+static void fio_cluster_shm_unlock(void) {
+  __asm__ volatile("" ::: "memory");
+  fio_atomic_xchange(&fio_cluster_shm.map->lock, 0);
+}
+
+/* returns the first of `need` free blocks, starting at `from` (or -1). */
+static size_t fio_cluster_shm_find_unsafe(size_t from, size_t need) {
+  fio_cluster_shm_map_s *map = fio_cluster_shm.map;
+  size_t run = 0;
+  for (size_t i = from; i < map->blocks; ++i) {
+    if (!(i & 63) && map->used[i >> 6] == ~(uint64_t)0) {
+      run = 0;
+      i += 63;
+      continue;
+    }
+    if (map->used[i >> 6] & ((uint64_t)1 << (i & 63))) {
+      run = 0;
+      continue;
+    }
+    if (++run == need)
+      return i + 1 - need;
+  }
+  return (size_t)-1;
+}
+
+/* marks a payload's blocks as free (lock must be held). */
+static void fio_cluster_shm_free_unsafe(fio_cluster_shm_s *p) {
+  fio_cluster_shm_map_s *map = fio_cluster_shm.map;
+  size_t i = ((uint8_t *)p - fio_cluster_shm.blocks) / FIO_CLUSTER_SHM_BLOCK;
+  for (const size_t end = i + p->blocks; i < end; ++i)
+    map->used[i >> 6] &= ~((uint64_t)1 << (i & 63));
+}
+
+/**
+ * Copies a payload to the shared segment, holding a reference for the calling
+ * process. Returns NULL if the payload is short or doesn't fit.
+ */
+static fio_cluster_shm_s *fio_cluster_shm_new(fio_str_info_s data) {
+  const int32_t holder = fio_cluster_shm_holder();
+  if (holder < 0 || data.len < FIO_CLUSTER_SHM_MIN || data.len >= (1UL << 31))
+    return NULL;
+  fio_cluster_shm_map_s *map = fio_cluster_shm.map;
+  const size_t need = (fio_cluster_shm.offset + data.len + 1 +
+                       (FIO_CLUSTER_SHM_BLOCK - 1)) /
+                      FIO_CLUSTER_SHM_BLOCK;
+  fio_cluster_shm_s *p = NULL;
+  fio_cluster_shm_lock(holder);
+  size_t i = fio_cluster_shm_find_unsafe(map->hint, need);
+  if (i == (size_t)-1 && map->hint)
+    i = fio_cluster_shm_find_unsafe(0, need);
+  if (i == (size_t)-1)
+    goto finish;
+  map->hint = i + need;
+  p = (fio_cluster_shm_s *)(fio_cluster_shm.blocks +
+                            (i * FIO_CLUSTER_SHM_BLOCK));
+  for (const size_t end = i + need; i < end; ++i)
+    map->used[i >> 6] |= ((uint64_t)1 << (i & 63));
+  memset(p, 0, fio_cluster_shm.offset);
+  p->total = 1;
+  p->blocks = (uint32_t)need;
+  p->len = (uint32_t)data.len;
+  p->refs[holder] = 1;
+finish:
+  fio_cluster_shm_unlock();
+  if (!p)
+    return NULL;
+  memcpy((uint8_t *)p + fio_cluster_shm.offset, data.data, data.len);
+  ((uint8_t *)p)[fio_cluster_shm.offset + data.len] = 0;
+  return p;
+}
+
+/* adds a reference on behalf of the process that will release it. */
+static void fio_cluster_shm_dup(fio_cluster_shm_s *p, size_t holder) {
+  fio_cluster_shm_lock(fio_cluster_shm_holder());
+  ++p->refs[holder];
+  ++p->total;
+  fio_cluster_shm_unlock();
+}
+
+/* releases a reference held by `holder`, freeing the payload if unused. */
+static void fio_cluster_shm_release(fio_cluster_shm_s *p, int32_t holder) {
+  if (!p || holder < 0 || !fio_cluster_shm.map)
+    return;
+  fio_cluster_shm_lock(holder);
+  /* the root might have released a lost worker's references */
+  if (p->refs[holder]) {
+    --p->refs[holder];
+    if (!--p->total)
+      fio_cluster_shm_free_unsafe(p);
+  }
+  fio_cluster_shm_unlock();
+}
+
+static void fio_cluster_shm_detach(fio_msg_internal_s *msg) {
+  /* a forked process doesn't hold its parent's references */
+  if (msg->shared_holder == fio_cluster_shm_holder())
+    fio_cluster_shm_release(msg->shared, msg->shared_holder);
+  msg->shared = NULL;
+}
+
+/*
+ * Points a received message's data at the shared payload it references (the
+ * message holds the process's reference). Returns -1 on error.
+ */
+static int fio_cluster_shm_attach(fio_msg_internal_s *m) {
+  const int32_t holder = fio_cluster_shm_holder();
+  if (holder < 0 || m->data.len != 8)
+    return -1;
+  uint32_t index = fio_str2u32(m->data.data);
+  uint32_t len = fio_str2u32(m->data.data + 4);
+  if (index >= fio_cluster_shm.map->blocks)
+    return -1;
+  fio_cluster_shm_s *p = (fio_cluster_shm_s *)(fio_cluster_shm.blocks +
+                                               (index * FIO_CLUSTER_SHM_BLOCK));
+  if (p->len != len)
+    return -1;
+  m->data = (fio_str_info_s){.data = (char *)p + fio_cluster_shm.offset,
+                             .len = len};
+  m->shared = p;
+  m->shared_holder = holder;
+  return 0;
+}
+
+/* wraps a cluster message that references a shared payload. */
+static fio_str_s *fio_cluster_shm_wrap(fio_cluster_shm_s *p, uint32_t type,
+                                       int32_t filter, fio_str_info_s ch,
+                                       uint64_t sequence) {
+  uint8_t ref[8];
+  fio_u2str32(ref, (uint32_t)(((uint8_t *)p - fio_cluster_shm.blocks) /
+                              FIO_CLUSTER_SHM_BLOCK));
+  fio_u2str32(ref + 4, p->len);
+  return fio_cluster_wrap_publication(
+      type | FIO_CLUSTER_MSG_SHARED, filter, ch,
+      (fio_str_info_s){.data = (char *)ref, .len = 8}, sequence);
+}
+
+/*
+ * Converts a complete message with FIO_CLUSTER_MSG_FLAGS set in its type
+ * (reading the sequence number and attaching the shared payload), returning
+ * the type without the flags. On error, the message is freed and set to NULL.
+ */
+static uint32_t fio_cluster_msg_receive(fio_msg_internal_s **m,
+                                        uint32_t type) {
+  if (!(type & FIO_CLUSTER_MSG_FLAGS))
+    return type;
+  if (type & FIO_CLUSTER_MSG_SEQUENCED) {
+    if ((*m)->data.len < 8)
+      goto error;
+    (*m)->sequence = fio_str2u64((*m)->data.data);
+    (*m)->data.data += 8;
+    (*m)->data.len -= 8;
+  }
+  if ((type & FIO_CLUSTER_MSG_SHARED) && fio_cluster_shm_attach(*m))
+    goto error;
+  return type & ~(uint32_t)FIO_CLUSTER_MSG_FLAGS;
+error:
+  FIO_LOG_ERROR("(%d) invalid cluster message payload.", getpid());
+  fio_msg_internal_free(*m);
+  *m = NULL;
+  return type & ~(uint32_t)FIO_CLUSTER_MSG_FLAGS;
+}
+
+/*
+ * Releases the references held by (or sent to) a slot's previous worker. This
+ * is performed by the root once a worker is lost and by the slot's next worker
+ * (for messages sent before the root released the slot).
+ */
+static void fio_cluster_shm_release_holder(size_t holder) {
+  fio_cluster_shm_map_s *map = fio_cluster_shm.map;
+  if (!map)
+    return;
+  /* the worker might have crashed while holding the lock */
+  __sync_bool_compare_and_swap(&map->lock, (uint32_t)holder + 1, 0);
+  fio_cluster_shm_lock(fio_cluster_shm_holder());
+  for (size_t i = 0; i < map->blocks;) {
+    if (!(map->used[i >> 6] & ((uint64_t)1 << (i & 63)))) {
+      ++i;
+      continue;
+    }
+    fio_cluster_shm_s *p =
+        (fio_cluster_shm_s *)(fio_cluster_shm.blocks +
+                              (i * FIO_CLUSTER_SHM_BLOCK));
+    i += p->blocks;
+    if (!p->refs[holder])
+      continue;
+    p->total -= p->refs[holder];
+    p->refs[holder] = 0;
+    if (!p->total)
+      fio_cluster_shm_free_unsafe(p);
+  }
+  fio_cluster_shm_unlock();
+}
+
+/* Allocates the shared segment (after the rings, before forking). */
+static void fio_cluster_shm_init(void) {
+  if (!FIO_CLUSTER_SHM_SIZE || !fio_cluster_rings.slots || fio_cluster_shm.map)
+    return;
+  const size_t blocks = FIO_CLUSTER_SHM_SIZE / FIO_CLUSTER_SHM_BLOCK;
+  size_t header = sizeof(fio_cluster_shm_map_s) + (blocks >> 3);
+  header = (header + 4095) & (~(size_t)4095);
+  uint8_t *mem =
+      mmap(NULL, header + FIO_CLUSTER_SHM_SIZE, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    FIO_LOG_WARNING("(%d) shared cluster payloads unavailable.", getpid());
+    return;
+  }
+  fio_cluster_shm.map = (fio_cluster_shm_map_s *)mem;
+  fio_cluster_shm.map->lock = 0;
+  fio_cluster_shm.map->blocks = blocks;
+  fio_cluster_shm.blocks = mem + header;
+  fio_cluster_shm.length = header + FIO_CLUSTER_SHM_SIZE;
+  /* a reference count for each slot and one for the root */
+  fio_cluster_shm.offset = (sizeof(fio_cluster_shm_s) +
+                            (sizeof(uint32_t) * (fio_cluster_rings.count + 1)) +
+                            15) &
+                           (~(size_t)15);
+}
+
+/* Unmaps the shared segment (messages must not reference it any more). */
+static void fio_cluster_shm_destroy(void *ignore) {
+  if (fio_cluster_shm.map)
+    munmap(fio_cluster_shm.map, fio_cluster_shm.length);
+  fio_cluster_shm.map = NULL;
+  fio_cluster_shm.blocks = NULL;
+  fio_cluster_shm.length = 0;
+  (void)ignore;
+}
+
+/* *****************************************************************************
+ * Cluster shared memory rings
+ **************************************************************************** */
+
+/* opens a non-blocking doorbell (an eventfd where available). */
+static int fio_cluster_bell_open(int fd[2]) {
+#if defined(__linux__)
+  fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return (fd[0] == -1) ? -1 : 0;
+#else
+  if (pipe(fd))
+    return -1;
+  fio_set_non_block(fd[0]);
+  fio_set_non_block(fd[1]);
+  return 0;
+#endif
+}
+
+/* closes the process's copy of a doorbell (the shared values are kept). */
+static void fio_cluster_bell_close(int fd[2]) {
+  if (fd[1] != fd[0] && fd[1] != -1)
+    close(fd[1]);
+  if (fd[0] != -1)
+    close(fd[0]);
+}
+
+/* clears any pending doorbell signals. */
+static void fio_cluster_bell_clear(int fd) {
+  uint64_t tmp[8];
+  while (read(fd, tmp, sizeof(tmp)) > 0)
+    ;
+}
+
+/* signals the consumer (a full pipe / counter is already signaled). */
+static void fio_cluster_bell_ring(int fd) {
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) == -1) {
+    return;
+  }
+}
+
+static void fio_cluster_mesh_read(void);
+
+/*
+ * The doorbell connection forwards the signal to the cluster connection (the
+ * mesh doorbell, with a target of -1, reads the mesh rings).
+ */
+typedef struct {
+  fio_protocol_s protocol;
+  intptr_t target;
+} fio_cluster_bell_s;
+
+static void fio_cluster_bell_on_data(intptr_t uuid, fio_protocol_s *pr) {
+  fio_cluster_bell_clear(fio_uuid2fd(uuid));
+  if (((fio_cluster_bell_s *)pr)->target == -1)
+    fio_cluster_mesh_read();
+  else
+    fio_force_event(((fio_cluster_bell_s *)pr)->target, FIO_EVENT_ON_DATA);
+}
+
+static void fio_cluster_bell_on_close(intptr_t uuid, fio_protocol_s *pr) {
+  fio_free(pr);
+  (void)uuid;
+}
+
+/* attaches a copy of the doorbell to the reactor, returns its uuid or -1. */
+static intptr_t fio_cluster_bell_attach(int fd, intptr_t target) {
+  fd = dup(fd);
+  if (fd == -1)
+    return -1;
+  fio_cluster_bell_s *b = fio_malloc(sizeof(*b));
+  FIO_ASSERT_ALLOC(b);
+  *b = (fio_cluster_bell_s){
+      .protocol =
+          {
+              .on_data = fio_cluster_bell_on_data,
+              .on_close = fio_cluster_bell_on_close,
+              .on_shutdown = mock_on_shutdown_eternal,
+              .ping = mock_ping_eternal,
+          },
+      .target = target,
+  };
+  intptr_t uuid = fio_fd2uuid(fd);
+  fio_attach(uuid, &b->protocol);
+  return uuid;
+}
+
+/* resets a ring's data (no producer or consumer may be active). */
+static void fio_cluster_ring_reset(fio_cluster_ring_s *r) {
+  r->tail = 0;
+  r->head = 0;
+  r->mode = 0;
+  fio_cluster_bell_clear(r->fd[0]);
+}
+
+/*
+ * Note: `fio_atomic_add(&x, 0)` is used as a sequentially consistent load, so
+ * the producer's `tail` store can't pass its `head` load (and vice versa).
+ */
+
+/**
+ * Pushes a record to the ring (producer only), returns -1 if the ring is full.
+ *
+ * Room for a FIO_CLUSTER_RING_SWITCH record is always kept, so the producer
+ * can always tell the consumer to switch to the socket.
+ */
+static int fio_cluster_ring_push(fio_cluster_ring_s *r, uint32_t kind,
+                                 void *data, uint32_t len) {
+  const size_t need = FIO_CLUSTER_RING_HEADER + ((len + 7) & (~(size_t)7));
+  const size_t tail = r->tail;
+  size_t pos = tail & (r->size - 1);
+  size_t pad = 0;
+  if (r->size - pos < need)
+    pad = r->size - pos;
+  if ((tail - fio_atomic_add(&r->head, 0)) + pad + need +
+          (kind == FIO_CLUSTER_RING_SWITCH ? 0 : FIO_CLUSTER_RING_HEADER) >
+      r->size)
+    return -1;
+  if (pad) {
+    fio_u2str32(r->buffer + pos, 0);
+    fio_u2str32(r->buffer + pos + 4, FIO_CLUSTER_RING_WRAP);
+    pos = 0;
+  }
+  fio_u2str32(r->buffer + pos, len);
+  fio_u2str32(r->buffer + pos + 4, kind);
+  if (len)
+    memcpy(r->buffer + pos + FIO_CLUSTER_RING_HEADER, data, len);
+  fio_atomic_xchange(&r->tail, tail + pad + need);
+  /* the consumer might be idle if it had read everything. */
+  if (kind != FIO_CLUSTER_RING_SWITCH && fio_atomic_add(&r->head, 0) == tail)
+    fio_cluster_bell_ring(r->fd[1]);
+  return 0;
+}
+
+/**
+ * Returns the next record's kind, or 0 if the ring is empty (consumer only).
+ *
+ * The record remains valid until `fio_cluster_ring_consume` is called.
+ */
+static uint32_t fio_cluster_ring_peek(fio_cluster_ring_s *r,
+                                      fio_str_info_s *rec) {
+  size_t head = r->head;
+  if (head == fio_atomic_add(&r->tail, 0))
+    return 0;
+  uint8_t *pos = r->buffer + (head & (r->size - 1));
+  uint32_t kind = fio_str2u32(pos + 4);
+  if (kind == FIO_CLUSTER_RING_WRAP) {
+    /* the wrapping record is always followed by a record at offset 0 */
+    head += r->size - (head & (r->size - 1));
+    fio_atomic_xchange(&r->head, head);
+    pos = r->buffer;
+    kind = fio_str2u32(pos + 4);
+  }
+  *rec = (fio_str_info_s){.data = (char *)pos + FIO_CLUSTER_RING_HEADER,
+                          .len = fio_str2u32(pos)};
+  return kind;
+}
+
+/** Tests if a FIO_CLUSTER_RING_FRAME record fits (producer only). */
+static int fio_cluster_ring_fits(fio_cluster_ring_s *r, size_t len) {
+  const size_t need = FIO_CLUSTER_RING_HEADER + ((len + 7) & (~(size_t)7));
+  const size_t pos = r->tail & (r->size - 1);
+  const size_t pad = (r->size - pos < need) ? (r->size - pos) : 0;
+  return (r->tail - fio_atomic_add(&r->head, 0)) + pad + need +
+             FIO_CLUSTER_RING_HEADER <=
+         r->size;
+}
+
+/** Consumes the record returned by `fio_cluster_ring_peek`. */
+static void fio_cluster_ring_consume(fio_cluster_ring_s *r,
+                                     fio_str_info_s rec) {
+  fio_atomic_xchange(&r->head, r->head + FIO_CLUSTER_RING_HEADER +
+                                   ((rec.len + 7) & (~(size_t)7)));
+}
+
+/**
+ * Tells the consumer to read the ring (producer lock must be held).
+ *
+ * Returns -1 if the consumer didn't read everything up to the last
+ * FIO_CLUSTER_RING_SWITCH record yet.
+ */
+static int fio_cluster_ring_activate_unsafe(fio_cluster_ring_s *r,
+                                            cluster_pr_s *c, int32_t index) {
+  if (r->mode)
+    return 0;
+  if (r->tail != fio_atomic_add(&r->head, 0))
+    return -1;
+  fio_cluster_write(c, fio_cluster_wrap_message(0, 0, FIO_CLUSTER_MSG_RING,
+                                                index, NULL, NULL));
+  r->mode = 1;
+  return 0;
+}
+
+/**
+ * Sends a wrapped cluster message, using the ring when possible and falling
+ * back to the socket. The `data` object isn't freed.
+ *
+ * Messages are never reordered: a FIO_CLUSTER_RING_SWITCH record tells the
+ * consumer to read the socket and a FIO_CLUSTER_MSG_RING message (sent using
+ * the socket) tells the consumer to read the ring again.
+ */
+static void fio_cluster_ring_send(fio_cluster_ring_s *r, cluster_pr_s *c,
+                                  int32_t index, fio_str_s *data) {
+  fio_str_info_s i = fio_str_info(data);
+  fio_lock(&r->lock);
+  if (i.len <= FIO_CLUSTER_RING_MSG_LIMIT(r) &&
+      !fio_cluster_ring_activate_unsafe(r, c, index) &&
+      !fio_cluster_ring_push(r, FIO_CLUSTER_RING_FRAME, i.data,
+                             (uint32_t)i.len)) {
+    fio_unlock(&r->lock);
+    return;
+  }
+  if (r->mode) {
+    fio_cluster_ring_push(r, FIO_CLUSTER_RING_SWITCH, NULL, 0);
+    r->mode = 0;
+  }
+  fio_cluster_write(c, fio_str_dup(data));
+  fio_unlock(&r->lock);
+}
+
+/* copies a complete wrapped message that was read from a ring (or NULL). */
+static fio_msg_internal_s *fio_cluster_frame2msg(fio_str_info_s frame,
+                                                 uint32_t *type) {
+  if (frame.len < 16)
+    return NULL;
+  uint32_t ch_len = fio_str2u32(frame.data);
+  uint32_t msg_len = fio_str2u32(frame.data + 4);
+  if ((size_t)ch_len + msg_len + 16 > frame.len)
+    return NULL;
+  const uint32_t flags = fio_str2u32(frame.data + 8) & FIO_CLUSTER_MSG_FLAGS;
+  *type = fio_str2u32(frame.data + 8) & ~(uint32_t)FIO_CLUSTER_MSG_FLAGS;
+  fio_msg_internal_s *m = fio_pubsub_create_message(
+      (int32_t)fio_str2u32(frame.data + 12),
+      (fio_str_info_s){.data = frame.data + 16, .len = ch_len},
+      (fio_str_info_s){.data = frame.data + 16 + ch_len, .len = msg_len},
+      (int8_t)(*type == FIO_CLUSTER_MSG_JSON ||
+               *type == FIO_CLUSTER_MSG_ROOT_JSON),
+      !flags);
+  if (!flags)
+    return m;
+  memcpy(m->channel.data, frame.data + 16, ch_len);
+  memcpy(m->data.data, frame.data + 16 + ch_len, msg_len);
+  fio_cluster_msg_receive(&m, *type | flags);
+  if (m)
+    fio_pubsub_create_message_update_meta(m);
+  return m;
+}
+
+/* handles a complete wrapped message that was read from a ring. */
+static void fio_cluster_on_frame(cluster_pr_s *c, fio_str_info_s frame) {
+  c->msg = fio_cluster_frame2msg(frame, &c->type);
+  if (!c->msg)
+    return;
+  c->filter = c->msg->filter;
+  c->handler(c);
+  fio_msg_internal_free(c->msg);
+  c->msg = NULL;
+}
+
+/* reads the ring until it's empty or the producer switched to the socket. */
+static void fio_cluster_ring_read(cluster_pr_s *c) {
+  fio_str_info_s rec;
+  uint32_t kind;
+  while (c->ring_mode && (kind = fio_cluster_ring_peek(c->ring, &rec))) {
+    if (kind == FIO_CLUSTER_RING_SWITCH)
+      c->ring_mode = 0;
+    else
+      fio_cluster_on_frame(c, rec);
+    fio_cluster_ring_consume(c->ring, rec);
+  }
+}
+
+/* *****************************************************************************
+ * Cluster worker mesh (direct worker-to-worker publishing)
+ **************************************************************************** */
+
+/* returns the registry bucket for a channel name (or a filter's bytes). */
+static inline size_t fio_cluster_mesh_bucket(const void *name, size_t len) {
+  return (size_t)(fio_risky_hash(name, len, 0) &
+                  (FIO_CLUSTER_MESH_BUCKETS - 1));
+}
+
+/* returns the ring from the `origin` slot to the `target` slot. */
+static inline fio_cluster_ring_s *fio_cluster_mesh_ring(size_t origin,
+                                                        size_t target) {
+  return fio_cluster_rings.mesh + (origin * fio_cluster_rings.count) + target;
+}
+
+/* returns the process's registry bit, or 0 if it has none (yet). */
+static uint64_t fio_cluster_mesh_bit(void) {
+  if (!fio_cluster_rings.registry)
+    return 0;
+  if (!fio_data->is_worker)
+    return FIO_CLUSTER_MESH_ROOT;
+  if (!fio_cluster_rings.self)
+    return 0;
+  return (uint64_t)1 << (fio_cluster_rings.self - fio_cluster_rings.slots);
+}
+
+/*
+ * Sets or clears a registry bit. Only the bit's owner (or the root, once the
+ * owner is gone) updates a bit, using atomic OR / AND so setting (or clearing)
+ * the same bit twice is harmless.
+ */
+static void fio_cluster_mesh_flag(volatile uint64_t *word, uint64_t bit,
+                                  int on) {
+  if (!(*word & bit) == !on)
+    return;
+  if (on)
+    __sync_fetch_and_or(word, bit);
+  else
+    __sync_fetch_and_and(word, ~bit);
+}
+
+/*
+ * Sets a registry bit to match a subscription count. Counts are updated
+ * without a lock, so the count is tested again after the bit was set (another
+ * thread might have crossed 0 in between). Whichever thread writes the bit last
+ * leaves it matching the count.
+ */
+static void fio_cluster_mesh_sync(volatile uint64_t *word,
+                                  volatile uint32_t *count, uint64_t bit) {
+  int on;
+  do {
+    on = (fio_atomic_add(count, 0) != 0);
+    fio_cluster_mesh_flag(word, bit, on);
+  } while ((fio_atomic_add(count, 0) != 0) != on);
+}
+
+/* publishes the process's subscriptions to the registry. */
+static void fio_cluster_mesh_register(void) {
+  const uint64_t bit = fio_cluster_mesh_bit();
+  if (!bit)
+    return;
+  fio_cluster_registry_s *registry = fio_cluster_rings.registry;
+  for (size_t i = 0; i < FIO_CLUSTER_MESH_BUCKETS; ++i) {
+    if (fio_cluster_mesh.counts[i])
+      fio_cluster_mesh_sync(registry->buckets + i, fio_cluster_mesh.counts + i,
+                            bit);
+  }
+  if (fio_cluster_mesh.patterns)
+    fio_cluster_mesh_sync(&registry->patterns, &fio_cluster_mesh.patterns, bit);
+}
+
+/*
+ * Counts a (non-mock) subscription, updating the registry only when the
+ * bucket's count moves between 0 and 1 (no lock is taken, see
+ * `fio_cluster_mesh_sync`).
+ */
+static void fio_cluster_mesh_count(channel_s *ch, int add) {
+  size_t bucket = 0;
+  volatile uint32_t *count = &fio_cluster_mesh.patterns;
+  if (!ch->match) {
+    bucket = fio_cluster_mesh_bucket(ch->name, ch->name_len);
+    count = fio_cluster_mesh.counts + bucket;
+  }
+  if (add ? (fio_atomic_add(count, 1) != 1) : (fio_atomic_sub(count, 1) != 0))
+    return;
+  /* counted anyway, so `fio_cluster_mesh_register` finds it later */
+  const uint64_t bit = fio_cluster_mesh_bit();
+  if (!bit)
+    return;
+  fio_cluster_registry_s *registry = fio_cluster_rings.registry;
+  fio_cluster_mesh_sync(ch->match ? &registry->patterns
+                                  : registry->buckets + bucket,
+                        count, bit);
+}
+
+/*
+ * (worker) Reads the mesh rings, stopping at any FIO_CLUSTER_RING_SWITCH
+ * record until the origin sends a FIO_CLUSTER_MSG_MESH message (through the
+ * root).
+ */
+static void fio_cluster_mesh_read(void) {
+  fio_cluster_slot_s *self = fio_cluster_rings.self;
+  if (!self || !fio_cluster_rings.mesh)
+    return;
+  const size_t index = self - fio_cluster_rings.slots;
+  fio_str_info_s rec;
+  uint32_t kind;
+  uint32_t type;
+  fio_lock(&fio_cluster_mesh.read_lock);
+  for (size_t origin = 0; origin < fio_cluster_rings.count; ++origin) {
+    fio_cluster_ring_s *r = fio_cluster_mesh_ring(origin, index);
+    /* a missed record is signaled by the producer (the ring was empty) */
+    if (r->head == r->tail)
+      continue;
+    while (!fio_cluster_mesh.paused[origin] &&
+           (kind = fio_cluster_ring_peek(r, &rec))) {
+      if (kind == FIO_CLUSTER_RING_SWITCH) {
+        fio_cluster_mesh.paused[origin] = 1;
+      } else {
+        fio_msg_internal_s *m = fio_cluster_frame2msg(rec, &type);
+        if (m)
+          fio_publish2process(m);
+      }
+      fio_cluster_ring_consume(r, rec);
+    }
+  }
+  fio_unlock(&fio_cluster_mesh.read_lock);
+}
+
+/* (worker) the `origin` worker publishes using the mesh again. */
+static void fio_cluster_mesh_resume(int32_t origin) {
+  if (!fio_cluster_rings.mesh || origin < 0 ||
+      (size_t)origin >= fio_cluster_rings.count)
+    return;
+  fio_lock(&fio_cluster_mesh.read_lock);
+  fio_cluster_mesh.paused[origin] = 0;
+  fio_unlock(&fio_cluster_mesh.read_lock);
+  fio_cluster_mesh_read();
+}
+
+/*
+ * (worker) pushes a FIO_CLUSTER_RING_SWITCH record to all of the process's
+ * mesh rings (mesh lock must be held).
+ *
+ * If a record doesn't fit, the ring already ends with a switch record.
+ */
+static void fio_cluster_mesh_switch_unsafe(size_t index) {
+  for (size_t target = 0; target < fio_cluster_rings.count; ++target) {
+    if (target != index)
+      fio_cluster_ring_push(fio_cluster_mesh_ring(index, target),
+                            FIO_CLUSTER_RING_SWITCH, NULL, 0);
+  }
+  fio_cluster_mesh.mode = 0;
+}
+
+/*
+ * (worker) prepares the mesh state after claiming a slot.
+ *
+ * The worker routes its messages through the root until the other workers
+ * read its switch records (when they receive its FIO_CLUSTER_MSG_MESH_JOIN
+ * message), and it ignores other workers' mesh rings until they send a
+ * FIO_CLUSTER_MSG_MESH message (in reply to the same message).
+ */
+static void fio_cluster_mesh_claim(void) {
+  fio_cluster_slot_s *self = fio_cluster_rings.self;
+  if (!self || !fio_cluster_rings.mesh)
+    return;
+  const size_t index = self - fio_cluster_rings.slots;
+  /* skip messages sent to the slot's previous worker */
+  for (size_t origin = 0; origin < fio_cluster_rings.count; ++origin) {
+    fio_cluster_ring_s *r = fio_cluster_mesh_ring(origin, index);
+    fio_atomic_xchange(&r->head, fio_atomic_add(&r->tail, 0));
+  }
+  memset(fio_cluster_mesh.paused, 1, sizeof(fio_cluster_mesh.paused));
+  fio_lock(&fio_cluster_mesh.lock);
+  fio_cluster_mesh_switch_unsafe(index);
+  fio_unlock(&fio_cluster_mesh.lock);
+  if (fio_cluster_bell_attach(self->mesh_bell[0], -1) == -1) {
+    FIO_LOG_ERROR("(%d) couldn't attach cluster mesh doorbell.", getpid());
+    return;
+  }
+  fio_cluster_mesh_register();
+}
+
+/* (root) clears a lost worker's registry bits. */
+static void fio_cluster_mesh_release(fio_cluster_slot_s *s) {
+  fio_cluster_registry_s *registry = fio_cluster_rings.registry;
+  if (!registry)
+    return;
+  const uint64_t bit = (uint64_t)1 << (s - fio_cluster_rings.slots);
+  for (size_t i = 0; i < FIO_CLUSTER_MESH_BUCKETS; ++i)
+    fio_cluster_mesh_flag(registry->buckets + i, bit, 0);
+  fio_cluster_mesh_flag(&registry->patterns, bit, 0);
+}
+
+/* *****************************************************************************
+ * Cluster shared memory rings - setup and cleanup
+ **************************************************************************** */
+
+/* Closes the process's doorbells and unmaps the rings. */
+static void fio_cluster_rings_destroy(void *ignore) {
+  if (!fio_cluster_rings.slots)
+    return;
+  for (size_t i = 0; i < fio_cluster_rings.count; ++i) {
+    fio_cluster_slot_s *s = fio_cluster_rings.slots + i;
+    /* workers keep all mesh doorbells, so they can signal any worker */
+    fio_cluster_bell_close(s->mesh_bell);
+    /* workers close the doorbells of other slots when claiming a slot */
+    if (fio_data->is_worker && s != fio_cluster_rings.self)
+      continue;
+    fio_cluster_bell_close(s->r2w.fd);
+    fio_cluster_bell_close(s->w2r.fd);
+  }
+  munmap(fio_cluster_rings.slots, fio_cluster_rings.length);
+  fio_cluster_rings.slots = NULL;
+  fio_cluster_rings.count = 0;
+  fio_cluster_rings.length = 0;
+  fio_cluster_rings.self = NULL;
+  fio_cluster_rings.mesh = NULL;
+  fio_cluster_rings.registry = NULL;
+  (void)ignore;
+}
+
+/* Allocates the shared memory rings (before any worker is spawned). */
+static void fio_cluster_rings_init(void *ignore) {
+  if (!FIO_CLUSTER_RINGS || fio_data->workers <= 1 || fio_cluster_rings.slots)
+    return;
+  /* extra slots allow workers to respawn before their slot was released */
+  const size_t count = (size_t)fio_data->workers << 1;
+  /* the registry has a bit for each slot and one for the root */
+  const size_t mesh = (FIO_CLUSTER_MESH && count < 64) ? count : 0;
+  /* slots, mesh rings, registry and (page aligned) buffers share a mapping */
+  size_t length = (sizeof(fio_cluster_slot_s) * count) +
+                  (sizeof(fio_cluster_ring_s) * mesh * mesh) +
+                  (mesh ? sizeof(fio_cluster_registry_s) : 0);
+  length = (length + 4095) & (~(size_t)4095);
+  const size_t buffers = length;
+  length += (FIO_CLUSTER_RING_SIZE * 2 * count) +
+            (FIO_CLUSTER_MESH_RING_SIZE * mesh * mesh);
+  uint8_t *mem = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    goto error;
+  fio_cluster_slot_s *slots = (fio_cluster_slot_s *)mem;
+  fio_cluster_ring_s *rings = (fio_cluster_ring_s *)(slots + count);
+  uint8_t *buffer = mem + buffers;
+  for (size_t i = 0; i < count; ++i) {
+    slots[i].r2w.fd[0] = slots[i].r2w.fd[1] = -1;
+    slots[i].w2r.fd[0] = slots[i].w2r.fd[1] = -1;
+    slots[i].mesh_bell[0] = slots[i].mesh_bell[1] = -1;
+    slots[i].r2w.size = slots[i].w2r.size = FIO_CLUSTER_RING_SIZE;
+    slots[i].r2w.buffer = buffer;
+    slots[i].w2r.buffer = buffer + FIO_CLUSTER_RING_SIZE;
+    buffer += FIO_CLUSTER_RING_SIZE * 2;
+  }
+  for (size_t i = 0; i < mesh * mesh; ++i) {
+    rings[i].size = FIO_CLUSTER_MESH_RING_SIZE;
+    rings[i].buffer = buffer;
+    buffer += FIO_CLUSTER_MESH_RING_SIZE;
+  }
+  fio_cluster_rings.slots = slots;
+  fio_cluster_rings.count = count;
+  fio_cluster_rings.length = length;
+  for (size_t i = 0; i < count; ++i) {
+    if (fio_cluster_bell_open(slots[i].r2w.fd) ||
+        fio_cluster_bell_open(slots[i].w2r.fd) ||
+        (mesh && fio_cluster_bell_open(slots[i].mesh_bell))) {
+      fio_cluster_rings_destroy(NULL);
+      goto error;
+    }
+  }
+  if (mesh) {
+    /* mesh rings share their target's doorbell */
+    for (size_t i = 0; i < mesh * mesh; ++i) {
+      rings[i].fd[0] = slots[i % mesh].mesh_bell[0];
+      rings[i].fd[1] = slots[i % mesh].mesh_bell[1];
+    }
+    fio_cluster_rings.mesh = rings;
+    fio_cluster_rings.registry =
+        (fio_cluster_registry_s *)(rings + (mesh * mesh));
+    /* subscriptions made before the server started */
+    fio_cluster_mesh_register();
+  }
+  fio_cluster_shm_init();
+  (void)ignore;
+  return;
+error:
+  FIO_LOG_WARNING("(%d) cluster rings unavailable, using Unix sockets.",
+                  getpid());
+}
+
+/* (worker) claims a ring pair, closing the doorbells of all other slots. */
+static void fio_cluster_rings_claim(void) {
+  fio_cluster_rings.self = NULL;
+  for (size_t i = 0; i < fio_cluster_rings.count; ++i) {
+    fio_cluster_slot_s *s = fio_cluster_rings.slots + i;
+    if (!fio_cluster_rings.self && !fio_trylock(&s->claim)) {
+      fio_cluster_rings.self = s;
+      continue;
+    }
+    fio_cluster_bell_close(s->r2w.fd);
+    fio_cluster_bell_close(s->w2r.fd);
+  }
+  if (fio_cluster_rings.count && !fio_cluster_rings.self)
+    FIO_LOG_WARNING("(%d) no cluster ring available, using Unix socket.",
+                    getpid());
+  else if (fio_cluster_rings.self)
+    fio_cluster_shm_release_holder(
+        (size_t)(fio_cluster_rings.self - fio_cluster_rings.slots));
+  fio_cluster_mesh_claim();
+}
+
+/* (root) binds a worker's ring pair to the worker's cluster connection. */
+static void fio_cluster_rings_bind(cluster_pr_s *c, int32_t index) {
+  if (c->ring || index < 0 || (size_t)index >= fio_cluster_rings.count)
+    return;
+  fio_cluster_slot_s *s = fio_cluster_rings.slots + index;
+  fio_lock(&cluster_data.lock);
+  if (!s->claim || s->uuid)
+    goto finish;
+  c->bell = fio_cluster_bell_attach(s->w2r.fd[0], c->uuid);
+  if (c->bell == -1) {
+    FIO_LOG_ERROR("(%d) couldn't attach cluster ring doorbell.", getpid());
+    goto finish;
+  }
+  s->uuid = c->uuid;
+  c->slot = s;
+  c->ring = &s->w2r;
+finish:
+  fio_unlock(&cluster_data.lock);
+}
+
+/* (worker) handles the root's reply to the ring pair's bind request. */
+static void fio_cluster_rings_bound(cluster_pr_s *c, int32_t index) {
+  if (!c->slot || c->ring_bound)
+    return;
+  if (index != (int32_t)(c->slot - fio_cluster_rings.slots)) {
+    FIO_LOG_WARNING("(%d) root couldn't bind the cluster ring, "
+                    "using the Unix socket.",
+                    getpid());
+    return;
+  }
+  fio_lock(&cluster_data.lock);
+  c->ring_bound = 1;
+  fio_unlock(&cluster_data.lock);
+}
+
+/* (root) releases a ring pair, called while `cluster_data.lock` is held. */
+static void fio_cluster_rings_release(cluster_pr_s *c) {
+  fio_cluster_slot_s *s = c->slot;
+  /* a new worker closes the root's (inherited) connections after a fork */
+  if (!s || fio_parent_pid() != getpid())
+    return;
+  fio_lock(&s->r2w.lock);
+  s->uuid = 0;
+  fio_cluster_ring_reset(&s->r2w);
+  fio_cluster_ring_reset(&s->w2r);
+  /* the worker might have crashed while sending a message */
+  s->w2r.lock = FIO_LOCK_INIT;
+  fio_unlock(&s->r2w.lock);
+  fio_cluster_mesh_release(s);
+  fio_cluster_shm_release_holder((size_t)(s - fio_cluster_rings.slots));
+  c->slot = NULL;
+  c->ring = NULL;
+  fio_unlock(&s->claim);
+}
+
+static uint8_t fio_cluster_on_shutdown(intptr_t uuid, fio_protocol_s *pr_) {
+  cluster_pr_s *p = (cluster_pr_s *)pr_;
+  p->sender(
+      fio_cluster_wrap_message(0, 0, FIO_CLUSTER_MSG_SHUTDOWN, 0, NULL, NULL),
+      -1);
+  return 255;
+  (void)pr_;
+  (void)uuid;
 }
 
 static void fio_cluster_on_data(intptr_t uuid, fio_protocol_s *pr_) {
   cluster_pr_s *c = (cluster_pr_s *)pr_;
-  ssize_t i =
-      fio_read(uuid, c->buffer + c->length, CLUSTER_READ_BUFFER - c->length);
+  size_t rounds = CLUSTER_READ_ROUNDS;
+  size_t space;
+  fio_cluster_ring_read(c);
+read_socket:
+  space = CLUSTER_READ_BUFFER - c->length;
+  ssize_t i = fio_read(uuid, c->buffer + c->length, space);
   if (i <= 0)
     return;
   c->length += i;
+  /* a full read implies more data is waiting in the socket */
+  space = ((size_t)i == space);
   i = 0;
   do {
     if (!c->exp_channel && !c->exp_msg) {
       if (c->length - i < 16)
         break;
+      /* messages pushed before the producer switched to the socket */
+      fio_cluster_ring_read(c);
       c->exp_channel = fio_str2u32(c->buffer + i);
       c->exp_msg = fio_str2u32(c->buffer + i + 4);
       c->type = fio_str2u32(c->buffer + i + 8);
       c->filter = (int32_t)fio_str2u32(c->buffer + i + 12);
+      if (c->type == FIO_CLUSTER_MSG_RING && !c->exp_channel && !c->exp_msg) {
+        /* the producer switched to the ring */
+        i += 16;
+        if (!fio_data->is_worker && !c->ring) {
+          /* a bind request, the worker uses the ring once it's confirmed */
+          fio_cluster_rings_bind(c, c->filter);
+          fio_cluster_write(c, fio_cluster_wrap_message(
+                                   0, 0, FIO_CLUSTER_MSG_RING_BOUND,
+                                   (c->ring ? c->filter : -1), NULL, NULL));
+          continue;
+        }
+        c->ring_mode = (c->ring != NULL);
+        fio_cluster_ring_read(c);
+        continue;
+      }
       if (c->exp_channel) {
         if (c->exp_channel >= (1024 * 1024 * 16)) {
           FIO_LOG_FATAL("(%d) cluster message name too long (16Mb limit): %u\n",
@@ -5978,8 +9072,10 @@ static void fio_cluster_on_data(intptr_t uuid, fio_protocol_s *pr_) {
           (fio_str_info_s){.data = (char *)(c->msg + 1), .len = c->exp_channel},
           (fio_str_info_s){.data = ((char *)(c->msg + 1) + c->exp_channel + 1),
                            .len = c->exp_msg},
-          (int8_t)(c->type == FIO_CLUSTER_MSG_JSON ||
-                   c->type == FIO_CLUSTER_MSG_ROOT_JSON),
+          (int8_t)((c->type & ~(uint32_t)FIO_CLUSTER_MSG_FLAGS) ==
+                       FIO_CLUSTER_MSG_JSON ||
+                   (c->type & ~(uint32_t)FIO_CLUSTER_MSG_FLAGS) ==
+                       FIO_CLUSTER_MSG_ROOT_JSON),
           0);
       i += 16;
     }
@@ -6011,6 +9107,9 @@ static void fio_cluster_on_data(intptr_t uuid, fio_protocol_s *pr_) {
         c->exp_msg = 0;
       }
     }
+    c->type = fio_cluster_msg_receive(&c->msg, c->type);
+    if (!c->msg)
+      continue;
     fio_pubsub_create_message_update_meta(c->msg);
     c->handler(c);
     fio_msg_internal_free(c->msg);
@@ -6020,13 +9119,16 @@ static void fio_cluster_on_data(intptr_t uuid, fio_protocol_s *pr_) {
   if (c->length && i) {
     memmove(c->buffer, c->buffer + i, c->length);
   }
+  if (space && --rounds)
+    goto read_socket;
   (void)pr_;
 }
 
 static void fio_cluster_ping(intptr_t uuid, fio_protocol_s *pr_) {
-  fio_str_send_free2(uuid, fio_cluster_wrap_message(0, 0, FIO_CLUSTER_MSG_PING,
-                                                    0, NULL, NULL));
-  (void)pr_;
+  fio_cluster_write((cluster_pr_s *)pr_,
+                    fio_cluster_wrap_message(0, 0, FIO_CLUSTER_MSG_PING, 0,
+                                             NULL, NULL));
+  (void)uuid;
 }
 
 static void fio_cluster_on_close(intptr_t uuid, fio_protocol_s *pr_) {
@@ -6035,15 +9137,21 @@ static void fio_cluster_on_close(intptr_t uuid, fio_protocol_s *pr_) {
     /* a child was lost, respawning is handled elsewhere. */
     fio_lock(&cluster_data.lock);
     FIO_LS_FOR(&cluster_data.clients, pos) {
-      if (pos->obj == (void *)uuid) {
+      if (pos->obj == (void *)c) {
         fio_ls_remove(pos);
         break;
       }
     }
+    fio_cluster_rings_release(c);
+    fio_unlock(&cluster_data.lock);
+  } else {
+    fio_lock(&cluster_data.lock);
+    if (cluster_data.pr == c)
+      cluster_data.pr = NULL;
     fio_unlock(&cluster_data.lock);
-  } else if (fio_data->active) {
     /* no shutdown message received - parent crashed. */
-    if (c->type != FIO_CLUSTER_MSG_SHUTDOWN && fio_is_running()) {
+    if (fio_data->active && c->type != FIO_CLUSTER_MSG_SHUTDOWN &&
+        fio_is_running()) {
       FIO_LOG_FATAL("(%d) Parent Process crash detected!", getpid());
       fio_state_callback_force(FIO_CALL_ON_PARENT_CRUSH);
       fio_state_callback_clear(FIO_CALL_ON_PARENT_CRUSH);
@@ -6051,6 +9159,10 @@ static void fio_cluster_on_close(intptr_t uuid, fio_protocol_s *pr_) {
       kill(getpid(), SIGINT);
     }
   }
+  if (c->batch)
+    fio_str_free2(c->batch);
+  if (c->bell != -1)
+    fio_force_close(c->bell);
   if (c->msg)
     fio_msg_internal_free(c->msg);
   c->msg = NULL;
@@ -6080,6 +9192,8 @@ fio_cluster_protocol_alloc(intptr_t uuid,
   p->pubsub = (fio_sub_hash_s)FIO_SET_INIT;
   p->patterns = (fio_sub_hash_s)FIO_SET_INIT;
   p->lock = FIO_LOCK_INIT;
+  p->batch_lock = FIO_LOCK_INIT;
+  p->bell = -1;
   return &p->protocol;
 }
 
@@ -6088,21 +9202,94 @@ fio_cluster_protocol_alloc(intptr_t uuid,
  **************************************************************************** */
 
 /**
- * A mock pub/sub callback for external subscriptions.
+ * A mock pub/sub callback for external subscriptions.
+ */
+static void fio_mock_on_message(fio_msg_s *msg) { (void)msg; }
+
+static void fio_cluster_server_sender(fio_str_s *data, intptr_t avoid_uuid) {
+  fio_lock(&cluster_data.lock);
+  FIO_LS_FOR(&cluster_data.clients, pos) {
+    cluster_pr_s *c = (cluster_pr_s *)pos->obj;
+    if (c->uuid == avoid_uuid)
+      continue;
+    if (c->slot)
+      fio_cluster_ring_send(&c->slot->r2w, c,
+                            (int32_t)(c->slot - fio_cluster_rings.slots), data);
+    else
+      fio_cluster_write(c, fio_str_dup(data));
+  }
+  fio_unlock(&cluster_data.lock);
+  fio_str_free2(data);
+}
+
+/** (root) Sends a wrapped message to a single worker. */
+static void fio_cluster_server_send2(intptr_t uuid, fio_str_s *data) {
+  fio_lock(&cluster_data.lock);
+  FIO_LS_FOR(&cluster_data.clients, pos) {
+    cluster_pr_s *c = (cluster_pr_s *)pos->obj;
+    if (c->uuid != uuid)
+      continue;
+    if (c->slot)
+      fio_cluster_ring_send(&c->slot->r2w, c,
+                            (int32_t)(c->slot - fio_cluster_rings.slots), data);
+    else
+      fio_cluster_write(c, fio_str_dup(data));
+    break;
+  }
+  fio_unlock(&cluster_data.lock);
+  fio_str_free2(data);
+}
+
+/* implemented later, see `fio_pubsub_stats_cluster` */
+static void fio_stats_request_on_worker(intptr_t uuid, int32_t id);
+static void fio_stats_request_on_root(int32_t id);
+static void fio_stats_request_reply(int32_t id, fio_str_info_s data);
+
+/**
+ * (root) Sends a pub/sub message to all the workers (except `avoid_uuid`).
+ *
+ * Long payloads are placed in the shared segment (unless `shared` is already
+ * set) and sent by reference to the workers that have a ring pair.
  */
-static void fio_mock_on_message(fio_msg_s *msg) { (void)msg; }
-
-static void fio_cluster_server_sender(fio_str_s *data, intptr_t avoid_uuid) {
+static void fio_cluster_server_publish(uint32_t type, int32_t filter,
+                                       fio_str_info_s ch, fio_str_info_s msg,
+                                       uint64_t sequence,
+                                       fio_cluster_shm_s *shared,
+                                       intptr_t avoid_uuid) {
+  fio_cluster_shm_s *own = NULL;
+  fio_str_s *data = NULL;
+  fio_str_s *ref = NULL;
+  if (!shared)
+    shared = own = fio_cluster_shm_new(msg);
   fio_lock(&cluster_data.lock);
   FIO_LS_FOR(&cluster_data.clients, pos) {
-    if ((intptr_t)pos->obj != -1) {
-      if ((intptr_t)pos->obj != avoid_uuid) {
-        fio_str_send_free2((intptr_t)pos->obj, fio_str_dup(data));
+    cluster_pr_s *c = (cluster_pr_s *)pos->obj;
+    if (c->uuid == avoid_uuid)
+      continue;
+    if (c->slot) {
+      const int32_t index = (int32_t)(c->slot - fio_cluster_rings.slots);
+      if (shared) {
+        if (!ref)
+          ref = fio_cluster_shm_wrap(shared, type, filter, ch, sequence);
+        fio_cluster_shm_dup(shared, (size_t)index);
+        fio_cluster_ring_send(&c->slot->r2w, c, index, ref);
+        continue;
       }
+      if (!data)
+        data = fio_cluster_wrap_publication(type, filter, ch, msg, sequence);
+      fio_cluster_ring_send(&c->slot->r2w, c, index, data);
+    } else {
+      if (!data)
+        data = fio_cluster_wrap_publication(type, filter, ch, msg, sequence);
+      fio_cluster_write(c, fio_str_dup(data));
     }
   }
   fio_unlock(&cluster_data.lock);
-  fio_str_free2(data);
+  if (data)
+    fio_str_free2(data);
+  if (ref)
+    fio_str_free2(ref);
+  fio_cluster_shm_release(own, fio_cluster_shm_holder());
 }
 
 static void fio_cluster_server_handler(struct cluster_pr_s *pr) {
@@ -6111,11 +9298,9 @@ static void fio_cluster_server_handler(struct cluster_pr_s *pr) {
 
   case FIO_CLUSTER_MSG_FORWARD: /* fallthrough */
   case FIO_CLUSTER_MSG_JSON: {
-    fio_cluster_server_sender(
-        fio_cluster_wrap_message(pr->msg->channel.len, pr->msg->data.len,
-                                 pr->type, pr->msg->filter,
-                                 pr->msg->channel.data, pr->msg->data.data),
-        pr->uuid);
+    fio_cluster_server_publish(pr->type, pr->msg->filter, pr->msg->channel,
+                               pr->msg->data, pr->msg->sequence,
+                               pr->msg->shared, pr->uuid);
     fio_publish2process(fio_msg_internal_dup(pr->msg));
     break;
   }
@@ -6184,6 +9369,20 @@ static void fio_cluster_server_handler(struct cluster_pr_s *pr) {
     fio_publish2process(fio_msg_internal_dup(pr->msg));
     break;
 
+  case FIO_CLUSTER_MSG_MESH:      /* fallthrough */
+  case FIO_CLUSTER_MSG_MESH_JOIN: /* the mesh handshake involves all workers */
+    fio_cluster_server_sender(fio_cluster_wrap_message(0, 0, pr->type,
+                                                       pr->filter, NULL, NULL),
+                              pr->uuid);
+    break;
+
+  case FIO_CLUSTER_MSG_STATS: /* a worker collects the cluster's statistics */
+    fio_stats_request_on_worker(pr->uuid, pr->filter);
+    break;
+  case FIO_CLUSTER_MSG_STATS_REPLY:
+    fio_stats_request_reply(pr->filter, pr->msg->data);
+    break;
+
   case FIO_CLUSTER_MSG_SHUTDOWN: /* fallthrough */
   case FIO_CLUSTER_MSG_ERROR:    /* fallthrough */
   case FIO_CLUSTER_MSG_PING:     /* fallthrough */
@@ -6198,12 +9397,12 @@ static void fio_cluster_listen_accept(intptr_t uuid, fio_protocol_s *protocol) {
   /* prevent `accept` backlog in parent */
   intptr_t client;
   while ((client = fio_accept(uuid)) != -1) {
-    fio_attach(client,
-               fio_cluster_protocol_alloc(client, fio_cluster_server_handler,
-                                          fio_cluster_server_sender));
+    fio_protocol_s *pr = fio_cluster_protocol_alloc(
+        client, fio_cluster_server_handler, fio_cluster_server_sender);
     fio_lock(&cluster_data.lock);
-    fio_ls_push(&cluster_data.clients, (void *)client);
+    fio_ls_push(&cluster_data.clients, pr);
     fio_unlock(&cluster_data.lock);
+    fio_attach(client, pr);
   }
 }
 
@@ -6251,13 +9450,32 @@ static void fio_listen2cluster(void *ignore) {
  * Worker (client) IPC connections
  **************************************************************************** */
 
+static void fio_cluster_mesh_join(int32_t origin);
+
 static void fio_cluster_client_handler(struct cluster_pr_s *pr) {
   /* what to do? */
   switch ((fio_cluster_message_type_e)pr->type) {
   case FIO_CLUSTER_MSG_FORWARD: /* fallthrough */
   case FIO_CLUSTER_MSG_JSON:
+    /* messages published directly before the publisher switched to the root */
+    fio_cluster_mesh_read();
     fio_publish2process(fio_msg_internal_dup(pr->msg));
     break;
+  case FIO_CLUSTER_MSG_MESH:
+    fio_cluster_mesh_resume(pr->filter);
+    break;
+  case FIO_CLUSTER_MSG_MESH_JOIN:
+    fio_cluster_mesh_join(pr->filter);
+    break;
+  case FIO_CLUSTER_MSG_STATS:
+    fio_stats_request_on_root(pr->filter);
+    break;
+  case FIO_CLUSTER_MSG_STATS_REPLY:
+    fio_stats_request_reply(pr->filter, pr->msg->data);
+    break;
+  case FIO_CLUSTER_MSG_RING_BOUND:
+    fio_cluster_rings_bound(pr, pr->filter);
+    break;
   case FIO_CLUSTER_MSG_SHUTDOWN:
     fio_stop();
     kill(getpid(), SIGINT);
@@ -6281,10 +9499,168 @@ static void fio_cluster_client_sender(fio_str_s *data, intptr_t ignr_) {
                         data, (void *)ignr_);
     return;
   }
-  fio_str_send_free2(cluster_data.uuid, data);
+  fio_lock(&cluster_data.lock);
+  cluster_pr_s *c = cluster_data.pr;
+  if (!c) {
+    fio_unlock(&cluster_data.lock);
+    fio_str_send_free2(cluster_data.uuid, data);
+    return;
+  }
+  if (c->ring_bound) {
+    fio_cluster_ring_send(&c->slot->w2r, c,
+                          (int32_t)(c->slot - fio_cluster_rings.slots), data);
+    fio_str_free2(data);
+  } else {
+    fio_cluster_write(c, data);
+  }
+  fio_unlock(&cluster_data.lock);
   (void)ignr_;
 }
 
+/**
+ * (worker) Tells all other workers (through the root) to read the mesh rings
+ * again, if the mesh isn't active (mesh lock must be held).
+ *
+ * Returns -1 if a worker didn't read everything up to the last
+ * FIO_CLUSTER_RING_SWITCH record yet.
+ */
+static int fio_cluster_mesh_activate_unsafe(size_t index) {
+  if (fio_cluster_mesh.mode)
+    return 0;
+  for (size_t i = 0; i < fio_cluster_rings.count; ++i) {
+    fio_cluster_ring_s *r = fio_cluster_mesh_ring(index, i);
+    /* a free slot's ring is skipped by the slot's next worker */
+    if (i != index && fio_cluster_rings.slots[i].claim && r->tail != r->head)
+      return -1;
+  }
+  fio_cluster_client_sender(fio_cluster_wrap_message(0, 0, FIO_CLUSTER_MSG_MESH,
+                                                     (int32_t)index, NULL,
+                                                     NULL),
+                            -1);
+  fio_cluster_mesh.mode = 1;
+  return 0;
+}
+
+/**
+ * (worker) The `origin` worker claimed a slot and waits for a
+ * FIO_CLUSTER_MSG_MESH message.
+ *
+ * The origin's ring holds the switch records it pushed when claiming the slot
+ * (and anything its slot's previous worker left behind). These are read even
+ * though the origin is paused, so the origin can activate the mesh. The
+ * origin can't push new records before the ring is empty.
+ */
+static void fio_cluster_mesh_join(int32_t origin) {
+  fio_cluster_slot_s *self = fio_cluster_rings.self;
+  if (!self || !fio_cluster_rings.mesh)
+    return;
+  const size_t index = self - fio_cluster_rings.slots;
+  if (origin >= 0 && (size_t)origin < fio_cluster_rings.count &&
+      (size_t)origin != index) {
+    fio_cluster_ring_s *r = fio_cluster_mesh_ring(origin, index);
+    fio_str_info_s rec;
+    uint32_t kind;
+    uint32_t type;
+    fio_lock(&fio_cluster_mesh.read_lock);
+    const size_t end = fio_atomic_add(&r->tail, 0);
+    while (r->head != end && (kind = fio_cluster_ring_peek(r, &rec))) {
+      if (kind != FIO_CLUSTER_RING_SWITCH) {
+        fio_msg_internal_s *m = fio_cluster_frame2msg(rec, &type);
+        if (m)
+          fio_publish2process(m);
+      }
+      fio_cluster_ring_consume(r, rec);
+    }
+    fio_cluster_mesh.paused[origin] = 1;
+    fio_unlock(&fio_cluster_mesh.read_lock);
+  }
+  fio_lock(&fio_cluster_mesh.lock);
+  if (fio_cluster_mesh.mode)
+    fio_cluster_client_sender(
+        fio_cluster_wrap_message(0, 0, FIO_CLUSTER_MSG_MESH,
+                                 (int32_t)(self - fio_cluster_rings.slots),
+                                 NULL, NULL),
+        -1);
+  fio_unlock(&fio_cluster_mesh.lock);
+}
+
+/**
+ * (worker) Publishes a message directly to the subscribed processes, falling
+ * back to the root (which forwards the message to all workers) when the
+ * message doesn't fit a ring.
+ *
+ * Returns -1 if the mesh is unavailable.
+ */
+static int fio_cluster_mesh_publish(int32_t filter, fio_str_info_s ch,
+                                    fio_str_info_s msg, uint8_t is_json,
+                                    uint64_t sequence) {
+  fio_cluster_slot_s *self = fio_cluster_rings.self;
+  fio_cluster_registry_s *registry = fio_cluster_rings.registry;
+  if (!self || !registry || !uuid_is_valid(cluster_data.uuid))
+    return -1;
+  const size_t index = self - fio_cluster_rings.slots;
+  const size_t count = fio_cluster_rings.count;
+  uint64_t targets;
+  if (filter)
+    targets = registry->buckets[fio_cluster_mesh_bucket(&filter,
+                                                        sizeof(filter))];
+  else
+    targets = registry->buckets[fio_cluster_mesh_bucket(ch.data, ch.len)] |
+              registry->patterns;
+  targets &= ~((uint64_t)1 << index);
+  if (!targets)
+    return 0;
+  const uint32_t type =
+      (is_json ? FIO_CLUSTER_MSG_JSON : FIO_CLUSTER_MSG_FORWARD);
+  /* long payloads are sent by reference, so they fit the rings */
+  fio_cluster_shm_s *shared = fio_cluster_shm_new(msg);
+  fio_str_s *data =
+      shared ? fio_cluster_shm_wrap(shared, type, filter, ch, sequence)
+             : fio_cluster_wrap_publication(type, filter, ch, msg, sequence);
+  fio_str_info_s i = fio_str_info(data);
+  size_t k;
+  fio_lock(&fio_cluster_mesh.lock);
+  if (i.len > FIO_CLUSTER_RING_MSG_LIMIT(fio_cluster_mesh_ring(index, 0)) ||
+      fio_cluster_mesh_activate_unsafe(index))
+    goto forward;
+  for (k = 0; k < count; ++k) {
+    if (((targets >> k) & 1) &&
+        !fio_cluster_ring_fits(fio_cluster_mesh_ring(index, k), i.len))
+      goto forward;
+  }
+  for (k = 0; k < count; ++k) {
+    if (!((targets >> k) & 1))
+      continue;
+    if (shared)
+      fio_cluster_shm_dup(shared, k);
+    fio_cluster_ring_push(fio_cluster_mesh_ring(index, k),
+                          FIO_CLUSTER_RING_FRAME, i.data, (uint32_t)i.len);
+  }
+  if (targets & FIO_CLUSTER_MESH_ROOT) {
+    /* the root doesn't forward FIO_CLUSTER_MSG_ROOT messages */
+    fio_u2str32((uint8_t *)i.data + 8,
+                (is_json ? FIO_CLUSTER_MSG_ROOT_JSON : FIO_CLUSTER_MSG_ROOT) |
+                    (fio_str2u32(i.data + 8) & FIO_CLUSTER_MSG_FLAGS));
+    if (shared)
+      fio_cluster_shm_dup(shared, count);
+    fio_cluster_client_sender(data, -1);
+  } else {
+    fio_str_free2(data);
+  }
+  fio_unlock(&fio_cluster_mesh.lock);
+  fio_cluster_shm_release(shared, (int32_t)index);
+  return 0;
+forward:
+  if (fio_cluster_mesh.mode)
+    fio_cluster_mesh_switch_unsafe(index);
+  if (shared)
+    fio_cluster_shm_dup(shared, count);
+  fio_cluster_client_sender(data, -1);
+  fio_unlock(&fio_cluster_mesh.lock);
+  fio_cluster_shm_release(shared, (int32_t)index);
+  return 0;
+}
+
 /** The address of the server we are connecting to. */
 // char *address;
 /** The port on the server we are connecting to. */
@@ -6297,27 +9673,58 @@ static void fio_cluster_client_sender(fio_str_s *data, intptr_t ignr_) {
  */
 static void fio_cluster_on_connect(intptr_t uuid, void *udata) {
   cluster_data.uuid = uuid;
+  fio_cluster_rings_claim();
 
   /* inform root about all existing channels */
-  fio_lock(&fio_postoffice.pubsub.lock);
-  FIO_SET_FOR_LOOP(&fio_postoffice.pubsub.channels, pos) {
-    if (!pos->hash) {
-      continue;
+  for (size_t i = 0; i < FIO_PUBSUB_SHARDS; ++i) {
+    fio_collection_shard_s *sh = fio_postoffice.pubsub.shards + i;
+    fio_lock(&sh->lock);
+    FIO_SET_FOR_LOOP(&sh->channels, pos) {
+      if (!pos->hash) {
+        continue;
+      }
+      fio_cluster_inform_root_about_channel(pos->obj, 1);
     }
-    fio_cluster_inform_root_about_channel(pos->obj, 1);
+    fio_unlock(&sh->lock);
   }
-  fio_unlock(&fio_postoffice.pubsub.lock);
-  fio_lock(&fio_postoffice.patterns.lock);
-  FIO_SET_FOR_LOOP(&fio_postoffice.patterns.channels, pos) {
-    if (!pos->hash) {
-      continue;
+  for (size_t i = 0; i < FIO_PUBSUB_SHARDS; ++i) {
+    fio_collection_shard_s *sh = fio_postoffice.patterns.shards + i;
+    fio_lock(&sh->lock);
+    FIO_SET_FOR_LOOP(&sh->channels, pos) {
+      if (!pos->hash) {
+        continue;
+      }
+      fio_cluster_inform_root_about_channel(pos->obj, 1);
     }
-    fio_cluster_inform_root_about_channel(pos->obj, 1);
+    fio_unlock(&sh->lock);
   }
-  fio_unlock(&fio_postoffice.patterns.lock);
 
-  fio_attach(uuid, fio_cluster_protocol_alloc(uuid, fio_cluster_client_handler,
-                                              fio_cluster_client_sender));
+  cluster_pr_s *c = (cluster_pr_s *)fio_cluster_protocol_alloc(
+      uuid, fio_cluster_client_handler, fio_cluster_client_sender);
+  fio_cluster_slot_s *s = fio_cluster_rings.self;
+  if (s) {
+    c->slot = s;
+    c->ring = &s->r2w;
+    c->bell = fio_cluster_bell_attach(s->r2w.fd[0], uuid);
+  }
+  fio_attach(uuid, &c->protocol);
+  fio_lock(&cluster_data.lock);
+  cluster_data.pr = c;
+  fio_unlock(&cluster_data.lock);
+  if (s) {
+    /* asks the root to bind the ring pair to this connection, the ring is
+     * used once the root confirms (see FIO_CLUSTER_MSG_RING_BOUND) */
+    fio_cluster_write(c, fio_cluster_wrap_message(
+                             0, 0, FIO_CLUSTER_MSG_RING,
+                             (int32_t)(s - fio_cluster_rings.slots), NULL,
+                             NULL));
+    if (fio_cluster_rings.mesh)
+      fio_cluster_client_sender(
+          fio_cluster_wrap_message(0, 0, FIO_CLUSTER_MSG_MESH_JOIN,
+                                   (int32_t)(s - fio_cluster_rings.slots), NULL,
+                                   NULL),
+          -1);
+  }
   (void)udata;
 }
 /**
@@ -6336,6 +9743,8 @@ static void fio_cluster_on_fail(intptr_t uuid, void *udata) {
 
 static void fio_connect2cluster(void *ignore) {
   /* this is called for each child, but not for single a process worker. */
+  fio_cluster_mesh.lock = FIO_LOCK_INIT;
+  fio_cluster_mesh.read_lock = FIO_LOCK_INIT;
   cluster_data.uuid = fio_connect(.address = cluster_data.name, .port = NULL,
                                   .on_connect = fio_cluster_on_connect,
                                   .on_fail = fio_cluster_on_fail);
@@ -6343,7 +9752,8 @@ static void fio_connect2cluster(void *ignore) {
 }
 
 static void fio_send2cluster(int32_t filter, fio_str_info_s ch,
-                             fio_str_info_s msg, uint8_t is_json) {
+                             fio_str_info_s msg, uint8_t is_json,
+                             uint64_t sequence) {
   if (!fio_is_running()) {
     FIO_LOG_ERROR("facio.io cluster inactive, can't send message.");
     return;
@@ -6352,20 +9762,21 @@ static void fio_send2cluster(int32_t filter, fio_str_info_s ch,
     /* nowhere to send to */
     return;
   }
+  const uint32_t type =
+      (is_json ? FIO_CLUSTER_MSG_JSON : FIO_CLUSTER_MSG_FORWARD);
   if (fio_is_master()) {
-    fio_cluster_server_sender(
-        fio_cluster_wrap_message(
-            ch.len, msg.len,
-            (is_json ? FIO_CLUSTER_MSG_JSON : FIO_CLUSTER_MSG_FORWARD), filter,
-            ch.data, msg.data),
-        -1);
-  } else {
+    fio_cluster_server_publish(type, filter, ch, msg, sequence, NULL, -1);
+  } else if (fio_cluster_mesh_publish(filter, ch, msg, is_json, sequence)) {
+    fio_cluster_shm_s *shared = fio_cluster_shm_new(msg);
+    if (!shared) {
+      fio_cluster_client_sender(
+          fio_cluster_wrap_publication(type, filter, ch, msg, sequence), -1);
+      return;
+    }
+    fio_cluster_shm_dup(shared, fio_cluster_rings.count);
     fio_cluster_client_sender(
-        fio_cluster_wrap_message(
-            ch.len, msg.len,
-            (is_json ? FIO_CLUSTER_MSG_JSON : FIO_CLUSTER_MSG_FORWARD), filter,
-            ch.data, msg.data),
-        -1);
+        fio_cluster_shm_wrap(shared, type, filter, ch, sequence), -1);
+    fio_cluster_shm_release(shared, fio_cluster_shm_holder());
   }
 }
 
@@ -6420,42 +9831,41 @@ static void fio_connect_after_fork(void *ignore) {
   (void)ignore;
 }
 
-static void fio_cluster_at_exit(void *ignore) {
-  /* unlock all */
-  fio_pubsub_on_fork();
-  /* clear subscriptions of all types */
-  while (fio_ch_set_count(&fio_postoffice.patterns.channels)) {
-    channel_s *ch = fio_ch_set_last(&fio_postoffice.patterns.channels);
-    while (fio_ls_embd_any(&ch->subscriptions)) {
-      subscription_s *sub =
-          FIO_LS_EMBD_OBJ(subscription_s, node, ch->subscriptions.next);
-      fio_unsubscribe(sub);
+/* unsubscribes all the subscriptions in a collection and frees its shards */
+static void fio_collection_clear(fio_collection_s *c) {
+  for (size_t i = 0; i < FIO_PUBSUB_SHARDS; ++i) {
+    fio_ch_set_s *channels = &c->shards[i].channels;
+    while (fio_ch_set_count(channels)) {
+      channel_s *ch = fio_ch_set_last(channels);
+      if (fio_ls_embd_any(&ch->subscriptions)) {
+        /* the last unsubscription removes the channel from the set */
+        fio_unsubscribe(
+            FIO_LS_EMBD_OBJ(subscription_s, node, ch->subscriptions.next));
+        continue;
+      }
+      if (c == &fio_postoffice.filters)
+        fio_filter_slot_clear(ch);
+      else if (c == &fio_postoffice.patterns)
+        fio_pattern_index_remove(ch);
+      fio_ch_set_pop(channels);
     }
-    fio_ch_set_pop(&fio_postoffice.patterns.channels);
+    fio_ch_set_free(channels);
   }
+}
 
-  while (fio_ch_set_count(&fio_postoffice.pubsub.channels)) {
-    channel_s *ch = fio_ch_set_last(&fio_postoffice.pubsub.channels);
-    while (fio_ls_embd_any(&ch->subscriptions)) {
-      subscription_s *sub =
-          FIO_LS_EMBD_OBJ(subscription_s, node, ch->subscriptions.next);
-      fio_unsubscribe(sub);
-    }
-    fio_ch_set_pop(&fio_postoffice.pubsub.channels);
-  }
+static void fio_stats_request_finish_all(void *ignore);
 
-  while (fio_ch_set_count(&fio_postoffice.filters.channels)) {
-    channel_s *ch = fio_ch_set_last(&fio_postoffice.filters.channels);
-    while (fio_ls_embd_any(&ch->subscriptions)) {
-      subscription_s *sub =
-          FIO_LS_EMBD_OBJ(subscription_s, node, ch->subscriptions.next);
-      fio_unsubscribe(sub);
-    }
-    fio_ch_set_pop(&fio_postoffice.filters.channels);
-  }
-  fio_ch_set_free(&fio_postoffice.filters.channels);
-  fio_ch_set_free(&fio_postoffice.patterns.channels);
-  fio_ch_set_free(&fio_postoffice.pubsub.channels);
+static void fio_cluster_at_exit(void *ignore) {
+  /* unlock all */
+  fio_pubsub_on_fork();
+  /* report any statistics collections still waiting for replies */
+  fio_stats_request_finish_all(NULL);
+  /* clear subscriptions of all types */
+  fio_collection_clear(&fio_postoffice.patterns);
+  fio_collection_clear(&fio_postoffice.pubsub);
+  fio_collection_clear(&fio_postoffice.filters);
+  fio_pattern_index_free();
+  fio_history_free_all();
 
   /* clear engines */
   FIO_PUBSUB_DEFAULT = FIO_PUBSUB_CLUSTER;
@@ -6474,11 +9884,18 @@ static void fio_cluster_at_exit(void *ignore) {
 
 static void fio_pubsub_initialize(void) {
   fio_cluster_init();
+  fio_history_sequences_init();
   fio_state_callback_add(FIO_CALL_PRE_START, fio_listen2cluster, NULL);
+  fio_state_callback_add(FIO_CALL_PRE_START, fio_cluster_rings_init, NULL);
   fio_state_callback_add(FIO_CALL_AFTER_FORK, fio_connect_after_fork, NULL);
   fio_state_callback_add(FIO_CALL_IN_CHILD, fio_connect2cluster, NULL);
   fio_state_callback_add(FIO_CALL_ON_FINISH, fio_cluster_cleanup, NULL);
+  fio_state_callback_add(FIO_CALL_ON_FINISH, fio_stats_request_finish_all,
+                         NULL);
+  /* (performed last) messages might reference the shared payloads */
+  fio_state_callback_add(FIO_CALL_AT_EXIT, fio_cluster_shm_destroy, NULL);
   fio_state_callback_add(FIO_CALL_AT_EXIT, fio_cluster_at_exit, NULL);
+  fio_state_callback_add(FIO_CALL_AT_EXIT, fio_cluster_rings_destroy, NULL);
 }
 
 /* *****************************************************************************
@@ -6497,9 +9914,12 @@ static void fio_cluster_signal_children(void) {
 }
 
 static inline void fio_publish2process2(int32_t filter, fio_str_info_s ch_name,
-                                        fio_str_info_s msg, uint8_t is_json) {
-  fio_publish2process(
-      fio_pubsub_create_message(filter, ch_name, msg, is_json, 1));
+                                        fio_str_info_s msg, uint8_t is_json,
+                                        uint64_t sequence) {
+  fio_msg_internal_s *m =
+      fio_pubsub_create_message(filter, ch_name, msg, is_json, 1);
+  m->sequence = sequence;
+  fio_publish2process(m);
 }
 
 /**
@@ -6525,28 +9945,37 @@ void fio_publish FIO_IGNORE_MACRO(fio_publish_args_s args) {
   } else if (!args.engine) {
     args.engine = FIO_PUBSUB_DEFAULT;
   }
+  /* history sequence numbers are assigned once, by the publishing process */
+  uint64_t seq;
   switch ((uintptr_t)args.engine) {
   case 0UL: /* fallthrough (missing default) */
   case 1UL: // ((uintptr_t)FIO_PUBSUB_CLUSTER):
-    fio_send2cluster(args.filter, args.channel, args.message, args.is_json);
-    fio_publish2process2(args.filter, args.channel, args.message, args.is_json);
+    seq = fio_history_sequence(args.filter, args.channel);
+    fio_send2cluster(args.filter, args.channel, args.message, args.is_json,
+                     seq);
+    fio_publish2process2(args.filter, args.channel, args.message, args.is_json,
+                         seq);
     break;
   case 2UL: // ((uintptr_t)FIO_PUBSUB_PROCESS):
-    fio_publish2process2(args.filter, args.channel, args.message, args.is_json);
+    seq = fio_history_sequence(args.filter, args.channel);
+    fio_publish2process2(args.filter, args.channel, args.message, args.is_json,
+                         seq);
     break;
   case 3UL: // ((uintptr_t)FIO_PUBSUB_SIBLINGS):
-    fio_send2cluster(args.filter, args.channel, args.message, args.is_json);
+    seq = fio_history_sequence(args.filter, args.channel);
+    fio_send2cluster(args.filter, args.channel, args.message, args.is_json,
+                     seq);
     break;
   case 4UL: // ((uintptr_t)FIO_PUBSUB_ROOT):
+    seq = fio_history_sequence(args.filter, args.channel);
     if (fio_data->is_worker == 0 || fio_data->workers == 1) {
       fio_publish2process2(args.filter, args.channel, args.message,
-                           args.is_json);
+                           args.is_json, seq);
     } else {
       fio_cluster_client_sender(
-          fio_cluster_wrap_message(
-              args.channel.len, args.message.len,
+          fio_cluster_wrap_publication(
               (args.is_json ? FIO_CLUSTER_MSG_ROOT_JSON : FIO_CLUSTER_MSG_ROOT),
-              args.filter, args.channel.data, args.message.data),
+              args.filter, args.channel, args.message, seq),
           -1);
     }
     break;
@@ -6563,6 +9992,449 @@ void fio_publish FIO_IGNORE_MACRO(fio_publish_args_s args) {
   return;
 }
 
+/* *****************************************************************************
+ * Pub/Sub statistics
+ **************************************************************************** */
+
+/*
+ * Statistics are collected to a hash map keyed by the channel's pattern flag
+ * (1 byte), filter (4 bytes) and name, so the statistics reported by other
+ * processes can be merged with the local statistics.
+ */
+#define FIO_STATS_KEY_HEADER 5
+/* the number of counters in a serialized record (following the key) */
+#define FIO_STATS_COUNTERS 7
+
+#define FIO_SET_NAME fio_stats_hash
+#define FIO_SET_OBJ_TYPE fio_pubsub_stats_s
+#define FIO_SET_KEY_TYPE fio_str_s
+#define FIO_SET_KEY_COPY(k1, k2)                                               \
+  (k1) = FIO_STR_INIT;                                                         \
+  fio_str_concat(&(k1), &(k2))
+#define FIO_SET_KEY_COMPARE(k1, k2) fio_str_iseq(&(k1), &(k2))
+#define FIO_SET_KEY_DESTROY(key) fio_str_free(&(key))
+#include <fio.h>
+
+/* adds the statistics to the entry for `key` (an existing string) */
+static void fio_stats_hash_merge(fio_stats_hash_s *h, fio_str_info_s key,
+                                 fio_pubsub_stats_s *add) {
+  fio_str_s k = FIO_STR_INIT_STATIC2(key.data, key.len);
+  uint64_t hashed = FIO_HASH_FN(key.data, key.len, &fio_postoffice.pubsub,
+                                &fio_postoffice.pubsub);
+  fio_pubsub_stats_s st = fio_stats_hash_find(h, hashed, k);
+  st.subscribers += add->subscribers;
+  st.messages += add->messages;
+  st.bytes += add->bytes;
+  st.pending += add->pending;
+  st.delivered += add->delivered;
+  st.latency_total += add->latency_total;
+  if (add->latency_max > st.latency_max)
+    st.latency_max = add->latency_max;
+  fio_stats_hash_insert(h, hashed, k, st, NULL);
+}
+
+/* adds a subscription's counters to the statistics (channel lock held) */
+static void fio_subscription_stats_add(fio_pubsub_stats_s *st,
+                                       subscription_s *s) {
+  ++st->subscribers;
+#if FIO_PUBSUB_STATS
+  st->delivered += s->delivered;
+  st->latency_total += s->latency_total;
+  if (s->latency_max > st->latency_max)
+    st->latency_max = s->latency_max;
+  if (s->conflate) {
+    fio_lock(&s->conflate->lock);
+    st->pending += fio_msg_ary_count(&s->conflate->pending);
+    fio_unlock(&s->conflate->lock);
+  } else {
+    st->pending += s->pending;
+  }
+#else
+  (void)s;
+#endif
+}
+
+/* sets the channel fields and counters of the statistics (channel lock held) */
+static void fio_channel_stats_set(fio_pubsub_stats_s *st, channel_s *ch) {
+  if (ch->parent == &fio_postoffice.filters) {
+    memcpy(&st->filter, ch->name, sizeof(st->filter));
+    st->channel = (fio_str_info_s){.data = NULL, .len = 0};
+  } else {
+    st->channel = (fio_str_info_s){.data = ch->name, .len = ch->name_len};
+    st->is_pattern = (ch->parent == &fio_postoffice.patterns);
+  }
+#if FIO_PUBSUB_STATS
+  st->messages = ch->messages;
+  st->bytes = ch->bytes;
+#endif
+}
+
+/* adds a channel's statistics, ignoring the root's subscriptions on behalf of
+ * the workers (the workers report their own subscriptions) */
+static void fio_channel_stats_collect(fio_stats_hash_s *h, channel_s *ch) {
+  fio_pubsub_stats_s st = {.filter = 0};
+  fio_lock(&ch->lock);
+  FIO_LS_EMBD_FOR(&ch->subscriptions, pos) {
+    subscription_s *s = FIO_LS_EMBD_OBJ(subscription_s, node, pos);
+    if (s->on_message == fio_mock_on_message)
+      continue;
+    fio_subscription_stats_add(&st, s);
+  }
+  fio_channel_stats_set(&st, ch);
+  fio_unlock(&ch->lock);
+  if (!st.subscribers)
+    return;
+  fio_str_s key = FIO_STR_INIT;
+  fio_str_info_s k =
+      fio_str_resize(&key, FIO_STATS_KEY_HEADER + st.channel.len);
+  k.data[0] = (char)st.is_pattern;
+  fio_u2str32((uint8_t *)k.data + 1, (uint32_t)st.filter);
+  if (st.channel.len)
+    memcpy(k.data + FIO_STATS_KEY_HEADER, st.channel.data, st.channel.len);
+  fio_stats_hash_merge(h, k, &st);
+  fio_str_free(&key);
+}
+
+/* adds the calling process's statistics to the hash map */
+static void fio_pubsub_stats_collect(fio_stats_hash_s *h) {
+  fio_collection_s *collections[] = {
+      &fio_postoffice.filters,
+      &fio_postoffice.pubsub,
+      &fio_postoffice.patterns,
+  };
+  for (size_t c = 0; c < sizeof(collections) / sizeof(collections[0]); ++c) {
+    for (size_t i = 0; i < FIO_PUBSUB_SHARDS; ++i) {
+      fio_collection_shard_s *sh = collections[c]->shards + i;
+      size_t count = 0;
+      /* channel locks are taken after releasing the shard's lock */
+      fio_lock(&sh->lock);
+      channel_s **channels =
+          fio_malloc(sizeof(*channels) * (fio_ch_set_count(&sh->channels) + 1));
+      FIO_ASSERT_ALLOC(channels);
+      FIO_SET_FOR_LOOP(&sh->channels, pos) {
+        if (!pos->hash)
+          continue;
+        fio_channel_dup(pos->obj);
+        channels[count++] = pos->obj;
+      }
+      fio_unlock(&sh->lock);
+      for (size_t j = 0; j < count; ++j) {
+        fio_channel_stats_collect(h, channels[j]);
+        fio_channel_free(channels[j]);
+      }
+      fio_free(channels);
+    }
+  }
+}
+
+/* calls `task` for each entry in the hash map, returning the count */
+static size_t fio_stats_hash_report(fio_stats_hash_s *h,
+                                    void (*task)(fio_pubsub_stats_s *stats,
+                                                 void *udata),
+                                    void *udata) {
+  size_t count = 0;
+  FIO_SET_FOR_LOOP(h, pos) {
+    if (!pos->hash)
+      continue;
+    fio_str_info_s k = fio_str_info(&pos->obj.key);
+    fio_pubsub_stats_s st = pos->obj.obj;
+    st.is_pattern = (uint8_t)k.data[0];
+    st.filter = (int32_t)fio_str2u32(k.data + 1);
+    st.channel = (fio_str_info_s){.data = k.data + FIO_STATS_KEY_HEADER,
+                                  .len = k.len - FIO_STATS_KEY_HEADER};
+    if (task)
+      task(&st, udata);
+    ++count;
+  }
+  return count;
+}
+
+/*
+ * Serialized records: the key's length (4 bytes), the key and the counters
+ * (8 bytes each), in network byte order.
+ */
+static void fio_stats_hash_serialize(fio_stats_hash_s *h, fio_str_s *dest) {
+  FIO_SET_FOR_LOOP(h, pos) {
+    if (!pos->hash)
+      continue;
+    fio_str_info_s k = fio_str_info(&pos->obj.key);
+    const uint64_t counters[FIO_STATS_COUNTERS] = {
+        pos->obj.obj.subscribers,   pos->obj.obj.messages,
+        pos->obj.obj.bytes,         pos->obj.obj.pending,
+        pos->obj.obj.delivered,     pos->obj.obj.latency_total,
+        pos->obj.obj.latency_max,
+    };
+    size_t offset = fio_str_len(dest);
+    fio_str_info_s i =
+        fio_str_resize(dest, offset + 4 + k.len + (FIO_STATS_COUNTERS * 8));
+    char *p = i.data + offset;
+    fio_u2str32((uint8_t *)p, (uint32_t)k.len);
+    memcpy(p + 4, k.data, k.len);
+    p += 4 + k.len;
+    for (size_t c = 0; c < FIO_STATS_COUNTERS; ++c) {
+      fio_u2str64((uint8_t *)p, counters[c]);
+      p += 8;
+    }
+  }
+}
+
+/* merges serialized records (see `fio_stats_hash_serialize`) */
+static void fio_stats_hash_deserialize(fio_stats_hash_s *h,
+                                       fio_str_info_s data) {
+  while (data.len >= 4) {
+    size_t klen = fio_str2u32(data.data);
+    size_t len = 4 + klen + (FIO_STATS_COUNTERS * 8);
+    if (klen < FIO_STATS_KEY_HEADER || len > data.len) {
+      FIO_LOG_ERROR("(pub/sub) malformed statistics received.");
+      return;
+    }
+    const char *p = data.data + 4 + klen;
+    uint64_t counters[FIO_STATS_COUNTERS];
+    for (size_t c = 0; c < FIO_STATS_COUNTERS; ++c) {
+      counters[c] = fio_str2u64(p);
+      p += 8;
+    }
+    fio_pubsub_stats_s st = {
+        .subscribers = counters[0],
+        .messages = counters[1],
+        .bytes = counters[2],
+        .pending = counters[3],
+        .delivered = counters[4],
+        .latency_total = counters[5],
+        .latency_max = counters[6],
+    };
+    fio_stats_hash_merge(
+        h, (fio_str_info_s){.data = data.data + 4, .len = klen}, &st);
+    data.data += len;
+    data.len -= len;
+  }
+}
+
+/**
+ * Calls `task` with the statistics of each channel, filter and pattern the
+ * calling process is subscribed to. Returns the number of channels.
+ */
+size_t fio_pubsub_stats(void (*task)(fio_pubsub_stats_s *stats, void *udata),
+                        void *udata) {
+  fio_stats_hash_s h = FIO_SET_INIT;
+  fio_pubsub_stats_collect(&h);
+  size_t count = fio_stats_hash_report(&h, task, udata);
+  fio_stats_hash_free(&h);
+  return count;
+}
+
+/** Returns the statistics of a single subscription (`subscribers` is 1). */
+fio_pubsub_stats_s fio_subscription_stats(subscription_s *s) {
+  fio_pubsub_stats_s st = {.filter = 0};
+  if (!s)
+    return st;
+  fio_lock(&s->parent->lock);
+  fio_subscription_stats_add(&st, s);
+  fio_channel_stats_set(&st, s->parent);
+  fio_unlock(&s->parent->lock);
+  return st;
+}
+
+/* *****************************************************************************
+ * Pub/Sub statistics - cluster collection
+ **************************************************************************** */
+
+/** A cluster statistics collection (see `fio_pubsub_stats_cluster`). */
+typedef struct {
+  fio_stats_hash_s stats;
+  void (*task)(fio_pubsub_stats_s *stats, void *udata);
+  void (*on_finish)(void *udata);
+  void *udata;
+  /** (root) the worker collecting the statistics, or -1 for the caller. */
+  intptr_t requester;
+  /** (root) the worker's collection id. */
+  int32_t requester_id;
+  int32_t id;
+  /** the number of replies expected (and received). */
+  size_t expected;
+  size_t received;
+} fio_stats_request_s;
+
+static fio_stats_request_s *
+fio_stats_request_new(void (*task)(fio_pubsub_stats_s *stats, void *udata),
+                      void (*on_finish)(void *udata), void *udata) {
+  fio_stats_request_s *r = fio_malloc(sizeof(*r));
+  FIO_ASSERT_ALLOC(r);
+  *r = (fio_stats_request_s){
+      .stats = FIO_SET_INIT,
+      .task = task,
+      .on_finish = on_finish,
+      .udata = udata,
+      .requester = -1,
+      .id = fio_atomic_add(&fio_stats_requests.counter, 1),
+  };
+  return r;
+}
+
+/* removes a collection from the registry, NULL if it was already finished */
+static fio_stats_request_s *fio_stats_request_remove(int32_t id) {
+  fio_stats_request_s *r = NULL;
+  fio_lock(&fio_stats_requests.lock);
+  FIO_LS_FOR(&fio_stats_requests.requests, pos) {
+    if (((fio_stats_request_s *)pos->obj)->id == id) {
+      r = fio_ls_remove(pos);
+      break;
+    }
+  }
+  fio_unlock(&fio_stats_requests.lock);
+  return r;
+}
+
+/* reports the statistics (to the caller or the worker) and frees them */
+static void fio_stats_request_finish(fio_stats_request_s *r) {
+  if (r->requester != -1) {
+    fio_str_s *data = fio_str_new2();
+    fio_stats_hash_serialize(&r->stats, data);
+    fio_str_info_s i = fio_str_info(data);
+    fio_cluster_server_send2(
+        r->requester,
+        fio_cluster_wrap_message(0, (uint32_t)i.len,
+                                 FIO_CLUSTER_MSG_STATS_REPLY, r->requester_id,
+                                 NULL, i.data));
+    fio_str_free2(data);
+  } else {
+    fio_stats_hash_report(&r->stats, r->task, r->udata);
+    if (r->on_finish)
+      r->on_finish(r->udata);
+  }
+  fio_stats_hash_free(&r->stats);
+  fio_free(r);
+}
+
+static void fio_stats_request_finish_task(void *r, void *ignr_) {
+  fio_stats_request_finish(r);
+  (void)ignr_;
+}
+
+/* reports the statistics collected so far */
+static void fio_stats_request_timeout(void *id) {
+  fio_stats_request_s *r = fio_stats_request_remove((int32_t)(intptr_t)id);
+  if (r)
+    fio_stats_request_finish(r);
+}
+
+/* finishes all the pending collections when the server stops */
+static void fio_stats_request_finish_all(void *ignore) {
+  fio_ls_s pending = FIO_LS_INIT(pending);
+  fio_stats_request_s *r;
+  fio_lock(&fio_stats_requests.lock);
+  while ((r = fio_ls_shift(&fio_stats_requests.requests)))
+    fio_ls_push(&pending, r);
+  fio_unlock(&fio_stats_requests.lock);
+  while ((r = fio_ls_shift(&pending))) {
+    if (r->requester != -1) {
+      /* the worker is stopping as well and finishes its own collection */
+      fio_stats_hash_free(&r->stats);
+      fio_free(r);
+      continue;
+    }
+    fio_stats_request_finish(r);
+  }
+  (void)ignore;
+}
+
+/* waits for `r->expected` replies (or the timeout) */
+static void fio_stats_request_wait(fio_stats_request_s *r, size_t timeout) {
+  fio_lock(&fio_stats_requests.lock);
+  fio_ls_push(&fio_stats_requests.requests, r);
+  fio_unlock(&fio_stats_requests.lock);
+  fio_run_every(timeout, 1, fio_stats_request_timeout,
+                (void *)(intptr_t)r->id, NULL);
+}
+
+/* merges a reply, finishing the collection once all the replies arrived */
+static void fio_stats_request_reply(int32_t id, fio_str_info_s data) {
+  fio_stats_request_s *r = NULL;
+  fio_lock(&fio_stats_requests.lock);
+  FIO_LS_FOR(&fio_stats_requests.requests, pos) {
+    if (((fio_stats_request_s *)pos->obj)->id != id)
+      continue;
+    r = (fio_stats_request_s *)pos->obj;
+    fio_stats_hash_deserialize(&r->stats, data);
+    if (++r->received < r->expected)
+      r = NULL;
+    else
+      fio_ls_remove(pos);
+    break;
+  }
+  fio_unlock(&fio_stats_requests.lock);
+  if (r)
+    fio_stats_request_finish(r);
+}
+
+/* (root) collects the root's statistics and asks the workers for theirs */
+static void fio_stats_request_gather(fio_stats_request_s *r) {
+  fio_pubsub_stats_collect(&r->stats);
+  fio_lock(&cluster_data.lock);
+  FIO_LS_FOR(&cluster_data.clients, pos) { ++r->expected; }
+  fio_unlock(&cluster_data.lock);
+  if (!r->expected) {
+    fio_defer(fio_stats_request_finish_task, r, NULL);
+    return;
+  }
+  const int32_t id = r->id;
+  fio_stats_request_wait(r, FIO_PUBSUB_STATS_TIMEOUT);
+  /* `r` might be finished by now (if the replies were quick) */
+  fio_cluster_server_sender(
+      fio_cluster_wrap_message(0, 0, FIO_CLUSTER_MSG_STATS, id, NULL, NULL),
+      -1);
+}
+
+/* (root) a worker collects the cluster's statistics */
+static void fio_stats_request_on_worker(intptr_t uuid, int32_t id) {
+  fio_stats_request_s *r = fio_stats_request_new(NULL, NULL, NULL);
+  r->requester = uuid;
+  r->requester_id = id;
+  fio_stats_request_gather(r);
+}
+
+/* (worker) the root asks for the worker's statistics */
+static void fio_stats_request_on_root(int32_t id) {
+  fio_stats_hash_s h = FIO_SET_INIT;
+  fio_str_s *data = fio_str_new2();
+  fio_pubsub_stats_collect(&h);
+  fio_stats_hash_serialize(&h, data);
+  fio_stats_hash_free(&h);
+  fio_str_info_s i = fio_str_info(data);
+  fio_cluster_client_sender(
+      fio_cluster_wrap_message(0, (uint32_t)i.len, FIO_CLUSTER_MSG_STATS_REPLY,
+                               id, NULL, i.data),
+      -1);
+  fio_str_free2(data);
+}
+
+/**
+ * Collects the statistics of all the processes in the cluster (the root and
+ * the workers) and calls `task` for each channel, followed by `on_finish`.
+ */
+void fio_pubsub_stats_cluster(void (*task)(fio_pubsub_stats_s *stats,
+                                           void *udata),
+                              void (*on_finish)(void *udata), void *udata) {
+  fio_stats_request_s *r = fio_stats_request_new(task, on_finish, udata);
+  if (!fio_is_running() || fio_data->workers == 1) {
+    /* no cluster, only the calling process */
+    fio_pubsub_stats_collect(&r->stats);
+    fio_defer(fio_stats_request_finish_task, r, NULL);
+    return;
+  }
+  if (fio_is_master()) {
+    fio_stats_request_gather(r);
+    return;
+  }
+  /* the root collects the statistics and replies with the combined result */
+  const int32_t id = r->id;
+  r->expected = 1;
+  fio_stats_request_wait(r, FIO_PUBSUB_STATS_TIMEOUT * 2);
+  fio_cluster_client_sender(
+      fio_cluster_wrap_message(0, 0, FIO_CLUSTER_MSG_STATS, id, NULL, NULL),
+      -1);
+}
+
 /* *****************************************************************************
  * Glob Matching
  **************************************************************************** */
@@ -6725,24 +10597,65 @@ Section Start Marker
 Allocator default settings
 ***************************************************************************** */
 
-/* doun't change these */
-#undef FIO_MEMORY_BLOCK_SLICES
-#undef FIO_MEMORY_BLOCK_HEADER_SIZE
-#undef FIO_MEMORY_BLOCK_START_POS
-#undef FIO_MEMORY_MAX_SLICES_PER_BLOCK
-#undef FIO_MEMORY_BLOCK_MASK
+/* doun't change these */
+#undef FIO_MEMORY_BLOCK_SLICES
+#undef FIO_MEMORY_BLOCK_HEADER_SIZE
+#undef FIO_MEMORY_BLOCK_START_POS
+#undef FIO_MEMORY_MAX_SLICES_PER_BLOCK
+#undef FIO_MEMORY_BLOCK_MASK
+#undef FIO_MEMORY_MAX_CLASS_UNITS
+#undef FIO_MEMORY_SIZE_CLASSES
+
+/* The number of blocks pre-allocated each system call, 256 ==8Mb */
+#ifndef FIO_MEMORY_BLOCKS_PER_ALLOCATION
+#define FIO_MEMORY_BLOCKS_PER_ALLOCATION 256
+#endif
+
+/* NUMA awareness (Linux), detected using sysfs. Set to 0 to disable. */
+#ifndef FIO_MEMORY_NUMA
+#define FIO_MEMORY_NUMA 1
+#endif
+
+/* The maximum number of NUMA nodes with a memory pool of their own */
+#ifndef FIO_MEMORY_NUMA_NODES
+#define FIO_MEMORY_NUMA_NODES 8
+#endif
+
+#undef FIO_MEMORY_NUMA_AVAILABLE
+#if FIO_MEMORY_NUMA && defined(__linux__) && defined(SYS_mbind)
+#define FIO_MEMORY_NUMA_AVAILABLE 1
+#else
+#define FIO_MEMORY_NUMA_AVAILABLE 0
+#endif
+
+/* Back the allocator's block regions with 2Mb huge pages when possible */
+#ifndef FIO_MEMORY_HUGE_PAGES
+#define FIO_MEMORY_HUGE_PAGES 0
+#endif
+
+/* The number of freed big allocations cached for reuse (0 disables) */
+#ifndef FIO_MEMORY_BIG_CACHE
+#define FIO_MEMORY_BIG_CACHE 8
+#endif
+
+/* The maximum number of bytes held by the big allocation cache (16Mb) */
+#ifndef FIO_MEMORY_BIG_CACHE_BYTES
+#define FIO_MEMORY_BIG_CACHE_BYTES ((size_t)1 << 24)
+#endif
+
+#define FIO_MEMORY_HUGE_PAGE_SIZE ((size_t)1 << 21)
 
-/* The number of blocks pre-allocated each system call, 256 ==8Mb */
-#ifndef FIO_MEMORY_BLOCKS_PER_ALLOCATION
-#define FIO_MEMORY_BLOCKS_PER_ALLOCATION 256
+/* Seconds after which unused memory is returned to the system (0 == off) */
+#ifndef FIO_MEMORY_DECAY_SECONDS
+#define FIO_MEMORY_DECAY_SECONDS 10
 #endif
 
 #define FIO_MEMORY_BLOCK_MASK (FIO_MEMORY_BLOCK_SIZE - 1) /* 0b0...1... */
 
 #define FIO_MEMORY_BLOCK_SLICES (FIO_MEMORY_BLOCK_SIZE >> 4) /* 16B slices */
 
-/* must be divisable by 16 bytes, bigger than min(sizeof(block_s), 16) */
-#define FIO_MEMORY_BLOCK_HEADER_SIZE 32
+/* must be divisable by 16 bytes, bigger than min(sizeof(block_node_s), 16) */
+#define FIO_MEMORY_BLOCK_HEADER_SIZE 48
 
 /* allocation counter position (start) */
 #define FIO_MEMORY_BLOCK_START_POS (FIO_MEMORY_BLOCK_HEADER_SIZE >> 4)
@@ -6750,6 +10663,12 @@ Allocator default settings
 #define FIO_MEMORY_MAX_SLICES_PER_BLOCK                                        \
   (FIO_MEMORY_BLOCK_SLICES - FIO_MEMORY_BLOCK_START_POS)
 
+/* the largest size class (in 16 byte units) is half a block */
+#define FIO_MEMORY_MAX_CLASS_UNITS (FIO_MEMORY_BLOCK_SIZE >> 5)
+
+/* 8 exact size classes (16-128 bytes) followed by 4 classes per power of 2 */
+#define FIO_MEMORY_SIZE_CLASSES (8 + ((FIO_MEMORY_BLOCK_SIZE_LOG - 8) << 2))
+
 /* *****************************************************************************
 FIO_FORCE_MALLOC handler
 ***************************************************************************** */
@@ -6775,10 +10694,22 @@ void *fio_realloc2(void *ptr, size_t new_size, size_t copy_length) {
 
 void *fio_mmap(size_t size) { return calloc(size, 1); }
 
+static void fio_mem_decay_init(void) {}
+void fio_malloc_decay_set(size_t seconds) { (void)seconds; }
+size_t fio_malloc_decay_get(void) { return 0; }
+size_t fio_malloc_release(void) { return 0; }
+
 void fio_malloc_after_fork(void) {}
 void fio_mem_destroy(void) {}
 void fio_mem_init(void) {}
 
+fio_malloc_stats_s fio_malloc_stats(fio_malloc_arena_stats_s *arena_stats,
+                                    size_t arena_count) {
+  return (fio_malloc_stats_s){.arenas = 0};
+  (void)arena_stats;
+  (void)arena_count;
+}
+
 #else
 
 /* *****************************************************************************
@@ -6928,11 +10859,18 @@ static void *sys_realloc(void *mem, size_t prev_len, size_t new_len) {
       result = mem;
     } else {
       /* copy and free */
-      munmap(result, new_len - prev_len); /* free the failed attempt */
-      result = sys_alloc(new_len, 1);     /* allocate new memory */
+      if (result != MAP_FAILED)
+        munmap(result, new_len - prev_len); /* free the failed attempt */
+      result = sys_alloc(new_len, 1);       /* allocate new memory */
       if (!result) {
         return NULL;
       }
+#if defined(__linux__) && defined(MREMAP_FIXED)
+      /* move the pages into the new (aligned) mapping instead of copying */
+      if (mremap(mem, prev_len, prev_len, MREMAP_MAYMOVE | MREMAP_FIXED,
+                 result) != MAP_FAILED)
+        return result;
+#endif
       fio_memcpy(result, mem, prev_len >> 4); /* copy data */
       // memcpy(result, mem, prev_len);
       munmap(mem, prev_len); /* free original memory */
@@ -6950,6 +10888,47 @@ static inline size_t sys_round_size(size_t size) {
   return (size & (~4095)) + (4096 * (!!(size & 4095)));
 }
 
+/*
+ * Allocates memory backed by huge pages when FIO_MEMORY_HUGE_PAGES is set,
+ * using MAP_HUGETLB (requires reserved huge pages) or MADV_HUGEPAGE
+ * (transparent huge pages) as a fallback. The memory is 2Mb aligned.
+ *
+ * `len` must be a multiple of FIO_MEMORY_HUGE_PAGE_SIZE (otherwise, or when
+ * huge pages are disabled, this is the same as `sys_alloc(len, 0)`).
+ */
+static void *sys_alloc_huge(size_t len) {
+#if FIO_MEMORY_HUGE_PAGES
+  if ((len & (FIO_MEMORY_HUGE_PAGE_SIZE - 1)))
+    return sys_alloc(len, 0);
+  char *result;
+#if defined(MAP_HUGETLB)
+  result = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (result != MAP_FAILED)
+    return result;
+#endif
+  /* align to a huge page boundary, so transparent huge pages can be used */
+  result = mmap(NULL, len + FIO_MEMORY_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (result == MAP_FAILED)
+    return NULL;
+  const uintptr_t offset =
+      (FIO_MEMORY_HUGE_PAGE_SIZE -
+       ((uintptr_t)result & (FIO_MEMORY_HUGE_PAGE_SIZE - 1))) &
+      (FIO_MEMORY_HUGE_PAGE_SIZE - 1);
+  if (offset)
+    munmap(result, offset);
+  munmap(result + offset + len, FIO_MEMORY_HUGE_PAGE_SIZE - offset);
+  result += offset;
+#if defined(MADV_HUGEPAGE)
+  madvise(result, len, MADV_HUGEPAGE);
+#endif
+  return result;
+#else
+  return sys_alloc(len, 0);
+#endif
+}
+
 /* *****************************************************************************
 Data Types
 ***************************************************************************** */
@@ -6961,41 +10940,119 @@ struct block_s {
   block_s *parent;   /* REQUIRED, root == point to self */
   uint16_t ref;      /* reference count (per memory page) */
   uint16_t pos;      /* position into the block */
-  uint16_t max;      /* available memory count */
+  uint16_t units;    /* slice size (the block's size class) in 16 byte units */
   uint16_t root_ref; /* root reference memory padding */
+  void *free_list;   /* freed slices, linked through their first word */
+  fio_lock_i lock;   /* protects the free list and the block's state */
+  uint8_t state;     /* the block's ownership state (see below) */
+  uint8_t node;      /* the NUMA node (memory pool) that owns the block */
+};
+
+/* block ownership states */
+enum {
+  BLOCK_OWNED = 0, /* the block is an arena's current block */
+  BLOCK_DETACHED,  /* the block isn't listed anywhere (no freed slices) */
+  BLOCK_LISTED,    /* the block is in a size class's partially used list */
+  BLOCK_FREE,      /* the block is in the memory pool */
+  BLOCK_DECAYED,   /* the block is in the memory pool, memory was released */
 };
 
 typedef struct block_node_s block_node_s;
 struct block_node_s {
   block_s dont_touch; /* prevent block internal data from being corrupted */
-  fio_ls_embd_s node; /* next block */
+  fio_ls_embd_s node; /* next block (available or partially used block) */
 };
 
-/* a per-CPU core "arena" for memory allocations  */
+/* a list of partially used blocks for a size class */
+typedef struct {
+  fio_ls_embd_s blocks;
+  fio_lock_i lock;
+} partial_s;
+
+/* a per-CPU core "arena" for memory allocations (a block per size class) */
 typedef struct {
-  block_s *block;
+  block_s *block[FIO_MEMORY_SIZE_CLASSES];
+  size_t refills;    /* statistics: slice collections */
+  size_t contention; /* statistics: failed attempts to lock the arena */
   fio_lock_i lock;
+  uint8_t node; /* the CPU core's NUMA node */
 } arena_s;
 
+/* a per-NUMA node memory pool */
+typedef struct {
+  fio_ls_embd_s available; /* free list for memory blocks */
+  /* blocks with freed slices, per size class */
+  partial_s partial[FIO_MEMORY_SIZE_CLASSES];
+  size_t regions;     /* statistics: system allocations */
+  size_t blocks_free; /* statistics: blocks in `available` */
+  size_t decayed;     /* statistics: decayed blocks in `available` */
+  size_t min_free;    /* decay: lowest `blocks_free` during the period */
+  size_t decay;       /* decay: blocks (from the list's tail) to decay */
+  fio_lock_i lock;    /* protects the free list and the statistics */
+} pool_s;
+
 /* The memory allocators persistent state */
 static struct {
-  fio_ls_embd_s available; /* free list for memory blocks */
+  pool_s pools[FIO_MEMORY_NUMA_NODES]; /* per NUMA node memory pools */
+  size_t node_ids[FIO_MEMORY_NUMA_NODES]; /* system NUMA node IDs */
+  size_t nodes;                        /* the number of memory pools in use */
   // intptr_t count;          /* free list counter */
   size_t cores;    /* the number of detected CPU cores*/
-  fio_lock_i lock; /* a global lock */
   uint8_t forked;  /* a forked collection indicator. */
+  /* statistics (see `fio_malloc_stats`) */
+  size_t blocks_partial; /* listed partially used blocks */
+  size_t big_count;      /* big allocations in use */
+  size_t big_bytes;      /* bytes in use by big allocations */
+  size_t big_total;      /* big allocations since startup */
+  fio_ls_embd_s threads; /* per-thread statistics (see the thread cache) */
+  size_t in_use;         /* merged statistics from exiting threads */
+  size_t requested;      /* merged statistics from exiting threads */
+  size_t reserved;       /* merged statistics from exiting threads */
+  fio_lock_i threads_lock;
+  /* idle memory decay (see `fio_malloc_decay_set`) */
+  size_t decay_seconds;
+  size_t decay_elapsed;
+  volatile uint8_t decay_pending;
+  fio_lock_i decay_lock;
+  /* block locks aren't held across a `fork` (see `fio_malloc_before_fork`) */
+  volatile size_t block_locks; /* block locks held (or about to be taken) */
+  volatile uint8_t forking;    /* set while a thread is about to fork */
+  fio_lock_i fork_lock;
 } memory = {
     .cores = 1,
-    .lock = FIO_LOCK_INIT,
-    .available = FIO_LS_INIT(memory.available),
+    .nodes = 1,
+    .threads = FIO_LS_INIT(memory.threads),
+    .threads_lock = FIO_LOCK_INIT,
+    .decay_seconds = FIO_MEMORY_DECAY_SECONDS,
+    .decay_lock = FIO_LOCK_INIT,
+    .fork_lock = FIO_LOCK_INIT,
 };
 
 /* The per-CPU arena array. */
 static arena_s *arenas;
 
+/* freed big allocations kept for reuse (oldest first). +1 allows 0 entries */
+static struct {
+  struct {
+    void *mem;
+    size_t len;
+    size_t epoch; /* the decay period in which the region was cached */
+  } regions[FIO_MEMORY_BIG_CACHE + 1];
+  size_t count;
+  size_t bytes;
+  size_t epoch;
+  fio_lock_i lock;
+} big_cache = {.lock = FIO_LOCK_INIT};
+
 /* The per-CPU arena array. */
 static long double on_malloc_zero;
 
+/* Size class lookup tables (16 byte units <=> size class) */
+static uint8_t fio_mem_units2class[FIO_MEMORY_MAX_CLASS_UNITS + 1];
+static uint16_t fio_mem_class2units[FIO_MEMORY_SIZE_CLASSES];
+/* The number of slices each thread may cache per size class (0 == none) */
+static uint16_t fio_mem_cache_limit[FIO_MEMORY_SIZE_CLASSES];
+
 #if DEBUG
 /* The per-CPU arena array. */
 static size_t fio_mem_block_count_max;
@@ -7026,6 +11083,127 @@ static size_t fio_mem_block_count;
 #define FIO_MEMORY_PRINT_BLOCK_STAT()
 #define FIO_MEMORY_PRINT_BLOCK_STAT_END()
 #endif
+
+/* *****************************************************************************
+Size Classes
+***************************************************************************** */
+
+/*
+ * Sizes are counted in 16 byte units. The first 8 size classes are exact (16
+ * to 128 bytes), after which each power of 2 is divided into 4 size classes,
+ * limiting waste to 25% of the allocation.
+ */
+static void fio_mem_class_init(void) {
+  size_t units = 1;
+  for (size_t i = 0; i < FIO_MEMORY_SIZE_CLASSES; ++i) {
+    size_t limit = i + 1;
+    if (i >= 8) {
+      const size_t p = 3 + ((i - 8) >> 2);
+      limit = ((size_t)1 << p) + ((((i - 8) & 3) + 1) << (p - 2));
+    }
+    fio_mem_class2units[i] = (uint16_t)limit;
+    fio_mem_cache_limit[i] = (uint16_t)(FIO_MEMORY_CACHE_BYTES / (limit << 4));
+    if (fio_mem_cache_limit[i] < 2)
+      fio_mem_cache_limit[i] = 0;
+    while (units <= limit && units <= FIO_MEMORY_MAX_CLASS_UNITS)
+      fio_mem_units2class[units++] = (uint8_t)i;
+  }
+  for (size_t n = 0; n < FIO_MEMORY_NUMA_NODES; ++n) {
+    pool_s *pool = memory.pools + n;
+    pool->available = (fio_ls_embd_s)FIO_LS_INIT(pool->available);
+    pool->lock = FIO_LOCK_INIT;
+    for (size_t i = 0; i < FIO_MEMORY_SIZE_CLASSES; ++i) {
+      pool->partial[i] = (partial_s){
+          .blocks = FIO_LS_INIT(pool->partial[i].blocks),
+          .lock = FIO_LOCK_INIT,
+      };
+    }
+  }
+}
+
+/* *****************************************************************************
+NUMA awareness (Linux)
+***************************************************************************** */
+
+/* parses a sysfs CPU list (i.e., "0-7,16-23"), setting the arenas' node */
+static void fio_mem_numa_cpulist(char *list, uint8_t node) {
+  while (*list >= '0' && *list <= '9') {
+    size_t cpu = (size_t)fio_atol(&list);
+    size_t end = cpu;
+    if (*list == '-') {
+      ++list;
+      end = (size_t)fio_atol(&list);
+    }
+    for (; cpu <= end && cpu < memory.cores; ++cpu)
+      arenas[cpu].node = node;
+    if (*list == ',')
+      ++list;
+  }
+}
+
+/* detects the NUMA topology using sysfs - must be called after the arenas were
+ * allocated. Avoids `malloc` (`fopen`), in case `malloc` was overridden. */
+static void fio_mem_numa_init(void) {
+  memory.nodes = 1;
+#if FIO_MEMORY_NUMA_AVAILABLE
+  char path[64];
+  char buf[1024];
+  size_t count = 0;
+  /* node IDs might be sparse, mbind node masks are limited to 63 IDs */
+  for (size_t id = 0; id < 63 && count < FIO_MEMORY_NUMA_NODES; ++id) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist",
+             id);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+      continue;
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+      continue;
+    buf[len] = 0;
+    memory.node_ids[count] = id;
+    fio_mem_numa_cpulist(buf, (uint8_t)count);
+    ++count;
+  }
+  if (count > 1) {
+    memory.nodes = count;
+    FIO_LOG_DEBUG("memory allocator detected %zu NUMA nodes", count);
+    return;
+  }
+  for (size_t i = 0; i < memory.cores; ++i)
+    arenas[i].node = 0;
+#endif
+}
+
+/* returns the calling thread's NUMA node (memory pool), if known */
+static inline uint8_t fio_mem_numa_node(void) {
+#if FIO_MEMORY_NUMA_AVAILABLE
+  if (memory.nodes > 1) {
+    const int cpu = sched_getcpu();
+    if (cpu >= 0)
+      return arenas[(size_t)cpu % memory.cores].node;
+  }
+#endif
+  return 0;
+}
+
+/* sets the prefered NUMA node for a memory region, before it's first touched */
+static inline void fio_mem_numa_bind(void *mem, size_t len, uint8_t node) {
+#if FIO_MEMORY_NUMA_AVAILABLE
+  if (memory.nodes < 2)
+    return;
+  unsigned long mask = 1UL << memory.node_ids[node];
+  /* MPOL_PREFERRED == 1 (falls back to other nodes when memory is short) */
+  if (syscall(SYS_mbind, mem, len, 1, &mask, (sizeof(mask) << 3) + 1, 0))
+    FIO_LOG_DEBUG("memory allocator couldn't bind memory to NUMA node %zu",
+                  memory.node_ids[node]);
+#else
+  (void)mem;
+  (void)len;
+  (void)node;
+#endif
+}
+
 /* *****************************************************************************
 Per-CPU Arena management
 ***************************************************************************** */
@@ -7036,6 +11214,15 @@ static inline arena_s *arena_lock(arena_s *preffered) {
     preffered = arenas;
   if (!fio_trylock(&preffered->lock))
     return preffered;
+  fio_atomic_add(&preffered->contention, 1);
+  if (memory.nodes > 1) {
+    /* prefer arenas on the same NUMA node */
+    for (size_t i = 0; i < memory.cores; ++i) {
+      if (arenas[i].node == preffered->node && arenas + i != preffered &&
+          !fio_trylock(&arenas[i].lock))
+        return arenas + i;
+    }
+  }
   do {
     arena_s *arena = preffered;
     for (size_t i = (size_t)(arena - arenas); i < memory.cores; ++i) {
@@ -7052,33 +11239,97 @@ static inline arena_s *arena_lock(arena_s *preffered) {
 
 static __thread arena_s *arena_last_used;
 
-static void arena_enter(void) { arena_last_used = arena_lock(arena_last_used); }
+static void arena_enter(void) {
+#if FIO_MEMORY_NUMA_AVAILABLE
+  if (memory.nodes > 1) {
+    /* prefer the CPU core's arena, for NUMA locality */
+    const int cpu = sched_getcpu();
+    if (cpu >= 0)
+      arena_last_used = arenas + ((size_t)cpu % memory.cores);
+  }
+#endif
+  arena_last_used = arena_lock(arena_last_used);
+}
 
 static inline void arena_exit(void) { fio_unlock(&arena_last_used->lock); }
 
+/*
+ * Waits until no block lock is held, blocking new block locks until the fork
+ * completes. Block locks are spread across the blocks, so the child process
+ * couldn't reset a lock inherited from a thread that no longer exists.
+ */
+static void fio_malloc_before_fork(void) {
+  fio_lock(&memory.fork_lock);
+  fio_atomic_xchange(&memory.forking, 1);
+  while (fio_atomic_add(&memory.block_locks, 0))
+    fio_reschedule_thread();
+}
+
+/* Resumes block locking in the parent process. */
+static void fio_malloc_after_fork_parent(void) {
+  fio_atomic_xchange(&memory.forking, 0);
+  fio_unlock(&memory.fork_lock);
+}
+
 /** Clears any memory locks, in case of a system call to `fork`. */
 void fio_malloc_after_fork(void) {
   arena_last_used = NULL;
+  /* threads waiting to take a block lock don't exist in the child */
+  memory.block_locks = 0;
+  memory.forking = 0;
+  memory.fork_lock = FIO_LOCK_INIT;
   if (!arenas) {
     return;
   }
-  memory.lock = FIO_LOCK_INIT;
+  memory.threads_lock = FIO_LOCK_INIT;
+  memory.decay_lock = FIO_LOCK_INIT;
+  big_cache.lock = FIO_LOCK_INIT;
   memory.forked = 1;
   for (size_t i = 0; i < memory.cores; ++i) {
     arenas[i].lock = FIO_LOCK_INIT;
   }
+  for (size_t n = 0; n < memory.nodes; ++n) {
+    memory.pools[n].lock = FIO_LOCK_INIT;
+    for (size_t i = 0; i < FIO_MEMORY_SIZE_CLASSES; ++i) {
+      memory.pools[n].partial[i].lock = FIO_LOCK_INIT;
+    }
+  }
 }
 
 /* *****************************************************************************
 Block management / allocation
 ***************************************************************************** */
 
-static inline void block_init_root(block_s *blk, block_s *parent) {
+/*
+ * Returns 0 if the block's lock was acquired. Fails while a thread is about to
+ * fork (the caller might hold a lock required by the block lock holders).
+ */
+static inline int block_trylock(block_s *blk) {
+  fio_atomic_add(&memory.block_locks, 1);
+  if (!fio_atomic_add(&memory.forking, 0) && !fio_trylock(&blk->lock))
+    return 0;
+  fio_atomic_sub(&memory.block_locks, 1);
+  return -1;
+}
+
+static inline void block_lock(block_s *blk) {
+  while (block_trylock(blk))
+    fio_reschedule_thread();
+}
+
+static inline void block_unlock(block_s *blk) {
+  fio_unlock(&blk->lock);
+  fio_atomic_sub(&memory.block_locks, 1);
+}
+
+static inline void block_init_root(block_s *blk, block_s *parent,
+                                   uint8_t node) {
   *blk = (block_s){
       .parent = parent,
       .ref = 1,
       .pos = FIO_MEMORY_BLOCK_START_POS,
       .root_ref = 1,
+      .node = node,
   };
 }
 
@@ -7087,6 +11338,9 @@ static inline void block_init(block_s *blk) {
   /* initialization shouldn't effect `parent` or `root_ref`*/
   blk->ref = 1;
   blk->pos = FIO_MEMORY_BLOCK_START_POS;
+  blk->free_list = NULL;
+  blk->lock = FIO_LOCK_INIT;
+  blk->state = BLOCK_OWNED;
   /* zero out linked list memory (everything else is already zero) */
   ((block_node_s *)blk)->node.next = NULL;
   ((block_node_s *)blk)->node.prev = NULL;
@@ -7094,19 +11348,22 @@ static inline void block_init(block_s *blk) {
   fio_atomic_add(&blk->parent->root_ref, 1);
 }
 
-/* intializes the block header for an available block of memory. */
-static inline void block_free(block_s *blk) {
-  if (fio_atomic_sub(&blk->ref, 1))
-    return;
-
+/*
+ * Returns an unused block to the memory pool of the NUMA node that owns it
+ * (the block's lock is held).
+ */
+static void block_recycle(block_s *blk) {
+  pool_s *pool = memory.pools + blk->node;
   memset(blk + 1, 0, (FIO_MEMORY_BLOCK_SIZE - sizeof(*blk)));
-  fio_lock(&memory.lock);
-  fio_ls_embd_push(&memory.available, &((block_node_s *)blk)->node);
+  blk->state = BLOCK_FREE;
+  fio_lock(&pool->lock);
+  fio_ls_embd_push(&pool->available, &((block_node_s *)blk)->node);
+  ++pool->blocks_free;
 
   blk = blk->parent;
 
   if (fio_atomic_sub(&blk->root_ref, 1)) {
-    fio_unlock(&memory.lock);
+    fio_unlock(&pool->lock);
     return;
   }
   // fio_unlock(&memory.lock);
@@ -7117,117 +11374,664 @@ static inline void block_free(block_s *blk) {
     block_node_s *pos =
         (block_node_s *)((uintptr_t)blk + (i * FIO_MEMORY_BLOCK_SIZE));
     fio_ls_embd_remove(&pos->node);
+    pool->decayed -= (pos->dont_touch.state == BLOCK_DECAYED);
   }
+  pool->blocks_free -= FIO_MEMORY_BLOCKS_PER_ALLOCATION;
+  if (pool->min_free > pool->blocks_free)
+    pool->min_free = pool->blocks_free;
+  if (pool->decay > pool->blocks_free)
+    pool->decay = pool->blocks_free;
+  --pool->regions;
 
-  fio_unlock(&memory.lock);
+  fio_unlock(&pool->lock);
   sys_free(blk, FIO_MEMORY_BLOCK_SIZE * FIO_MEMORY_BLOCKS_PER_ALLOCATION);
   FIO_LOG_DEBUG("memory allocator returned %p to the system", (void *)blk);
   FIO_MEMORY_ON_BLOCK_FREE();
 }
 
-/* intializes the block header for an available block of memory. */
-static inline block_s *block_new(void) {
+/*
+ * Releases `count` slices, linked from `head` to `tail` (or NULL), and their
+ * references. If `disown` is set, the arena's reference is released as well.
+ *
+ * Blocks with freed slices are listed as partially used blocks, unless they are
+ * still owned by an arena. Unused blocks are recycled. Either way, the block
+ * is returned to the NUMA node that owns it (remote frees are sent back).
+ *
+ * Lock order: the block's lock is taken before the size class's list lock.
+ */
+static void block_release(block_s *blk, void *head, void *tail, uint16_t count,
+                          uint8_t disown) {
+  partial_s *partial =
+      memory.pools[blk->node].partial + fio_mem_units2class[blk->units];
+  block_lock(blk);
+  if (head) {
+    *(void **)tail = blk->free_list;
+    blk->free_list = head;
+  }
+  if (disown)
+    blk->state = BLOCK_DETACHED;
+  if (fio_atomic_sub(&blk->ref, count)) {
+    if (blk->state == BLOCK_DETACHED && blk->free_list) {
+      fio_lock(&partial->lock);
+      fio_ls_embd_push(&partial->blocks, &((block_node_s *)blk)->node);
+      fio_unlock(&partial->lock);
+      blk->state = BLOCK_LISTED;
+      fio_atomic_add(&memory.blocks_partial, 1);
+    }
+    block_unlock(blk);
+    return;
+  }
+  if (blk->state == BLOCK_LISTED) {
+    fio_lock(&partial->lock);
+    fio_ls_embd_remove(&((block_node_s *)blk)->node);
+    fio_unlock(&partial->lock);
+    fio_atomic_sub(&memory.blocks_partial, 1);
+  }
+  /* the block's lock is reset when the block is reused */
+  block_recycle(blk);
+  fio_atomic_sub(&memory.block_locks, 1);
+}
+
+/* releases the arena's reference to the block. */
+static inline void block_free(block_s *blk) {
+  block_release(blk, NULL, NULL, 1, 1);
+}
+
+/*
+ * Collects up to `*count` freed slices of the size class `cls` from a
+ * partially used block on the NUMA node `node`, updating `*count`.
+ *
+ * Returns a NULL terminated list.
+ */
+static void *block_partial_pop(uint8_t cls, uint8_t node, size_t *count) {
+  partial_s *partial = memory.pools[node].partial + cls;
+  void *head = NULL;
+  size_t got = 0;
+  if (fio_ls_embd_is_empty(&partial->blocks))
+    goto finish;
+  fio_lock(&partial->lock);
+  FIO_LS_EMBD_FOR(&partial->blocks, pos) {
+    block_s *blk = (block_s *)FIO_LS_EMBD_OBJ(block_node_s, node, pos);
+    if (block_trylock(blk))
+      continue;
+    void *tail = head = blk->free_list;
+    got = 1;
+    while (got < *count && *(void **)tail) {
+      tail = *(void **)tail;
+      ++got;
+    }
+    blk->free_list = *(void **)tail;
+    *(void **)tail = NULL;
+    fio_atomic_add(&blk->ref, (uint16_t)got);
+    if (!blk->free_list) {
+      fio_ls_embd_remove(pos);
+      blk->state = BLOCK_DETACHED;
+      fio_atomic_sub(&memory.blocks_partial, 1);
+    }
+    block_unlock(blk);
+    break;
+  }
+  fio_unlock(&partial->lock);
+finish:
+  *count = got;
+  return head;
+}
+
+/* collects an available block of memory from the NUMA node's memory pool. */
+static inline block_s *block_new(uint8_t node) {
+  pool_s *pool = memory.pools + node;
   block_s *blk = NULL;
 
-  fio_lock(&memory.lock);
-  blk = (block_s *)fio_ls_embd_pop(&memory.available);
+  fio_lock(&pool->lock);
+  blk = (block_s *)fio_ls_embd_pop(&pool->available);
   if (blk) {
     blk = (block_s *)FIO_LS_EMBD_OBJ(block_node_s, node, blk);
     FIO_ASSERT(((uintptr_t)blk & FIO_MEMORY_BLOCK_MASK) == 0,
                "Memory allocator error! double `fio_free`?\n");
+    pool->decayed -= (blk->state == BLOCK_DECAYED);
     block_init(blk); /* must be performed within lock */
-    fio_unlock(&memory.lock);
+    --pool->blocks_free;
+    if (pool->min_free > pool->blocks_free)
+      pool->min_free = pool->blocks_free;
+    fio_unlock(&pool->lock);
     return blk;
   }
   /* collect memory from the system */
-  blk = sys_alloc(FIO_MEMORY_BLOCK_SIZE * FIO_MEMORY_BLOCKS_PER_ALLOCATION, 0);
-  if (!blk)
+  blk =
+      sys_alloc_huge(FIO_MEMORY_BLOCK_SIZE * FIO_MEMORY_BLOCKS_PER_ALLOCATION);
+  if (!blk) {
+    fio_unlock(&pool->lock);
     return NULL;
+  }
+  /* bind the region before the headers are written (first touch) */
+  fio_mem_numa_bind(
+      blk, FIO_MEMORY_BLOCK_SIZE * FIO_MEMORY_BLOCKS_PER_ALLOCATION, node);
   FIO_LOG_DEBUG("memory allocator allocated %p from the system", (void *)blk);
   FIO_MEMORY_ON_BLOCK_ALLOC();
-  block_init_root(blk, blk);
+  block_init_root(blk, blk, node);
   /* the extra memory goes into the memory pool. initialize + linke-list. */
   block_node_s *tmp = (block_node_s *)blk;
   for (int i = 1; i < FIO_MEMORY_BLOCKS_PER_ALLOCATION; ++i) {
     tmp = (block_node_s *)((uintptr_t)tmp + FIO_MEMORY_BLOCK_SIZE);
-    block_init_root((block_s *)tmp, blk);
-    fio_ls_embd_push(&memory.available, &tmp->node);
-  }
-  fio_unlock(&memory.lock);
+    block_init_root((block_s *)tmp, blk, node);
+    tmp->dont_touch.state = BLOCK_DECAYED; /* memory wasn't touched yet */
+    fio_ls_embd_push(&pool->available, &tmp->node);
+  }
+  pool->blocks_free += FIO_MEMORY_BLOCKS_PER_ALLOCATION - 1;
+  pool->decayed += FIO_MEMORY_BLOCKS_PER_ALLOCATION - 1;
+  ++pool->regions;
+  fio_unlock(&pool->lock);
   /* return the root block (which isn't in the memory pool). */
   return blk;
 }
 
-/* allocates memory from within a block - called within an arena's lock */
-static inline void *block_slice(uint16_t units) {
-  block_s *blk = arena_last_used->block;
+/*
+ * Allocates up to `*count` consecutive slices of the size class `cls` from the
+ * arena's block, updating `*count` - called within an arena's lock.
+ */
+static inline void *block_slice(uint8_t cls, size_t *count) {
+  const uint16_t units = fio_mem_class2units[cls];
+  block_s *blk = arena_last_used->block[cls];
   if (!blk) {
     /* arena is empty */
-    blk = block_new();
-    arena_last_used->block = blk;
-  } else if (blk->pos + units > FIO_MEMORY_MAX_SLICES_PER_BLOCK) {
-    /* not enough memory in the block - rotate */
-    block_free(blk);
-    blk = block_new();
-    arena_last_used->block = blk;
-  }
-  if (!blk) {
-    /* no system memory available? */
-    errno = ENOMEM;
-    return NULL;
+    blk = block_new(arena_last_used->node);
+    if (!blk) {
+      /* no system memory available? */
+      *count = 0;
+      errno = ENOMEM;
+      return NULL;
+    }
+    blk->units = units;
+    arena_last_used->block[cls] = blk;
   }
+  const size_t available = (FIO_MEMORY_MAX_SLICES_PER_BLOCK - blk->pos) / units;
+  if (*count > available)
+    *count = available;
   /* slice block starting at blk->pos and increase reference count */
   const void *mem = (void *)((uintptr_t)blk + ((uintptr_t)blk->pos << 4));
-  fio_atomic_add(&blk->ref, 1);
-  blk->pos += units;
-  if (blk->pos >= FIO_MEMORY_MAX_SLICES_PER_BLOCK) {
+  fio_atomic_add(&blk->ref, (uint16_t)*count);
+  blk->pos += (uint16_t)(*count * units);
+  if (blk->pos + units > FIO_MEMORY_MAX_SLICES_PER_BLOCK) {
     /* ... the block was fully utilized, clear arena */
     block_free(blk);
-    arena_last_used->block = NULL;
+    arena_last_used->block[cls] = NULL;
   }
   return (void *)mem;
 }
 
-/* handle's a bock's reference count - called without a lock */
+/* *****************************************************************************
+Per-Thread slice cache (lock-free allocation / deallocation)
+***************************************************************************** */
+
+/* A per-thread cache for a single size class */
+typedef struct {
+  void *freed;          /* freed slices, linked through their first word */
+  uintptr_t fresh;      /* unused (zeroed) slices, reserved from an arena */
+  uint16_t freed_count; /* the number of slices in the `freed` list */
+  uint16_t fresh_count; /* the number of slices starting at `fresh` */
+} cache_bin_s;
+
+typedef struct {
+  cache_bin_s bin[FIO_MEMORY_SIZE_CLASSES];
+  fio_ls_embd_s node; /* statistics: a node in `memory.threads` */
+  size_t in_use;      /* statistics: bytes allocated less bytes freed */
+  size_t requested;   /* statistics: bytes requested */
+  size_t reserved;    /* statistics: bytes reserved (size class) */
+  uint8_t registered; /* thread exit cleanup was registered */
+} cache_s;
+
+static __thread cache_s cache;
+
+/* used for returning a thread's cached slices when the thread exits */
+static pthread_key_t cache_key;
+
+/* returns `count` cached slices to their blocks, batching per-block updates */
+static void cache_bin_flush(cache_bin_s *bin, size_t count) {
+  while (count && bin->freed) {
+    void *head = bin->freed;
+    void *tail = head;
+    block_s *blk = (block_s *)((uintptr_t)head & (~FIO_MEMORY_BLOCK_MASK));
+    uint16_t refs = 1;
+    --count;
+    while (count && *(void **)tail &&
+           ((uintptr_t)(*(void **)tail) & (~FIO_MEMORY_BLOCK_MASK)) ==
+               (uintptr_t)blk) {
+      tail = *(void **)tail;
+      ++refs;
+      --count;
+    }
+    bin->freed = *(void **)tail;
+    bin->freed_count -= refs;
+    block_release(blk, head, tail, refs, 0);
+  }
+}
+
+/* returns all of the calling thread's cached slices to their blocks */
+static void cache_flush(void) {
+  for (size_t i = 0; i < FIO_MEMORY_SIZE_CLASSES; ++i) {
+    cache_bin_s *bin = cache.bin + i;
+    cache_bin_flush(bin, bin->freed_count);
+    if (bin->fresh_count) {
+      /* link the unused slices, so they can be reused by the block */
+      const uintptr_t size = (uintptr_t)fio_mem_class2units[i] << 4;
+      uintptr_t tail = bin->fresh;
+      for (size_t j = 1; j < bin->fresh_count; ++j) {
+        *(void **)tail = (void *)(tail + size);
+        tail += size;
+      }
+      block_release((block_s *)(bin->fresh & (~FIO_MEMORY_BLOCK_MASK)),
+                    (void *)bin->fresh, (void *)tail, bin->fresh_count, 0);
+      bin->fresh_count = 0;
+      bin->fresh = 0;
+    }
+  }
+}
+
+/* `pthread_key_create` destructor, called when a thread exits */
+static void cache_on_thread_exit(void *ignr_) {
+  cache.registered = 0;
+  cache_flush();
+  /* merge the thread's statistics */
+  fio_lock(&memory.threads_lock);
+  fio_ls_embd_remove(&cache.node);
+  memory.in_use += cache.in_use;
+  memory.requested += cache.requested;
+  memory.reserved += cache.reserved;
+  fio_unlock(&memory.threads_lock);
+  cache.in_use = cache.requested = cache.reserved = 0;
+  (void)ignr_;
+}
+
+/* makes sure the thread's cache will be flushed when the thread exits */
+static inline void cache_register(void) {
+  if (cache.registered)
+    return;
+  cache.registered = 1;
+  pthread_setspecific(cache_key, (void *)&cache);
+  fio_lock(&memory.threads_lock);
+  fio_ls_embd_push(&memory.threads, &cache.node);
+  fio_unlock(&memory.threads_lock);
+}
+
+/* returns a cached (zeroed) slice or NULL */
+static inline void *cache_pop(uint8_t cls) {
+  cache_bin_s *bin = cache.bin + cls;
+  void *mem;
+  if (bin->freed) {
+    mem = bin->freed;
+    bin->freed = *(void **)mem;
+    --bin->freed_count;
+    memset(mem, 0, (size_t)fio_mem_class2units[cls] << 4);
+    return mem;
+  }
+  if (bin->fresh_count) {
+    mem = (void *)bin->fresh;
+    bin->fresh += (uintptr_t)fio_mem_class2units[cls] << 4;
+    --bin->fresh_count;
+    return mem;
+  }
+  return NULL;
+}
+
+/* caches a freed slice, returns -1 if the slice's size class isn't cached */
+static inline int cache_push(void *mem, uint8_t cls) {
+  if (!fio_mem_cache_limit[cls])
+    return -1;
+  cache_bin_s *bin = cache.bin + cls;
+  if (bin->freed_count >= fio_mem_cache_limit[cls])
+    cache_bin_flush(bin, bin->freed_count >> 1);
+  *(void **)mem = bin->freed;
+  bin->freed = mem;
+  ++bin->freed_count;
+  return 0;
+}
+
+/*
+ * Collects slices, caching any surplus slices. Freed slices in partially used
+ * blocks are preferred over the arena's block (and over taking new blocks).
+ */
+static inline void *cache_refill(uint8_t cls) {
+  size_t count = (fio_mem_cache_limit[cls] >> 1) + 1;
+  cache_bin_s *bin = cache.bin + cls;
+  cache_register();
+  void *mem = block_partial_pop(cls, fio_mem_numa_node(), &count);
+  if (mem) {
+    if (count > 1) {
+      bin->freed = *(void **)mem;
+      bin->freed_count = (uint16_t)(count - 1);
+    }
+    memset(mem, 0, (size_t)fio_mem_class2units[cls] << 4);
+    return mem;
+  }
+  count = (fio_mem_cache_limit[cls] >> 1) + 1;
+  arena_enter();
+  ++arena_last_used->refills;
+  mem = block_slice(cls, &count);
+  arena_exit();
+  if (count > 1) {
+    bin->fresh = (uintptr_t)mem + ((uintptr_t)fio_mem_class2units[cls] << 4);
+    bin->fresh_count = (uint16_t)(count - 1);
+  }
+  return mem;
+}
+
+/* returns a slice to the thread's cache or to its block (no lock required) */
 static inline void block_slice_free(void *mem) {
   /* locate block boundary */
   block_s *blk = (block_s *)((uintptr_t)mem & (~FIO_MEMORY_BLOCK_MASK));
-  block_free(blk);
+  cache_register();
+  cache.in_use -= (size_t)blk->units << 4;
+  /* the cache is reused by the thread, so it only holds node local slices */
+  if ((memory.nodes < 2 || blk->node == fio_mem_numa_node()) &&
+      !cache_push(mem, fio_mem_units2class[blk->units]))
+    return;
+  block_release(blk, mem, mem, 1, 0);
 }
 
 /* *****************************************************************************
 Non-Block allocations (direct from the system)
 ***************************************************************************** */
 
+/*
+ * Big allocations start with a 16 byte header (the mapping's length).
+ *
+ * Freed big allocations are cached (up to FIO_MEMORY_BIG_CACHE regions and
+ * FIO_MEMORY_BIG_CACHE_BYTES bytes), so large buffers that are allocated and
+ * freed repeatedly don't cause `mmap` / `munmap` churn.
+ */
+
+/* caches a freed mapping, returns -1 if the mapping should be unmapped. */
+static int big_cache_push(void *mem, size_t len) {
+  struct {
+    void *mem;
+    size_t len;
+  } evicted[FIO_MEMORY_BIG_CACHE + 1];
+  size_t evicted_count = 0;
+  if (!FIO_MEMORY_BIG_CACHE || len > FIO_MEMORY_BIG_CACHE_BYTES)
+    return -1;
+  fio_lock(&big_cache.lock);
+  /* evict the oldest regions to make room */
+  while (big_cache.count &&
+         (big_cache.count >= FIO_MEMORY_BIG_CACHE ||
+          big_cache.bytes + len > FIO_MEMORY_BIG_CACHE_BYTES)) {
+    evicted[evicted_count].mem = big_cache.regions[0].mem;
+    evicted[evicted_count].len = big_cache.regions[0].len;
+    ++evicted_count;
+    big_cache.bytes -= big_cache.regions[0].len;
+    --big_cache.count;
+    memmove(big_cache.regions, big_cache.regions + 1,
+            sizeof(big_cache.regions[0]) * big_cache.count);
+  }
+  big_cache.regions[big_cache.count].mem = mem;
+  big_cache.regions[big_cache.count].len = len;
+  big_cache.regions[big_cache.count].epoch = big_cache.epoch;
+  ++big_cache.count;
+  big_cache.bytes += len;
+  fio_unlock(&big_cache.lock);
+  for (size_t i = 0; i < evicted_count; ++i)
+    sys_free(evicted[i].mem, evicted[i].len);
+  return 0;
+}
+
+/* collects a cached mapping of `len` bytes (up to 25% more), setting `*len`. */
+static void *big_cache_pop(size_t *len) {
+  void *mem = NULL;
+  if (!FIO_MEMORY_BIG_CACHE || !big_cache.count)
+    return NULL;
+  const size_t limit = *len + (*len >> 2);
+  size_t pos = (size_t)-1;
+  fio_lock(&big_cache.lock);
+  /* best fit, preferring recently freed regions */
+  for (size_t i = big_cache.count; i--;) {
+    if (big_cache.regions[i].len >= *len && big_cache.regions[i].len <= limit &&
+        (pos == (size_t)-1 ||
+         big_cache.regions[i].len < big_cache.regions[pos].len))
+      pos = i;
+  }
+  if (pos != (size_t)-1) {
+    mem = big_cache.regions[pos].mem;
+    *len = big_cache.regions[pos].len;
+    big_cache.bytes -= *len;
+    --big_cache.count;
+    memmove(big_cache.regions + pos, big_cache.regions + pos + 1,
+            sizeof(big_cache.regions[0]) * (big_cache.count - pos));
+  }
+  fio_unlock(&big_cache.lock);
+  return mem;
+}
+
+/* unmaps all the cached mappings. */
+static void big_cache_clear(void) {
+  fio_lock(&big_cache.lock);
+  while (big_cache.count) {
+    --big_cache.count;
+    sys_free(big_cache.regions[big_cache.count].mem,
+             big_cache.regions[big_cache.count].len);
+  }
+  big_cache.bytes = 0;
+  fio_unlock(&big_cache.lock);
+}
+
+/* unmaps cached mappings that remained unused for a whole decay period. */
+static size_t big_cache_decay(void) {
+  struct {
+    void *mem;
+    size_t len;
+  } evicted[FIO_MEMORY_BIG_CACHE + 1];
+  size_t evicted_count = 0;
+  size_t bytes = 0;
+  if (!big_cache.count)
+    return 0;
+  fio_lock(&big_cache.lock);
+  size_t keep = 0;
+  for (size_t i = 0; i < big_cache.count; ++i) {
+    if (big_cache.regions[i].epoch + 1 < big_cache.epoch) {
+      evicted[evicted_count].mem = big_cache.regions[i].mem;
+      evicted[evicted_count].len = big_cache.regions[i].len;
+      ++evicted_count;
+      big_cache.bytes -= big_cache.regions[i].len;
+      continue;
+    }
+    big_cache.regions[keep++] = big_cache.regions[i];
+  }
+  big_cache.count = keep;
+  fio_unlock(&big_cache.lock);
+  for (size_t i = 0; i < evicted_count; ++i) {
+    sys_free(evicted[i].mem, evicted[i].len);
+    bytes += evicted[i].len;
+  }
+  return bytes;
+}
+
 /* allocates directly from the system adding size header - no lock required. */
 static inline void *big_alloc(size_t size) {
-  size = sys_round_size(size + 16);
-  size_t *mem = sys_alloc(size, 1);
+  size_t len = sys_round_size(size + 16);
+  size_t *mem = big_cache_pop(&len);
+  if (mem)
+    memset(mem + 2, 0, size);
+  else
+    mem = sys_alloc(len, 1);
+  if (!mem)
+    goto error;
+  mem[0] = len;
+  fio_atomic_add(&memory.big_count, 1);
+  fio_atomic_add(&memory.big_total, 1);
+  fio_atomic_add(&memory.big_bytes, len);
+  return (void *)(((uintptr_t)mem) + 16);
+error:
+  return NULL;
+}
+
+/* reads size header and frees memory back to the system (or the cache) */
+static inline void big_free(void *ptr) {
+  size_t *mem = (void *)(((uintptr_t)ptr) - 16);
+  fio_atomic_sub(&memory.big_count, 1);
+  fio_atomic_sub(&memory.big_bytes, *mem);
+  if (big_cache_push(mem, *mem))
+    sys_free(mem, *mem);
+}
+
+/* reallocates memory using the system, resetting the size header */
+static inline void *big_realloc(void *ptr, size_t new_size) {
+  size_t *mem = (void *)(((uintptr_t)ptr) - 16);
+  const size_t old_size = *mem;
+  new_size = sys_round_size(new_size + 16);
+  mem = sys_realloc(mem, old_size, new_size);
   if (!mem)
     goto error;
-  *mem = size;
+  *mem = new_size;
+  fio_atomic_add(&memory.big_bytes, new_size);
+  fio_atomic_sub(&memory.big_bytes, old_size);
   return (void *)(((uintptr_t)mem) + 16);
 error:
   return NULL;
 }
 
-/* reads size header and frees memory back to the system */
-static inline void big_free(void *ptr) {
-  size_t *mem = (void *)(((uintptr_t)ptr) - 16);
-  sys_free(mem, *mem);
+/* *****************************************************************************
+Idle memory decay - returning unused memory to the system
+
+Free blocks are pushed to (and popped from) the head of their memory pool, so
+the blocks at the list's tail are the least recently used. The lowest number of
+free blocks during a decay period (`min_free`) marks the blocks at the tail
+that weren't used during the whole period. These blocks are returned to the
+system using `madvise(MADV_DONTNEED)` (the header page is kept), preferably when
+the reactor is idle. Cached big allocations are unmapped the same way.
+***************************************************************************** */
+
+/* the maximum number of blocks decayed per pool lock (per call) */
+#define FIO_MEMORY_DECAY_BATCH 64
+
+/* decays up to `pool->decay` blocks, returns the number of bytes released. */
+static size_t fio_mem_decay_pool(pool_s *pool) {
+  size_t count = 0;
+#if defined(MADV_DONTNEED) && !FIO_MEMORY_HUGE_PAGES &&                        \
+    FIO_MEMORY_BLOCK_SIZE_LOG > 12
+  if (!pool->decay)
+    return 0;
+  fio_lock(&pool->lock);
+  size_t limit = pool->decay;
+  if (limit > pool->min_free)
+    limit = pool->min_free;
+  fio_ls_embd_s *pos = pool->available.next;
+  while (limit && pos != &pool->available && count < FIO_MEMORY_DECAY_BATCH) {
+    block_s *blk = (block_s *)FIO_LS_EMBD_OBJ(block_node_s, node, pos);
+    pos = pos->next;
+    --limit;
+    if (blk->state == BLOCK_DECAYED)
+      continue;
+    /* keep the first page, it contains the block's header */
+    madvise((void *)((uintptr_t)blk + 4096), FIO_MEMORY_BLOCK_SIZE - 4096,
+            MADV_DONTNEED);
+    blk->state = BLOCK_DECAYED;
+    ++pool->decayed;
+    ++count;
+  }
+  if (!limit || pos == &pool->available)
+    pool->decay = 0; /* done (otherwise, the batch limit was reached) */
+  fio_unlock(&pool->lock);
+#else
+  pool->decay = 0;
+#endif
+  return count * (FIO_MEMORY_BLOCK_SIZE - 4096);
+}
+
+/* performs pending decay work, returns the number of bytes released. */
+static size_t fio_mem_decay_perform(void) {
+  size_t bytes = 0;
+  uint8_t pending = 0;
+  if (!arenas || fio_trylock(&memory.decay_lock))
+    return 0;
+  for (size_t n = 0; n < memory.nodes; ++n) {
+    bytes += fio_mem_decay_pool(memory.pools + n);
+    pending |= (memory.pools[n].decay != 0);
+  }
+  bytes += big_cache_decay();
+  memory.decay_pending = pending;
+  fio_unlock(&memory.decay_lock);
+  return bytes;
+}
+
+/* starts a new decay period, marking the memory that wasn't used. */
+static void fio_mem_decay_period(void) {
+  for (size_t n = 0; n < memory.nodes; ++n) {
+    pool_s *pool = memory.pools + n;
+    fio_lock(&pool->lock);
+    pool->decay = pool->min_free;
+    pool->min_free = pool->blocks_free;
+    fio_unlock(&pool->lock);
+  }
+  fio_lock(&big_cache.lock);
+  ++big_cache.epoch;
+  fio_unlock(&big_cache.lock);
+  memory.decay_pending = 1;
+}
+
+/* a timer task, performed every second. */
+static void fio_mem_decay_tick(void *ignr_) {
+  if (!memory.decay_seconds || !arenas)
+    return;
+  if (++memory.decay_elapsed < memory.decay_seconds)
+    return;
+  memory.decay_elapsed = 0;
+  /* the reactor was never idle, perform pending work before it's replaced */
+  while (memory.decay_pending && fio_mem_decay_perform())
+    ;
+  fio_mem_decay_period();
+  (void)ignr_;
+}
+
+/* an FIO_CALL_ON_IDLE callback. */
+static void fio_mem_decay_on_idle(void *ignr_) {
+  if (memory.decay_pending)
+    fio_mem_decay_perform();
+  (void)ignr_;
+}
+
+/* an FIO_CALL_PRE_START callback, starts the decay timer. */
+static void fio_mem_decay_on_start(void *ignr_) {
+  fio_run_every(1000, 0, fio_mem_decay_tick, NULL, NULL);
+  (void)ignr_;
+}
+
+static void fio_mem_decay_init(void) {
+  fio_state_callback_add(FIO_CALL_PRE_START, fio_mem_decay_on_start, NULL);
+  fio_state_callback_add(FIO_CALL_ON_IDLE, fio_mem_decay_on_idle, NULL);
+}
+
+/**
+ * Sets the number of seconds after which unused memory is returned to the
+ * system (0 disables idle memory decay).
+ */
+void fio_malloc_decay_set(size_t seconds) {
+  memory.decay_seconds = seconds;
+  memory.decay_elapsed = 0;
 }
 
-/* reallocates memory using the system, resetting the size header */
-static inline void *big_realloc(void *ptr, size_t new_size) {
-  size_t *mem = (void *)(((uintptr_t)ptr) - 16);
-  new_size = sys_round_size(new_size + 16);
-  mem = sys_realloc(mem, *mem, new_size);
-  if (!mem)
-    goto error;
-  *mem = new_size;
-  return (void *)(((uintptr_t)mem) + 16);
-error:
-  return NULL;
+/** Returns the idle memory decay period (in seconds). */
+size_t fio_malloc_decay_get(void) { return memory.decay_seconds; }
+
+/**
+ * Returns all the free memory to the system immediately, returning the number
+ * of bytes released.
+ */
+size_t fio_malloc_release(void) {
+  size_t bytes = 0;
+  if (!arenas)
+    return 0;
+  for (size_t n = 0; n < memory.nodes; ++n) {
+    pool_s *pool = memory.pools + n;
+    fio_lock(&pool->lock);
+    pool->decay = pool->min_free = pool->blocks_free;
+    fio_unlock(&pool->lock);
+  }
+  fio_lock(&big_cache.lock);
+  big_cache.epoch += 2;
+  fio_unlock(&big_cache.lock);
+  memory.decay_pending = 1;
+  do {
+    bytes += fio_mem_decay_perform();
+  } while (memory.decay_pending);
+  return bytes;
 }
 
 /* *****************************************************************************
@@ -7237,17 +12041,18 @@ Allocator Initialization (initialize arenas and allocate a block for each CPU)
 #if DEBUG
 void fio_memory_dump_missing(void) {
   fprintf(stderr, "\n ==== Attempting Memory Dump (will crash) ====\n");
-  if (fio_ls_embd_is_empty(&memory.available)) {
+  block_node_s *smallest = NULL;
+  for (size_t n = 0; n < memory.nodes; ++n) {
+    FIO_LS_EMBD_FOR(&memory.pools[n].available, node) {
+      block_node_s *tmp = FIO_LS_EMBD_OBJ(block_node_s, node, node);
+      if (!smallest || smallest > tmp)
+        smallest = tmp;
+    }
+  }
+  if (!smallest) {
     fprintf(stderr, "- Memory dump attempt canceled\n");
     return;
   }
-  block_node_s *smallest =
-      FIO_LS_EMBD_OBJ(block_node_s, node, memory.available.next);
-  FIO_LS_EMBD_FOR(&memory.available, node) {
-    block_node_s *tmp = FIO_LS_EMBD_OBJ(block_node_s, node, node);
-    if (smallest > tmp)
-      smallest = tmp;
-  }
 
   for (size_t i = 0;
        i < FIO_MEMORY_BLOCK_SIZE * FIO_MEMORY_BLOCKS_PER_ALLOCATION; ++i) {
@@ -7277,10 +12082,15 @@ static void fio_mem_init(void) {
   if (cpu_count <= 0)
     cpu_count = 8;
   memory.cores = cpu_count;
+  fio_mem_class_init();
+  pthread_key_create(&cache_key, cache_on_thread_exit);
   arenas = big_alloc(sizeof(*arenas) * cpu_count);
   FIO_ASSERT_ALLOC(arenas);
-  block_free(block_new());
-  pthread_atfork(NULL, NULL, fio_malloc_after_fork);
+  fio_mem_numa_init();
+  for (size_t n = 0; n < memory.nodes; ++n)
+    block_free(block_new((uint8_t)n));
+  pthread_atfork(fio_malloc_before_fork, fio_malloc_after_fork_parent,
+                 fio_malloc_after_fork);
 }
 
 static void fio_mem_destroy(void) {
@@ -7289,17 +12099,22 @@ static void fio_mem_destroy(void) {
 
   FIO_MEMORY_PRINT_BLOCK_STAT();
 
+  cache_flush();
   for (size_t i = 0; i < memory.cores; ++i) {
-    if (arenas[i].block)
-      block_free(arenas[i].block);
-    arenas[i].block = NULL;
+    for (size_t j = 0; j < FIO_MEMORY_SIZE_CLASSES; ++j) {
+      if (arenas[i].block[j])
+        block_free(arenas[i].block[j]);
+      arenas[i].block[j] = NULL;
+    }
+  }
+  size_t count = 0;
+  for (size_t n = 0; n < memory.nodes; ++n) {
+    FIO_LS_EMBD_FOR(&memory.pools[n].available, node) { ++count; }
   }
-  if (!memory.forked && fio_ls_embd_any(&memory.available)) {
+  if (!memory.forked && count) {
     FIO_LOG_WARNING("facil.io detected memory traces remaining after cleanup"
                     " - memory leak?");
     FIO_MEMORY_PRINT_BLOCK_STAT_END();
-    size_t count = 0;
-    FIO_LS_EMBD_FOR(&memory.available, node) { ++count; }
     FIO_LOG_DEBUG("Memory blocks in pool: %zu (%zu blocks per allocation).",
                   count, (size_t)FIO_MEMORY_BLOCKS_PER_ALLOCATION);
 #if FIO_MEM_DUMP
@@ -7308,6 +12123,7 @@ static void fio_mem_destroy(void) {
   }
   big_free(arenas);
   arenas = NULL;
+  big_cache_clear();
 }
 /* *****************************************************************************
 Memory allocation / deacclocation API
@@ -7322,16 +12138,20 @@ void *fio_malloc(size_t size) {
     /* changed behavior prevents "allocation failed" test for `malloc(0)` */
     return (void *)(&on_malloc_zero);
   }
-  if (size >= FIO_MEMORY_BLOCK_ALLOC_LIMIT) {
+  if (size >= FIO_MEMORY_BLOCK_ALLOC_LIMIT ||
+      size > (FIO_MEMORY_MAX_CLASS_UNITS << 4)) {
     /* system allocation - must be block aligned */
     // FIO_LOG_WARNING("fio_malloc re-routed to mmap - big allocation");
     return big_alloc(size);
   }
   /* ceiling for 16 byte alignement, translated to 16 byte units */
-  size = (size >> 4) + (!!(size & 15));
-  arena_enter();
-  void *mem = block_slice(size);
-  arena_exit();
+  const uint8_t cls = fio_mem_units2class[(size >> 4) + (!!(size & 15))];
+  void *mem = cache_pop(cls);
+  if (!mem && !(mem = cache_refill(cls)))
+    return NULL;
+  cache.requested += size;
+  cache.reserved += (size_t)fio_mem_class2units[cls] << 4;
+  cache.in_use += (size_t)fio_mem_class2units[cls] << 4;
   return mem;
 }
 
@@ -7353,7 +12173,7 @@ void fio_free(void *ptr) {
 
 /**
  * Re-allocates memory. An attept to avoid copying the data is made only for big
- * memory allocations.
+ * memory allocations and for allocations that fit within their size class.
  *
  * This variation is slightly faster as it might copy less data
  */
@@ -7368,14 +12188,22 @@ void *fio_realloc2(void *ptr, size_t new_size, size_t copy_length) {
     /* big reallocation - direct from the system */
     return big_realloc(ptr, new_size);
   }
-  /* allocated within block - don't even try to expand the allocation */
+  /* allocated within block - keep the slice if the size class is a fit */
+  const size_t old_units =
+      ((block_s *)((uintptr_t)ptr & (~FIO_MEMORY_BLOCK_MASK)))->units;
   /* ceiling for 16 byte alignement, translated to 16 byte units */
+  const size_t new_units = ((new_size >> 4) + (!!(new_size & 15)));
+  if (new_units <= old_units && new_units > (old_units >> 1))
+    return ptr;
   void *new_mem = fio_malloc(new_size);
   if (!new_mem)
     return NULL;
-  new_size = ((new_size >> 4) + (!!(new_size & 15)));
   copy_length = ((copy_length >> 4) + (!!(copy_length & 15)));
-  fio_memcpy(new_mem, ptr, copy_length > new_size ? new_size : copy_length);
+  if (copy_length > new_units)
+    copy_length = new_units;
+  if (copy_length > old_units)
+    copy_length = old_units;
+  fio_memcpy(new_mem, ptr, copy_length);
 
   block_slice_free(ptr);
   return new_mem;
@@ -7403,6 +12231,58 @@ void *fio_mmap(size_t size) {
   return big_alloc(size);
 }
 
+/* *****************************************************************************
+Memory allocator statistics
+***************************************************************************** */
+
+fio_malloc_stats_s fio_malloc_stats(fio_malloc_arena_stats_s *arena_stats,
+                                    size_t arena_count) {
+  fio_malloc_stats_s r = {.arenas = 0};
+  if (!arenas)
+    return r;
+  r.arenas = memory.cores;
+  r.nodes = memory.nodes;
+  for (size_t n = 0; n < memory.nodes; ++n) {
+    fio_lock(&memory.pools[n].lock);
+    r.system_allocations += memory.pools[n].regions;
+    r.blocks_free += memory.pools[n].blocks_free;
+    r.blocks_decayed += memory.pools[n].decayed;
+    fio_unlock(&memory.pools[n].lock);
+  }
+  r.blocks_in_use =
+      (r.system_allocations * FIO_MEMORY_BLOCKS_PER_ALLOCATION) - r.blocks_free;
+  r.blocks_partial = memory.blocks_partial;
+  r.big_allocations = memory.big_count;
+  r.big_bytes = memory.big_bytes;
+  r.big_total = memory.big_total;
+  r.big_cached = big_cache.bytes;
+  fio_lock(&memory.threads_lock);
+  r.bytes_in_use = memory.in_use;
+  r.bytes_requested = memory.requested;
+  r.bytes_reserved = memory.reserved;
+  FIO_LS_EMBD_FOR(&memory.threads, node) {
+    cache_s *c = FIO_LS_EMBD_OBJ(cache_s, node, node);
+    r.bytes_in_use += c->in_use;
+    r.bytes_requested += c->requested;
+    r.bytes_reserved += c->reserved;
+  }
+  fio_unlock(&memory.threads_lock);
+  for (size_t i = 0; i < memory.cores; ++i) {
+    fio_malloc_arena_stats_s a = {
+        .refills = arenas[i].refills,
+        .contention = arenas[i].contention,
+        .node = arenas[i].node,
+    };
+    for (size_t j = 0; j < FIO_MEMORY_SIZE_CLASSES; ++j) {
+      a.blocks += (arenas[i].block[j] != NULL);
+    }
+    r.contention += a.contention;
+    if (arena_stats && i < arena_count)
+      arena_stats[i] = a;
+  }
+  return r;
+}
+
 /* *****************************************************************************
 FIO_OVERRIDE_MALLOC - override glibc / library malloc
 ***************************************************************************** */
@@ -7415,6 +12295,36 @@ void *realloc(void *ptr, size_t new_size) { return fio_realloc(ptr, new_size); }
 
 #endif
 
+/** Prints the memory allocator's statistics (see `fio_malloc_stats`). */
+void fio_malloc_stats_print(void) {
+  fio_malloc_stats_s s = fio_malloc_stats(NULL, 0);
+  fio_malloc_arena_stats_s *arena_stats = malloc(sizeof(*arena_stats) * s.arenas);
+  if (arena_stats)
+    s = fio_malloc_stats(arena_stats, s.arenas);
+  FIO_LOG_INFO("(%d) memory allocator statistics:\n"
+               "       NUMA nodes: %zu\n"
+               "       system allocations: %zu (%zu bytes each)\n"
+               "       blocks: %zu in use (%zu partially used), %zu free "
+               "(%zu decayed)\n"
+               "       bytes in use: %zu (%zu requested / %zu reserved)\n"
+               "       big allocations: %zu (%zu bytes), %zu since startup\n"
+               "       big allocation cache: %zu bytes\n"
+               "       arena lock contention: %zu",
+               (int)getpid(), s.nodes, s.system_allocations,
+               (size_t)(FIO_MEMORY_BLOCK_SIZE * FIO_MEMORY_BLOCKS_PER_ALLOCATION),
+               s.blocks_in_use, s.blocks_partial, s.blocks_free,
+               s.blocks_decayed, s.bytes_in_use,
+               s.bytes_requested, s.bytes_reserved, s.big_allocations,
+               s.big_bytes, s.big_total, s.big_cached, s.contention);
+  for (size_t i = 0; arena_stats && i < s.arenas; ++i) {
+    FIO_LOG_INFO("(%d) arena %zu (node %zu): %zu blocks, %zu refills, "
+                 "%zu contention",
+                 (int)getpid(), i, arena_stats[i].node, arena_stats[i].blocks,
+                 arena_stats[i].refills, arena_stats[i].contention);
+  }
+  free(arena_stats);
+}
+
 /* *****************************************************************************
 
 
@@ -9169,70 +14079,147 @@ FIO_FUNC void fio_malloc_test(void) {
   FIO_ASSERT(mem[0] == 'a', "fio_realloc memory wasn't copied!\n");
   FIO_ASSERT(arena_last_used, "arena_last_used wasn't initialized!\n");
   fio_free(mem);
-  block_s *b = arena_last_used->block;
-
-  /* move arena to block's start */
-  while (arena_last_used->block == b) {
-    mem = fio_malloc(1);
-    FIO_ASSERT(mem, "fio_malloc failed to allocate memory!\n");
-    fio_free(mem);
+  for (size_t i = 1; i <= FIO_MEMORY_MAX_CLASS_UNITS; ++i) {
+    const uint8_t cls = fio_mem_units2class[i];
+    FIO_ASSERT(cls < FIO_MEMORY_SIZE_CLASSES &&
+                   fio_mem_class2units[cls] >= i &&
+                   (!cls || fio_mem_class2units[cls - 1] < i),
+               "size class error for %zu units\n", i);
+    FIO_ASSERT(fio_mem_class2units[cls] - i <= (i >> 2),
+               "size class for %zu units wastes too much memory\n", i);
+  }
+  fprintf(stderr, "* Testing per-thread slice cache.\n");
+  mem = fio_malloc(32);
+  memset(mem, 'a', 32);
+  fio_free(mem);
+  mem2 = fio_malloc(20);
+  FIO_ASSERT(!fio_mem_cache_limit[1] || mem2 == mem,
+             "thread cache didn't recycle the slice!\n");
+  for (size_t i = 0; i < 32; ++i) {
+    FIO_ASSERT(!mem2[i], "cached slice wasn't zeroed out!\n");
+  }
+  mem2[31] = 'z';
+  FIO_ASSERT(fio_realloc(mem2, 30) == mem2,
+             "fio_realloc within the size class should keep the slice!\n");
+  FIO_ASSERT(mem2[31] == 'z', "fio_realloc within size class lost data!\n");
+  fio_free(mem2);
+  {
+    /* count allocations within a block */
+    const size_t expected =
+        FIO_MEMORY_MAX_SLICES_PER_BLOCK - FIO_MEMORY_BLOCK_START_POS;
+    const size_t total = expected * 3;
+    char **ptrs = malloc(sizeof(*ptrs) * total);
+    FIO_ASSERT_ALLOC(ptrs);
+    cache_flush();
+    for (size_t i = 0; i < total; ++i) {
+      ptrs[i] = fio_malloc(1);
+      FIO_ASSERT(ptrs[i], "fio_malloc failed to allocate memory!\n");
+      FIO_ASSERT(!((uintptr_t)ptrs[i] & 15),
+                 "fio_malloc memory not aligned at allocation #%zu!\n", i);
+      FIO_ASSERT((((uintptr_t)ptrs[i] & FIO_MEMORY_BLOCK_MASK) != 16),
+                 "fio_malloc memory indicates system allocation!\n");
+      ptrs[i][0] = 'a';
+    }
+    /* skip the first (partial) block */
+    size_t start = 1;
+    while (((uintptr_t)ptrs[start] ^ (uintptr_t)ptrs[start - 1]) &
+           (~FIO_MEMORY_BLOCK_MASK))
+      ++start;
+    while (!(((uintptr_t)ptrs[start] ^ (uintptr_t)ptrs[start - 1]) &
+             (~FIO_MEMORY_BLOCK_MASK)))
+      ++start;
+    block_s *b = (block_s *)((uintptr_t)ptrs[start] & (~FIO_MEMORY_BLOCK_MASK));
+    size_t count = 0;
+    while (start + count < total &&
+           (block_s *)((uintptr_t)ptrs[start + count] &
+                       (~FIO_MEMORY_BLOCK_MASK)) == b)
+      ++count;
+    fprintf(stderr,
+            "* Performed %zu allocations out of expected %zu allocations per "
+            "block.\n",
+            count, expected);
+    FIO_ASSERT(count == expected, "block size class slicing error!\n");
+    for (size_t i = 0; i < total; ++i)
+      fio_free(ptrs[i]);
+    free(ptrs);
+    cache_flush();
+    size_t found = 0;
+    FIO_LS_EMBD_FOR(&memory.pools[b->node].available, node) {
+      found |= (FIO_LS_EMBD_OBJ(block_node_s, node, node) == (block_node_s *)b);
+    }
+    FIO_ASSERT(found, "memory pool not updated after block being freed!\n");
+  }
+  {
+    /* freed slices in partially used blocks are reused before new blocks */
+    FIO_ASSERT(sizeof(block_node_s) <= FIO_MEMORY_BLOCK_HEADER_SIZE,
+               "memory block header overflow!\n");
+    const size_t size = 4096; /* big enough to bypass the thread's cache */
+    const uint8_t cls = fio_mem_units2class[size >> 4];
+    const size_t per_block =
+        (FIO_MEMORY_MAX_SLICES_PER_BLOCK - FIO_MEMORY_BLOCK_START_POS) /
+        fio_mem_class2units[cls];
+    const size_t total = per_block * 3;
+    char **ptrs = malloc(sizeof(*ptrs) * total);
+    FIO_ASSERT_ALLOC(ptrs);
+    for (size_t i = 0; i < total; ++i) {
+      ptrs[i] = fio_malloc(size);
+      FIO_ASSERT(ptrs[i], "fio_malloc failed to allocate memory!\n");
+      memset(ptrs[i], 'a', size);
+    }
+    /* free every other slice, so every block is partially used */
+    for (size_t i = 0; i < total; i += 2) {
+      fio_free(ptrs[i]);
+      ptrs[i] = NULL;
+    }
+    for (size_t i = 0; i < total; i += 2) {
+      ptrs[i] = fio_malloc(size);
+      FIO_ASSERT(ptrs[i], "fio_malloc failed to allocate memory!\n");
+      for (size_t j = 0; j < size; ++j) {
+        FIO_ASSERT(!ptrs[i][j], "reused slice wasn't zeroed out!\n");
+      }
+      size_t found = 0;
+      for (size_t j = 1; j < total; j += 2) {
+        found |= !(((uintptr_t)ptrs[i] ^ (uintptr_t)ptrs[j]) &
+                   (~FIO_MEMORY_BLOCK_MASK));
+      }
+      FIO_ASSERT(found, "freed slices weren't reused (new block used)!\n");
+    }
+    for (size_t i = 0; i < total; ++i)
+      fio_free(ptrs[i]);
+    free(ptrs);
   }
-  /* make sure a block is assigned */
-  fio_free(fio_malloc(1));
-  b = arena_last_used->block;
-  size_t count = 1;
-  /* count allocations within block */
-  do {
-    FIO_ASSERT(mem, "fio_malloc failed to allocate memory!\n");
-    FIO_ASSERT(!((uintptr_t)mem & 15),
-               "fio_malloc memory not aligned at allocation #%zu!\n", count);
-    FIO_ASSERT((((uintptr_t)mem & FIO_MEMORY_BLOCK_MASK) != 16),
-               "fio_malloc memory indicates system allocation!\n");
-#if __x86_64__
-    fio_memcpy((size_t *)mem, (size_t *)"0123456789abcdefg", 1);
-#else
-    mem[0] = 'a';
-#endif
-    fio_free(mem); /* make sure we hold on to the block, so it rotates */
-    mem = fio_malloc(1);
-    ++count;
-  } while (arena_last_used->block == b);
   {
-    fprintf(stderr, "* Confirm block address: %p, last allocation was %p\n",
-            (void *)arena_last_used->block, (void *)mem);
-    fprintf(
-        stderr,
-        "* Performed %zu allocations out of expected %zu allocations per "
-        "block.\n",
-        count,
-        (size_t)((FIO_MEMORY_BLOCK_SLICES - 2) - (sizeof(block_s) >> 4) - 1));
-    fio_ls_embd_s old_memory_list = memory.available;
+    /* block locks aren't held across a fork */
+    fprintf(stderr, "* Testing block locks and fork.\n");
+    mem = fio_malloc(4096);
+    block_s *b = (block_s *)((uintptr_t)mem & (~FIO_MEMORY_BLOCK_MASK));
+    FIO_ASSERT(!block_trylock(b) && memory.block_locks == 1,
+               "block lock wasn't counted!\n");
+    block_unlock(b);
+    FIO_ASSERT(!memory.block_locks, "block lock count wasn't released!\n");
+    memory.forking = 1;
+    FIO_ASSERT(block_trylock(b) && !memory.block_locks,
+               "block lock shouldn't be taken while forking!\n");
+    memory.forking = 0;
+    pid_t pid = fork();
+    FIO_ASSERT(pid != -1, "fork failed during block lock test!\n");
+    if (!pid) {
+      /* the child releases slices to (and collects from) inherited blocks */
+      char *ptrs[64];
+      fio_free(mem);
+      for (size_t i = 0; i < 64; ++i)
+        ptrs[i] = fio_malloc(4096);
+      for (size_t i = 0; i < 64; ++i)
+        fio_free(ptrs[i]);
+      _exit(memory.block_locks != 0 || memory.forking != 0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    FIO_ASSERT(WIFEXITED(status) && !WEXITSTATUS(status),
+               "forked process allocator error!\n");
     fio_free(mem);
-    FIO_ASSERT(fio_ls_embd_any(&memory.available),
-               "memory pool empty (memory block wasn't freed)!\n");
-    FIO_ASSERT(old_memory_list.next != memory.available.next ||
-                   memory.available.prev != old_memory_list.prev,
-               "memory pool not updated after block being freed!\n");
-  }
-  /* rotate block again */
-  b = arena_last_used->block;
-  mem = fio_realloc(mem, 1);
-  do {
-    mem2 = mem;
-    mem = fio_malloc(1);
-    fio_free(mem2); /* make sure we hold on to the block, so it rotates */
-    FIO_ASSERT(mem, "fio_malloc failed to allocate memory!\n");
-    FIO_ASSERT(!((uintptr_t)mem & 15),
-               "fio_malloc memory not aligned at allocation #%zu!\n", count);
-    FIO_ASSERT((((uintptr_t)mem & FIO_MEMORY_BLOCK_MASK) != 16),
-               "fio_malloc memory indicates system allocation!\n");
-#if __x86_64__
-    fio_memcpy((size_t *)mem, (size_t *)"0123456789abcdefg", 1);
-#else
-    mem[0] = 'a';
-#endif
-    ++count;
-  } while (arena_last_used->block == b);
+  }
+  mem = fio_malloc(1);
 
   mem2 = mem;
   mem = fio_calloc(FIO_MEMORY_BLOCK_ALLOC_LIMIT - 64, 1);
@@ -9270,16 +14257,230 @@ FIO_FUNC void fio_malloc_test(void) {
   }
   {
     size_t pool_size = 0;
-    FIO_LS_EMBD_FOR(&memory.available, node) { ++pool_size; }
+    for (size_t n = 0; n < memory.nodes; ++n) {
+      FIO_LS_EMBD_FOR(&memory.pools[n].available, node) { ++pool_size; }
+    }
     mem = fio_mmap(512);
     FIO_ASSERT(mem, "fio_mmap allocation failed!\n");
     fio_free(mem);
     size_t new_pool_size = 0;
-    FIO_LS_EMBD_FOR(&memory.available, node) { ++new_pool_size; }
+    for (size_t n = 0; n < memory.nodes; ++n) {
+      FIO_LS_EMBD_FOR(&memory.pools[n].available, node) { ++new_pool_size; }
+    }
     FIO_ASSERT(new_pool_size == pool_size,
                "fio_free of fio_mmap went to memory pool!\n");
   }
 
+  {
+    fprintf(stderr, "* Testing big allocation cache and reallocation.\n");
+    const size_t len = FIO_MEMORY_BLOCK_SIZE * 4;
+    char *big = fio_malloc(len);
+    FIO_ASSERT(big && ((uintptr_t)big & FIO_MEMORY_BLOCK_MASK) == 16,
+               "big allocation failed or isn't aligned!\n");
+    memset(big, 'a', len);
+    fio_free(big);
+    char *big2 = fio_malloc(len - 4096);
+    FIO_ASSERT(big2 && ((uintptr_t)big2 & FIO_MEMORY_BLOCK_MASK) == 16,
+               "cached big allocation isn't aligned!\n");
+    if (FIO_MEMORY_BIG_CACHE)
+      FIO_ASSERT(big2 == big, "big allocation cache wasn't used!\n");
+    for (size_t i = 0; i < len - 4096; ++i) {
+      FIO_ASSERT(!big2[i], "cached big allocation wasn't zeroed!\n");
+    }
+    memset(big2, 'b', len - 4096);
+    big2 = fio_realloc(big2, len * 64);
+    FIO_ASSERT(big2 && ((uintptr_t)big2 & FIO_MEMORY_BLOCK_MASK) == 16,
+               "big reallocation failed or isn't aligned!\n");
+    for (size_t i = 0; i < len - 4096; ++i) {
+      FIO_ASSERT(big2[i] == 'b', "big reallocation lost data!\n");
+    }
+    fio_free(big2);
+    FIO_ASSERT(fio_malloc_stats(NULL, 0).big_cached <=
+                   FIO_MEMORY_BIG_CACHE_BYTES,
+               "big allocation cache limit exceeded!\n");
+    big_cache_clear();
+    FIO_ASSERT(!big_cache.count && !big_cache.bytes,
+               "big allocation cache wasn't cleared!\n");
+#if defined(MAP_FIXED_NOREPLACE)
+    /* block in-place growth, forcing `mremap` to move the pages */
+    size_t *sys = sys_alloc(FIO_MEMORY_BLOCK_SIZE, 1);
+    FIO_ASSERT(sys, "sys_alloc failed!\n");
+    void *blocker = mmap((void *)((uintptr_t)sys + FIO_MEMORY_BLOCK_SIZE), 4096,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1,
+                         0);
+    if (blocker == (void *)((uintptr_t)sys + FIO_MEMORY_BLOCK_SIZE)) {
+      for (size_t i = 0; i < (FIO_MEMORY_BLOCK_SIZE / sizeof(size_t)); ++i)
+        sys[i] = i;
+      size_t *moved =
+          sys_realloc(sys, FIO_MEMORY_BLOCK_SIZE, FIO_MEMORY_BLOCK_SIZE * 4);
+      FIO_ASSERT(moved && moved != sys &&
+                     !((uintptr_t)moved & FIO_MEMORY_BLOCK_MASK),
+                 "sys_realloc move failed or isn't aligned!\n");
+      for (size_t i = 0; i < (FIO_MEMORY_BLOCK_SIZE / sizeof(size_t)); ++i) {
+        FIO_ASSERT(moved[i] == i, "sys_realloc move lost data!\n");
+      }
+      sys_free(moved, FIO_MEMORY_BLOCK_SIZE * 4);
+      munmap(blocker, 4096);
+    } else {
+      if (blocker != MAP_FAILED)
+        munmap(blocker, 4096);
+      sys_free(sys, FIO_MEMORY_BLOCK_SIZE);
+    }
+#endif
+    void *huge = sys_alloc_huge(FIO_MEMORY_HUGE_PAGE_SIZE * 2);
+    FIO_ASSERT(huge && !((uintptr_t)huge & FIO_MEMORY_BLOCK_MASK),
+               "sys_alloc_huge failed or isn't aligned!\n");
+    memset(huge, 1, FIO_MEMORY_HUGE_PAGE_SIZE * 2);
+    sys_free(huge, FIO_MEMORY_HUGE_PAGE_SIZE * 2);
+  }
+
+  {
+    fprintf(stderr, "* Testing allocator statistics.\n");
+    void *ptrs[100];
+    fio_malloc_arena_stats_s arena_stats[1];
+    fio_malloc_stats_s s0 = fio_malloc_stats(arena_stats, 1);
+    FIO_ASSERT(s0.arenas == memory.cores && s0.system_allocations &&
+                   s0.blocks_in_use,
+               "fio_malloc_stats returned invalid data!\n");
+    for (size_t i = 0; i < 100; ++i) {
+      ptrs[i] = fio_malloc(100);
+    }
+    mem = fio_malloc(FIO_MEMORY_BLOCK_SIZE);
+    fio_malloc_stats_s s1 = fio_malloc_stats(NULL, 0);
+    FIO_ASSERT(s1.bytes_requested - s0.bytes_requested == 100 * 100 &&
+                   s1.bytes_reserved - s0.bytes_reserved == 100 * 112 &&
+                   s1.bytes_in_use - s0.bytes_in_use == 100 * 112,
+               "fio_malloc_stats didn't count allocations!\n");
+    FIO_ASSERT(s1.big_allocations == s0.big_allocations + 1 &&
+                   s1.big_total == s0.big_total + 1 &&
+                   s1.big_bytes > s0.big_bytes + FIO_MEMORY_BLOCK_SIZE,
+               "fio_malloc_stats didn't count big allocations!\n");
+    for (size_t i = 0; i < 100; ++i) {
+      fio_free(ptrs[i]);
+    }
+    fio_free(mem);
+    s1 = fio_malloc_stats(NULL, 0);
+    FIO_ASSERT(s1.bytes_in_use == s0.bytes_in_use &&
+                   s1.big_allocations == s0.big_allocations &&
+                   s1.big_bytes == s0.big_bytes,
+               "fio_malloc_stats didn't count deallocations!\n");
+  }
+
+#if defined(MADV_DONTNEED) && !FIO_MEMORY_HUGE_PAGES &&                        \
+    FIO_MEMORY_BLOCK_SIZE_LOG > 12
+  /* free blocks aren't decayed when they might be backed by huge pages */
+  {
+    fprintf(stderr, "* Testing idle memory decay.\n");
+    void *ptrs[30];
+    const uint8_t node = fio_mem_numa_node();
+    pool_s *pool = memory.pools + node;
+    for (size_t i = 0; i < 30; ++i) {
+      ptrs[i] = fio_malloc(8192);
+      memset(ptrs[i], 1, 8192);
+    }
+    for (size_t i = 0; i < 30; ++i)
+      fio_free(ptrs[i]);
+    fio_mem_decay_period();
+    /* use (and free) a block during the period */
+    block_free(block_new(node));
+    fio_mem_decay_period();
+    FIO_ASSERT(pool->decay < pool->blocks_free,
+               "decay should ignore blocks used during the period!\n");
+    while (fio_mem_decay_perform())
+      ;
+    block_s *hot = (block_s *)FIO_LS_EMBD_OBJ(block_node_s, node,
+                                              pool->available.prev);
+    FIO_ASSERT(hot->state == BLOCK_FREE,
+               "a recently used block was decayed!\n");
+    FIO_ASSERT(fio_malloc_release() >= FIO_MEMORY_BLOCK_SIZE - 4096 &&
+                   hot->state == BLOCK_DECAYED,
+               "fio_malloc_release didn't release free blocks!\n");
+    FIO_ASSERT(fio_malloc_stats(NULL, 0).blocks_decayed == pool->decayed ||
+                   memory.nodes > 1,
+               "decayed block statistics error!\n");
+#if defined(__linux__) && FIO_MEMORY_BLOCK_SIZE_LOG > 12 &&                  \
+    !FIO_MEMORY_HUGE_PAGES
+    unsigned char resident[FIO_MEMORY_BLOCK_SIZE / 4096];
+    FIO_ASSERT(!mincore((void *)((uintptr_t)hot + 4096),
+                        FIO_MEMORY_BLOCK_SIZE - 4096, resident) &&
+                   !(resident[0] & 1),
+               "decayed block memory is still resident!\n");
+#endif
+    for (size_t i = 0; i < 30; ++i) {
+      ptrs[i] = fio_malloc(8192);
+      for (size_t j = 0; j < 8192; ++j) {
+        FIO_ASSERT(!((char *)ptrs[i])[j], "decayed memory isn't zeroed!\n");
+      }
+    }
+    for (size_t i = 0; i < 30; ++i)
+      fio_free(ptrs[i]);
+    FIO_ASSERT(fio_malloc_decay_get() == FIO_MEMORY_DECAY_SECONDS,
+               "fio_malloc_decay_get error!\n");
+  }
+#endif
+
+  {
+    fprintf(stderr, "* Testing NUMA pools (%zu nodes detected).\n",
+            memory.nodes);
+    FIO_ASSERT(memory.nodes && memory.nodes <= FIO_MEMORY_NUMA_NODES,
+               "NUMA node count error!\n");
+    for (size_t i = 0; i < memory.cores; ++i) {
+      FIO_ASSERT(arenas[i].node < memory.nodes,
+                 "arena %zu is assigned to an invalid NUMA node!\n", i);
+    }
+    FIO_ASSERT(fio_mem_numa_node() < memory.nodes,
+               "fio_mem_numa_node returned an invalid node!\n");
+    mem = fio_malloc(64);
+    FIO_ASSERT(((block_s *)((uintptr_t)mem & (~FIO_MEMORY_BLOCK_MASK)))->node <
+                   memory.nodes,
+               "block is owned by an invalid NUMA node!\n");
+    fio_free(mem);
+    if (memory.cores >= 4) {
+      uint8_t *nodes = malloc(memory.cores);
+      FIO_ASSERT_ALLOC(nodes);
+      for (size_t i = 0; i < memory.cores; ++i)
+        nodes[i] = arenas[i].node;
+      char list[] = "1-2,3\n";
+      fio_mem_numa_cpulist(list, 3);
+      FIO_ASSERT(arenas[0].node == nodes[0] && arenas[1].node == 3 &&
+                     arenas[2].node == 3 && arenas[3].node == 3,
+                 "NUMA sysfs CPU list parsing error!\n");
+      for (size_t i = 0; i < memory.cores; ++i)
+        arenas[i].node = nodes[i];
+      free(nodes);
+    }
+#if FIO_MEMORY_NUMA_AVAILABLE
+    {
+      /* slices owned by another NUMA node are returned to their block */
+      const size_t nodes = memory.nodes;
+      uint8_t *cores = malloc(memory.cores);
+      FIO_ASSERT_ALLOC(cores);
+      mem = fio_malloc(64);
+      block_s *blk = (block_s *)((uintptr_t)mem & (~FIO_MEMORY_BLOCK_MASK));
+      cache_bin_s *bin = cache.bin + fio_mem_units2class[blk->units];
+      const size_t cached = bin->freed_count;
+      for (size_t i = 0; i < memory.cores; ++i) {
+        cores[i] = arenas[i].node;
+        arenas[i].node = (blk->node ? 0 : 1);
+      }
+      memory.nodes = 2;
+      fio_free(mem);
+      FIO_ASSERT(bin->freed_count == cached && bin->freed != mem,
+                 "a remote NUMA node's slice was cached!\n");
+      memory.nodes = nodes;
+      for (size_t i = 0; i < memory.cores; ++i)
+        arenas[i].node = cores[i];
+      free(cores);
+      mem = fio_malloc(64);
+      blk = (block_s *)((uintptr_t)mem & (~FIO_MEMORY_BLOCK_MASK));
+      bin = cache.bin + fio_mem_units2class[blk->units];
+      fio_free(mem);
+      FIO_ASSERT(bin->freed == mem, "a local slice wasn't cached!\n");
+    }
+#endif
+  }
+
   fprintf(stderr, "* passed.\n");
 }
 #endif
@@ -9396,6 +14597,110 @@ FIO_FUNC void fio_timer_test(void) {
   fprintf(stderr, "* passed.\n");
 }
 
+/* *****************************************************************************
+Testing fio_future (futures / promises)
+***************************************************************************** */
+
+FIO_FUNC void *fio_future_test_task(fio_future_s *settled, void *counter) {
+  ++(((size_t *)counter)[0]);
+  return fio_future_result(settled);
+}
+
+FIO_FUNC void fio_future_test(void) {
+  fprintf(stderr, "=== Testing facil.io futures (fio_future)\n");
+  size_t counter = 0;
+  const size_t in_use = fio_future_pool.in_use;
+  fio_future_s *list[3];
+  for (size_t i = 0; i < 3; ++i) {
+    list[i] = fio_future_new();
+    FIO_ASSERT(list[i], "fio_future_new failed!");
+  }
+  fio_future_s *all = fio_future_all(list, 3);
+  fio_future_s *any = fio_future_any(list, 3);
+  fio_future_s *then = fio_future_then(all, fio_future_test_task, &counter);
+  FIO_ASSERT(all && any && then, "future combinator creation failed!");
+  FIO_ASSERT(fio_future_reject(list[0], ECONNREFUSED) == 0,
+             "fio_future_reject failed!");
+  FIO_ASSERT(fio_future_state(any) == FIO_FUTURE_PENDING,
+             "`any` shouldn't settle on the first rejection.");
+  FIO_ASSERT(fio_future_state(all) == FIO_FUTURE_REJECTED &&
+                 fio_future_error(all) == ECONNREFUSED,
+             "`all` should be rejected by any rejection.");
+  FIO_ASSERT(fio_future_fulfill(list[0], NULL) == -1,
+             "futures should only settle once!");
+  fio_future_fulfill(list[2], (void *)&counter);
+  FIO_ASSERT(fio_future_state(any) == FIO_FUTURE_FULFILLED &&
+                 fio_future_result(any) == (void *)&counter,
+             "`any` should be fulfilled by the first fulfilled future.");
+  FIO_ASSERT(counter == 0 && fio_future_state(then) == FIO_FUTURE_PENDING,
+             "`then` continuations should be deferred.");
+  fio_defer_perform();
+  FIO_ASSERT(counter == 1 && fio_future_state(then) == FIO_FUTURE_REJECTED,
+             "`then` continuation error (%zu calls).", counter);
+  fio_future_free(all);
+  fio_future_free(any);
+  fio_future_free(then);
+
+  /* chaining and fulfillment order */
+  fio_future_s *chain = fio_future_then(list[1], fio_future_test_task,
+                                        &counter);
+  fio_future_s *tmp = fio_future_then(chain, fio_future_test_task, &counter);
+  fio_future_free(chain);
+  chain = tmp;
+  fio_future_fulfill(list[1], (void *)list);
+  fio_defer_perform();
+  FIO_ASSERT(counter == 3 && fio_future_result(chain) == (void *)list,
+             "chained `then` continuations error (%zu calls).", counter);
+  fio_future_free(chain);
+
+  /* timeouts */
+  fio_data->active = 1;
+  fio_mark_time();
+  fio_future_s *slow = fio_future_new();
+  fio_future_s *timeout = fio_future_timeout(slow, 100);
+  fio_future_s *early = fio_future_timeout(list[1], 100);
+  FIO_ASSERT(fio_future_state(early) == FIO_FUTURE_FULFILLED,
+             "timeout for a settled future should follow it immediately.");
+  fio_timer_schedule();
+  fio_defer_perform();
+  FIO_ASSERT(fio_future_state(timeout) == FIO_FUTURE_PENDING,
+             "timeout settled too soon.");
+  /* the timer doesn't keep a settled (or discarded) future alive */
+  const size_t timers = fio_future_pool.in_use;
+  fio_future_s *quick = fio_future_new();
+  fio_future_s *guarded = fio_future_timeout(quick, 100);
+  fio_future_fulfill(quick, NULL);
+  fio_future_free(quick);
+  fio_future_free(guarded);
+  fio_future_s *lost = fio_future_new();
+  fio_future_free(fio_future_timeout(lost, 100));
+  fio_future_free(lost);
+  FIO_ASSERT(fio_future_pool.in_use == timers + 2,
+             "timeout timers kept their futures alive (%zu nodes).",
+             fio_future_pool.in_use - timers);
+  fio_data->last_cycle.tv_sec += 1;
+  fio_timer_schedule();
+  fio_defer_perform();
+  FIO_ASSERT(fio_future_state(timeout) == FIO_FUTURE_REJECTED &&
+                 fio_future_error(timeout) == ETIMEDOUT,
+             "timeout didn't reject the future.");
+  fio_future_fulfill(slow, NULL);
+  FIO_ASSERT(fio_future_state(timeout) == FIO_FUTURE_REJECTED,
+             "timed out future should ignore late results.");
+  fio_data->active = 0;
+  fio_timer_clear_all();
+  fio_future_free(slow);
+  fio_future_free(timeout);
+  fio_future_free(early);
+  for (size_t i = 0; i < 3; ++i) {
+    fio_future_free(list[i]);
+  }
+  FIO_ASSERT(fio_future_pool.in_use == in_use,
+             "future objects leaked (%zu != %zu).", fio_future_pool.in_use,
+             in_use);
+  fprintf(stderr, "* passed.\n");
+}
+
 /* *****************************************************************************
 Testing listening socket
 ***************************************************************************** */
@@ -10604,6 +15909,198 @@ FIO_FUNC void fio_uuid_link_test(void) {
   fprintf(stderr, "* passed.\n");
 }
 
+/* *****************************************************************************
+Test connection memory budgets
+***************************************************************************** */
+
+FIO_FUNC void fio_mem_budget_test(void) {
+  fprintf(stderr, "=== Testing connection memory budgets\n");
+  int fds[4];
+  intptr_t uuid[4];
+  const size_t base = fio_mem_charged();
+  FIO_ASSERT(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds) &&
+                 !socketpair(AF_UNIX, SOCK_STREAM, 0, fds + 2),
+             "socketpair failed during memory budget test");
+  for (size_t i = 0; i < 4; ++i) {
+    fio_set_non_block(fds[i]);
+    uuid[i] = fio_fd2uuid(fds[i]);
+  }
+  /* the packet queue is charged until it's sent */
+  fio_write(uuid[0], "hello", 5);
+  FIO_ASSERT(fio_uuid_mem(uuid[0]) == 5, "packet queue wasn't charged (%zu)",
+             fio_uuid_mem(uuid[0]));
+  FIO_ASSERT(fio_mem_charged() == base + 5, "process total not charged");
+  fio_flush_strong(uuid[0]);
+  FIO_ASSERT(!fio_uuid_mem(uuid[0]), "sent packet wasn't released");
+  FIO_ASSERT(fio_mem_charged() == base, "process total not released");
+  /* explicit charges */
+  FIO_ASSERT(fio_uuid_mem_charge(uuid[0], 100) == 100, "charge failed");
+  FIO_ASSERT(fio_uuid_mem_charge(uuid[0], -40) == 60, "release failed");
+  FIO_ASSERT(!fio_uuid_mem_charge(-1, 100) && errno == EBADF,
+             "invalid uuid charged");
+  /* per connection budget */
+  fio_mem_budget_set(64, 0, FIO_MEM_EVICT_LARGEST);
+  fio_uuid_mem_charge(uuid[1], 10);
+  fio_uuid_mem_charge(uuid[0], 10);
+  fio_defer_perform();
+  FIO_ASSERT(!fio_is_valid(uuid[0]), "connection over budget wasn't evicted");
+  FIO_ASSERT(fio_is_valid(uuid[1]), "connection within budget was evicted");
+  FIO_ASSERT(fio_mem_charged() == base + 10, "evicted memory not released");
+  /* process ceiling - largest first */
+  fio_mem_budget_set(0, 500, FIO_MEM_EVICT_LARGEST);
+  fio_uuid_mem_charge(uuid[2], 300);
+  fio_uuid_mem_charge(uuid[3], 200);
+  fio_defer_perform();
+  FIO_ASSERT(!fio_is_valid(uuid[2]), "largest connection wasn't evicted");
+  FIO_ASSERT(fio_is_valid(uuid[1]) && fio_is_valid(uuid[3]),
+             "too many connections evicted");
+  /* process ceiling - idle first */
+  fio_mem_budget_set(0, 350, FIO_MEM_EVICT_IDLE);
+  uuid_data(uuid[1]).active = 1;
+  uuid_data(uuid[3]).active = 2;
+  fio_uuid_mem_charge(uuid[1], 100);
+  fio_uuid_mem_charge(uuid[3], 100);
+  fio_defer_perform();
+  FIO_ASSERT(!fio_is_valid(uuid[1]), "idle connection wasn't evicted");
+  FIO_ASSERT(fio_is_valid(uuid[3]), "active connection was evicted");
+  fio_mem_budget_set(0, 0, FIO_MEM_EVICT_LARGEST);
+  fio_force_close(uuid[3]);
+  fio_defer_perform();
+  FIO_ASSERT(fio_mem_charged() == base, "memory charges leaked (%zu != %zu)",
+             fio_mem_charged(), base);
+  /* process ceiling - a few victims, largest first */
+  FIO_ASSERT(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds) &&
+                 !socketpair(AF_UNIX, SOCK_STREAM, 0, fds + 2),
+             "socketpair failed during memory budget test");
+  for (size_t i = 0; i < 4; ++i) {
+    fio_set_non_block(fds[i]);
+    uuid[i] = fio_fd2uuid(fds[i]);
+    fio_uuid_mem_charge(uuid[i], (ssize_t)(10 * (1 + ((i + 1) & 3))));
+  }
+  fio_mem_budget_set(0, base + 45, FIO_MEM_EVICT_LARGEST);
+  fio_uuid_mem_charge(uuid[0], 1);
+  fio_defer_perform();
+  FIO_ASSERT(!fio_is_valid(uuid[2]) && !fio_is_valid(uuid[1]),
+             "largest connections weren't evicted");
+  FIO_ASSERT(fio_is_valid(uuid[0]) && fio_is_valid(uuid[3]),
+             "too many connections evicted");
+  fio_mem_budget_set(0, 0, FIO_MEM_EVICT_LARGEST);
+  fio_force_close(uuid[0]);
+  fio_force_close(uuid[3]);
+  fio_defer_perform();
+  FIO_ASSERT(fio_mem_charged() == base, "memory charges leaked (%zu != %zu)",
+             fio_mem_charged(), base);
+  fprintf(stderr, "* passed.\n");
+}
+
+/* *****************************************************************************
+Test send queue limits
+***************************************************************************** */
+
+/* writes a droppable message, returning `fio_write2`'s return value. */
+FIO_FUNC ssize_t fio_queue_limit_test_write(intptr_t uuid, char *str,
+                                            uintptr_t key) {
+  return fio_write2(uuid, .data.buffer = str, .length = strlen(str),
+                    .after.dealloc = FIO_DEALLOC_NOOP, .droppable = 1,
+                    .key = key);
+}
+
+/* flushes `uuid` and tests the data received by the peer `fd`. */
+FIO_FUNC void fio_queue_limit_test_expect(intptr_t uuid, int fd,
+                                          const char *expected) {
+  char buf[64];
+  ssize_t len;
+  fio_flush_strong(uuid);
+  len = read(fd, buf, 63);
+  FIO_ASSERT(len == (ssize_t)strlen(expected) && !memcmp(buf, expected, len),
+             "send queue policy error: %.*s != %s", (int)(len > 0 ? len : 0),
+             buf, expected);
+}
+
+FIO_FUNC void fio_queue_limit_test(void) {
+  fprintf(stderr, "=== Testing send queue limits\n");
+  int fds[2];
+  FIO_ASSERT(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds),
+             "socketpair failed during send queue test");
+  fio_set_non_block(fds[0]);
+  intptr_t uuid = fio_fd2uuid(fds[0]);
+  /* drop newest */
+  fio_queue_limit_set(uuid, 0, 2, FIO_QUEUE_DROP_NEWEST);
+  FIO_ASSERT(!fio_queue_limit_test_write(uuid, "1", 0) &&
+                 !fio_queue_limit_test_write(uuid, "2", 0),
+             "packets under the limit were dropped");
+  FIO_ASSERT(fio_queue_limit_test_write(uuid, "3", 0) == -1 &&
+                 errno == ENOBUFS,
+             "newest packet wasn't dropped");
+  fio_write2(uuid, .data.buffer = "4", .length = 1,
+             .after.dealloc = FIO_DEALLOC_NOOP);
+  FIO_ASSERT(fio_pending(uuid) == 3, "non-droppable packet wasn't queued");
+  fio_queue_limit_test_expect(uuid, fds[1], "124");
+  FIO_ASSERT(!fio_pending(uuid), "queue count error after flush");
+  /* drop oldest */
+  fio_queue_limit_set(uuid, 8, 0, FIO_QUEUE_DROP_OLDEST);
+  fio_queue_limit_test_write(uuid, "aaaa", 0);
+  fio_queue_limit_test_write(uuid, "bbbb", 0);
+  fio_queue_limit_test_write(uuid, "cccc", 0);
+  FIO_ASSERT(uuid_data(uuid).packet_bytes == 8, "queued bytes error (%zu)",
+             uuid_data(uuid).packet_bytes);
+  fio_queue_limit_test_expect(uuid, fds[1], "bbbbcccc");
+  FIO_ASSERT(!uuid_data(uuid).packet_bytes, "queued bytes not released");
+  /* keep latest (per key) */
+  fio_queue_limit_set(uuid, 0, 2, FIO_QUEUE_KEEP_LATEST);
+  fio_queue_limit_test_write(uuid, "a1", 1);
+  fio_queue_limit_test_write(uuid, "b1", 2);
+  fio_queue_limit_test_write(uuid, "a2", 1);
+  FIO_ASSERT(fio_queue_limit_test_write(uuid, "c1", 3) == -1,
+             "keep latest should drop a new key when the queue is full");
+  fio_queue_limit_test_expect(uuid, fds[1], "b1a2");
+  /* disconnect */
+  fio_queue_limit_set(uuid, 0, 1, FIO_QUEUE_DISCONNECT);
+  fio_queue_limit_test_write(uuid, "x", 0);
+  fio_queue_limit_test_write(uuid, "y", 0);
+  fio_defer_perform();
+  FIO_ASSERT(!fio_is_valid(uuid), "connection over limit wasn't closed");
+  FIO_ASSERT(fio_queue_limit_set(uuid, 0, 0, FIO_QUEUE_DISCONNECT) == -1,
+             "queue limit set for invalid uuid");
+  close(fds[1]);
+  fprintf(stderr, "* passed.\n");
+}
+
+/* *****************************************************************************
+Test lazy connection data initialization
+***************************************************************************** */
+
+FIO_FUNC void fio_fd_commit_test(void) {
+  fprintf(stderr, "=== Testing lazy connection data initialization\n");
+  const uintptr_t chunk = (uintptr_t)1 << FIO_FD_CHUNK_LOG;
+  FIO_ASSERT(fio_data->committed_end <= fio_data->capa,
+             "committed fd range exceeds capacity!");
+  if (fio_data->capa < chunk * 4) {
+    fprintf(stderr, "* skipped (fd capacity too small).\n");
+    return;
+  }
+  const uintptr_t fd = fio_data->capa - 1;
+  FIO_ASSERT(fio_is_valid(fd2uuid(fd)) == !!fd_is_committed(fd),
+             "uncommitted connection data considered valid!");
+  if (!fd_is_committed(fd)) {
+    FIO_ASSERT(!fd_data(fd).rw_hooks && !fd_data(fd).counter,
+               "uncommitted connection data was initialized!");
+  }
+  FIO_ASSERT(fio_fd2uuid(fd) != -1, "fio_fd2uuid failed for a high fd!");
+  FIO_ASSERT(fd_is_committed(fd) && fd_is_committed(fd - (fd & (chunk - 1))),
+             "connection data chunk wasn't committed!");
+  FIO_ASSERT(fd_data(fd).rw_hooks == &FIO_DEFAULT_RW_HOOKS &&
+                 fd_data(fd).packet_last == &fd_data(fd).packet &&
+                 fd_data(fd - 1).rw_hooks == &FIO_DEFAULT_RW_HOOKS &&
+                 fd_data(fd).open,
+             "committed connection data wasn't initialized!");
+  FIO_ASSERT(fio_is_valid(fd2uuid(fd)), "committed fd should be valid!");
+  fio_clear_fd(fd, 0);
+  FIO_ASSERT(fio_data->committed_end == fio_data->capa,
+             "committed fd range error!");
+  fprintf(stderr, "* passed.\n");
+}
+
 /* *****************************************************************************
 Byte Order Testing
 ***************************************************************************** */
@@ -10649,6 +16146,43 @@ FIO_FUNC void fio_pubsub_test_on_unsubscribe(void *udata1, void *udata2) {
   (void)udata2;
 }
 
+FIO_FUNC void fio_pubsub_test_on_message_last(fio_msg_s *msg) {
+  fio_atomic_add((uintptr_t *)msg->udata1, 1);
+  *(char *)msg->udata2 = msg->msg.len ? msg->msg.data[0] : 0;
+}
+
+FIO_FUNC void fio_pubsub_test_on_message_ordered(fio_msg_s *msg) {
+  uintptr_t *count = msg->udata1;
+  char *tmp = msg->msg.data;
+  if ((uintptr_t)fio_atol(&tmp) != *count)
+    *(uint8_t *)msg->udata2 = 1;
+  ++*count;
+}
+
+typedef struct {
+  fio_pubsub_stats_s stats;
+  size_t channels;
+  uint8_t finished;
+} fio_pubsub_test_stats_s;
+
+FIO_FUNC void fio_pubsub_test_on_stats(fio_pubsub_stats_s *st, void *udata) {
+  fio_pubsub_test_stats_s *t = udata;
+  ++t->channels;
+  if (!st->is_pattern && st->channel.len == 5 &&
+      !memcmp(st->channel.data, "stats", 5))
+    t->stats = *st;
+}
+
+FIO_FUNC void fio_pubsub_test_on_stats_finish(void *udata) {
+  ((fio_pubsub_test_stats_s *)udata)->finished = 1;
+}
+
+FIO_FUNC int fio_pubsub_test_match(fio_str_info_s pattern,
+                                   fio_str_info_s channel) {
+  return channel.len == 3;
+  (void)pattern;
+}
+
 FIO_FUNC void fio_pubsub_test(void) {
   fprintf(stderr, "=== Testing pub/sub (partial)\n");
   fio_data->active = 1;
@@ -10698,6 +16232,412 @@ FIO_FUNC void fio_pubsub_test(void) {
   ++expect;
   fio_defer_perform();
   FIO_ASSERT(counter == expect, "unsubscribe wasn't called for named channel!");
+  {
+    /* conflating subscriptions (the newest message per channel) */
+    uintptr_t conflated = 0;
+    char last = 0;
+    subscription_s *c1 = fio_subscribe(
+        .channel = {0, 4, "conf"}, .udata1 = &conflated, .udata2 = &last,
+        .on_message = fio_pubsub_test_on_message_last, .conflate = 1);
+    FIO_ASSERT(c1, "fio_subscribe FAILED on conflating subscription.");
+    fio_publish(.channel = {0, 4, "conf"}, .message = {0, 1, "1"});
+    fio_publish(.channel = {0, 4, "conf"}, .message = {0, 1, "2"});
+    fio_publish(.channel = {0, 4, "conf"}, .message = {0, 1, "3"});
+    fio_defer_perform();
+    FIO_ASSERT(conflated == 1 && last == '3',
+               "conflating subscription should receive only the newest "
+               "message (%zu messages, last %c)",
+               (size_t)conflated, last);
+    fio_unsubscribe(c1);
+    c1 = fio_subscribe(.channel = {0, 4, "cf.*"}, .match = FIO_MATCH_GLOB,
+                       .udata1 = &conflated, .udata2 = &last,
+                       .on_message = fio_pubsub_test_on_message_last,
+                       .conflate = 1);
+    FIO_ASSERT(c1, "fio_subscribe FAILED on conflating pattern subscription.");
+    fio_publish(.channel = {0, 4, "cf.a"}, .message = {0, 1, "a"});
+    fio_publish(.channel = {0, 4, "cf.b"}, .message = {0, 1, "b"});
+    fio_publish(.channel = {0, 4, "cf.a"}, .message = {0, 1, "c"});
+    fio_defer_perform();
+    FIO_ASSERT(conflated == 3,
+               "conflating pattern subscriptions should keep a message per "
+               "channel (%zu messages)",
+               (size_t)conflated);
+    fio_unsubscribe(c1);
+    fio_defer_perform();
+  }
+  {
+    /* channel history and replay */
+    uintptr_t replayed = 0;
+    char last = 0;
+    char data[2] = {0};
+    fio_pubsub_history_set((fio_str_info_s){.data = "hist", .len = 4}, 3, 0);
+    for (char i = '1'; i <= '5'; ++i) {
+      data[0] = i;
+      fio_publish(.channel = {0, 4, "hist"}, .message = {0, 1, data});
+    }
+    fio_defer_perform();
+    subscription_s *h1 = fio_subscribe(
+        .channel = {0, 4, "hist"}, .udata1 = &replayed, .udata2 = &last,
+        .on_message = fio_pubsub_test_on_message_last, .replay_since = 1);
+    FIO_ASSERT(h1, "fio_subscribe FAILED on replaying subscription.");
+    fio_defer_perform();
+    FIO_ASSERT(replayed == 3 && last == '5',
+               "history replay error (%zu messages, last %c)",
+               (size_t)replayed, last);
+    /* a message published before subscribing, but not yet delivered */
+    fio_publish(.channel = {0, 4, "hist"}, .message = {0, 1, "6"});
+    subscription_s *h2 = fio_subscribe(
+        .channel = {0, 4, "hist"}, .udata1 = &replayed, .udata2 = &last,
+        .on_message = fio_pubsub_test_on_message_last, .replay_since = 6);
+    FIO_ASSERT(h2, "fio_subscribe FAILED on replaying subscription.");
+    fio_defer_perform();
+    FIO_ASSERT(replayed == 5 && last == '6',
+               "history replay should deliver messages exactly once (%zu)",
+               (size_t)replayed);
+    fio_unsubscribe(h1);
+    fio_unsubscribe(h2);
+    fio_pubsub_history_set((fio_str_info_s){.data = "hist", .len = 4}, 0, 5);
+    fio_lock(&fio_history.lock);
+    FIO_ASSERT(fio_history_set_count(&fio_history.set) == 1, "history lost");
+    fio_history_s *h = fio_history_set_last(&fio_history.set);
+    FIO_ASSERT(fio_msg_ary_count(&h->msgs) == 1, "history byte limit ignored");
+    fio_unlock(&fio_history.lock);
+    fio_pubsub_history_set((fio_str_info_s){.data = "hist", .len = 4}, 0, 0);
+    FIO_ASSERT(!fio_history_set_count(&fio_history.set),
+               "history should be removed when both limits are 0");
+    fio_defer_perform();
+  }
+  {
+    /* fan-out in slices (FIO_PUBSUB_CHUNK) */
+    const size_t subscribers = (FIO_PUBSUB_CHUNK * 2) + 1;
+    subscription_s **subs = fio_malloc(sizeof(*subs) * subscribers);
+    FIO_ASSERT_ALLOC(subs);
+    for (size_t i = 0; i < subscribers; ++i) {
+      subs[i] = fio_subscribe(.channel = {0, 6, "fanout"}, .udata1 = &counter,
+                              .on_message = fio_pubsub_test_on_message);
+      FIO_ASSERT(subs[i], "fio_subscribe FAILED on fan-out subscription.");
+    }
+    fio_publish(.channel = {0, 6, "fanout"});
+    fio_publish(.channel = {0, 6, "fanout"});
+    expect += subscribers * 2;
+    fio_defer_perform();
+    FIO_ASSERT(counter == expect, "fan-out delivery error (%zu != %zu)",
+               (size_t)counter, (size_t)expect);
+    for (size_t i = 0; i < subscribers; ++i) {
+      fio_unsubscribe(subs[i]);
+    }
+    fio_free(subs);
+    fio_defer_perform();
+  }
+  {
+    /* pattern index */
+    struct {
+      char *pattern;
+      fio_match_fn match;
+      uintptr_t counter;
+    } p[] = {
+        {"user.*.events", FIO_MATCH_GLOB, 0}, {"user.42.*", FIO_MATCH_GLOB, 0},
+        {"*", FIO_MATCH_GLOB, 0},             {"[ab]x*", FIO_MATCH_GLOB, 0},
+        {"", fio_pubsub_test_match, 0},
+    };
+    const size_t count = sizeof(p) / sizeof(p[0]);
+    subscription_s *ps[sizeof(p) / sizeof(p[0])];
+    for (size_t i = 0; i < count; ++i) {
+      ps[i] = fio_subscribe(.channel = {0, strlen(p[i].pattern), p[i].pattern},
+                            .match = p[i].match, .udata1 = &p[i].counter,
+                            .on_message = fio_pubsub_test_on_message);
+      FIO_ASSERT(ps[i], "fio_subscribe FAILED on pattern subscription.");
+    }
+    FIO_ASSERT(fio_pattern_set_count(&fio_pattern_index.buckets) == 3 &&
+                   fio_pattern_shape_ary_count(&fio_pattern_index.shapes) == 3,
+               "pattern index bucket / shape count error");
+    char *channels[] = {"user.42.events", "user.7.events", "ax.events", "abc",
+                        "user.events"};
+    uintptr_t expected[][sizeof(p) / sizeof(p[0])] = {
+        {1, 1, 1, 0, 0}, {2, 1, 2, 0, 0}, {2, 1, 3, 1, 0},
+        {2, 1, 4, 1, 1}, {2, 1, 5, 1, 1},
+    };
+    for (size_t i = 0; i < sizeof(channels) / sizeof(channels[0]); ++i) {
+      fio_publish(.channel = {0, strlen(channels[i]), channels[i]});
+      fio_defer_perform();
+      for (size_t j = 0; j < count; ++j) {
+        FIO_ASSERT(p[j].counter == expected[i][j],
+                   "pattern %s match error for %s (%zu != %zu)", p[j].pattern,
+                   channels[i], (size_t)p[j].counter, (size_t)expected[i][j]);
+      }
+    }
+    for (size_t i = 0; i < count; ++i) {
+      fio_unsubscribe(ps[i]);
+    }
+    fio_defer_perform();
+    FIO_ASSERT(!fio_pattern_set_count(&fio_pattern_index.buckets) &&
+                   !fio_pattern_shape_ary_count(&fio_pattern_index.shapes),
+               "pattern index should be empty once unsubscribed");
+  }
+  {
+    /* sharded collections */
+    subscription_s *subs[64];
+    char name[16] = "shard.";
+    size_t used = 0;
+    counter = expect = 0;
+    for (size_t i = 0; i < 32; ++i) {
+      size_t len = 6 + fio_ltoa(name + 6, (int64_t)i, 10);
+      subs[i] = fio_subscribe(.channel = {0, len, name}, .udata1 = &counter,
+                              .on_message = fio_pubsub_test_on_message);
+      subs[i + 32] =
+          fio_subscribe(.filter = (int32_t)(i + 1), .udata1 = &counter,
+                        .on_message = fio_pubsub_test_on_message);
+      FIO_ASSERT(subs[i] && subs[i + 32],
+                 "fio_subscribe FAILED on sharded subscription.");
+    }
+    for (size_t i = 0; i < FIO_PUBSUB_SHARDS; ++i) {
+      used += !!fio_ch_set_count(&fio_postoffice.pubsub.shards[i].channels);
+    }
+    FIO_ASSERT(FIO_PUBSUB_SHARDS == 1 || used > 1,
+               "channels should be spread across shards (%zu of %zu)", used,
+               (size_t)FIO_PUBSUB_SHARDS);
+    for (size_t i = 0; i < 32; ++i) {
+      size_t len = 6 + fio_ltoa(name + 6, (int64_t)i, 10);
+      fio_publish(.channel = {0, len, name});
+      fio_publish(.filter = (int32_t)(i + 1));
+    }
+    expect = 64;
+    fio_defer_perform();
+    FIO_ASSERT(counter == expect, "sharded delivery error (%zu != %zu)",
+               (size_t)counter, (size_t)expect);
+    for (size_t i = 0; i < 64; ++i) {
+      fio_unsubscribe(subs[i]);
+    }
+    fio_defer_perform();
+    for (size_t i = 0; i < FIO_PUBSUB_SHARDS; ++i) {
+      FIO_ASSERT(
+          !fio_ch_set_count(&fio_postoffice.pubsub.shards[i].channels) &&
+              !fio_ch_set_count(&fio_postoffice.filters.shards[i].channels),
+          "channels should be removed from their shard once unsubscribed");
+    }
+  }
+  {
+    /* directly indexed filters (and the filters just outside the table) */
+    const int32_t filters[] = {
+        -1,
+        FIO_PUBSUB_FILTER_MIN,
+        FIO_PUBSUB_FILTER_MIN - 1,
+        FIO_PUBSUB_FILTER_MIN + FIO_PUBSUB_FILTER_DIRECT - 1,
+        FIO_PUBSUB_FILTER_MIN + FIO_PUBSUB_FILTER_DIRECT,
+    };
+    const size_t count = sizeof(filters) / sizeof(filters[0]);
+    subscription_s *subs[sizeof(filters) / sizeof(filters[0])];
+    counter = expect = 0;
+    for (size_t i = 0; i < count; ++i) {
+      if (!filters[i]) {
+        subs[i] = NULL;
+        continue;
+      }
+      subs[i] = fio_subscribe(.filter = filters[i], .udata1 = &counter,
+                              .on_message = fio_pubsub_test_on_message);
+      FIO_ASSERT(subs[i], "fio_subscribe FAILED for filter %d.",
+                 (int)filters[i]);
+      channel_s **slot = fio_filter_slot((uint32_t)filters[i]);
+      FIO_ASSERT(!slot || (*slot && *slot == subs[i]->parent),
+                 "filter %d should be in the direct lookup table",
+                 (int)filters[i]);
+      ++expect;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      if (filters[i])
+        fio_publish(.filter = filters[i]);
+    }
+    fio_publish(.filter = FIO_PUBSUB_FILTER_MIN + 1); /* no subscribers */
+    fio_defer_perform();
+    FIO_ASSERT(counter == expect, "direct filter delivery error (%zu != %zu)",
+               (size_t)counter, (size_t)expect);
+    for (size_t i = 0; i < count; ++i) {
+      fio_unsubscribe(subs[i]);
+      channel_s **slot = fio_filter_slot((uint32_t)filters[i]);
+      FIO_ASSERT(!slot || !*slot,
+                 "filter %d should be removed from the lookup table",
+                 (int)filters[i]);
+    }
+    fio_defer_perform();
+  }
+  {
+    /* a busy subscription queues messages in its mailbox (no re-deferral) */
+    const size_t total = (FIO_PUBSUB_MAILBOX_BATCH * 2) + 1;
+    uint8_t disordered = 0;
+    char num[32];
+    counter = 0;
+    s = fio_subscribe(.channel = {0, 4, "mbox"}, .udata1 = &counter,
+                      .udata2 = &disordered,
+                      .on_message = fio_pubsub_test_on_message_ordered);
+    FIO_ASSERT(s && s->mailbox, "subscriptions should have a mailbox");
+    /* pretend another thread is performing the subscription's callback */
+    fio_atomic_add(&s->ref, 1);
+    s->mailbox->draining = 1;
+    for (size_t i = 0; i < total; ++i) {
+      fio_publish(.channel = {0, 4, "mbox"},
+                  .message = {0, fio_ltoa(num, i, 10), num});
+    }
+    fio_defer_perform();
+    FIO_ASSERT(!counter && fio_msg_ary_count(&s->mailbox->pending) == total,
+               "a busy subscription should queue its messages (%zu/%zu)",
+               fio_msg_ary_count(&s->mailbox->pending), total);
+    /* the "other thread" is done, so it performs the queued messages */
+    fio_perform_subscription_mailbox(s, NULL);
+    FIO_ASSERT(counter == FIO_PUBSUB_MAILBOX_BATCH,
+               "mailbox draining should yield after a batch (%zu)",
+               (size_t)counter);
+    fio_defer_perform();
+    FIO_ASSERT(counter == total && !disordered && !s->mailbox->draining,
+               "mailbox messages should be performed in order (%zu/%zu)",
+               (size_t)counter, total);
+    fio_unsubscribe(s);
+    fio_defer_perform();
+  }
+  {
+    /* forking resets busy subscriptions, tasks scheduled earlier are void */
+    subscription_s *c;
+    counter = 0;
+    s = fio_subscribe(.channel = {0, 4, "fork"}, .udata1 = &counter,
+                      .on_message = fio_pubsub_test_on_message);
+    c = fio_subscribe(.channel = {0, 4, "fork"}, .udata1 = &counter,
+                      .on_message = fio_pubsub_test_on_message, .conflate = 1);
+    fio_msg_internal_s *m = fio_pubsub_create_message(
+        0, (fio_str_info_s){0, 4, "fork"}, (fio_str_info_s){0, 4, "data"}, 0,
+        1);
+    /* a thread is draining the mailbox and a drain task is scheduled */
+    fio_atomic_add(&s->ref, 3);
+    s->mailbox->draining = 1;
+#if FIO_PUBSUB_STATS
+    fio_atomic_add(&s->pending, 1);
+#endif
+    fio_subscription_deliver(s, fio_msg_internal_dup(m));
+    fio_defer_push_task(fio_perform_subscription_mailbox, s,
+                        (void *)(uintptr_t)s->mailbox->epoch);
+    fio_subscription_conflate(c, m);
+    fio_msg_internal_free(m);
+    FIO_ASSERT(fio_msg_ary_count(&s->mailbox->pending) == 1 &&
+                   c->conflate->scheduled,
+               "messages should be pending before the fork");
+    fio_collection_on_fork(&fio_postoffice.pubsub);
+    FIO_ASSERT(!s->mailbox->draining &&
+                   !fio_msg_ary_count(&s->mailbox->pending) &&
+                   !c->conflate->scheduled &&
+                   !fio_msg_ary_count(&c->conflate->pending),
+               "forking should reset the subscriptions' delivery state");
+    fio_defer_perform();
+    FIO_ASSERT(!counter, "tasks scheduled before forking should be void (%zu)",
+               (size_t)counter);
+    fio_publish(.channel = {0, 4, "fork"}, .message = {0, 4, "data"});
+    fio_defer_perform();
+    FIO_ASSERT(counter == 2, "subscriptions should deliver after forking (%zu)",
+               (size_t)counter);
+    /* the draining thread didn't survive the fork */
+    fio_subscription_free(s);
+    fio_unsubscribe(s);
+    fio_unsubscribe(c);
+    fio_defer_perform();
+  }
+  {
+    /* statistics */
+    fio_pubsub_test_stats_s t = {.channels = 0};
+    counter = 0;
+    subscription_s *sub1 =
+        fio_subscribe(.channel = {0, 5, "stats"}, .udata1 = &counter,
+                      .on_message = fio_pubsub_test_on_message);
+    subscription_s *sub2 =
+        fio_subscribe(.channel = {0, 5, "stats"}, .udata1 = &counter,
+                      .on_message = fio_pubsub_test_on_message);
+    subscription_s *sub3 =
+        fio_subscribe(.filter = 7, .udata1 = &counter,
+                      .on_message = fio_pubsub_test_on_message);
+    for (size_t i = 0; i < 3; ++i)
+      fio_publish(.channel = {0, 5, "stats"}, .message = {0, 4, "data"});
+    fio_defer_perform();
+    FIO_ASSERT(fio_pubsub_stats(fio_pubsub_test_on_stats, &t) == 2 &&
+                   t.channels == 2,
+               "fio_pubsub_stats should report two channels (%zu)", t.channels);
+    FIO_ASSERT(t.stats.subscribers == 2, "stats subscriber count error");
+    fio_pubsub_stats_s st;
+#if FIO_PUBSUB_STATS
+    FIO_ASSERT(t.stats.messages == 3 && t.stats.bytes == 12,
+               "stats message count error (%zu messages, %zu bytes)",
+               (size_t)t.stats.messages, (size_t)t.stats.bytes);
+    FIO_ASSERT(t.stats.delivered == 6 && !t.stats.pending,
+               "stats delivery count error (%zu delivered, %zu pending)",
+               (size_t)t.stats.delivered, (size_t)t.stats.pending);
+    FIO_ASSERT(t.stats.latency_total >= t.stats.latency_max,
+               "stats latency error");
+    /* a busy subscription's messages are pending */
+    fio_atomic_add(&sub1->ref, 1);
+    sub1->mailbox->draining = 1;
+    fio_publish(.channel = {0, 5, "stats"}, .message = {0, 4, "data"});
+    fio_defer_perform();
+    st = fio_subscription_stats(sub1);
+    FIO_ASSERT(st.subscribers == 1 && st.pending == 1 && st.delivered == 3 &&
+                   st.messages == 4 && st.channel.len == 5,
+               "fio_subscription_stats error (%zu pending, %zu delivered)",
+               (size_t)st.pending, (size_t)st.delivered);
+    fio_perform_subscription_mailbox(sub1, NULL);
+    fio_defer_perform();
+    st = fio_subscription_stats(sub1);
+    FIO_ASSERT(!st.pending && st.delivered == 4,
+               "fio_subscription_stats pending error");
+#else
+    FIO_ASSERT(!t.stats.messages && !t.stats.bytes && !t.stats.delivered &&
+                   !t.stats.pending && !t.stats.latency_max,
+               "statistics should be zero without FIO_PUBSUB_STATS");
+#endif
+    st = fio_subscription_stats(sub3);
+    FIO_ASSERT(st.filter == 7 && !st.channel.len && st.subscribers == 1,
+               "fio_subscription_stats filter error");
+    {
+      /* serialized statistics are merged with existing statistics */
+      fio_stats_hash_s h = FIO_SET_INIT;
+      fio_str_s *data = fio_str_new2();
+      fio_pubsub_stats_collect(&h);
+      fio_stats_hash_serialize(&h, data);
+      fio_stats_hash_deserialize(&h, fio_str_info(data));
+      fio_str_free2(data);
+      t = (fio_pubsub_test_stats_s){.channels = 0};
+      FIO_ASSERT(fio_stats_hash_report(&h, fio_pubsub_test_on_stats, &t) == 2,
+                 "statistics merge should keep channels unique");
+      FIO_ASSERT(t.stats.subscribers == 4,
+                 "statistics merge error (%zu subscribers)",
+                 (size_t)t.stats.subscribers);
+      fio_stats_hash_free(&h);
+    }
+    /* without a cluster, the calling process is reported */
+    t = (fio_pubsub_test_stats_s){.channels = 0};
+    fio_pubsub_stats_cluster(fio_pubsub_test_on_stats,
+                             fio_pubsub_test_on_stats_finish, &t);
+    fio_defer_perform();
+    FIO_ASSERT(t.finished && t.channels == 2 && t.stats.subscribers == 2,
+               "fio_pubsub_stats_cluster error");
+    {
+      /* collections waiting for replies are finished when the server stops */
+      fio_stats_request_s *r = fio_stats_request_new(
+          fio_pubsub_test_on_stats, fio_pubsub_test_on_stats_finish, &t);
+      fio_stats_request_s *w = fio_stats_request_new(NULL, NULL, NULL);
+      w->requester = 1;
+      fio_pubsub_stats_collect(&r->stats);
+      r->expected = w->expected = 1;
+      fio_lock(&fio_stats_requests.lock);
+      fio_ls_push(&fio_stats_requests.requests, r);
+      fio_ls_push(&fio_stats_requests.requests, w);
+      fio_unlock(&fio_stats_requests.lock);
+      t = (fio_pubsub_test_stats_s){.channels = 0};
+      fio_stats_request_finish_all(NULL);
+      FIO_ASSERT(t.finished && t.channels == 2 &&
+                     fio_ls_is_empty(&fio_stats_requests.requests),
+                 "pending statistics collections should be finished");
+    }
+    fio_unsubscribe(sub1);
+    fio_unsubscribe(sub2);
+    fio_unsubscribe(sub3);
+    fio_defer_perform();
+    FIO_ASSERT(!fio_pubsub_stats(NULL, NULL),
+               "fio_pubsub_stats should report no channels");
+  }
   fio_data->is_worker = 0;
   fio_data->active = 0;
   fio_data->workers = 0;
@@ -10706,8 +16646,218 @@ FIO_FUNC void fio_pubsub_test(void) {
   (void)fio_pubsub_test_on_unsubscribe;
   fprintf(stderr, "* passed.\n");
 }
+
+/* *****************************************************************************
+Cluster shared memory ring tests
+***************************************************************************** */
+
+FIO_FUNC void fio_cluster_ring_test(void) {
+  fprintf(stderr, "=== Testing cluster shared memory rings\n");
+  fio_cluster_ring_s *r = fio_mmap(sizeof(*r) + FIO_CLUSTER_RING_SIZE);
+  FIO_ASSERT_ALLOC(r);
+  r->size = FIO_CLUSTER_RING_SIZE;
+  r->buffer = (uint8_t *)(r + 1);
+  FIO_ASSERT(!fio_cluster_bell_open(r->fd), "doorbell creation failed");
+  fio_str_info_s rec;
+  char data[1000];
+  size_t pushed = 0, popped = 0;
+  FIO_ASSERT(!fio_cluster_ring_peek(r, &rec), "new ring should be empty");
+  FIO_ASSERT(!fio_cluster_ring_push(r, FIO_CLUSTER_RING_FRAME, "hello", 5),
+             "ring push failed");
+  FIO_ASSERT(read(r->fd[0], data, 8) > 0,
+             "doorbell wasn't signaled when the ring was empty");
+  FIO_ASSERT(!fio_cluster_ring_push(r, FIO_CLUSTER_RING_FRAME, "world", 5),
+             "ring push failed");
+  FIO_ASSERT(read(r->fd[0], data, 8) <= 0,
+             "doorbell shouldn't be signaled when the ring wasn't empty");
+  FIO_ASSERT(fio_cluster_ring_peek(r, &rec) == FIO_CLUSTER_RING_FRAME &&
+                 rec.len == 5 && !memcmp(rec.data, "hello", 5),
+             "ring peek error");
+  fio_cluster_ring_consume(r, rec);
+  FIO_ASSERT(fio_cluster_ring_peek(r, &rec) == FIO_CLUSTER_RING_FRAME &&
+                 rec.len == 5 && !memcmp(rec.data, "world", 5),
+             "ring peek error (second record)");
+  fio_cluster_ring_consume(r, rec);
+  FIO_ASSERT(!fio_cluster_ring_peek(r, &rec), "ring should be empty");
+  /* fill the ring, the switch record must always fit */
+  for (size_t round = 0; round < 3; ++round) {
+    for (;;) {
+      memset(data, (int)(pushed & 127), sizeof(data));
+      if (fio_cluster_ring_push(r, FIO_CLUSTER_RING_FRAME, data,
+                                (uint32_t)(sizeof(data) - (pushed & 7))))
+        break;
+      ++pushed;
+    }
+    FIO_ASSERT(pushed, "ring push failed on an empty ring");
+    FIO_ASSERT(!fio_cluster_ring_fits(r, sizeof(data) - (pushed & 7)),
+               "ring fit test should fail for a rejected record");
+    FIO_ASSERT(!fio_cluster_ring_push(r, FIO_CLUSTER_RING_SWITCH, NULL, 0),
+               "switch record didn't fit in a full ring");
+    uint32_t kind;
+    while ((kind = fio_cluster_ring_peek(r, &rec)) == FIO_CLUSTER_RING_FRAME) {
+      FIO_ASSERT(rec.len == sizeof(data) - (popped & 7) &&
+                     rec.data[0] == (char)(popped & 127) &&
+                     rec.data[rec.len - 1] == (char)(popped & 127),
+                 "ring record %zu corrupted", popped);
+      fio_cluster_ring_consume(r, rec);
+      ++popped;
+    }
+    FIO_ASSERT(kind == FIO_CLUSTER_RING_SWITCH,
+               "switch record missing (%u) after %zu records", kind, popped);
+    fio_cluster_ring_consume(r, rec);
+    FIO_ASSERT(popped == pushed, "ring lost records (%zu != %zu)", popped,
+               pushed);
+    FIO_ASSERT(!fio_cluster_ring_peek(r, &rec), "ring should be empty");
+  }
+  FIO_ASSERT(r->tail > FIO_CLUSTER_RING_SIZE, "ring test didn't wrap");
+  FIO_ASSERT(fio_cluster_ring_fits(r, sizeof(data)),
+             "ring fit test failed for an empty ring");
+  fio_cluster_bell_close(r->fd);
+  fio_free(r);
+  /* registry bits */
+  volatile uint64_t word = 0;
+  fio_cluster_mesh_flag(&word, 4, 1);
+  fio_cluster_mesh_flag(&word, 4, 1);
+  fio_cluster_mesh_flag(&word, FIO_CLUSTER_MESH_ROOT, 1);
+  FIO_ASSERT(word == (FIO_CLUSTER_MESH_ROOT | 4), "registry bit set error");
+  fio_cluster_mesh_flag(&word, 4, 0);
+  fio_cluster_mesh_flag(&word, 4, 0);
+  FIO_ASSERT(word == FIO_CLUSTER_MESH_ROOT, "registry bit clear error");
+  volatile uint32_t bit_count = 2;
+  fio_cluster_mesh_sync(&word, &bit_count, 8);
+  FIO_ASSERT(word == (FIO_CLUSTER_MESH_ROOT | 8), "registry sync set error");
+  bit_count = 0;
+  fio_cluster_mesh_sync(&word, &bit_count, 8);
+  FIO_ASSERT(word == FIO_CLUSTER_MESH_ROOT, "registry sync clear error");
+  FIO_ASSERT(fio_cluster_mesh_bucket("channel", 7) < FIO_CLUSTER_MESH_BUCKETS,
+             "registry bucket out of bounds");
+  {
+    /* without a registry, subscriptions are only counted (for later) */
+    fio_cluster_registry_s *registry = fio_cluster_rings.registry;
+    fio_cluster_rings.registry = NULL;
+    channel_s counted = {.name = "channel", .name_len = 7};
+    const size_t bucket = fio_cluster_mesh_bucket("channel", 7);
+    const uint32_t before = fio_cluster_mesh.counts[bucket];
+    fio_cluster_mesh_count(&counted, 1);
+    fio_cluster_mesh_count(&counted, 1);
+    FIO_ASSERT(fio_cluster_mesh.counts[bucket] == before + 2,
+               "subscription count error");
+    fio_cluster_mesh_count(&counted, 0);
+    fio_cluster_mesh_count(&counted, 0);
+    FIO_ASSERT(fio_cluster_mesh.counts[bucket] == before,
+               "subscription count release error");
+    fio_cluster_rings.registry = registry;
+  }
+  {
+    /* history sequence numbers are carried by the cluster frames */
+    fio_str_s *frame = fio_cluster_wrap_publication(
+        FIO_CLUSTER_MSG_FORWARD, 0, (fio_str_info_s){.data = "ch", .len = 2},
+        (fio_str_info_s){.data = "message", .len = 7}, 42);
+    uint32_t seq_type = 0;
+    fio_msg_internal_s *seq_msg =
+        fio_cluster_frame2msg(fio_str_info(frame), &seq_type);
+    fio_str_free2(frame);
+    FIO_ASSERT(seq_msg && seq_type == FIO_CLUSTER_MSG_FORWARD &&
+                   seq_msg->sequence == 42 && seq_msg->channel.len == 2 &&
+                   !memcmp(seq_msg->channel.data, "ch", 2) &&
+                   seq_msg->data.len == 7 &&
+                   !memcmp(seq_msg->data.data, "message", 7),
+               "sequenced cluster message error");
+    fio_msg_internal_free(seq_msg);
+    frame = fio_cluster_wrap_publication(
+        FIO_CLUSTER_MSG_FORWARD, 0, (fio_str_info_s){.data = "ch", .len = 2},
+        (fio_str_info_s){.data = "message", .len = 7}, 0);
+    seq_msg = fio_cluster_frame2msg(fio_str_info(frame), &seq_type);
+    fio_str_free2(frame);
+    FIO_ASSERT(seq_msg && !seq_msg->sequence && seq_msg->data.len == 7,
+               "unsequenced cluster message error");
+    fio_msg_internal_free(seq_msg);
+  }
+#if FIO_CLUSTER_SHM_SIZE
+  /* shared payloads (tested as the root, with two worker slots) */
+  fio_cluster_slot_s slots[2];
+  fio_cluster_rings.slots = slots;
+  fio_cluster_rings.count = 2;
+  fio_cluster_shm_init();
+  FIO_ASSERT(fio_cluster_shm.map && fio_cluster_shm_holder() == 2,
+             "shared payload segment unavailable");
+  char payload[FIO_CLUSTER_SHM_MIN * 3];
+  for (size_t i = 0; i < sizeof(payload); ++i)
+    payload[i] = (char)(i * 7);
+  FIO_ASSERT(!fio_cluster_shm_new((fio_str_info_s){
+                 .data = payload, .len = FIO_CLUSTER_SHM_MIN - 1}),
+             "short payloads shouldn't be shared");
+  fio_cluster_shm_s *p = fio_cluster_shm_new(
+      (fio_str_info_s){.data = payload, .len = sizeof(payload)});
+  FIO_ASSERT(p && p->total == 1 && p->refs[2] == 1,
+             "shared payload allocation error");
+  /* a reference sent to the root, received as a message */
+  fio_cluster_shm_dup(p, 2);
+  fio_str_s *ref =
+      fio_cluster_shm_wrap(p, FIO_CLUSTER_MSG_JSON, 0,
+                           (fio_str_info_s){.data = "ch", .len = 2}, 42);
+  uint32_t type = 0;
+  fio_msg_internal_s *m = fio_cluster_frame2msg(fio_str_info(ref), &type);
+  fio_str_free2(ref);
+  FIO_ASSERT(m && type == FIO_CLUSTER_MSG_JSON && m->shared == p &&
+                 m->sequence == 42 && m->is_json && m->channel.len == 2 &&
+                 m->data.len == sizeof(payload) &&
+                 !memcmp(m->data.data, payload, sizeof(payload)) &&
+                 !m->data.data[m->data.len],
+             "shared payload message error");
+  /* a kept message (history or deferred) copies the payload */
+  fio_msg_internal_s *kept = fio_msg_internal_unshare(fio_msg_internal_dup(m));
+  FIO_ASSERT(kept != m && !kept->shared && kept->is_json &&
+                 kept->data.len == sizeof(payload) &&
+                 !memcmp(kept->data.data, payload, sizeof(payload)),
+             "kept message shouldn't reference the shared payload");
+  fio_msg_internal_free(m);
+  FIO_ASSERT(p->total == 1 && p->refs[2] == 1,
+             "shared payload reference wasn't released with the message");
+  fio_msg_internal_free(kept);
+  /* the references held by (or sent to) a lost worker */
+  fio_cluster_shm_dup(p, 1);
+  fio_cluster_shm_dup(p, 1);
+  fio_cluster_shm_release_holder(1);
+  FIO_ASSERT(p->total == 1 && !p->refs[1],
+             "lost worker's shared payload references weren't released");
+  /* a lock held by a lost worker (another holder's lock is kept) */
+  fio_cluster_shm_lock(1);
+  FIO_ASSERT(fio_cluster_shm.map->lock == 2, "shared segment lock owner error");
+  fio_cluster_shm_release_holder(1);
+  FIO_ASSERT(!fio_cluster_shm.map->lock,
+             "lost worker's shared segment lock wasn't released");
+  fio_cluster_shm_release(p, 2);
+  /* fill the segment, release everything and allocate again */
+  const size_t max = FIO_CLUSTER_SHM_SIZE / FIO_CLUSTER_SHM_BLOCK;
+  fio_cluster_shm_s **all = fio_malloc(sizeof(*all) * max);
+  FIO_ASSERT_ALLOC(all);
+  size_t count = 0;
+  while (count < max && (all[count] = fio_cluster_shm_new((fio_str_info_s){
+                             .data = payload, .len = sizeof(payload)})))
+    ++count;
+  FIO_ASSERT(count > 1 && count < max, "shared segment should fill up (%zu)",
+             count);
+  for (size_t i = 0; i < count; i += 2)
+    fio_cluster_shm_release(all[i], 2);
+  for (size_t i = 1; i < count; i += 2)
+    fio_cluster_shm_release(all[i], 2);
+  for (size_t i = 0; i < (max >> 6); ++i)
+    FIO_ASSERT(!fio_cluster_shm.map->used[i], "shared segment leaked blocks");
+  p = fio_cluster_shm_new(
+      (fio_str_info_s){.data = payload, .len = sizeof(payload)});
+  FIO_ASSERT(p, "shared payload allocation failed after the segment was full");
+  fio_cluster_shm_release(p, 2);
+  fio_free(all);
+  fio_cluster_shm_destroy(NULL);
+  fio_cluster_rings.slots = NULL;
+  fio_cluster_rings.count = 0;
+#endif
+  fprintf(stderr, "* passed.\n");
+}
 #else
 #define fio_pubsub_test()
+#define fio_cluster_ring_test()
 #endif
 
 /* *****************************************************************************
@@ -10987,9 +17137,13 @@ void fio_test(void) {
   fio_set_test();
   fio_defer_test();
   fio_timer_test();
+  fio_future_test();
   fio_poll_test();
   fio_socket_test();
   fio_uuid_link_test();
+  fio_fd_commit_test();
+  fio_mem_budget_test();
+  fio_queue_limit_test();
   fio_cycle_test();
   fio_riskyhash_test();
   fio_siphash_test();
@@ -10998,6 +17152,7 @@ void fio_test(void) {
   fio_base64_test();
   fio_test_random();
   fio_pubsub_test();
+  fio_cluster_ring_test();
   (void)fio_sentinel_task;
   (void)deferred_on_shutdown;
   (void)fio_poll;
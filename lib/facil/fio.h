@@ -28,6 +28,7 @@ Feel free to copy, use and enjoy according to the license provided.
  * Concurrency overridable functions
  * Connection Task scheduling
  * Event / Task scheduling
+ * Futures / Promises (combinators over fio_defer)
  * Startup / State Callbacks (fork, start up, idle, etc')
  * Lower Level API - for special circumstances, use with care under
  *
@@ -373,6 +374,99 @@ void *FIO_ALIGN_NEW fio_mmap(size_t size);
  */
 void fio_malloc_after_fork(void);
 
+/** Per-arena memory allocator statistics, see `fio_malloc_stats`. */
+typedef struct {
+  /** Blocks currently owned by the arena (one per active size class). */
+  size_t blocks;
+  /** The number of times slices were collected using the arena. */
+  size_t refills;
+  /** The number of times the arena was busy when a thread tried to lock it. */
+  size_t contention;
+  /** The arena's NUMA node (memory pool index). */
+  size_t node;
+} fio_malloc_arena_stats_s;
+
+/** Memory allocator statistics, see `fio_malloc_stats`. */
+typedef struct {
+  /** The number of per-CPU arenas. */
+  size_t arenas;
+  /** The number of NUMA nodes (memory pools) in use. */
+  size_t nodes;
+  /** Memory regions collected from the system (see FIO_MEMORY_BLOCK_SIZE). */
+  size_t system_allocations;
+  /** Blocks in use (owned by an arena or containing allocated slices). */
+  size_t blocks_in_use;
+  /** Blocks in the memory pool, available for any arena and size class. */
+  size_t blocks_free;
+  /** Free blocks with released memory (see `fio_malloc_release`). */
+  size_t blocks_decayed;
+  /** Blocks in use that contain freed slices available for reuse. */
+  size_t blocks_partial;
+  /** Bytes currently allocated from blocks (rounded up to their size class). */
+  size_t bytes_in_use;
+  /** The total number of bytes requested from blocks (since startup). */
+  size_t bytes_requested;
+  /** The total number of bytes reserved for these requests (since startup). */
+  size_t bytes_reserved;
+  /** Big allocations currently allocated directly from the system. */
+  size_t big_allocations;
+  /** Bytes currently allocated directly from the system (big allocations). */
+  size_t big_bytes;
+  /** The total number of big allocations (since startup). */
+  size_t big_total;
+  /** Bytes held by the cache of freed big allocations (kept for reuse). */
+  size_t big_cached;
+  /** The sum of all the arenas' lock contention counts. */
+  size_t contention;
+} fio_malloc_stats_s;
+
+/**
+ * Returns the memory allocator's statistics.
+ *
+ * If `arena_stats` isn't NULL, up to `arena_count` per-arena statistics will be
+ * written to the array (see the `arenas` field for the number of arenas).
+ *
+ * Statistics are collected without stopping the allocator, so they might be
+ * slightly inaccurate while other threads allocate memory.
+ */
+fio_malloc_stats_s fio_malloc_stats(fio_malloc_arena_stats_s *arena_stats,
+                                    size_t arena_count);
+
+/** Prints the memory allocator's statistics (see `fio_malloc_stats`). */
+void fio_malloc_stats_print(void);
+
+/**
+ * Sets the number of seconds after which unused memory is returned to the
+ * system (0 disables idle memory decay). Defaults to FIO_MEMORY_DECAY_SECONDS
+ * (10 seconds).
+ *
+ * Free blocks that weren't used during a whole decay period are released
+ * using `madvise(MADV_DONTNEED)` and cached big allocations are unmapped, so
+ * the process's memory footprint follows its actual load.
+ *
+ * The work is performed when the reactor is idle (`FIO_CALL_ON_IDLE`), or by
+ * the decay timer if the reactor wasn't idle during the whole period.
+ */
+void fio_malloc_decay_set(size_t seconds);
+
+/** Returns the idle memory decay period in seconds (0 == disabled). */
+size_t fio_malloc_decay_get(void);
+
+/**
+ * Returns all the free memory to the system immediately (regardless of the
+ * decay period), returning the number of bytes released.
+ */
+size_t fio_malloc_release(void);
+
+/**
+ * Prints the memory allocator's statistics every `milliseconds` (if not 0) and
+ * whenever the process receives `signal` (if not 0, i.e., `SIGUSR2`).
+ *
+ * The statistics are printed by the reactor (see `fio_start`), using the
+ * `FIO_LOG_LEVEL_INFO` logging level.
+ */
+void fio_malloc_stats_dump(size_t milliseconds, int signal);
+
 #undef FIO_ALIGN
 
 /* *****************************************************************************
@@ -1130,8 +1224,18 @@ typedef struct {
   uintptr_t length;
   /** Starting point offset from the buffer or file descriptor's beginning. */
   uintptr_t offset;
+  /**
+   * A message key (i.e., a channel's hash), used by the `FIO_QUEUE_KEEP_LATEST`
+   * send queue policy. 0 == none.
+   */
+  uintptr_t key;
   /** The packet will be sent as soon as possible. */
   unsigned urgent : 1;
+  /**
+   * The buffer contains a complete message that may be dropped by the
+   * connection's send queue policy (see `fio_queue_limit_set`).
+   */
+  unsigned droppable : 1;
   /**
    * The data union contains the value of a file descriptor (`int`). i.e.:
    *  `.data.fd = fd` or `.data.buffer = (void*)fd;`
@@ -1219,6 +1323,32 @@ inline FIO_FUNC ssize_t fio_sendfile(intptr_t uuid, intptr_t source_fd,
  */
 size_t fio_pending(intptr_t uuid);
 
+/** Policies used when a connection's send queue limit is reached. */
+typedef enum {
+  /** The new (droppable) packet is dropped. */
+  FIO_QUEUE_DROP_NEWEST = 0,
+  /** The oldest (droppable) queued packets are dropped to make room. */
+  FIO_QUEUE_DROP_OLDEST = 1,
+  /** Queued (droppable) packets with the same `key` are dropped. */
+  FIO_QUEUE_KEEP_LATEST = 2,
+  /** The connection is closed (without flushing the queue). */
+  FIO_QUEUE_DISCONNECT = 3,
+} fio_queue_policy_e;
+
+/**
+ * Limits the connection's send queue to `bytes` buffered bytes and / or
+ * `packets` pending `fio_write` calls (0 == no limit).
+ *
+ * The limit is enforced before a packet is queued. Only packets marked as
+ * `droppable` (complete messages, such as WebSocket frames or SSE events) are
+ * ever dropped. A packet that was dropped is freed and `fio_write2` returns -1,
+ * setting `errno` to `ENOBUFS`.
+ *
+ * Returns -1 on error (invalid `uuid`) and 0 on success.
+ */
+int fio_queue_limit_set(intptr_t uuid, size_t bytes, size_t packets,
+                        fio_queue_policy_e policy);
+
 /**
  * `fio_flush` attempts to write any remaining data in the internal buffer to
  * the underlying file descriptor and closes the underlying file descriptor once
@@ -1309,6 +1439,52 @@ void fio_uuid_link(intptr_t uuid, void *obj, void (*on_close)(void *obj));
  */
 int fio_uuid_unlink(intptr_t uuid, void *obj);
 
+/* *****************************************************************************
+Connection Memory Budgets
+***************************************************************************** */
+
+/** Eviction policies, used when the process memory ceiling is exceeded. */
+typedef enum {
+  /** Closes the connections charged with the most memory first. */
+  FIO_MEM_EVICT_LARGEST = 0,
+  /** Closes the connections that were idle for the longest time first. */
+  FIO_MEM_EVICT_IDLE = 1,
+} fio_mem_evict_e;
+
+/**
+ * Charges `bytes` to the connection's memory budget (or releases them, when
+ * `bytes` is negative).
+ *
+ * Data waiting in the outgoing packet queue is charged automatically. Protocols
+ * should charge their buffers and any objects linked to the connection.
+ *
+ * Connections exceeding their budget are closed (without flushing their queue).
+ *
+ * Returns the number of bytes charged to the connection after the update (0 and
+ * sets `errno` to `EBADF` if the `uuid` was invalid).
+ */
+size_t fio_uuid_mem_charge(intptr_t uuid, ssize_t bytes);
+
+/** Returns the number of bytes charged to the connection. */
+size_t fio_uuid_mem(intptr_t uuid);
+
+/** Returns the number of bytes charged to all the (process's) connections. */
+size_t fio_mem_charged(void);
+
+/**
+ * Sets the per connection memory budget and the process wide memory ceiling
+ * (in bytes, 0 == no limit).
+ *
+ * When the total memory charged to the process's connections exceeds the
+ * ceiling, connections are closed according to the eviction `policy` until the
+ * ceiling is respected.
+ *
+ * Budgets are per process, so this should be called before `fio_start` (or in
+ * every worker process).
+ */
+void fio_mem_budget_set(size_t connection_limit, size_t ceiling,
+                        fio_mem_evict_e policy);
+
 /* *****************************************************************************
 Connection Read / Write Hooks, for overriding the system calls
 ***************************************************************************** */
@@ -1531,6 +1707,112 @@ void fio_defer_perform(void);
 /** Returns true if there are deferred functions waiting for execution. */
 int fio_defer_has_queue(void);
 
+/* *****************************************************************************
+Futures / Promises (combinators over fio_defer)
+***************************************************************************** */
+
+/**
+ * A future is a reference counted placeholder for a result that will become
+ * available later (i.e., the response from an upstream service).
+ *
+ * A future is settled once, either fulfilled (with an opaque `void *` result)
+ * or rejected (with an `errno` style error code). Later attempts to settle the
+ * future are ignored.
+ *
+ * Continuations (`fio_future_then`) are scheduled using `fio_defer` once the
+ * future is settled. The `all`, `any` and `timeout` combinators settle their
+ * dependent futures inline, without scheduling any tasks.
+ *
+ * Future objects are allocated from an internal slab pool, so chaining steps
+ * doesn't require a call to `malloc`.
+ *
+ * Every function that returns a future returns a new reference that should be
+ * released using `fio_future_free`. Dependent futures are kept alive by their
+ * sources, so releasing a future doesn't cancel any pending continuations.
+ */
+typedef struct fio_future_s fio_future_s;
+
+/** The possible states of a future, see `fio_future_state`. */
+typedef enum {
+  FIO_FUTURE_PENDING = 0,
+  FIO_FUTURE_FULFILLED = 1,
+  FIO_FUTURE_REJECTED = 2,
+} fio_future_state_e;
+
+/** Creates a new (pending) future. Returns NULL on error. */
+fio_future_s *fio_future_new(void);
+
+/**
+ * Fulfills the future with the `result` provided.
+ *
+ * Returns -1 if the future was already settled, 0 on success.
+ */
+int fio_future_fulfill(fio_future_s *f, void *result);
+
+/**
+ * Rejects the future with the `error` code provided (i.e., `ECONNREFUSED`).
+ *
+ * Returns -1 if the future was already settled, 0 on success.
+ */
+int fio_future_reject(fio_future_s *f, int error);
+
+/**
+ * Schedules `task` (using `fio_defer`) to be performed once `f` is settled.
+ *
+ * Returns a new future that will be fulfilled with the value returned by
+ * `task`. If `f` was rejected, the `task` is still performed (so errors can be
+ * handled) but the returned future will be rejected with the same error.
+ *
+ * If `task` is NULL, the returned future simply follows `f`.
+ */
+fio_future_s *fio_future_then(fio_future_s *f,
+                              void *(*task)(fio_future_s *settled, void *udata),
+                              void *udata);
+
+/**
+ * Returns a future that will be fulfilled (with a NULL result) once all the
+ * `futures` in the list were fulfilled, or rejected as soon as any of them is
+ * rejected.
+ *
+ * The list itself isn't retained and could be placed on the stack. Results
+ * should be collected from the original futures using `fio_future_result`.
+ */
+fio_future_s *fio_future_all(fio_future_s **futures, size_t count);
+
+/**
+ * Returns a future that will be fulfilled with the result of the first future
+ * in the list to be fulfilled, or rejected (with the last error) if all of them
+ * are rejected.
+ *
+ * An empty list results in a future rejected with `ECANCELED`.
+ */
+fio_future_s *fio_future_any(fio_future_s **futures, size_t count);
+
+/**
+ * Returns a future that follows `f`, but is rejected with `ETIMEDOUT` if `f`
+ * isn't settled within `milliseconds`.
+ *
+ * Timeouts use `fio_run_every`, so they are only reviewed while the facil.io
+ * reactor is running. The timer doesn't keep the returned future alive, it's
+ * released as soon as it settles (and isn't referenced).
+ */
+fio_future_s *fio_future_timeout(fio_future_s *f, size_t milliseconds);
+
+/** Increases the future's reference count, returning the future. */
+fio_future_s *fio_future_dup(fio_future_s *f);
+
+/** Releases a reference to the future (see `fio_future_new`). */
+void fio_future_free(fio_future_s *f);
+
+/** Returns the future's state. */
+fio_future_state_e fio_future_state(fio_future_s *f);
+
+/** Returns the result of a fulfilled future (NULL if not fulfilled). */
+void *fio_future_result(fio_future_s *f);
+
+/** Returns the error code of a rejected future (0 if not rejected). */
+int fio_future_error(fio_future_s *f);
+
 /* *****************************************************************************
 Startup / State Callbacks (fork, start up, idle, etc')
 ***************************************************************************** */
@@ -1677,6 +1959,11 @@ typedef struct fio_msg_s {
   void *udata2;
   /** flag indicating if the message is JSON data or binary/text. */
   uint8_t is_json;
+  /**
+   * The message's sequence number in the channel's history (see
+   * `fio_pubsub_history_set`), or 0 if no history is kept for the channel.
+   */
+  uint64_t sequence;
 } fio_msg_s;
 
 /**
@@ -1721,9 +2008,10 @@ typedef struct {
    * and each pub/sub message (a message where filter == 0) will be tested
    * against that pattern.
    *
-   * Using pattern subscriptions extensively could become a performance concern,
-   * since channel names are tested against each distinct pattern rather than
-   * leveraging a hashmap for possible name matching.
+   * `FIO_MATCH_GLOB` patterns are indexed by their literal prefix and suffix,
+   * so channel names are only tested against patterns that could match.
+   * Custom match functions are tested against each published channel name,
+   * which could become a performance concern if used extensively.
    */
   fio_match_fn match;
   /**
@@ -1736,6 +2024,21 @@ typedef struct {
   void *udata1;
   /** The udata values are ignored and made available to the callback. */
   void *udata2;
+  /**
+   * If set, messages are conflated: a message published to a channel replaces
+   * any message from the same channel that is still waiting to be delivered to
+   * the subscription, so a lagging subscriber only receives the newest value.
+   */
+  uint8_t conflate;
+  /**
+   * If set, messages in the channel's history (see `fio_pubsub_history_set`)
+   * with a sequence number of `replay_since` or above are delivered before any
+   * new message.
+   *
+   * Sequence numbers start at 1, so setting `replay_since` to 1 replays the
+   * whole history. Ignored for filter and pattern subscriptions.
+   */
+  uint64_t replay_since;
 } subscribe_args_s;
 
 /** Publishing and on_message callback arguments. */
@@ -1830,6 +2133,97 @@ void *fio_message_metadata(fio_msg_s *msg, intptr_t type_id);
  */
 void fio_message_defer(fio_msg_s *msg);
 
+/**
+ * Keeps a history of the last messages published to `channel` (an exact
+ * channel name), so new subscriptions can replay them (see `replay_since`).
+ *
+ * The history is capped by both `max_messages` and `max_bytes` (the channel
+ * name and message data lengths). A limit of 0 means no limit, setting both
+ * limits to 0 disables (and frees) the history.
+ *
+ * Each history message is assigned a sequence number (`fio_msg_s.sequence`).
+ *
+ * The history is kept by the calling process. When called by the root process
+ * before the workers are spawned, each worker keeps its own history.
+ *
+ * Sequence numbers are assigned once, by the publishing process, using
+ * counters shared by the whole cluster. A message has the same sequence number
+ * in every worker's history and the numbers keep growing when a crashed
+ * worker is respawned, so a client can resume a stream from any worker. The
+ * numbers grow with each message but might skip values (see
+ * `FIO_PUBSUB_HISTORY_BUCKETS`). Messages published before the history was
+ * first set (by any process) aren't kept.
+ */
+void fio_pubsub_history_set(fio_str_info_s channel, size_t max_messages,
+                            size_t max_bytes);
+
+/** Pub/Sub channel statistics, see `fio_pubsub_stats`. */
+typedef struct {
+  /** The channel's name (or pattern), valid only during the callback. */
+  fio_str_info_s channel;
+  /** The filter (for filter subscriptions, where `channel` is empty). */
+  int32_t filter;
+  /** True (1) if `channel` is a pattern. */
+  uint8_t is_pattern;
+  /** The number of subscriptions. */
+  uint64_t subscribers;
+  /** The number of messages published to the channel (or pattern). */
+  uint64_t messages;
+  /** The number of message data bytes published to the channel. */
+  uint64_t bytes;
+  /** The number of messages waiting for the subscriptions' callbacks. */
+  uint64_t pending;
+  /** The number of messages performed by the subscriptions' callbacks. */
+  uint64_t delivered;
+  /** The sum of the publish to callback times (nanoseconds) of `delivered`. */
+  uint64_t latency_total;
+  /** The longest publish to callback time (nanoseconds). */
+  uint64_t latency_max;
+} fio_pubsub_stats_s;
+
+/**
+ * Calls `task` with the statistics of each channel, filter and pattern the
+ * calling process is subscribed to. Returns the number of channels.
+ *
+ * The message counters cover the channel's lifetime, while the delivery
+ * counters cover the lifetime of the channel's current subscriptions.
+ *
+ * Messages replayed from a channel's history aren't counted as delivered.
+ *
+ * Counters are only collected when facil.io is compiled with
+ * FIO_PUBSUB_STATS (disabled by default), otherwise only `subscribers` is
+ * reported.
+ *
+ * The latency is only measured when facil.io is compiled with
+ * FIO_PUBSUB_STATS_LATENCY, from the moment the message was published (or
+ * received from another process) until its callback was called.
+ */
+size_t fio_pubsub_stats(void (*task)(fio_pubsub_stats_s *stats, void *udata),
+                        void *udata);
+
+/**
+ * Returns the statistics of a single subscription (`subscribers` is 1).
+ *
+ * The `channel` string is valid as long as the subscription is valid.
+ */
+fio_pubsub_stats_s fio_subscription_stats(subscription_s *subscription);
+
+/**
+ * Collects the statistics of all the processes in the cluster (the root and
+ * the workers) and calls `task` for each channel, followed by `on_finish`.
+ *
+ * The statistics are collected asynchronously, using the cluster's IPC. The
+ * values reported by each process are summed (except `latency_max`), so a
+ * message delivered by three workers counts as three messages.
+ *
+ * Processes that don't reply within FIO_PUBSUB_STATS_TIMEOUT milliseconds
+ * are left out. If facil.io stops before the collection is complete, the
+ * statistics collected so far are reported.
+ */
+void fio_pubsub_stats_cluster(void (*task)(fio_pubsub_stats_s *stats,
+                                           void *udata),
+                              void (*on_finish)(void *udata), void *udata);
+
 /* *****************************************************************************
  * Cluster / Pub/Sub Middleware and Extensions ("Engines")
  **************************************************************************** */
@@ -2812,29 +3206,48 @@ C++ extern end
  * short life spans (memory is freed shortly, but not immediately, after it was
  * allocated) as well as small allocations (realloc almost always copies data).
  *
- * These assumptions allow the allocator to avoid lock contention by ignoring
- * fragmentation within a memory "block" and waiting for the whole "block" to be
- * freed before it's memory is recycled (no per-allocation "free list").
+ * These assumptions allow the allocator to avoid lock contention by slicing
+ * memory "blocks" sequentially and waiting for the whole "block" to be freed
+ * before it's memory is recycled.
+ *
+ * However, freed slices in a partially used block are placed in the block's
+ * "free list" and the block is listed per size class, so freed slices are
+ * reused before new blocks are taken. This limits the fragmentation caused by
+ * long-life objects that pin a block.
+ *
+ * Each block serves a single size class (see below), so a slice's size is known
+ * from the block's header. This allows each thread to cache recently freed
+ * slices (and slices reserved in advance) per size class, so most allocations
+ * and deallocations don't touch the arena's lock or any atomic counters (see
+ * FIO_MEMORY_CACHE_BYTES). Cached slices are returned to their blocks in
+ * batches, when the cache is full or when the thread exits.
  *
  * An "arena" is allocated per-CPU core during initialization - there's no
  * dynamic allocation of arenas. This allows threads to minimize lock contention
  * by cycling through the arenas until a free arena is detected.
  *
+ * Big allocations are mapped directly from the system. Freed big allocations
+ * are cached for reuse (see FIO_MEMORY_BIG_CACHE) and grow using `mremap`.
+ *
+ * On Linux, NUMA nodes are detected using sysfs (see FIO_MEMORY_NUMA). Each
+ * node has a memory pool of its own, memory regions are bound to their node
+ * and arenas prefer blocks (and partially used blocks) from the CPU core's
+ * node. Freed blocks are always returned to the node that owns them.
+ *
  * There should be a free arena at any given time (statistically speaking) and
  * the thread will only be deferred in the unlikely event in which there's no
  * available arena.
  *
- * By avoiding the "free-list", the need for allocation "headers" is also
- * avoided and allocations are performed with practically zero overhead (about
- * 32 bytes overhead per 32KB memory, that's 1 bit per 1Kb).
+ * Since the free list is stored within the freed slices, allocation "headers"
+ * are avoided and allocations are performed with practically zero overhead
+ * (about 48 bytes overhead per 32KB memory).
  *
- * However, the lack of a "free list" means that memory "leaks" are more
- * expensive and small long-life allocations could cause fragmentation if
- * performed periodically (rather than performed during startup).
+ * However, memory "leaks" are still expensive and small long-life allocations
+ * could cause fragmentation if the rest of the size class isn't used.
  *
  * This allocator should NOT be used for objects with a long life-span, because
- * even a single persistent object will prevent the re-use of the whole memory
- * block from which it was allocated (see FIO_MEMORY_BLOCK_SIZE for size).
+ * a persistent object will prevent the memory block from which it was allocated
+ * from being returned to the memory pool (see FIO_MEMORY_BLOCK_SIZE for size).
  *
  * Some more details:
  *
@@ -2844,8 +3257,8 @@ C++ extern end
  * of 2 (up to 1Mb of memory). However, the default value, set by the value of
  * FIO_MEMORY_BLOCK_SIZE_LOG, is 32Kb (see value at the end of this header).
  *
- * Each block includes a 32 byte header that uses reference counters and
- * position markers (24 bytes are required padding).
+ * Each block includes a 48 byte header that uses reference counters, position
+ * markers, a free list and the list node used for pooling / listing the block.
  *
  * The block's position marker (`pos`) marks the next available byte (counted in
  * multiples of 16 bytes).
@@ -2853,8 +3266,12 @@ C++ extern end
  * The block's reference counter (`ref`) counts how many allocations reference
  * memory in the block (including the "arena" that "owns" the block).
  *
- * Except for the position marker (`pos`) that acts the same as `sbrk`, there's
- * no way to know which "slices" are allocated and which "slices" are available.
+ * The block's size class (`units`) is the size of every slice in the block
+ * (counted in multiples of 16 bytes). The first 8 size classes are exact (16 to
+ * 128 bytes), after which each power of 2 is divided into 4 size classes.
+ *
+ * Except for the position marker (`pos`) that acts the same as `sbrk` and the
+ * block's free list, there's no way to know which "slices" are allocated.
  *
  * The allocator uses `mmap` when requesting memory from the system and for
  * allocations bigger than MEMORY_BLOCK_ALLOC_LIMIT (37.5% of the block).
@@ -2899,6 +3316,17 @@ C++ extern end
 #define FIO_MEMORY_BLOCK_ALLOC_LIMIT (FIO_MEMORY_BLOCK_SIZE >> 1)
 #endif
 
+/**
+ * The number of bytes each thread may cache per size class, allowing most
+ * allocations and deallocations to avoid the arena's lock.
+ *
+ * Defaults to 4Kb. Size classes bigger than half this value aren't cached.
+ * Setting this to 0 disables the per-thread cache.
+ */
+#ifndef FIO_MEMORY_CACHE_BYTES
+#define FIO_MEMORY_CACHE_BYTES 4096
+#endif
+
 /* *****************************************************************************
 
 
@@ -1247,6 +1247,27 @@ static inline void http_sse_copy2str(FIOBJ dest, char *prefix, size_t pre_len,
   }
 }
 
+/* defined later - writes an event, `key` marks droppable pub/sub events. */
+static int http_sse_write_event(http_sse_internal_s *sse,
+                                struct http_sse_write_args *args,
+                                uintptr_t key);
+
+/** Writes a pub/sub message directly, when there's no `on_message`. */
+static void http_sse_on_message__direct(http_sse_internal_s *sse,
+                                        fio_msg_s *msg) {
+  /* the channel is the message key for the send queue's keep latest policy */
+  uintptr_t key = (uintptr_t)fio_risky_hash(msg->channel.data,
+                                            msg->channel.len, 0);
+  struct http_sse_write_args args = {.data = msg->msg};
+  char id[24];
+  if (msg->sequence) {
+    /* history messages are sent with their sequence number as the event ID */
+    args.id.data = id;
+    args.id.len = fio_ltoa(id, (int64_t)msg->sequence, 10);
+  }
+  http_sse_write_event(sse, &args, (key ? key : 1));
+}
+
 /** The on message callback. the `*msg` pointer is to a temporary object. */
 static void http_sse_on_message(fio_msg_s *msg) {
   http_sse_internal_s *sse = msg->udata1;
@@ -1255,7 +1276,10 @@ static void http_sse_on_message(fio_msg_s *msg) {
   fio_protocol_s *pr = fio_protocol_try_lock(sse->uuid, FIO_PR_LOCK_TASK);
   if (!pr)
     goto postpone;
-  args->on_message(&sse->sse, msg->channel, msg->msg, args->udata);
+  if (args->on_message)
+    args->on_message(&sse->sse, msg->channel, msg->msg, args->udata);
+  else
+    http_sse_on_message__direct(sse, msg);
   fio_protocol_unlock(pr, FIO_PR_LOCK_TASK);
   return;
 postpone:
@@ -1265,12 +1289,6 @@ postpone:
   return;
 }
 
-static void http_sse_on_message__direct(http_sse_s *sse, fio_str_info_s channel,
-                                        fio_str_info_s msg, void *udata) {
-  http_sse_write(sse, .data = msg);
-  (void)udata;
-  (void)channel;
-}
 /** An optional callback for when a subscription is fully canceled. */
 static void http_sse_on_unsubscribe(void *sse_, void *args_) {
   http_sse_internal_s *sse = sse_;
@@ -1301,8 +1319,6 @@ uintptr_t http_sse_subscribe(http_sse_s *sse_,
   http_sse_internal_s *sse = FIO_LS_EMBD_OBJ(http_sse_internal_s, sse, sse_);
   if (sse->uuid == -1)
     return 0;
-  if (!args.on_message)
-    args.on_message = http_sse_on_message__direct;
   struct http_sse_subscribe_args *udata = fio_malloc(sizeof(*udata));
   FIO_ASSERT_ALLOC(udata);
   *udata = args;
@@ -1311,7 +1327,9 @@ uintptr_t http_sse_subscribe(http_sse_s *sse_,
   subscription_s *sub =
       fio_subscribe(.channel = args.channel, .on_message = http_sse_on_message,
                     .on_unsubscribe = http_sse_on_unsubscribe, .udata1 = sse,
-                    .udata2 = udata, .match = args.match);
+                    .udata2 = udata, .match = args.match,
+                    .conflate = args.conflate,
+                    .replay_since = args.replay_since);
   if (!sub)
     return 0;
 
@@ -1368,28 +1386,37 @@ void http_sse_set_timout(http_sse_s *sse_, uint8_t timeout) {
  * Writes data to an EventSource (SSE) connection.
  */
 int http_sse_write(http_sse_s *sse, struct http_sse_write_args args) {
-  if (!sse || !(args.id.len + args.data.len + args.event.len) ||
-      fio_is_closed(FIO_LS_EMBD_OBJ(http_sse_internal_s, sse, sse)->uuid))
+  if (!sse)
+    return -1;
+  return http_sse_write_event(FIO_LS_EMBD_OBJ(http_sse_internal_s, sse, sse),
+                              &args, 0);
+}
+
+/** Formats and writes an event, `key` marks droppable pub/sub events. */
+static int http_sse_write_event(http_sse_internal_s *sse,
+                                struct http_sse_write_args *args,
+                                uintptr_t key) {
+  if (!(args->id.len + args->data.len + args->event.len) ||
+      fio_is_closed(sse->uuid))
     return -1;
   FIOBJ buf;
   {
     /* best guess at data length, ignoring missing fields and multiline data */
-    const size_t total = 4 + args.id.len + 2 + 7 + args.event.len + 2 + 6 +
-                         args.data.len + 2 + 7 + 10 + 4;
+    const size_t total = 4 + args->id.len + 2 + 7 + args->event.len + 2 + 6 +
+                         args->data.len + 2 + 7 + 10 + 4;
     buf = fiobj_str_buf(total);
   }
-  http_sse_copy2str(buf, (char *)"id: ", 4, args.id);
-  http_sse_copy2str(buf, (char *)"event: ", 7, args.event);
-  if (args.retry) {
-    FIOBJ i = fiobj_num_new(args.retry);
+  http_sse_copy2str(buf, (char *)"id: ", 4, args->id);
+  http_sse_copy2str(buf, (char *)"event: ", 7, args->event);
+  if (args->retry) {
+    FIOBJ i = fiobj_num_new(args->retry);
     fiobj_str_write(buf, (char *)"retry: ", 7);
     fiobj_str_join(buf, i);
     fiobj_free(i);
   }
-  http_sse_copy2str(buf, (char *)"data: ", 6, args.data);
+  http_sse_copy2str(buf, (char *)"data: ", 6, args->data);
   fiobj_str_write(buf, "\r\n", 2);
-  return FIO_LS_EMBD_OBJ(http_sse_internal_s, sse, sse)
-      ->vtable->http_sse_write(sse, buf);
+  return sse->vtable->http_sse_write(&sse->sse, buf, key);
 }
 
 /**
@@ -42,6 +42,27 @@ Compile Time Settings
 #define HTTP_MAX_HEADER_LENGTH 8192
 #endif
 
+#ifndef HTTP_READ_BUFFER_POOL_LIMIT
+/**
+ * HTTP/1.1 read buffers are attached to a connection only while it has unparsed
+ * data. This limits the number of released buffers cached for reuse.
+ */
+#define HTTP_READ_BUFFER_POOL_LIMIT 256
+#endif
+
+#ifndef WS_IDLE_BUFFER_SIZE
+/**
+ * The size to which a Websocket connection's read buffer is shrunk once all the
+ * received data was consumed. When 0 (default), the buffer is released.
+ */
+#define WS_IDLE_BUFFER_SIZE 0
+#endif
+
+#ifndef WS_BUFFER_POOL_BYTES
+/** The number of bytes kept by the Websocket buffer pool for reuse. */
+#define WS_BUFFER_POOL_BYTES (1024 * 1024 * 4)
+#endif
+
 #ifndef FIO_HTTP_EXACT_LOGGING
 /**
  * By default, facil.io logs the HTTP request cycle using a fuzzy starting point
@@ -383,6 +404,19 @@ struct http_settings_s {
    * connections. Defaults to ~250KB.
    */
   size_t ws_max_msg_size;
+  /**
+   * The send queue limit (in bytes) for Websocket and EventSource (SSE)
+   * connections. Defaults to 0 (no limit).
+   *
+   * When the limit is reached, messages are dropped (or the connection is
+   * closed) according to the `ws_queue_policy`.
+   */
+  size_t ws_queue_limit;
+  /**
+   * The send queue limit (in messages) for Websocket and EventSource (SSE)
+   * connections. Defaults to 0 (no limit).
+   */
+  size_t ws_queue_msgs;
   /**
    * An HTTP/1.x connection timeout.
    *
@@ -401,6 +435,14 @@ struct http_settings_s {
   uint8_t ws_timeout;
   /** Logging flag - set to TRUE to log HTTP requests. */
   uint8_t log;
+  /**
+   * The send queue policy (a `fio_queue_policy_e` value) for Websocket and
+   * EventSource (SSE) connections. Defaults to `FIO_QUEUE_DROP_NEWEST`.
+   *
+   * Pub/Sub messages use their channel as the `FIO_QUEUE_KEEP_LATEST` key.
+   * SSE events written using `http_sse_write` are never dropped.
+   */
+  uint8_t ws_queue_policy;
   /** a read only flag set automatically to indicate the protocol's mode. */
   uint8_t is_client;
 };
@@ -679,6 +721,16 @@ struct http_sse_subscribe_args {
   void *udata;
   /** A callback for pattern matching. */
   fio_match_fn match;
+  /** If set, only the newest undelivered message per channel is sent. */
+  uint8_t conflate;
+  /**
+   * If set, the channel's history is replayed from this sequence number (see
+   * `fio_pubsub_history_set`). History messages are sent with their sequence
+   * number as the event ID, so a reconnecting client's `Last-Event-ID` + 1 can
+   * be used. Sequence numbers are shared by all the workers, so a client can
+   * reconnect to any worker.
+   */
+  uint64_t replay_since;
 };
 
 /**
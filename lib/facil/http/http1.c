@@ -28,7 +28,7 @@ typedef struct http1pr_s {
   uint8_t close;
   uint8_t is_client;
   uint8_t stop;
-  uint8_t buf[];
+  uint8_t *buf; /* pooled read buffer, NULL while the connection is idle */
 } http1pr_s;
 
 struct http_vtable_s HTTP1_VTABLE; /* initialized later on */
@@ -47,6 +47,82 @@ inline static void h1_reset(http1pr_s *p) { p->header_size = 0; }
 
 static fio_str_info_s http1pr_status2str(uintptr_t status);
 
+/* *****************************************************************************
+Read Buffer Pool
+
+Read buffers are attached to a connection only while it has unparsed data, so
+idle keep-alive connections don't pin `HTTP_MAX_HEADER_LENGTH` bytes each.
+Released buffers are kept in a bounded LIFO free list for reuse.
+***************************************************************************** */
+
+typedef struct http1_buf_s {
+  struct http1_buf_s *next;
+} http1_buf_s;
+
+static struct {
+  http1_buf_s *available;
+  size_t count;
+  fio_lock_i lock;
+} http1_buf_pool = {.lock = FIO_LOCK_INIT};
+
+/* attaches a read buffer to the protocol object (if missing). */
+static inline void http1_buf_attach(http1pr_s *p) {
+  if (p->buf)
+    return;
+  fio_lock(&http1_buf_pool.lock);
+  http1_buf_s *b = http1_buf_pool.available;
+  if (b) {
+    http1_buf_pool.available = b->next;
+    --http1_buf_pool.count;
+  }
+  fio_unlock(&http1_buf_pool.lock);
+  if (!b) {
+    b = fio_malloc(HTTP_MAX_HEADER_LENGTH);
+    FIO_ASSERT_ALLOC(b);
+  }
+  p->buf = (uint8_t *)b;
+  fio_uuid_mem_charge(p->p.uuid, HTTP_MAX_HEADER_LENGTH);
+}
+
+/* returns the protocol's read buffer to the pool. */
+static inline void http1_buf_release(http1pr_s *p) {
+  http1_buf_s *b = (http1_buf_s *)p->buf;
+  if (!b)
+    return;
+  p->buf = NULL;
+  p->buf_len = 0;
+  fio_uuid_mem_charge(p->p.uuid, 0 - (ssize_t)HTTP_MAX_HEADER_LENGTH);
+  fio_lock(&http1_buf_pool.lock);
+  if (http1_buf_pool.count < HTTP_READ_BUFFER_POOL_LIMIT) {
+    b->next = http1_buf_pool.available;
+    http1_buf_pool.available = b;
+    ++http1_buf_pool.count;
+    b = NULL;
+  }
+  fio_unlock(&http1_buf_pool.lock);
+  fio_free(b);
+}
+
+/* frees all pooled buffers (called at exit). */
+static void http1_buf_pool_clear(void *ignr_) {
+  http1_buf_s *b;
+  fio_lock(&http1_buf_pool.lock);
+  b = http1_buf_pool.available;
+  http1_buf_pool.available = NULL;
+  http1_buf_pool.count = 0;
+  fio_unlock(&http1_buf_pool.lock);
+  while (b) {
+    http1_buf_s *tmp = b;
+    b = b->next;
+    fio_free(tmp);
+  }
+  (void)ignr_;
+}
+
+static __attribute__((constructor)) void http1_buf_pool_constructor(void) {
+  fio_state_callback_add(FIO_CALL_AT_EXIT, http1_buf_pool_clear, NULL);
+}
+
 /* cleanup an HTTP/1.1 handler object */
 static inline void http1_after_finish(http_s *h) {
   http1pr_s *p = handle2pr(h);
@@ -266,7 +342,9 @@ static void http1_on_resume(http_s *h, http_fio_protocol_s *pr) {
 }
 
 static intptr_t http1_hijack(http_s *h, fio_str_info_s *leftover) {
-  if (leftover) {
+  if (leftover && !handle2pr(h)->buf) {
+    *leftover = (fio_str_info_s){.len = 0, .data = NULL};
+  } else if (leftover) {
     intptr_t len =
         handle2pr(h)->buf_len -
         (intptr_t)(handle2pr(h)->parser.state.next - handle2pr(h)->buf);
@@ -297,8 +375,11 @@ static void http1_websocket_client_on_upgrade(http_s *h, char *proto,
   set->udata = NULL;
   http_finish(h);
   p->stop = 1;
-  websocket_attach(uuid, set, args, p->parser.state.next,
-                   p->buf_len - (intptr_t)(p->parser.state.next - p->buf));
+  if (p->buf)
+    websocket_attach(uuid, set, args, p->parser.state.next,
+                     p->buf_len - (intptr_t)(p->parser.state.next - p->buf));
+  else
+    websocket_attach(uuid, set, args, NULL, 0);
   fio_free(args);
   (void)proto;
   (void)len;
@@ -358,8 +439,11 @@ static int http1_http2websocket_server(http_s *h, websocket_settings_s *args) {
   http_settings_s *set = handle2pr(h)->p.settings;
   http_finish(h);
   pr->stop = 1;
-  websocket_attach(uuid, set, args, pr->parser.state.next,
-                   pr->buf_len - (intptr_t)(pr->parser.state.next - pr->buf));
+  if (pr->buf)
+    websocket_attach(uuid, set, args, pr->parser.state.next,
+                     pr->buf_len - (intptr_t)(pr->parser.state.next - pr->buf));
+  else
+    websocket_attach(uuid, set, args, NULL, 0);
   return 0;
 bad_request:
   http_send_error(h, 400);
@@ -492,6 +576,12 @@ static int http1_upgrade2sse(http_s *h, http_sse_s *sse) {
 
   http_sse_init(sse_pr->sse, uuid, &HTTP1_VTABLE, sse);
   fio_timeout_set(uuid, handle2pr(h)->p.settings->ws_timeout);
+  if (handle2pr(h)->p.settings->ws_queue_limit ||
+      handle2pr(h)->p.settings->ws_queue_msgs)
+    fio_queue_limit_set(
+        uuid, handle2pr(h)->p.settings->ws_queue_limit,
+        handle2pr(h)->p.settings->ws_queue_msgs,
+        (fio_queue_policy_e)handle2pr(h)->p.settings->ws_queue_policy);
   if (sse->on_open)
     sse->on_open(&sse_pr->sse->sse);
   fio_attach(uuid, &sse_pr->p);
@@ -511,8 +601,16 @@ failed:
  *
  * See the {struct http_sse_write_args} for possible named arguments.
  */
-static int http1_sse_write(http_sse_s *sse, FIOBJ str) {
-  return fiobj_send_free(((http_sse_internal_s *)sse)->uuid, str);
+static int http1_sse_write(http_sse_s *sse, FIOBJ str, uintptr_t key) {
+  if (!key)
+    return fiobj_send_free(((http_sse_internal_s *)sse)->uuid, str);
+  /* pub/sub events are complete messages the send queue policy can drop */
+  fio_str_info_s s = fiobj_obj2cstr(str);
+  return fio_write2(((http_sse_internal_s *)sse)->uuid,
+                    .data.buffer = (void *)(str),
+                    .offset = (((intptr_t)s.data) - ((intptr_t)(str))),
+                    .length = s.len, .after.dealloc = fiobj4sock_dealloc,
+                    .droppable = 1, .key = key);
 }
 
 /**
@@ -679,8 +777,10 @@ static inline void http1_consume_data(intptr_t uuid, http1pr_s *p) {
   ssize_t i = 0;
   size_t org_len = p->buf_len;
   int pipeline_limit = 8;
-  if (!p->buf_len)
+  if (!p->buf_len) {
+    http1_buf_release(p);
     return;
+  }
   do {
     i = http1_fio_parser(.parser = &p->parser,
                          .buffer = p->buf + (org_len - p->buf_len),
@@ -697,7 +797,10 @@ static inline void http1_consume_data(intptr_t uuid, http1pr_s *p) {
     --pipeline_limit;
   } while (i && p->buf_len && pipeline_limit && !p->stop);
 
-  if (p->buf_len && org_len != p->buf_len) {
+  if (!p->buf_len) {
+    /* everything was consumed, the buffer isn't needed while idle */
+    http1_buf_release(p);
+  } else if (org_len != p->buf_len) {
     memmove(p->buf, p->buf + (org_len - p->buf_len), p->buf_len);
   }
 
@@ -724,6 +827,7 @@ static void http1_on_data(intptr_t uuid, fio_protocol_s *protocol) {
     return;
   }
   ssize_t i = 0;
+  http1_buf_attach(p);
   if (HTTP_MAX_HEADER_LENGTH - p->buf_len)
     i = fio_read(uuid, p->buf + p->buf_len,
                  HTTP_MAX_HEADER_LENGTH - p->buf_len);
@@ -744,10 +848,14 @@ static void http1_on_data_first_time(intptr_t uuid, fio_protocol_s *protocol) {
   http1pr_s *p = (http1pr_s *)protocol;
   ssize_t i;
 
+  http1_buf_attach(p);
   i = fio_read(uuid, p->buf + p->buf_len, HTTP_MAX_HEADER_LENGTH - p->buf_len);
 
-  if (i <= 0)
+  if (i <= 0) {
+    if (!p->buf_len)
+      http1_buf_release(p);
     return;
+  }
   p->buf_len += i;
 
   /* ensure future reads skip this first time HTTP/2.0 test */
@@ -773,7 +881,7 @@ fio_protocol_s *http1_new(uintptr_t uuid, http_settings_s *settings,
                           void *unread_data, size_t unread_length) {
   if (unread_data && unread_length > HTTP_MAX_HEADER_LENGTH)
     return NULL;
-  http1pr_s *p = fio_malloc(sizeof(*p) + HTTP_MAX_HEADER_LENGTH);
+  http1pr_s *p = fio_malloc(sizeof(*p));
   // FIO_LOG_DEBUG("Allocated HTTP/1.1 protocol at. %p", (void *)p);
   FIO_ASSERT_ALLOC(p);
   *p = (http1pr_s){
@@ -788,7 +896,8 @@ fio_protocol_s *http1_new(uintptr_t uuid, http_settings_s *settings,
       .is_client = settings->is_client,
   };
   http_s_new(&p->request, &p->p, &HTTP1_VTABLE);
-  if (unread_data && unread_length <= HTTP_MAX_HEADER_LENGTH) {
+  if (unread_data && unread_length) {
+    http1_buf_attach(p);
     memcpy(p->buf, unread_data, unread_length);
     p->buf_len = unread_length;
   }
@@ -804,6 +913,7 @@ void http1_destroy(fio_protocol_s *pr) {
   http1pr_s *p = (http1pr_s *)pr;
   http1_pr2handle(p).status = 0;
   http_s_destroy(&http1_pr2handle(p), 0);
+  http1_buf_release(p);
   fio_free(p);
   // FIO_LOG_DEBUG("Deallocated HTTP/1.1 protocol at. %p", (void *)p);
 }
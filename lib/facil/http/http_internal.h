@@ -52,8 +52,13 @@ struct http_vtable_s {
 
   /** Upgrades an HTTP connection to an EventSource (SSE) connection. */
   int (*http_upgrade2sse)(http_s *h, http_sse_s *sse);
-  /** Writes data to an EventSource (SSE) connection. MUST free the FIOBJ. */
-  int (*http_sse_write)(http_sse_s *sse, FIOBJ str);
+  /**
+   * Writes data to an EventSource (SSE) connection. MUST free the FIOBJ.
+   *
+   * A non-zero `key` marks a pub/sub event the send queue policy can drop (see
+   * `fio_write2`), 0 marks an event that must be sent.
+   */
+  int (*http_sse_write)(http_sse_s *sse, FIOBJ str, uintptr_t key);
   /** Closes an EventSource (SSE) connection. */
   int (*http_sse_close)(http_sse_s *sse);
 };
@@ -58,40 +58,138 @@ void free_ws_buffer(ws_s *owner, struct buffer_s);
 #define WS_INITIAL_BUFFER_SIZE 4096UL
 
 /*******************************************************************************
-Buffer management - simple implementation...
-Since Websocket connections have a long life expectancy, optimizing this part of
-the code probably wouldn't offer a high performance boost.
+Buffer management - size-classed buffer pool.
+
+Most Websocket connections are long lived and idle, so socket buffers are
+released (or shrunk to `WS_IDLE_BUFFER_SIZE`) once the received data was
+consumed. Buffers are taken from per size class free lists (4Kb to 64Kb), so
+attaching a buffer when data arrives is cheap. Larger buffers bypass the pool.
 */
 
-// buffer increments by 4,096 Bytes (4Kb)
-#define round_up_buffer_size(size) (((size) >> 12) + 1) << 12
+#define WS_POOL_CLASSES 5
+#define WS_POOL_HEADER 16
+
+typedef struct ws_pool_buf_s {
+  struct ws_pool_buf_s *next;
+  size_t size; /* usable size, following the header */
+} ws_pool_buf_s;
+
+static struct {
+  ws_pool_buf_s *available[WS_POOL_CLASSES];
+  size_t bytes;
+  fio_lock_i lock;
+} ws_pool = {.lock = FIO_LOCK_INIT};
+
+#define ws_pool_class2size(cls)                                                \
+  ((WS_INITIAL_BUFFER_SIZE << (cls)) - WS_POOL_HEADER)
+#define ws_pool_data2buf(data)                                                 \
+  ((ws_pool_buf_s *)((char *)(data)-WS_POOL_HEADER))
+
+/* returns the size class for the requested size (WS_POOL_CLASSES if none) */
+static inline size_t ws_pool_size2class(size_t size) {
+  size_t cls = 0;
+  while (cls < WS_POOL_CLASSES && ws_pool_class2size(cls) < size)
+    ++cls;
+  return cls;
+}
+
+/* returns a buffer with (at least) `*size` bytes, updating `*size`. */
+static void *ws_pool_alloc(size_t *size) {
+  size_t cls = ws_pool_size2class(*size);
+  ws_pool_buf_s *b = NULL;
+  if (cls < WS_POOL_CLASSES) {
+    *size = ws_pool_class2size(cls);
+    fio_lock(&ws_pool.lock);
+    b = ws_pool.available[cls];
+    if (b) {
+      ws_pool.available[cls] = b->next;
+      ws_pool.bytes -= b->size;
+    }
+    fio_unlock(&ws_pool.lock);
+  }
+  if (!b) {
+    b = fio_malloc(*size + WS_POOL_HEADER);
+    if (!b)
+      return NULL;
+    b->size = *size;
+  }
+  return (char *)b + WS_POOL_HEADER;
+}
+
+/* returns a buffer to the pool (or to the system). */
+static void ws_pool_free(void *data) {
+  if (!data)
+    return;
+  ws_pool_buf_s *b = ws_pool_data2buf(data);
+  size_t cls = ws_pool_size2class(b->size);
+  if (cls < WS_POOL_CLASSES) {
+    fio_lock(&ws_pool.lock);
+    if (ws_pool.bytes + b->size <= WS_BUFFER_POOL_BYTES) {
+      b->next = ws_pool.available[cls];
+      ws_pool.available[cls] = b;
+      ws_pool.bytes += b->size;
+      b = NULL;
+    }
+    fio_unlock(&ws_pool.lock);
+  }
+  fio_free(b);
+}
+
+/* frees all pooled buffers (called at exit). */
+static void ws_pool_clear(void *ignr_) {
+  for (size_t i = 0; i < WS_POOL_CLASSES; ++i) {
+    fio_lock(&ws_pool.lock);
+    ws_pool_buf_s *b = ws_pool.available[i];
+    ws_pool.available[i] = NULL;
+    fio_unlock(&ws_pool.lock);
+    while (b) {
+      ws_pool_buf_s *tmp = b;
+      b = b->next;
+      ws_pool.bytes -= tmp->size;
+      fio_free(tmp);
+    }
+  }
+  (void)ignr_;
+}
+
+static __attribute__((constructor)) void ws_pool_constructor(void) {
+  fio_state_callback_add(FIO_CALL_AT_EXIT, ws_pool_clear, NULL);
+}
 
 struct buffer_s create_ws_buffer(ws_s *owner) {
   (void)(owner);
   struct buffer_s buff;
   buff.size = WS_INITIAL_BUFFER_SIZE;
-  buff.data = malloc(buff.size);
+  buff.data = ws_pool_alloc(&buff.size);
+  if (!buff.data)
+    buff.size = 0;
   return buff;
 }
 
 struct buffer_s resize_ws_buffer(ws_s *owner, struct buffer_s buff) {
-  buff.size = round_up_buffer_size(buff.size);
-  void *tmp = realloc(buff.data, buff.size);
+  (void)(owner);
+  size_t old_size = buff.data ? ws_pool_data2buf(buff.data)->size : 0;
+  if (buff.data && ws_pool_size2class(buff.size) < WS_POOL_CLASSES &&
+      ws_pool_size2class(buff.size) == ws_pool_size2class(old_size)) {
+    buff.size = old_size;
+    return buff;
+  }
+  void *tmp = ws_pool_alloc(&buff.size);
   if (!tmp) {
-    free_ws_buffer(owner, buff);
-    buff.data = NULL;
+    ws_pool_free(buff.data);
     buff.size = 0;
+  } else if (buff.data) {
+    memcpy(tmp, buff.data, (old_size < buff.size ? old_size : buff.size));
+    ws_pool_free(buff.data);
   }
   buff.data = tmp;
   return buff;
 }
 void free_ws_buffer(ws_s *owner, struct buffer_s buff) {
   (void)(owner);
-  free(buff.data);
+  ws_pool_free(buff.data);
 }
 
-#undef round_up_buffer_size
-
 /*******************************************************************************
 Create/Destroy the websocket object (prototypes)
 */
@@ -102,6 +200,15 @@ static void destroy_ws(ws_s *ws);
 /*******************************************************************************
 The Websocket object (protocol + parser)
 */
+
+/** A fragmented message is collected in pooled chunks until it's complete. */
+typedef struct ws_msg_chunk_s {
+  struct ws_msg_chunk_s *next;
+  size_t len;
+  size_t capa;
+  char data[];
+} ws_msg_chunk_s;
+
 struct ws_s {
   /** The Websocket protocol */
   fio_protocol_s protocol;
@@ -124,8 +231,15 @@ struct ws_s {
   struct buffer_s buffer;
   /** data length (how much of the buffer actually used). */
   size_t length;
-  /** message buffer. */
-  FIOBJ msg;
+  /** fragmented message chunks (pooled). */
+  ws_msg_chunk_s *msg;
+  ws_msg_chunk_s *msg_last;
+  /** fragmented message length. */
+  size_t msg_len;
+  /** fragmented message chunks capacity. */
+  size_t msg_mem;
+  /** bytes charged to the connection's memory budget. */
+  size_t mem;
   /** latest text state. */
   uint8_t is_text;
   /** websocket connection type. */
@@ -144,6 +258,86 @@ static inline void clear_subscriptions(ws_s *ws) {
   fio_unlock(&ws->sub_lock);
 }
 
+/* *****************************************************************************
+Fragmented message collection
+***************************************************************************** */
+
+/* releases any collected message fragments */
+static void websocket_msg_clear(ws_s *ws) {
+  while (ws->msg) {
+    ws_msg_chunk_s *tmp = ws->msg;
+    ws->msg = tmp->next;
+    ws_pool_free(tmp);
+  }
+  ws->msg_last = NULL;
+  ws->msg_len = 0;
+  ws->msg_mem = 0;
+}
+
+/* appends a message fragment, returns -1 on error (message too long). */
+static int websocket_msg_write(ws_s *ws, char *data, size_t len) {
+  if (ws->msg_len + len > ws->max_msg_size)
+    return -1;
+  ws->msg_len += len;
+  while (len) {
+    ws_msg_chunk_s *c = ws->msg_last;
+    if (!c || c->len == c->capa) {
+      /* each chunk reserves a byte for the NUL terminator */
+      size_t size = len + 1 + sizeof(*c);
+      if (size > ws_pool_class2size(WS_POOL_CLASSES - 1))
+        size = ws_pool_class2size(WS_POOL_CLASSES - 1);
+      c = ws_pool_alloc(&size);
+      if (!c)
+        return -1;
+      *c = (ws_msg_chunk_s){.capa = size - sizeof(*c) - 1};
+      ws->msg_mem += size;
+      if (ws->msg_last)
+        ws->msg_last->next = c;
+      else
+        ws->msg = c;
+      ws->msg_last = c;
+    }
+    size_t to_copy = c->capa - c->len;
+    if (to_copy > len)
+      to_copy = len;
+    memcpy(c->data + c->len, data, to_copy);
+    c->len += to_copy;
+    data += to_copy;
+    len -= to_copy;
+  }
+  return 0;
+}
+
+/* calls `on_message` with the collected message and releases the fragments */
+static void websocket_msg_finish(ws_s *ws) {
+  if (!ws->msg || ws->msg == ws->msg_last) {
+    char *msg = (char *)"";
+    if (ws->msg) {
+      msg = ws->msg->data;
+      msg[ws->msg->len] = 0;
+    }
+    ws->on_message(ws, (fio_str_info_s){.data = msg, .len = ws->msg_len},
+                   ws->is_text);
+    websocket_msg_clear(ws);
+    return;
+  }
+  char *msg = fio_malloc(ws->msg_len + 1);
+  if (!msg) {
+    websocket_msg_clear(ws);
+    websocket_close(ws);
+    return;
+  }
+  size_t pos = 0;
+  for (ws_msg_chunk_s *c = ws->msg; c; c = c->next) {
+    memcpy(msg + pos, c->data, c->len);
+    pos += c->len;
+  }
+  msg[pos] = 0;
+  websocket_msg_clear(ws);
+  ws->on_message(ws, (fio_str_info_s){.data = msg, .len = pos}, ws->is_text);
+  fio_free(msg);
+}
+
 /* *****************************************************************************
 Callbacks - Required functions for websocket_parser.h
 ***************************************************************************** */
@@ -159,13 +353,15 @@ static void websocket_on_unwrapped(void *ws_p, void *msg, uint64_t len,
   }
   if (first) {
     ws->is_text = (uint8_t)text;
-    if (ws->msg == FIOBJ_INVALID)
-      ws->msg = fiobj_str_buf(len);
-    fiobj_str_resize(ws->msg, 0);
+    websocket_msg_clear(ws);
+  }
+  if (websocket_msg_write(ws, msg, len)) {
+    websocket_msg_clear(ws);
+    websocket_close(ws);
+    return;
   }
-  fiobj_str_write(ws->msg, msg, len);
   if (last) {
-    ws->on_message(ws, fiobj_obj2cstr(ws->msg), ws->is_text);
+    websocket_msg_finish(ws);
   }
 
   (void)rsv;
@@ -244,6 +440,30 @@ static uint8_t on_shutdown(intptr_t fd, fio_protocol_s *ws) {
   return 0;
 }
 
+/* updates the memory charged to the connection for its buffers */
+static inline void websocket_mem_update(ws_s *ws) {
+  size_t mem = ws->buffer.size + ws->msg_mem;
+  if (mem == ws->mem)
+    return;
+  fio_uuid_mem_charge(ws->fd, (ssize_t)mem - (ssize_t)ws->mem);
+  ws->mem = mem;
+}
+
+/* releases (or shrinks) the socket buffer once all data was consumed */
+static inline void websocket_buffer_compact(ws_s *ws) {
+  if (ws->length || !ws->buffer.data)
+    return;
+#if WS_IDLE_BUFFER_SIZE
+  if (ws->buffer.size <= WS_IDLE_BUFFER_SIZE)
+    return;
+  ws->buffer.size = WS_IDLE_BUFFER_SIZE;
+  ws->buffer = resize_ws_buffer(ws, ws->buffer);
+#else
+  free_ws_buffer(ws, ws->buffer);
+  ws->buffer = (struct buffer_s){.data = NULL, .size = 0};
+#endif
+}
+
 static void on_data(intptr_t sockfd, fio_protocol_s *ws_) {
   ws_s *const ws = (ws_s *)ws_;
   if (ws == NULL)
@@ -271,10 +491,14 @@ static void on_data(intptr_t sockfd, fio_protocol_s *ws_) {
   const ssize_t len = fio_read(sockfd, (uint8_t *)ws->buffer.data + ws->length,
                                ws->buffer.size - ws->length);
   if (len <= 0) {
+    websocket_buffer_compact(ws);
+    websocket_mem_update(ws);
     return;
   }
   ws->length = websocket_consume(ws->buffer.data, ws->length + len, ws,
                                  (~(ws->is_client) & 1));
+  websocket_buffer_compact(ws);
+  websocket_mem_update(ws);
 
   fio_force_event(sockfd, FIO_EVENT_ON_DATA);
 }
@@ -290,13 +514,16 @@ static void on_data_first(intptr_t sockfd, fio_protocol_s *ws_) {
     ws->length = websocket_consume(ws->buffer.data, ws->length, ws,
                                    (~(ws->is_client) & 1));
   }
+  websocket_buffer_compact(ws);
+  websocket_mem_update(ws);
   fio_force_event(sockfd, FIO_EVENT_ON_DATA);
   fio_force_event(sockfd, FIO_EVENT_ON_READY);
 }
 
 /* later */
 static void websocket_write_impl(intptr_t fd, void *data, size_t len, char text,
-                                 char first, char last, char client);
+                                 char first, char last, char client,
+                                 uintptr_t key);
 
 /*******************************************************************************
 Create/Destroy the websocket object
@@ -320,8 +547,7 @@ static ws_s *new_websocket(intptr_t uuid) {
 static void destroy_ws(ws_s *ws) {
   if (ws->on_close)
     ws->on_close(ws->fd, ws->udata);
-  if (ws->msg)
-    fiobj_free(ws->msg);
+  websocket_msg_clear(ws);
   clear_subscriptions(ws);
   free_ws_buffer(ws, ws->buffer);
   free(ws);
@@ -331,8 +557,6 @@ void websocket_attach(intptr_t uuid, http_settings_s *http_settings,
                       websocket_settings_s *args, void *data, size_t length) {
   ws_s *ws = new_websocket(uuid);
   FIO_ASSERT_ALLOC(ws);
-  // we have an active websocket connection - prep the connection buffer
-  ws->buffer = create_ws_buffer(ws);
   // Setup ws callbacks
   ws->on_open = args->on_open;
   ws->on_close = args->on_close;
@@ -346,6 +570,11 @@ void websocket_attach(intptr_t uuid, http_settings_s *http_settings,
     ws->is_client = http_settings->is_client;
     // buffer limits
     ws->max_msg_size = http_settings->ws_max_msg_size;
+    // send queue limits
+    if (http_settings->ws_queue_limit || http_settings->ws_queue_msgs)
+      fio_queue_limit_set(uuid, http_settings->ws_queue_limit,
+                          http_settings->ws_queue_msgs,
+                          (fio_queue_policy_e)http_settings->ws_queue_policy);
     // update the timeout
     fio_timeout_set(uuid, http_settings->ws_timeout);
   } else {
@@ -354,6 +583,8 @@ void websocket_attach(intptr_t uuid, http_settings_s *http_settings,
   }
 
   if (data && length) {
+    // prep the connection buffer for the leftover data
+    ws->buffer = create_ws_buffer(ws);
     if (length > ws->buffer.size) {
       ws->buffer.size = length;
       ws->buffer = resize_ws_buffer(ws, ws->buffer);
@@ -367,6 +598,7 @@ void websocket_attach(intptr_t uuid, http_settings_s *http_settings,
     memcpy(ws->buffer.data, data, length);
     ws->length = length;
   }
+  websocket_mem_update(ws);
   // update the protocol object, cleaning up the old one
   fio_attach(uuid, (fio_protocol_s *)ws);
   // allow the on_open and on_data to take over the control.
@@ -380,24 +612,28 @@ Writing to the Websocket
   (FIO_MEMORY_BLOCK_ALLOC_LIMIT - 4096) // should be less then `unsigned short`
 
 static void websocket_write_impl(intptr_t fd, void *data, size_t len, char text,
-                                 char first, char last, char client) {
+                                 char first, char last, char client,
+                                 uintptr_t key) {
   if (len <= WS_MAX_FRAME_SIZE) {
     void *buff = fio_malloc(len + 16);
     len = (client ? websocket_client_wrap(buff, data, len, (text ? 1 : 2),
                                           first, last, 0)
                   : websocket_server_wrap(buff, data, len, (text ? 1 : 2),
                                           first, last, 0));
+    /* complete messages can be dropped by the send queue policy */
     fio_write2(fd, .data.buffer = buff, .length = len,
-               .after.dealloc = fio_free);
+               .after.dealloc = fio_free, .droppable = (first && last),
+               .key = key);
   } else {
     /* frame fragmentation is better for large data then large frames */
     while (len > WS_MAX_FRAME_SIZE) {
-      websocket_write_impl(fd, data, WS_MAX_FRAME_SIZE, text, first, 0, client);
+      websocket_write_impl(fd, data, WS_MAX_FRAME_SIZE, text, first, 0, client,
+                           key);
       data = ((uint8_t *)data) + WS_MAX_FRAME_SIZE;
       first = 0;
       len -= WS_MAX_FRAME_SIZE;
     }
-    websocket_write_impl(fd, data, len, text, first, 1, client);
+    websocket_write_impl(fd, data, len, text, first, 1, client, key);
   }
   return;
 }
@@ -541,6 +777,11 @@ static inline void websocket_on_pubsub_message_direct_internal(fio_msg_s *msg,
   }
   FIOBJ message = FIOBJ_INVALID;
   FIOBJ pre_wrapped = FIOBJ_INVALID;
+  /* the channel is the message key for the send queue's keep latest policy */
+  const uintptr_t key =
+      (msg->filter ? (uintptr_t)msg->filter
+                   : (uintptr_t)fio_risky_hash(msg->channel.data,
+                                               msg->channel.len, 0));
   if (!((ws_s *)pr)->is_client) {
     /* pre-wrapping is only for client data */
     switch (txt) {
@@ -561,7 +802,12 @@ static inline void websocket_on_pubsub_message_direct_internal(fio_msg_s *msg,
     if (pre_wrapped) {
       // FIO_LOG_DEBUG(
       //     "pub/sub WebSocket optimization route for pre-wrapped message.");
-      fiobj_send_free((intptr_t)msg->udata1, fiobj_dup(pre_wrapped));
+      fio_str_info_s wrapped = fiobj_obj2cstr(pre_wrapped);
+      fio_write2((intptr_t)msg->udata1,
+                 .data.buffer = (void *)fiobj_dup(pre_wrapped),
+                 .offset = (uintptr_t)wrapped.data - (uintptr_t)pre_wrapped,
+                 .length = wrapped.len, .after.dealloc = fiobj4sock_dealloc,
+                 .droppable = 1, .key = key);
       goto finish;
     }
   }
@@ -571,7 +817,8 @@ static inline void websocket_on_pubsub_message_direct_internal(fio_msg_s *msg,
         FIO_STR_INIT_STATIC2(msg->msg.data, msg->msg.len); // don't free
     txt = (tmp.len >= (2 << 14) ? 0 : fio_str_utf8_valid(&tmp));
   }
-  websocket_write((ws_s *)pr, msg->msg, txt & 1);
+  websocket_write_impl((intptr_t)msg->udata1, msg->msg.data, msg->msg.len,
+                       txt & 1, 1, 1, ((ws_s *)pr)->is_client, key);
   fiobj_free(message);
 finish:
   fio_protocol_unlock(pr, FIO_PR_LOCK_WRITE);
@@ -659,7 +906,8 @@ uintptr_t websocket_subscribe(struct websocket_subscribe_s args) {
       fio_subscribe(.channel = args.channel, .match = args.match,
                     .on_unsubscribe = websocket_on_unsubscribe,
                     .on_message = handler, .udata1 = (void *)args.ws->fd,
-                    .udata2 = d);
+                    .udata2 = d, .conflate = args.conflate,
+                    .replay_since = args.replay_since);
   if (!sub) {
     /* don't free `d`, return (`d` freed by fio_subscribe) */
     return 0;
@@ -717,7 +965,7 @@ uint8_t websocket_is_client(ws_s *ws) { return ws->is_client; }
 int websocket_write(ws_s *ws, fio_str_info_s msg, uint8_t is_text) {
   if (fio_is_valid(ws->fd)) {
     websocket_write_impl(ws->fd, msg.data, msg.len, is_text, 1, 1,
-                         ws->is_client);
+                         ws->is_client, 0);
     return 0;
   }
   return -1;
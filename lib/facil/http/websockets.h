@@ -112,6 +112,16 @@ struct websocket_subscribe_s {
    *
    */
   unsigned force_text : 1;
+  /**
+   * If set, a lagging client only receives the newest message per channel
+   * (undelivered messages are replaced by newer ones).
+   */
+  unsigned conflate : 1;
+  /**
+   * If set, the channel's history is replayed from this sequence number (see
+   * `fio_pubsub_history_set`).
+   */
+  uint64_t replay_since;
 };
 
 /**
@@ -0,0 +1,1042 @@
+/*
+Copyright: Boaz segev, 2016-2019
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+
+#define FIO_INCLUDE_LINKED_LIST
+#define FIO_INCLUDE_STR
+// #define DEBUG 1
+#include <fio.h>
+
+#include <node_engine.h>
+
+/** The size of each connection's read buffer (larger frames are allocated). */
+#define NODE_READ_BUFFER 16384
+/** The number of socket reads performed for each `on_data` event. */
+#define NODE_READ_ROUNDS 8
+/** The number of milliseconds between reconnection attempts. */
+#ifndef NODE_RECONNECT_INTERVAL
+#define NODE_RECONNECT_INTERVAL 1000
+#endif
+
+/** The length of the random challenge sent with the HELLO frame. */
+#define NODE_NONCE_LENGTH 16
+/** The length of the proof sent with the AUTH frame (a SHA-256 digest). */
+#define NODE_PROOF_LENGTH 32
+
+/* frame size limits, matching the cluster's limits */
+#define NODE_CHANNEL_LIMIT (1024 * 1024 * 16)
+#define NODE_MESSAGE_LIMIT (1024 * 1024 * 64)
+/* the longest frame accepted before the peer authenticated (HELLO or AUTH) */
+#define NODE_HANDSHAKE_LIMIT                                                   \
+  (16 + ((8 + NODE_NONCE_LENGTH) > NODE_PROOF_LENGTH ? (8 + NODE_NONCE_LENGTH) \
+                                                     : NODE_PROOF_LENGTH))
+
+/*
+ * Frames use facil.io's cluster framing: a 16 byte header containing the
+ * channel length, the message length, the message type and a filter (all
+ * 32 bit, network byte order), followed by the channel and the message.
+ *
+ * The message types mirror the cluster's message types.
+ */
+typedef enum {
+  NODE_MSG_FORWARD = 0,
+  NODE_MSG_JSON = 1,
+  NODE_MSG_PUBSUB_SUB = 4,
+  NODE_MSG_PUBSUB_UNSUB = 5,
+  NODE_MSG_PATTERN_SUB = 6,
+  NODE_MSG_PATTERN_UNSUB = 7,
+  NODE_MSG_PING = 10,
+  /* the node's identity (the channel is the node's 64 bit id) and a random
+   * challenge (the message) */
+  NODE_MSG_HELLO = 0x200,
+  /* the answer to the peer's challenge, proving the secret is known (the
+   * connecting node answers first, the accepting node answers only after
+   * validating that answer) */
+  NODE_MSG_AUTH = 0x201,
+} node_msg_type_e;
+
+/* *****************************************************************************
+The Node Engine and Connection Objects
+***************************************************************************** */
+
+/* a (counted) collection of channel names */
+#define FIO_SET_NAME node_interest
+#define FIO_SET_OBJ_TYPE uintptr_t
+#define FIO_SET_KEY_TYPE fio_str_s
+#define FIO_SET_KEY_COPY(k1, k2)                                               \
+  (k1) = FIO_STR_INIT;                                                         \
+  fio_str_concat(&(k1), &(k2))
+#define FIO_SET_KEY_COMPARE(k1, k2) fio_str_iseq(&(k1), &(k2))
+#define FIO_SET_KEY_DESTROY(key) fio_str_free(&(key))
+#include <fio.h>
+
+typedef struct node_engine_s node_engine_s;
+
+/* a peer listed in the `nodes` argument (we initiate these connections) */
+typedef struct {
+  node_engine_s *engine;
+  char *address;
+  char *port;
+  /* the connection's uuid, -1 when disconnected */
+  intptr_t uuid;
+  /* the peer's node id, once known */
+  uint64_t id;
+  /* set while a reconnection attempt is scheduled */
+  fio_lock_i pending;
+  /* set when the address belongs to the local node */
+  uint8_t self;
+} node_peer_s;
+
+/* a connection to a peer node (either accepted or initiated) */
+typedef struct {
+  fio_protocol_s protocol;
+  fio_ls_embd_s node;
+  node_engine_s *engine;
+  /* the peer we connected to, NULL for accepted connections */
+  node_peer_s *peer;
+  intptr_t uuid;
+  /* the remote node's id (valid after the HELLO frame) */
+  uint64_t id;
+  /* the challenge we sent the remote node */
+  uint8_t nonce[NODE_NONCE_LENGTH];
+  /* the challenge the remote node sent us */
+  uint8_t peer_nonce[NODE_NONCE_LENGTH];
+  /* the remote node's subscription interest */
+  node_interest_s channels;
+  node_interest_s patterns;
+  size_t everything;
+  fio_lock_i lock;
+  /* publications are only sent to ready connections */
+  volatile uint8_t ready;
+  /* set once the HELLO frame was received */
+  uint8_t greeted;
+  /* set once the remote node proved it knows the secret */
+  uint8_t authenticated;
+  /* a frame that doesn't fit in the read buffer */
+  uint8_t *frame;
+  size_t frame_len;
+  size_t frame_pos;
+  size_t buf_pos;
+  uint8_t buf[NODE_READ_BUFFER];
+} node_connection_s;
+
+struct node_engine_s {
+  fio_pubsub_engine_s en;
+  fio_protocol_s listener;
+  intptr_t listen_uuid;
+  subscription_s *publication_forwarder;
+  /* the local (cluster wide) subscription interest, counted */
+  node_interest_s channels;
+  node_interest_s patterns;
+  /* the number of patterns using a custom match function */
+  size_t everything;
+  fio_ls_embd_s connections;
+  uint64_t id;
+  size_t ref;
+  char *address;
+  char *port;
+  char *secret;
+  size_t secret_len;
+  size_t peer_count;
+  fio_lock_i lock;
+  uint8_t ping_int;
+  volatile uint8_t flag;
+  node_peer_s peers[];
+};
+
+/** converts from a listening protocol to a `node_engine_s`. */
+#define listener2node(pr) FIO_LS_EMBD_OBJ(node_engine_s, listener, (pr))
+
+/** cleans up and frees the engine data. */
+static inline void node_free(node_engine_s *e) {
+  if (fio_atomic_sub(&e->ref, 1))
+    return;
+  fio_unsubscribe(e->publication_forwarder);
+  e->publication_forwarder = NULL;
+  node_interest_free(&e->channels);
+  node_interest_free(&e->patterns);
+  fio_free(e);
+}
+
+/** hashes a channel name for the interest collections. */
+static inline uint64_t node_hash(fio_str_info_s ch) {
+  fio_str_s tmp = FIO_STR_INIT_EXISTING(ch.data, ch.len, 0); // don't free
+  return fio_str_hash(&tmp);
+}
+
+/* *****************************************************************************
+Framing
+***************************************************************************** */
+
+/** appends a frame to the `dest` String. */
+static void node_frame_write(fio_str_s *dest, uint32_t type, int32_t filter,
+                             fio_str_info_s ch, fio_str_info_s msg) {
+  char header[16];
+  fio_u2str32((uint8_t *)header, ch.len);
+  fio_u2str32((uint8_t *)(header + 4), msg.len);
+  fio_u2str32((uint8_t *)(header + 8), type);
+  fio_u2str32((uint8_t *)(header + 12), (uint32_t)filter);
+  fio_str_write(dest, header, 16);
+  if (ch.len)
+    fio_str_write(dest, ch.data, ch.len);
+  if (msg.len)
+    fio_str_write(dest, msg.data, msg.len);
+}
+
+/** sends a single frame through the connection. */
+static void node_frame_send(intptr_t uuid, uint32_t type, int32_t filter,
+                            fio_str_info_s ch, fio_str_info_s msg) {
+  fio_str_s *frame = fio_str_new2();
+  node_frame_write(frame, type, filter, ch, msg);
+  fio_str_send_free2(uuid, frame);
+}
+
+/** sends a frame to all the ready connections (engine lock must be held). */
+static void node_broadcast_unsafe(node_engine_s *e, uint32_t type,
+                                  int32_t filter, fio_str_info_s ch,
+                                  fio_str_info_s msg) {
+  fio_str_s frame = FIO_STR_INIT;
+  FIO_LS_EMBD_FOR(&e->connections, pos) {
+    node_connection_s *c = FIO_LS_EMBD_OBJ(node_connection_s, node, pos);
+    if (!c->ready)
+      continue;
+    if (!fio_str_len(&frame))
+      node_frame_write(&frame, type, filter, ch, msg);
+    fio_str_info_s i = fio_str_info(&frame);
+    fio_write(c->uuid, i.data, i.len);
+  }
+  fio_str_free(&frame);
+}
+
+/** sends the local subscription interest (engine lock must be held). */
+static void node_send_interest_unsafe(node_engine_s *e, node_connection_s *c) {
+  fio_str_s *frames = fio_str_new2();
+  FIO_SET_FOR_LOOP(&e->channels, pos) {
+    if (!pos->hash)
+      continue;
+    node_frame_write(frames, NODE_MSG_PUBSUB_SUB, 0,
+                     fio_str_info(&pos->obj.key), (fio_str_info_s){.len = 0});
+  }
+  FIO_SET_FOR_LOOP(&e->patterns, pos) {
+    if (!pos->hash)
+      continue;
+    node_frame_write(frames, NODE_MSG_PATTERN_SUB, 0,
+                     fio_str_info(&pos->obj.key), (fio_str_info_s){.len = 0});
+  }
+  if (e->everything)
+    node_frame_write(frames, NODE_MSG_PATTERN_SUB, 1,
+                     (fio_str_info_s){.len = 0}, (fio_str_info_s){.len = 0});
+  if (fio_str_len(frames))
+    fio_str_send_free2(c->uuid, frames);
+  else
+    fio_str_free2(frames);
+}
+
+/* *****************************************************************************
+Remote Subscription Interest
+***************************************************************************** */
+
+/** returns 1 if the remote node has subscribers for the channel. */
+static int node_connection_wants(node_connection_s *c, fio_str_info_s ch,
+                                 uint64_t hashed) {
+  int ret = 0;
+  fio_lock(&c->lock);
+  if (c->everything) {
+    ret = 1;
+    goto finish;
+  }
+  if (node_interest_find(&c->channels, hashed,
+                         FIO_STR_INIT_EXISTING(ch.data, ch.len, 0))) {
+    ret = 1;
+    goto finish;
+  }
+  FIO_SET_FOR_LOOP(&c->patterns, pos) {
+    if (!pos->hash)
+      continue;
+    if (FIO_MATCH_GLOB(fio_str_info(&pos->obj.key), ch)) {
+      ret = 1;
+      goto finish;
+    }
+  }
+finish:
+  fio_unlock(&c->lock);
+  return ret;
+}
+
+/** updates the remote node's subscription interest. */
+static void node_connection_interest(node_connection_s *c, uint32_t type,
+                                     int32_t filter, fio_str_info_s ch) {
+  node_interest_s *set =
+      (type == NODE_MSG_PUBSUB_SUB || type == NODE_MSG_PUBSUB_UNSUB)
+          ? &c->channels
+          : &c->patterns;
+  fio_str_s key = FIO_STR_INIT_EXISTING(ch.data, ch.len, 0); // don't free
+  fio_lock(&c->lock);
+  switch (type) {
+  case NODE_MSG_PUBSUB_SUB: /* fallthrough */
+  case NODE_MSG_PATTERN_SUB:
+    if (filter)
+      ++c->everything;
+    else
+      node_interest_insert(set, node_hash(ch), key, 1, NULL);
+    break;
+  case NODE_MSG_PUBSUB_UNSUB: /* fallthrough */
+  case NODE_MSG_PATTERN_UNSUB:
+    if (!filter)
+      node_interest_remove(set, node_hash(ch), key, NULL);
+    else if (c->everything)
+      --c->everything;
+    break;
+  }
+  fio_unlock(&c->lock);
+}
+
+/* *****************************************************************************
+Connection Callbacks (fio_protocol_s)
+***************************************************************************** */
+
+/** defined later - schedules a reconnection attempt. */
+static void node_peer_schedule(node_peer_s *p);
+
+/** returns 1 if a ready connection to the node exists (engine lock held). */
+static int node_is_connected_unsafe(node_engine_s *e, uint64_t id) {
+  FIO_LS_EMBD_FOR(&e->connections, pos) {
+    node_connection_s *c = FIO_LS_EMBD_OBJ(node_connection_s, node, pos);
+    if (c->ready && c->id == id)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * computes the answer to a challenge:
+ *
+ *     SHA-256(secret + role + challenge + prover's nonce + prover's id)
+ *
+ * The role (1 if the prover initiated the connection) and both nonces bind the
+ * answer to a single connection and direction, so an answer can't be relayed
+ * to another node or reflected back to the challenger.
+ */
+static void node_proof(node_engine_s *e, uint8_t initiator, uint8_t *challenge,
+                       uint8_t *nonce, uint64_t id, uint8_t *dest) {
+  char tmp[8];
+  fio_u2str64(tmp, id);
+  fio_sha2_s sha2 = fio_sha2_init(SHA_256);
+  fio_sha2_write(&sha2, e->secret, e->secret_len);
+  fio_sha2_write(&sha2, &initiator, 1);
+  fio_sha2_write(&sha2, challenge, NODE_NONCE_LENGTH);
+  fio_sha2_write(&sha2, nonce, NODE_NONCE_LENGTH);
+  fio_sha2_write(&sha2, tmp, 8);
+  memcpy(dest, fio_sha2_result(&sha2), NODE_PROOF_LENGTH);
+}
+
+/** answers the remote node's challenge. */
+static void node_auth_send(node_connection_s *c) {
+  node_engine_s *e = c->engine;
+  uint8_t proof[NODE_PROOF_LENGTH];
+  node_proof(e, (c->peer != NULL), c->peer_nonce, c->nonce, e->id, proof);
+  node_frame_send(c->uuid, NODE_MSG_AUTH, 0, (fio_str_info_s){.len = 0},
+                  (fio_str_info_s){.data = (char *)proof,
+                                   .len = NODE_PROOF_LENGTH});
+}
+
+/**
+ * handles the remote node's identity. Only the connecting node answers the
+ * challenge at this point, otherwise anyone could use a node to answer
+ * another node's challenge.
+ */
+static void node_on_hello(node_connection_s *c, uint64_t id, uint8_t *nonce) {
+  node_engine_s *e = c->engine;
+  if (id == e->id) {
+    /* we connected to ourselves */
+    if (c->peer)
+      c->peer->self = 1;
+    fio_close(c->uuid);
+    return;
+  }
+  c->id = id;
+  c->greeted = 1;
+  memcpy(c->peer_nonce, nonce, NODE_NONCE_LENGTH);
+  if (c->peer)
+    node_auth_send(c);
+}
+
+/**
+ * validates the answer to our challenge, readying the connection (an accepted
+ * connection answers the remote node's challenge only now).
+ */
+static void node_on_auth(node_connection_s *c, uint8_t *answer) {
+  node_engine_s *e = c->engine;
+  const uint64_t id = c->id;
+  uint8_t proof[NODE_PROOF_LENGTH];
+  uint8_t diff = 0;
+  node_proof(e, (c->peer == NULL), c->nonce, c->peer_nonce, id, proof);
+  for (size_t i = 0; i < NODE_PROOF_LENGTH; ++i)
+    diff |= proof[i] ^ answer[i];
+  if (diff) {
+    FIO_LOG_WARNING("(node %d) node %p failed to authenticate "
+                    "(wrong secret?), disconnecting.",
+                    (int)getpid(), (void *)id);
+    fio_close(c->uuid);
+    return;
+  }
+  c->authenticated = 1;
+  if (c->peer)
+    c->peer->id = id;
+  else
+    node_auth_send(c);
+  /* nodes connecting to each other should keep only one connection, the one
+   * initiated by the node with the lower id. */
+  const uint64_t keeper = (e->id < id) ? e->id : id;
+  fio_lock(&e->lock);
+  FIO_LS_EMBD_FOR(&e->connections, pos) {
+    node_connection_s *o = FIO_LS_EMBD_OBJ(node_connection_s, node, pos);
+    if (o == c || !o->ready || o->id != id)
+      continue;
+    if ((c->peer ? e->id : id) != keeper && (o->peer ? e->id : id) == keeper) {
+      fio_unlock(&e->lock);
+      FIO_LOG_DEBUG("(node %d) dropping duplicate connection to %p.",
+                    (int)getpid(), (void *)id);
+      fio_close(c->uuid);
+      return;
+    }
+    o->ready = 0;
+    fio_close(o->uuid);
+  }
+  c->ready = 1;
+  node_send_interest_unsafe(e, c);
+  fio_unlock(&e->lock);
+  FIO_LOG_INFO("(node %d) connected to node %p.", (int)getpid(), (void *)id);
+}
+
+/** handles a complete frame. */
+static void node_on_frame(node_connection_s *c, uint8_t *frame) {
+  const uint32_t type = fio_str2u32(frame + 8);
+  const int32_t filter = (int32_t)fio_str2u32(frame + 12);
+  fio_str_info_s ch = {.data = (char *)frame + 16, .len = fio_str2u32(frame)};
+  fio_str_info_s msg = {.data = ch.data + ch.len,
+                        .len = fio_str2u32(frame + 4)};
+  switch ((node_msg_type_e)type) {
+  case NODE_MSG_FORWARD: /* fallthrough */
+  case NODE_MSG_JSON:
+    if (!c->authenticated)
+      break;
+    if (!c->ready)
+      return;
+    /* deliver to the local cluster, never forwarding it to other nodes */
+    fio_publish(.channel = ch, .message = msg, .engine = FIO_PUBSUB_CLUSTER,
+                .is_json = (type == NODE_MSG_JSON));
+    return;
+  case NODE_MSG_PUBSUB_SUB:   /* fallthrough */
+  case NODE_MSG_PUBSUB_UNSUB: /* fallthrough */
+  case NODE_MSG_PATTERN_SUB:  /* fallthrough */
+  case NODE_MSG_PATTERN_UNSUB:
+    if (!c->authenticated)
+      break;
+    node_connection_interest(c, type, filter, ch);
+    return;
+  case NODE_MSG_PING:
+    return;
+  case NODE_MSG_HELLO:
+    if (c->greeted || ch.len != 8 || msg.len != NODE_NONCE_LENGTH)
+      break;
+    node_on_hello(c, fio_str2u64(ch.data), (uint8_t *)msg.data);
+    return;
+  case NODE_MSG_AUTH:
+    if (!c->greeted || c->authenticated || msg.len != NODE_PROOF_LENGTH)
+      break;
+    node_on_auth(c, (uint8_t *)msg.data);
+    return;
+  }
+  FIO_LOG_WARNING("(node %d) unexpected frame (type %u), disconnecting.",
+                  (int)getpid(), (unsigned int)type);
+  fio_close(c->uuid);
+}
+
+/** Called when a data is available, but will not run concurrently */
+static void node_on_data(intptr_t uuid, fio_protocol_s *pr) {
+  node_connection_s *c = (node_connection_s *)pr;
+  for (size_t rounds = NODE_READ_ROUNDS; rounds; --rounds) {
+    ssize_t r;
+    if (c->frame) {
+      /* large frames are read directly to their own buffer */
+      r = fio_read(uuid, c->frame + c->frame_pos, c->frame_len - c->frame_pos);
+      if (r <= 0)
+        return;
+      c->frame_pos += r;
+      if (c->frame_pos < c->frame_len)
+        continue;
+      node_on_frame(c, c->frame);
+      fio_free(c->frame);
+      c->frame = NULL;
+      continue;
+    }
+    r = fio_read(uuid, c->buf + c->buf_pos, NODE_READ_BUFFER - c->buf_pos);
+    if (r <= 0)
+      return;
+    c->buf_pos += r;
+    size_t i = 0;
+    while (c->buf_pos - i >= 16) {
+      const uint32_t ch_len = fio_str2u32(c->buf + i);
+      const uint32_t msg_len = fio_str2u32(c->buf + i + 4);
+      if (ch_len >= NODE_CHANNEL_LIMIT || msg_len >= NODE_MESSAGE_LIMIT) {
+        FIO_LOG_ERROR("(node %d) frame too long (%u + %u bytes), "
+                      "disconnecting.",
+                      (int)getpid(), (unsigned int)ch_len,
+                      (unsigned int)msg_len);
+        c->buf_pos = 0;
+        fio_close(uuid);
+        return;
+      }
+      const size_t total = 16 + (size_t)ch_len + msg_len;
+      if (!c->authenticated && total > NODE_HANDSHAKE_LIMIT) {
+        FIO_LOG_WARNING("(node %d) frame too long for the handshake "
+                        "(%zu bytes), disconnecting.",
+                        (int)getpid(), total);
+        c->buf_pos = 0;
+        fio_close(uuid);
+        return;
+      }
+      if (total > NODE_READ_BUFFER) {
+        c->frame = fio_malloc(total);
+        FIO_ASSERT_ALLOC(c->frame);
+        c->frame_len = total;
+        c->frame_pos = c->buf_pos - i;
+        memcpy(c->frame, c->buf + i, c->frame_pos);
+        i = c->buf_pos;
+        break;
+      }
+      if (i + total > c->buf_pos)
+        break;
+      node_on_frame(c, c->buf + i);
+      i += total;
+    }
+    if (i < c->buf_pos)
+      memmove(c->buf, c->buf + i, c->buf_pos - i);
+    c->buf_pos -= i;
+  }
+}
+
+/** Called when the connection was closed, but will not run concurrently */
+static void node_on_close(intptr_t uuid, fio_protocol_s *pr) {
+  node_connection_s *c = (node_connection_s *)pr;
+  node_engine_s *e = c->engine;
+  const uint8_t was_ready = c->ready;
+  c->ready = 0;
+  fio_lock(&e->lock);
+  fio_ls_embd_remove(&c->node);
+  fio_unlock(&e->lock);
+  if (e->flag) {
+    if (was_ready) {
+      FIO_LOG_WARNING("(node %d) connection to node %p lost.", (int)getpid(),
+                      (void *)c->id);
+      /* peers on standby for this node should reconnect */
+      for (size_t i = 0; i < e->peer_count; ++i) {
+        if (e->peers[i].id == c->id && e->peers[i].uuid == -1)
+          node_peer_schedule(e->peers + i);
+      }
+    }
+    if (c->peer) {
+      c->peer->uuid = -1;
+      node_peer_schedule(c->peer);
+    }
+  } else if (c->peer) {
+    c->peer->uuid = -1;
+  }
+  node_interest_free(&c->channels);
+  node_interest_free(&c->patterns);
+  fio_free(c->frame);
+  fio_free(c);
+  node_free(e);
+  (void)uuid;
+}
+
+/** Called on connection timeout. */
+static void node_ping(intptr_t uuid, fio_protocol_s *pr) {
+  node_frame_send(uuid, NODE_MSG_PING, 0, (fio_str_info_s){.len = 0},
+                  (fio_str_info_s){.len = 0});
+  (void)pr;
+}
+
+/** Initializes a connection object and attaches it to the reactor. */
+static void node_connection_attach(node_engine_s *e, node_peer_s *p,
+                                   intptr_t uuid) {
+  node_connection_s *c = fio_malloc(sizeof(*c));
+  FIO_ASSERT_ALLOC(c);
+  *c = (node_connection_s){
+      .protocol =
+          {
+              .on_data = node_on_data,
+              .on_close = node_on_close,
+              .ping = node_ping,
+          },
+      .engine = e,
+      .peer = p,
+      .uuid = uuid,
+      .lock = FIO_LOCK_INIT,
+  };
+  fio_atomic_add(&e->ref, 1);
+  fio_lock(&e->lock);
+  fio_ls_embd_push(&e->connections, &c->node);
+  fio_unlock(&e->lock);
+  if (p)
+    p->uuid = uuid;
+  char id[8];
+  fio_u2str64(id, e->id);
+  fio_rand_bytes(c->nonce, NODE_NONCE_LENGTH);
+  node_frame_send(uuid, NODE_MSG_HELLO, 0,
+                  (fio_str_info_s){.data = id, .len = 8},
+                  (fio_str_info_s){.data = (char *)c->nonce,
+                                   .len = NODE_NONCE_LENGTH});
+  fio_attach(uuid, &c->protocol);
+  fio_timeout_set(uuid, e->ping_int);
+}
+
+/* *****************************************************************************
+Listening for Nodes
+***************************************************************************** */
+
+/** Called when new peers are waiting to be accepted. */
+static void node_listen_on_data(intptr_t uuid, fio_protocol_s *pr) {
+  node_engine_s *e = listener2node(pr);
+  intptr_t client;
+  while ((client = fio_accept(uuid)) != -1) {
+    if (!e->flag) {
+      fio_close(client);
+      continue;
+    }
+    node_connection_attach(e, NULL, client);
+  }
+}
+
+/** Called when the listening socket was closed. */
+static void node_listen_on_close(intptr_t uuid, fio_protocol_s *pr) {
+  node_engine_s *e = listener2node(pr);
+  e->listen_uuid = -1;
+  if (e->flag) {
+    FIO_LOG_WARNING("(node %d) stopped listening for nodes on port %s.",
+                    (int)getpid(), e->port);
+  }
+  node_free(e);
+  (void)uuid;
+}
+
+/** Keeps the listening socket alive. */
+static void node_listen_ping(intptr_t uuid, fio_protocol_s *pr) {
+  fio_touch(uuid);
+  (void)pr;
+}
+
+/** returns 1 if the address is a loopback address. */
+static int node_is_local(const char *address) {
+  return !strcmp(address, "localhost") || !strncmp(address, "127.", 4) ||
+         !strcmp(address, "::1");
+}
+
+/** Opens the listening socket. */
+static void node_listen(node_engine_s *e) {
+  if (e->listen_uuid != -1)
+    return;
+  e->listen_uuid = fio_socket(e->address, e->port, 1);
+  if (e->listen_uuid == -1) {
+    FIO_LOG_ERROR("(node %d) couldn't listen for nodes on port %s.",
+                  (int)getpid(), e->port);
+    return;
+  }
+  e->listener = (fio_protocol_s){
+      .on_data = node_listen_on_data,
+      .on_close = node_listen_on_close,
+      .ping = node_listen_ping,
+  };
+  fio_atomic_add(&e->ref, 1);
+  fio_attach(e->listen_uuid, &e->listener);
+  FIO_LOG_INFO("(node %d) listening for nodes on %s:%s.", (int)getpid(),
+               e->address, e->port);
+  if (!e->secret_len && !node_is_local(e->address)) {
+    FIO_LOG_WARNING("(node %d) listening for nodes on %s without a secret, "
+                    "any host that can connect can subscribe and publish.",
+                    (int)getpid(), e->address);
+  }
+}
+
+/* *****************************************************************************
+Connecting to Nodes
+***************************************************************************** */
+
+static void node_on_connect(intptr_t uuid, void *p_) {
+  node_peer_s *p = p_;
+  node_engine_s *e = p->engine;
+  if (!e->flag) {
+    p->uuid = -1;
+    fio_close(uuid);
+  } else {
+    node_connection_attach(e, p, uuid);
+  }
+  node_free(e);
+}
+
+static void node_on_connect_failed(intptr_t uuid, void *p_) {
+  node_peer_s *p = p_;
+  node_engine_s *e = p->engine;
+  p->uuid = -1;
+  if (e->flag)
+    node_peer_schedule(p);
+  node_free(e);
+  (void)uuid;
+}
+
+/** Connects to a peer, unless it's already connected. */
+static void node_peer_connect(void *p_) {
+  node_peer_s *p = p_;
+  node_engine_s *e = p->engine;
+  fio_unlock(&p->pending);
+  if (!e->flag || p->self || p->uuid != -1 || !fio_is_running())
+    return;
+  if (p->id) {
+    /* the peer might have connected to us, keeping us on standby */
+    fio_lock(&e->lock);
+    int standby = node_is_connected_unsafe(e, p->id);
+    fio_unlock(&e->lock);
+    if (standby)
+      return;
+  }
+  fio_atomic_add(&e->ref, 1);
+  p->uuid = fio_connect(.address = p->address, .port = p->port,
+                        .on_connect = node_on_connect, .udata = p,
+                        .on_fail = node_on_connect_failed);
+}
+
+static void node_peer_connect_task(void *p, void *ignr) {
+  node_peer_connect(p);
+  (void)ignr;
+}
+
+/** releases the engine reference held by a reconnection timer. */
+static void node_peer_schedule_finish(void *p_) {
+  node_peer_s *p = p_;
+  node_free(p->engine);
+}
+
+/** schedules a reconnection attempt. */
+static void node_peer_schedule(node_peer_s *p) {
+  if (p->self || fio_trylock(&p->pending))
+    return;
+  fio_atomic_add(&p->engine->ref, 1);
+  fio_run_every(NODE_RECONNECT_INTERVAL, 1, node_peer_connect, p,
+                node_peer_schedule_finish);
+}
+
+/* *****************************************************************************
+Engine / Bridge Callbacks (Root Process)
+***************************************************************************** */
+
+static void node_on_subscribe_root(const fio_pubsub_engine_s *eng,
+                                   fio_str_info_s channel,
+                                   fio_match_fn match) {
+  node_engine_s *e = (node_engine_s *)eng;
+  int32_t filter = 0;
+  fio_lock(&e->lock);
+  if (match && match != FIO_MATCH_GLOB) {
+    /* custom match functions can't be evaluated by other nodes */
+    if (e->everything++)
+      goto finish;
+    filter = 1;
+    channel = (fio_str_info_s){.len = 0};
+  } else {
+    node_interest_s *set = match ? &e->patterns : &e->channels;
+    fio_str_s key = FIO_STR_INIT_EXISTING(channel.data, channel.len, 0);
+    const uint64_t hashed = node_hash(channel);
+    uintptr_t count = node_interest_find(set, hashed, key);
+    node_interest_insert(set, hashed, key, count + 1, NULL);
+    if (count)
+      goto finish;
+  }
+  node_broadcast_unsafe(e, match ? NODE_MSG_PATTERN_SUB : NODE_MSG_PUBSUB_SUB,
+                        filter, channel, (fio_str_info_s){.len = 0});
+finish:
+  fio_unlock(&e->lock);
+}
+
+static void node_on_unsubscribe_root(const fio_pubsub_engine_s *eng,
+                                     fio_str_info_s channel,
+                                     fio_match_fn match) {
+  node_engine_s *e = (node_engine_s *)eng;
+  int32_t filter = 0;
+  fio_lock(&e->lock);
+  if (match && match != FIO_MATCH_GLOB) {
+    if (!e->everything || --e->everything)
+      goto finish;
+    filter = 1;
+    channel = (fio_str_info_s){.len = 0};
+  } else {
+    node_interest_s *set = match ? &e->patterns : &e->channels;
+    fio_str_s key = FIO_STR_INIT_EXISTING(channel.data, channel.len, 0);
+    const uint64_t hashed = node_hash(channel);
+    uintptr_t count = node_interest_find(set, hashed, key);
+    if (count > 1) {
+      node_interest_insert(set, hashed, key, count - 1, NULL);
+      goto finish;
+    }
+    if (node_interest_remove(set, hashed, key, NULL))
+      goto finish;
+  }
+  node_broadcast_unsafe(
+      e, match ? NODE_MSG_PATTERN_UNSUB : NODE_MSG_PUBSUB_UNSUB, filter,
+      channel, (fio_str_info_s){.len = 0});
+finish:
+  fio_unlock(&e->lock);
+}
+
+static void node_on_publish_root(const fio_pubsub_engine_s *eng,
+                                 fio_str_info_s channel, fio_str_info_s msg,
+                                 uint8_t is_json) {
+  node_engine_s *e = (node_engine_s *)eng;
+  const uint32_t type = is_json ? NODE_MSG_JSON : NODE_MSG_FORWARD;
+  const uint64_t hashed = node_hash(channel);
+  fio_str_s frame = FIO_STR_INIT;
+  fio_lock(&e->lock);
+  FIO_LS_EMBD_FOR(&e->connections, pos) {
+    node_connection_s *c = FIO_LS_EMBD_OBJ(node_connection_s, node, pos);
+    if (!c->ready || !node_connection_wants(c, channel, hashed))
+      continue;
+    if (!fio_str_len(&frame))
+      node_frame_write(&frame, type, 0, channel, msg);
+    fio_str_info_s i = fio_str_info(&frame);
+    fio_write(c->uuid, i.data, i.len);
+  }
+  fio_unlock(&e->lock);
+  fio_str_free(&frame);
+  /* deliver to the local cluster */
+  fio_publish(.channel = channel, .message = msg, .engine = FIO_PUBSUB_CLUSTER,
+              .is_json = is_json);
+}
+
+/* *****************************************************************************
+Engine / Bridge Stub Callbacks (Child Process)
+***************************************************************************** */
+
+static void node_on_mock_subscribe_child(const fio_pubsub_engine_s *eng,
+                                         fio_str_info_s channel,
+                                         fio_match_fn match) {
+  /* do nothing, root process is notified about (un)subscriptions by facil.io */
+  (void)eng;
+  (void)channel;
+  (void)match;
+}
+
+static void node_on_publish_child(const fio_pubsub_engine_s *eng,
+                                  fio_str_info_s channel, fio_str_info_s msg,
+                                  uint8_t is_json) {
+  /* attach engine data to channel (prepend) */
+  fio_str_s tmp = FIO_STR_INIT;
+  /* by using fio_str_s, short names are allocated on the stack */
+  fio_str_info_s tmp_info = fio_str_resize(&tmp, channel.len + 8);
+  fio_u2str64(tmp_info.data, (uint64_t)eng);
+  memcpy(tmp_info.data + 8, channel.data, channel.len);
+  /* forward publication request to Root */
+  fio_publish(.filter = -1, .channel = tmp_info, .message = msg,
+              .engine = FIO_PUBSUB_ROOT, .is_json = is_json);
+  fio_str_free(&tmp);
+}
+
+/* *****************************************************************************
+Root Publication Handler
+***************************************************************************** */
+
+/* listens to filter -1 and publishes and messages */
+static void node_on_internal_publish(fio_msg_s *msg) {
+  if (msg->channel.len < 8)
+    return; /* internal error, unexpected data */
+  void *en = (void *)fio_str2u64(msg->channel.data);
+  if (en != msg->udata1)
+    return; /* should be delivered by a different engine */
+  /* step after the engine data */
+  msg->channel.len -= 8;
+  msg->channel.data += 8;
+  node_on_publish_root(msg->udata1, msg->channel, msg->msg, msg->is_json);
+}
+
+/* *****************************************************************************
+Node Engine Creation
+***************************************************************************** */
+
+static void node_on_facil_start(void *e_) {
+  node_engine_s *e = e_;
+  e->flag = 1;
+  node_listen(e);
+  for (size_t i = 0; i < e->peer_count; ++i) {
+    if (e->peers[i].uuid != -1 || e->peers[i].self)
+      continue;
+    e->peers[i].pending = FIO_LOCK_INIT;
+    fio_defer(node_peer_connect_task, e->peers + i, NULL);
+  }
+}
+
+static void node_on_facil_shutdown(void *e_) {
+  node_engine_s *e = e_;
+  e->flag = 0;
+}
+
+static void node_on_engine_fork(void *e_) {
+  node_engine_s *e = e_;
+  /* inherited connections are closed by facil.io, cleanup happens later */
+  e->flag = 0;
+  e->lock = FIO_LOCK_INIT;
+  e->en = (fio_pubsub_engine_s){
+      .subscribe = node_on_mock_subscribe_child,
+      .unsubscribe = node_on_mock_subscribe_child,
+      .publish = node_on_publish_child,
+  };
+  fio_unsubscribe(e->publication_forwarder);
+  e->publication_forwarder = NULL;
+}
+
+/** Parses the `nodes` list, returns the number of peers. */
+static size_t node_parse_peers(node_engine_s *e, char *list) {
+  size_t count = 0;
+  while (*list) {
+    char *end = list;
+    while (*end && *end != ',')
+      ++end;
+    char *next = end + (*end == ',');
+    *end = 0;
+    while (*list == ' ')
+      ++list;
+    while (end > list && end[-1] == ' ')
+      *(--end) = 0;
+    char *port = end;
+    while (port > list && port[-1] != ':')
+      --port;
+    if (port > list && *port) {
+      port[-1] = 0;
+      e->peers[count++] = (node_peer_s){
+          .engine = e,
+          .address = (port - 1 > list ? list : (char *)"localhost"),
+          .port = port,
+          .uuid = -1,
+          .pending = FIO_LOCK_INIT,
+      };
+    } else if (*list) {
+      FIO_LOG_WARNING("(node) invalid node address (missing port): %s", list);
+    }
+    list = next;
+  }
+  return count;
+}
+
+fio_pubsub_engine_s *node_engine_create
+FIO_IGNORE_MACRO(struct node_engine_create_args args) {
+  if (getpid() != fio_parent_pid()) {
+    FIO_LOG_FATAL("(node) Node engine initialization can only "
+                  "be performed in the Root process.");
+    kill(0, SIGINT);
+    fio_stop();
+    return NULL;
+  }
+  if (!args.address.len && args.address.data)
+    args.address.len = strlen(args.address.data);
+  if (!args.port.len && args.port.data)
+    args.port.len = strlen(args.port.data);
+  if (!args.nodes.len && args.nodes.data)
+    args.nodes.len = strlen(args.nodes.data);
+  if (!args.secret.len && args.secret.data)
+    args.secret.len = strlen(args.secret.data);
+  if (!args.address.data || !args.address.len) {
+    args.address = (fio_str_info_s){.len = 9, .data = (char *)"localhost"};
+  }
+  if (!args.port.data || !args.port.len) {
+    args.port = (fio_str_info_s){.len = 4, .data = (char *)"3333"};
+  }
+  /* the number of list entries limits the number of peers */
+  size_t peers = 1;
+  for (size_t i = 0; i < args.nodes.len; ++i)
+    peers += (args.nodes.data[i] == ',');
+  node_engine_s *e =
+      fio_malloc(sizeof(*e) + (sizeof(node_peer_s) * peers) +
+                 args.address.len + 1 + args.port.len + 1 + args.secret.len +
+                 1 + args.nodes.len + 1);
+  FIO_ASSERT_ALLOC(e);
+  char *strings = (char *)(e->peers + peers);
+  *e = (node_engine_s){
+      .en =
+          {
+              .subscribe = node_on_subscribe_root,
+              .unsubscribe = node_on_unsubscribe_root,
+              .publish = node_on_publish_root,
+          },
+      .listen_uuid = -1,
+      .publication_forwarder =
+          fio_subscribe(.filter = -1, .udata1 = e,
+                        .on_message = node_on_internal_publish),
+      .connections = FIO_LS_INIT(e->connections),
+      .id = fio_rand64(),
+      .ref = 1,
+      .address = strings,
+      .port = strings + args.address.len + 1,
+      .secret = strings + args.address.len + 1 + args.port.len + 1,
+      .secret_len = args.secret.len,
+      .lock = FIO_LOCK_INIT,
+      .ping_int = args.ping_interval,
+      .flag = 1,
+  };
+  memcpy(e->address, args.address.data, args.address.len);
+  e->address[args.address.len] = 0;
+  memcpy(e->port, args.port.data, args.port.len);
+  e->port[args.port.len] = 0;
+  if (args.secret.len)
+    memcpy(e->secret, args.secret.data, args.secret.len);
+  e->secret[args.secret.len] = 0;
+  char *list = e->secret + args.secret.len + 1;
+  if (args.nodes.len)
+    memcpy(list, args.nodes.data, args.nodes.len);
+  list[args.nodes.len] = 0;
+  e->peer_count = node_parse_peers(e, list);
+  fio_pubsub_attach(&e->en);
+  fio_state_callback_add(FIO_CALL_IN_CHILD, node_on_engine_fork, e);
+  fio_state_callback_add(FIO_CALL_ON_SHUTDOWN, node_on_facil_shutdown, e);
+  fio_state_callback_add(FIO_CALL_PRE_START, node_on_facil_start, e);
+  if (fio_is_running())
+    node_on_facil_start(e);
+
+  FIO_LOG_DEBUG("Node engine initialized %p", (void *)e);
+  return &e->en;
+}
+
+/** Returns the number of peer nodes currently connected to the engine. */
+size_t node_engine_count(fio_pubsub_engine_s *engine) {
+  node_engine_s *e = (node_engine_s *)engine;
+  size_t count = 0;
+  fio_lock(&e->lock);
+  FIO_LS_EMBD_FOR(&e->connections, pos) {
+    node_connection_s *c = FIO_LS_EMBD_OBJ(node_connection_s, node, pos);
+    count += c->ready;
+  }
+  fio_unlock(&e->lock);
+  return count;
+}
+
+/* *****************************************************************************
+Node Engine Destruction
+***************************************************************************** */
+
+void node_engine_destroy(fio_pubsub_engine_s *engine) {
+  node_engine_s *e = (node_engine_s *)engine;
+  e->flag = 0;
+  fio_pubsub_detach(&e->en);
+  fio_state_callback_remove(FIO_CALL_IN_CHILD, node_on_engine_fork, e);
+  fio_state_callback_remove(FIO_CALL_ON_SHUTDOWN, node_on_facil_shutdown, e);
+  fio_state_callback_remove(FIO_CALL_PRE_START, node_on_facil_start, e);
+  fio_close(e->listen_uuid);
+  fio_lock(&e->lock);
+  FIO_LS_EMBD_FOR(&e->connections, pos) {
+    node_connection_s *c = FIO_LS_EMBD_OBJ(node_connection_s, node, pos);
+    c->ready = 0;
+    fio_close(c->uuid);
+  }
+  fio_unlock(&e->lock);
+  FIO_LOG_DEBUG("Node engine destroyed %p", (void *)e);
+  node_free(e);
+}
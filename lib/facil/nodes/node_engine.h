@@ -0,0 +1,87 @@
+/*
+Copyright: Boaz segev, 2016-2019
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+#ifndef H_NODE_ENGINE_H
+#define H_NODE_ENGINE_H
+
+#include <fio.h>
+
+/* support C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** possible arguments for the `node_engine_create` function call */
+struct node_engine_create_args {
+  /**
+   * The address on which to listen for other nodes, defaults to `localhost`.
+   *
+   * Nodes on other machines require a public (or private network) address.
+   */
+  fio_str_info_s address;
+  /** The port on which to listen for other nodes, defaults to 3333. */
+  fio_str_info_s port;
+  /**
+   * A comma separated list of peer nodes (`"host:port,host:port"`).
+   *
+   * The list may include the node's own address (it will be ignored), so the
+   * same list could be used by all the nodes.
+   */
+  fio_str_info_s nodes;
+  /**
+   * A secret shared by all the nodes, used to authenticate peers.
+   *
+   * Peers that can't prove they know the secret are disconnected before they
+   * can subscribe or publish. The secret isn't sent over the network, but the
+   * messages aren't encrypted.
+   */
+  fio_str_info_s secret;
+  /** A `ping` will be sent every `ping_interval` interval or inactivity. */
+  uint8_t ping_interval;
+};
+
+/**
+ * See the {fio.h} file for documentation about engines.
+ *
+ * Creates a Pub/Sub engine that connects facil.io applications ("nodes")
+ * directly to each other over TCP/IP, without an external Pub/Sub service.
+ *
+ * Each node informs its peers about the channels (and patterns) its processes
+ * are subscribed to, so a publication is only sent to nodes that have a
+ * subscriber for the message.
+ *
+ * Nodes authenticate each other using the `secret` shared by all the nodes.
+ * When listening on a non-local address, a secret should always be set.
+ *
+ * The engine is active only after facil.io starts running.
+ *
+ * A `ping` will be sent every `ping_interval` interval or inactivity. The
+ * default value (0) will fallback to facil.io's maximum time of inactivity (5
+ * minutes) before polling on the connection's protocol.
+ *
+ * Note: The node engine assumes it will stay alive until all the messages and
+ * callbacks have been called (or facil.io exits).
+ */
+fio_pubsub_engine_s *node_engine_create(struct node_engine_create_args);
+#define node_engine_create(...)                                                \
+  node_engine_create((struct node_engine_create_args){__VA_ARGS__})
+
+/** Returns the number of peer nodes currently connected to the engine. */
+size_t node_engine_count(fio_pubsub_engine_s *engine);
+
+/**
+ * See the {fio.h} file for documentation about engines.
+ *
+ * function names speak for themselves ;-)
+ */
+void node_engine_destroy(fio_pubsub_engine_s *engine);
+
+/* support C++ */
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* H_NODE_ENGINE_H */
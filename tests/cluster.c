@@ -0,0 +1,121 @@
+/*
+Copyright: Boaz Segev, 2019
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+
+/*
+Tests the cluster's worker to root messaging, including the handover from the
+Unix socket to the shared memory rings.
+
+Each worker starts publishing sequenced messages to the root as soon as it
+starts (before the root confirmed the ring's binding) and keeps publishing
+more messages than the ring can hold, so messages are sent using both the
+socket and the ring. The root must receive every message, in order.
+
+Compile using (from the repository's root folder):
+
+    gcc -O2 -std=gnu11 -Ilib/facil -o tmp/cluster tests/cluster.c \
+        lib/facil/fio.c -lpthread -lm
+
+The exit code is 0 on success.
+*/
+#include <fio.h>
+
+#define TEST_WORKERS 4
+#define TEST_MESSAGES 16384
+/* the number of messages published by a worker on each tick */
+#define TEST_BURST 256
+#define TEST_CHANNEL "cluster/test"
+/* the number of milliseconds before the test fails */
+#define TEST_TIMEOUT 5000
+
+/* *****************************************************************************
+Worker processes
+***************************************************************************** */
+
+static size_t published;
+
+static void publish_burst(void *ignr) {
+  char buf[64];
+  for (size_t i = 0; i < TEST_BURST && published < TEST_MESSAGES; ++i) {
+    size_t len = (size_t)snprintf(buf, 64, "%d:%zu", (int)getpid(), published);
+    fio_publish(.engine = FIO_PUBSUB_ROOT,
+                .channel = {.data = TEST_CHANNEL, .len = strlen(TEST_CHANNEL)},
+                .message = {.data = buf, .len = len});
+    ++published;
+  }
+  (void)ignr;
+}
+
+static void on_start(void *ignr) {
+  if (!fio_is_worker())
+    return;
+  publish_burst(NULL);
+  fio_run_every(5, -1, publish_burst, NULL, NULL);
+  (void)ignr;
+}
+
+/* *****************************************************************************
+Root process
+***************************************************************************** */
+
+static struct {
+  int pid;
+  size_t next;
+} workers[TEST_WORKERS];
+static size_t received;
+static size_t ticks;
+static int failed;
+
+static void on_message(fio_msg_s *msg) {
+  int pid = atoi(msg->msg.data);
+  char *seq = strchr(msg->msg.data, ':');
+  size_t i = 0;
+  while (i < TEST_WORKERS && workers[i].pid && workers[i].pid != pid)
+    ++i;
+  if (i == TEST_WORKERS || !seq) {
+    fprintf(stderr, "FAILED: unexpected message %s\n", msg->msg.data);
+    failed = 1;
+    return;
+  }
+  workers[i].pid = pid;
+  if ((size_t)atol(seq + 1) != workers[i].next) {
+    fprintf(stderr, "FAILED: worker %d message %s, expected %zu\n", pid,
+            seq + 1, workers[i].next);
+    failed = 1;
+  }
+  workers[i].next = (size_t)atol(seq + 1) + 1;
+  ++received;
+}
+
+static void on_tick(void *ignr) {
+  if (fio_is_worker())
+    return;
+  ++ticks;
+  if (received == TEST_WORKERS * TEST_MESSAGES || ticks * 50 >= TEST_TIMEOUT)
+    fio_stop();
+  (void)ignr;
+}
+
+/* *****************************************************************************
+Main
+***************************************************************************** */
+
+int main(void) {
+  FIO_LOG_LEVEL = FIO_LOG_LEVEL_ERROR;
+  fio_subscribe(.channel = {.data = TEST_CHANNEL, .len = strlen(TEST_CHANNEL)},
+                .on_message = on_message);
+  fio_state_callback_add(FIO_CALL_ON_START, on_start, NULL);
+  fio_run_every(50, -1, on_tick, NULL, NULL);
+  fio_start(.threads = 1, .workers = TEST_WORKERS);
+  if (fio_is_worker())
+    return 0;
+  if (received != TEST_WORKERS * TEST_MESSAGES)
+    failed = 1;
+  fprintf(stderr, "%s: %zu/%d messages from %d workers.\n",
+          (failed ? "FAILED" : "PASSED"), received,
+          TEST_WORKERS * TEST_MESSAGES, TEST_WORKERS);
+  return failed;
+}
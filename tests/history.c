@@ -0,0 +1,168 @@
+/*
+Copyright: Boaz Segev, 2019
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+
+/*
+Tests the pub/sub channel history sequence numbers in a cluster.
+
+Every worker publishes messages to a channel with a history (set by the root
+before the workers are spawned). Once all the messages arrived, each worker
+replays its history and reports a digest of the sequence number -> message
+mapping to the root. All the workers must report the same digest.
+
+Compile using (from the repository's root folder):
+
+    gcc -O2 -std=gnu11 -Ilib/facil -o tmp/history tests/history.c \
+        lib/facil/fio.c -lpthread -lm
+
+The exit code is 0 on success.
+*/
+#include <fio.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_WORKERS 4
+#define TEST_MESSAGES 200
+#define TEST_CHANNEL "history/test"
+#define TEST_RESULTS "history/results"
+/* the number of milliseconds before the workers start publishing */
+#define TEST_DELAY 200
+/* the number of milliseconds before the test fails */
+#define TEST_TIMEOUT 5000
+
+/* *****************************************************************************
+Worker processes
+***************************************************************************** */
+
+static size_t published;
+static size_t received;
+static size_t replayed;
+static uint64_t received_digest;
+static uint64_t replayed_digest;
+static uint8_t replaying;
+static uint8_t reported;
+
+/* a digest that doesn't depend on the order of the messages */
+static uint64_t message_digest(fio_msg_s *msg) {
+  return fio_risky_hash(msg->msg.data, msg->msg.len, msg->sequence);
+}
+
+static void on_message(fio_msg_s *msg) {
+  ++received;
+  received_digest += message_digest(msg);
+}
+
+static void on_replay(fio_msg_s *msg) {
+  if (msg->sequence)
+    ++replayed;
+  replayed_digest += message_digest(msg);
+}
+
+static void on_tick(void *ignr) {
+  char buf[96];
+  (void)ignr;
+  if (published < TEST_MESSAGES) {
+    size_t len = (size_t)snprintf(buf, 96, "%d:%zu", (int)getpid(), published);
+    fio_publish(.channel = {.data = TEST_CHANNEL, .len = strlen(TEST_CHANNEL)},
+                .message = {.data = buf, .len = len});
+    ++published;
+    return;
+  }
+  if (received < TEST_WORKERS * TEST_MESSAGES)
+    return;
+  if (!replaying) {
+    fio_subscribe(.channel = {.data = TEST_CHANNEL,
+                              .len = strlen(TEST_CHANNEL)},
+                  .on_message = on_replay, .replay_since = 1);
+    replaying = 1;
+    return;
+  }
+  if (reported || replayed < TEST_WORKERS * TEST_MESSAGES)
+    return;
+  size_t len = (size_t)snprintf(
+      buf, 96, "%d:%llu:%llu", (int)getpid(),
+      (unsigned long long)received_digest, (unsigned long long)replayed_digest);
+  fio_publish(.engine = FIO_PUBSUB_ROOT,
+              .channel = {.data = TEST_RESULTS, .len = strlen(TEST_RESULTS)},
+              .message = {.data = buf, .len = len});
+  reported = 1;
+}
+
+static void start_publishing(void *ignr) {
+  fio_run_every(1, -1, on_tick, NULL, NULL);
+  (void)ignr;
+}
+
+static void on_start(void *ignr) {
+  if (!fio_is_worker())
+    return;
+  /* subscriptions reach the other processes asynchronously */
+  fio_run_every(TEST_DELAY, 1, start_publishing, NULL, NULL);
+  (void)ignr;
+}
+
+/* *****************************************************************************
+Root process
+***************************************************************************** */
+
+static size_t reports;
+static size_t ticks;
+static int failed;
+static unsigned long long expected;
+
+static void on_result(fio_msg_s *msg) {
+  char *pos = strchr(msg->msg.data, ':');
+  unsigned long long digest = strtoull(pos + 1, &pos, 10);
+  unsigned long long replay = strtoull(pos + 1, NULL, 10);
+  fprintf(stderr, "* worker %d: digest %llu\n", atoi(msg->msg.data), digest);
+  if (digest != replay) {
+    fprintf(stderr, "FAILED: the history doesn't match the messages.\n");
+    failed = 1;
+  }
+  if (!reports)
+    expected = digest;
+  else if (expected != digest) {
+    fprintf(stderr, "FAILED: workers numbered the messages differently.\n");
+    failed = 1;
+  }
+  ++reports;
+}
+
+static void on_root_tick(void *ignr) {
+  if (fio_is_worker())
+    return;
+  ++ticks;
+  if (reports == TEST_WORKERS || ticks * 50 >= TEST_TIMEOUT)
+    fio_stop();
+  (void)ignr;
+}
+
+/* *****************************************************************************
+Main
+***************************************************************************** */
+
+int main(void) {
+  FIO_LOG_LEVEL = FIO_LOG_LEVEL_ERROR;
+  fio_pubsub_history_set(
+      (fio_str_info_s){.data = TEST_CHANNEL, .len = strlen(TEST_CHANNEL)},
+      TEST_WORKERS * TEST_MESSAGES, 0);
+  fio_subscribe(.channel = {.data = TEST_CHANNEL, .len = strlen(TEST_CHANNEL)},
+                .on_message = on_message);
+  fio_subscribe(.channel = {.data = TEST_RESULTS, .len = strlen(TEST_RESULTS)},
+                .on_message = on_result);
+  fio_state_callback_add(FIO_CALL_ON_START, on_start, NULL);
+  fio_run_every(50, -1, on_root_tick, NULL, NULL);
+  fio_start(.threads = 1, .workers = TEST_WORKERS);
+  if (fio_is_worker())
+    return 0;
+  if (reports != TEST_WORKERS)
+    failed = 1;
+  fprintf(stderr, "%s: %zu/%d workers kept the same history.\n",
+          (failed ? "FAILED" : "PASSED"), reports, TEST_WORKERS);
+  return failed;
+}
@@ -4,13 +4,21 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #define TEST_CYCLES_START 128
 #define TEST_CYCLES_END 256
 #define TEST_CYCLES_REPEAT 3
 #define REPEAT_LIB_TEST 0
 
+#define MIXED_ROUNDS 512
+#define MIXED_ALLOCATIONS 4096
+#define MIXED_KEEP_EVERY 64 /* every 64th allocation is long-lived */
+#define MIXED_LONG_LIVED 2048
+#define MIXED_SIZE_MASK 1023 /* allocations are 16 to 1039 bytes long */
+
 static size_t test_mem_functions(void *(*malloc_func)(size_t),
                                  void *(*calloc_func)(size_t, size_t),
                                  void *(*realloc_func)(void *, size_t),
@@ -133,6 +141,104 @@ static size_t test_mem_functions(void *(*malloc_func)(size_t),
   return clock_alloc + clock_realloc + clock_free + clock_calloc + clock_free2;
 }
 
+/* returns the process's resident memory (in bytes), if available */
+static size_t test_rss(void) {
+  size_t pages = 0, rss = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return 0;
+  if (fscanf(f, "%zu %zu", &pages, &rss) != 2)
+    rss = 0;
+  fclose(f);
+  return rss * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/* marks an allocation, so it can be tested after other allocations are made */
+static void test_stamp(void *p, size_t size) {
+  memcpy(p, &size, sizeof(size));
+  ((unsigned char *)p)[size - 1] = (unsigned char)(size ^ 0x5A);
+}
+
+/* tests that an allocation's mark wasn't overwritten */
+static int test_stamp_valid(void *p) {
+  size_t size;
+  memcpy(&size, p, sizeof(size));
+  return size >= 16 && size <= MIXED_SIZE_MASK + 16 &&
+         ((unsigned char *)p)[size - 1] == (unsigned char)(size ^ 0x5A);
+}
+
+/* short lived allocations, with a few long-lived allocations between them */
+static void test_mixed_lifetime(void *(*malloc_func)(size_t),
+                                void (*free_func)(void *)) {
+  void **pointers = malloc_func(sizeof(*pointers) * MIXED_ALLOCATIONS);
+  void **long_lived = malloc_func(sizeof(*long_lived) * MIXED_LONG_LIVED);
+  size_t long_pos = 0, errors = 0, live = 0;
+  uint64_t seed = 1;
+  memset(long_lived, 0, sizeof(*long_lived) * MIXED_LONG_LIVED);
+  /* the facil.io allocator reports the memory it hands out */
+  const fio_malloc_stats_s stats_start = fio_malloc_stats(NULL, 0);
+  const size_t rss_start = test_rss();
+  clock_t start = clock();
+  for (int round = 0; round < MIXED_ROUNDS; ++round) {
+    for (int j = 0; j < MIXED_ALLOCATIONS; ++j) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      const size_t size = ((seed >> 33) & MIXED_SIZE_MASK) + 16;
+      pointers[j] = malloc_func(size);
+      if (!pointers[j]) {
+        ++errors;
+        continue;
+      }
+      test_stamp(pointers[j], size);
+      ++live;
+    }
+    for (int j = 0; j < MIXED_ALLOCATIONS; ++j) {
+      if (!pointers[j])
+        continue;
+      if ((j % MIXED_KEEP_EVERY)) {
+        free_func(pointers[j]);
+        --live;
+        continue;
+      }
+      /* replace the oldest long-lived allocation */
+      if (long_lived[long_pos]) {
+        FIO_ASSERT(test_stamp_valid(long_lived[long_pos]),
+                   "long-lived allocation corrupted (round %d)", round);
+        free_func(long_lived[long_pos]);
+        --live;
+      }
+      long_lived[long_pos] = pointers[j];
+      long_pos = (long_pos + 1) % MIXED_LONG_LIVED;
+    }
+  }
+  clock_t end = clock() - start;
+  const size_t rss_end = test_rss();
+  for (int j = 0; j < MIXED_LONG_LIVED; ++j) {
+    if (!long_lived[j])
+      continue;
+    FIO_ASSERT(test_stamp_valid(long_lived[j]),
+               "long-lived allocation %d corrupted", j);
+    free_func(long_lived[j]);
+    --live;
+  }
+  FIO_ASSERT(!live, "%zu allocations weren't freed", live);
+  free_func(long_lived);
+  free_func(pointers);
+  const fio_malloc_stats_s stats_end = fio_malloc_stats(NULL, 0);
+  FIO_ASSERT(stats_end.bytes_in_use <= stats_start.bytes_in_use &&
+                 stats_end.big_allocations <= stats_start.big_allocations,
+             "memory wasn't returned to the allocator (%zu bytes in use, "
+             "started with %zu)",
+             stats_end.bytes_in_use, stats_start.bytes_in_use);
+  fprintf(stderr,
+          "* Avrg. clock count for a mixed-lifetime round: %zu\n"
+          "* Resident memory growth (mixed-lifetime): %zu Kb (%zu Kb live)\n",
+          (size_t)(end / MIXED_ROUNDS),
+          (size_t)(rss_end > rss_start ? (rss_end - rss_start) >> 10 : 0),
+          (size_t)(MIXED_LONG_LIVED * (16 + (MIXED_SIZE_MASK >> 1))) >> 10);
+  if (errors)
+    fprintf(stderr, "* Failed allocations (mixed-lifetime): %zu\n", errors);
+}
+
 void *test_system_malloc(void *ignr) {
   (void)ignr;
   uintptr_t result = test_mem_functions(malloc, calloc, realloc, free);
@@ -162,6 +268,7 @@ int main(void) {
   FIO_ASSERT(pthread_join(thread2, &thrd_result) == 0, "Couldn't join thread");
   system += (uintptr_t)thrd_result;
   fprintf(stderr, "Total Cycles: %zu\n", system);
+  test_mixed_lifetime(malloc, free);
 
   /* test facil.io allocations */
   fprintf(stderr, "\n===== Performance Testing facil.io memory allocator "
@@ -173,6 +280,7 @@ int main(void) {
   FIO_ASSERT(pthread_join(thread2, &thrd_result) == 0, "Couldn't join thread");
   fio += (uintptr_t)thrd_result;
   fprintf(stderr, "Total Cycles: %zu\n", fio);
+  test_mixed_lifetime(fio_malloc, fio_free);
 
   return 0; // fio > system;
 }
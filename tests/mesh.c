@@ -0,0 +1,129 @@
+/*
+Copyright: Boaz Segev, 2019
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+
+/*
+Tests the cluster's worker mesh (workers publishing directly to each other).
+
+Every worker publishes sequenced messages to a channel all the workers are
+subscribed to and counts the publications that were sent over the mesh rings
+(rather than routed through the root). Each worker must receive every message
+and must have published most of its messages over the mesh.
+
+The test requires access to the mesh's internal state, so it includes the
+facil.io source file. Compile using (from the repository's root folder):
+
+    gcc -O2 -std=gnu11 -Ilib/facil -o tmp/mesh tests/mesh.c -lpthread -lm
+
+The exit code is 0 on success.
+*/
+#include <fio.c>
+
+#define TEST_WORKERS 4
+#define TEST_MESSAGES 2000
+/* the number of messages published by a worker on each tick */
+#define TEST_BURST 50
+#define TEST_CHANNEL "mesh/test"
+#define TEST_RESULTS "mesh/results"
+/* the number of milliseconds before the test fails */
+#define TEST_TIMEOUT 5000
+
+/* *****************************************************************************
+Worker processes
+***************************************************************************** */
+
+static size_t published;
+static size_t direct;
+static size_t received;
+static uint8_t reported;
+
+static void on_message(fio_msg_s *msg) {
+  ++received;
+  (void)msg;
+}
+
+static void publish_burst(void *ignr) {
+  char buf[64];
+  for (size_t i = 0; i < TEST_BURST && published < TEST_MESSAGES; ++i) {
+    size_t len = (size_t)snprintf(buf, 64, "%d:%zu", (int)getpid(), published);
+    fio_publish(.channel = {.data = TEST_CHANNEL, .len = strlen(TEST_CHANNEL)},
+                .message = {.data = buf, .len = len});
+    /* the mesh is deactivated whenever a message is routed through the root */
+    if (fio_cluster_mesh.mode)
+      ++direct;
+    ++published;
+  }
+  if (published == TEST_MESSAGES && !reported &&
+      received == TEST_WORKERS * TEST_MESSAGES) {
+    size_t len = (size_t)snprintf(buf, 64, "%d:%zu:%zu", (int)getpid(), direct,
+                                  received);
+    fio_publish(.engine = FIO_PUBSUB_ROOT,
+                .channel = {.data = TEST_RESULTS, .len = strlen(TEST_RESULTS)},
+                .message = {.data = buf, .len = len});
+    reported = 1;
+  }
+  (void)ignr;
+}
+
+static void on_start(void *ignr) {
+  if (!fio_is_worker())
+    return;
+  fio_run_every(5, -1, publish_burst, NULL, NULL);
+  (void)ignr;
+}
+
+/* *****************************************************************************
+Root process
+***************************************************************************** */
+
+static size_t reports;
+static size_t ticks;
+static int failed;
+
+static void on_result(fio_msg_s *msg) {
+  int pid = atoi(msg->msg.data);
+  char *pos = strchr(msg->msg.data, ':');
+  size_t count = (size_t)atol(pos + 1);
+  pos = strchr(pos + 1, ':');
+  fprintf(stderr, "* worker %d: %zu/%d published directly, %zu received.\n",
+          pid, count, TEST_MESSAGES, (size_t)atol(pos + 1));
+  if (count < TEST_MESSAGES / 2) {
+    fprintf(stderr, "FAILED: worker %d didn't publish over the mesh.\n", pid);
+    failed = 1;
+  }
+  ++reports;
+}
+
+static void on_tick(void *ignr) {
+  if (fio_is_worker())
+    return;
+  ++ticks;
+  if (reports == TEST_WORKERS || ticks * 50 >= TEST_TIMEOUT)
+    fio_stop();
+  (void)ignr;
+}
+
+/* *****************************************************************************
+Main
+***************************************************************************** */
+
+int main(void) {
+  FIO_LOG_LEVEL = FIO_LOG_LEVEL_ERROR;
+  fio_subscribe(.channel = {.data = TEST_CHANNEL, .len = strlen(TEST_CHANNEL)},
+                .on_message = on_message);
+  fio_subscribe(.channel = {.data = TEST_RESULTS, .len = strlen(TEST_RESULTS)},
+                .on_message = on_result);
+  fio_state_callback_add(FIO_CALL_ON_START, on_start, NULL);
+  fio_run_every(50, -1, on_tick, NULL, NULL);
+  fio_start(.threads = 1, .workers = TEST_WORKERS);
+  if (fio_is_worker())
+    return 0;
+  if (reports != TEST_WORKERS)
+    failed = 1;
+  fprintf(stderr, "%s: %zu/%d workers published over the mesh.\n",
+          (failed ? "FAILED" : "PASSED"), reports, TEST_WORKERS);
+  return failed;
+}
@@ -0,0 +1,335 @@
+/*
+Copyright: Boaz Segev, 2019
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+
+/*
+Tests the node Pub/Sub engine using a few processes on localhost.
+
+A few nodes sharing a secret connect to each other and publish a message each,
+so every node should receive every message. An intruder node (using the wrong
+secret) and a raw TCP client that skips the authentication must be rejected
+without receiving any message.
+
+A relay client (connecting to two nodes and passing one node's challenge to
+the other) must not get an answer it could use to authenticate, and a client
+declaring a large frame before authenticating must be disconnected.
+
+Compile using (from the repository's root folder):
+
+    gcc -O2 -std=gnu11 -Ilib/facil -Ilib/facil/nodes -o tmp/nodes \
+        tests/nodes.c lib/facil/fio.c lib/facil/nodes/node_engine.c \
+        -lpthread -lm
+
+The test uses the ports 3331-3334. The exit code is 0 on success.
+*/
+#include <fio.h>
+#include <node_engine.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define TEST_NODES 3
+#define TEST_PORT 3331
+#define TEST_SECRET "node test secret"
+#define TEST_CHANNEL "nodes/test"
+/* the number of milliseconds each node runs */
+#define TEST_RUNTIME 3000
+
+/* *****************************************************************************
+Node processes
+***************************************************************************** */
+
+static fio_pubsub_engine_s *engine;
+static size_t received;
+static size_t expected_peers;
+static size_t max_peers;
+static size_t ticks;
+static size_t connected;
+
+static void on_message(fio_msg_s *msg) {
+  ++received;
+  FIO_LOG_DEBUG("(%d) got %s", (int)getpid(), msg->msg.data);
+}
+
+static void on_tick(void *ignr) {
+  size_t count = node_engine_count(engine);
+  if (count > max_peers)
+    max_peers = count;
+  ++ticks;
+  if (ticks * 50 >= TEST_RUNTIME) {
+    fio_stop();
+    return;
+  }
+  if (!expected_peers || count < expected_peers) {
+    connected = 0;
+    return;
+  }
+  /* give the peers' subscription interest time to arrive */
+  if (++connected == 5) {
+    char buf[32];
+    size_t len = (size_t)snprintf(buf, 32, "token-123 from %d", (int)getpid());
+    fio_publish(.channel = {.data = TEST_CHANNEL, .len = strlen(TEST_CHANNEL)},
+                .message = {.data = buf, .len = len});
+  }
+  (void)ignr;
+}
+
+/** runs a node, returning its exit code. */
+static int run_node(size_t index, const char *secret) {
+  char port[16];
+  char list[128];
+  size_t pos = 0;
+  snprintf(port, 16, "%d", (int)(TEST_PORT + index));
+  for (size_t i = 0; i < TEST_NODES; ++i)
+    pos += (size_t)snprintf(list + pos, 128 - pos, "%slocalhost:%d",
+                            (i ? "," : ""), (int)(TEST_PORT + i));
+  engine = node_engine_create(.port = {.data = port},
+                              .nodes = {.data = list},
+                              .secret = {.data = (char *)secret});
+  FIO_PUBSUB_DEFAULT = engine;
+  expected_peers = (index < TEST_NODES ? TEST_NODES - 1 : 0);
+  fio_subscribe(.channel = {.data = TEST_CHANNEL, .len = strlen(TEST_CHANNEL)},
+                .on_message = on_message);
+  fio_run_every(50, -1, on_tick, NULL, NULL);
+  fio_start(.threads = 1, .workers = 1);
+  if (index < TEST_NODES) {
+    if (received != TEST_NODES) {
+      fprintf(stderr, "FAILED: node %zu received %zu/%d messages.\n", index,
+              received, TEST_NODES);
+      return 1;
+    }
+    return 0;
+  }
+  if (received || max_peers) {
+    fprintf(stderr,
+            "FAILED: intruder received %zu messages (%zu connections).\n",
+            received, max_peers);
+    return 1;
+  }
+  return 0;
+}
+
+/* *****************************************************************************
+A raw client that doesn't authenticate
+***************************************************************************** */
+
+static void frame_write(char *dest, uint32_t type, int32_t filter,
+                        uint32_t ch_len, uint32_t msg_len) {
+  fio_u2str32((uint8_t *)dest, ch_len);
+  fio_u2str32((uint8_t *)dest + 4, msg_len);
+  fio_u2str32((uint8_t *)dest + 8, type);
+  fio_u2str32((uint8_t *)dest + 12, (uint32_t)filter);
+}
+
+/** returns 0 if the node disconnected the client without publishing to it. */
+static int run_raw_client(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(TEST_PORT)};
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    perror("FAILED: raw client couldn't connect");
+    return 1;
+  }
+  /* HELLO (id + challenge), followed by a subscription to everything */
+  char request[16 + 8 + 16 + 16] = {0};
+  frame_write(request, 0x200, 0, 8, 16);
+  request[16] = 1;
+  frame_write(request + 40, 6, 1, 0, 0);
+  if (write(fd, request, sizeof(request)) != (ssize_t)sizeof(request)) {
+    perror("FAILED: raw client couldn't write");
+    close(fd);
+    return 1;
+  }
+  char buf[4096];
+  size_t pos = 0;
+  int ret = 1;
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  while (poll(&pfd, 1, TEST_RUNTIME) == 1) {
+    ssize_t r = read(fd, buf + pos, sizeof(buf) - pos);
+    if (r <= 0) {
+      ret = 0; /* disconnected */
+      break;
+    }
+    pos += r;
+    for (size_t i = 0; i + 9 <= pos; ++i) {
+      if (!memcmp(buf + i, "token-123", 9)) {
+        fprintf(stderr, "FAILED: raw client received a publication.\n");
+        close(fd);
+        return 1;
+      }
+    }
+    if (pos == sizeof(buf))
+      pos = 0;
+  }
+  if (ret)
+    fprintf(stderr, "FAILED: raw client wasn't disconnected.\n");
+  close(fd);
+  return ret;
+}
+
+/* *****************************************************************************
+A relay client, using one node to answer another node's challenge
+***************************************************************************** */
+
+/** connects to a node, returning the socket or -1. */
+static int node_connect(size_t index) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(TEST_PORT + index)};
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    perror("FAILED: relay client couldn't connect");
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/** reads `len` bytes, returning -1 on disconnection or timeout. */
+static int read_exact(int fd, char *dest, size_t len) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  while (len) {
+    if (poll(&pfd, 1, 1000) != 1)
+      return -1;
+    ssize_t r = read(fd, dest, len);
+    if (r <= 0)
+      return -1;
+    dest += r;
+    len -= r;
+  }
+  return 0;
+}
+
+/** reads a frame's payload to `dest`, returning its type or -1. */
+static int frame_read(int fd, char *dest, size_t limit) {
+  char header[16];
+  if (read_exact(fd, header, 16))
+    return -1;
+  size_t len = (size_t)fio_str2u32(header) + fio_str2u32(header + 4);
+  if (len > limit || read_exact(fd, dest, len))
+    return -1;
+  return (int)fio_str2u32(header + 8);
+}
+
+/** returns 0 if the relayed challenge wasn't answered (or didn't help). */
+static int run_relay_client(void) {
+  char hello_a[24], hello_b[24], buf[256];
+  char frames[(16 + 24) + (16 + 32)];
+  int ret = 0;
+  int a = node_connect(0);
+  int b = node_connect(1);
+  if (a == -1 || b == -1)
+    goto error;
+  /* both nodes send their id and challenge */
+  if (frame_read(a, hello_a, 24) != 0x200 ||
+      frame_read(b, hello_b, 24) != 0x200)
+    goto error;
+  /* ask node B to answer node A's challenge */
+  frame_write(frames, 0x200, 0, 8, 16);
+  memcpy(frames + 16, "relay-id", 8);
+  memcpy(frames + 24, hello_a + 8, 16);
+  if (write(b, frames, 40) != 40)
+    goto error;
+  int type;
+  while ((type = frame_read(b, buf, sizeof(buf))) == 10)
+    ;
+  if (type != 0x201)
+    goto finish;
+  fprintf(stderr, "FAILED: node answered an unauthenticated challenge.\n");
+  ret = 1;
+  /* use node B's answer to authenticate with node A as node B */
+  frame_write(frames, 0x200, 0, 8, 16);
+  memcpy(frames + 16, hello_b, 24);
+  frame_write(frames + 40, 0x201, 0, 0, 32);
+  memcpy(frames + 56, buf, 32);
+  if (write(a, frames, sizeof(frames)) != (ssize_t)sizeof(frames))
+    goto finish;
+  while ((type = frame_read(a, buf, sizeof(buf))) == 10)
+    ;
+  if (type != -1)
+    fprintf(stderr, "FAILED: relayed answer was accepted (frame %d).\n",
+            type);
+finish:
+  close(a);
+  close(b);
+  return ret;
+error:
+  fprintf(stderr, "FAILED: relay client handshake error.\n");
+  if (a != -1)
+    close(a);
+  if (b != -1)
+    close(b);
+  return 1;
+}
+
+/** returns 0 if a client declaring a large frame was disconnected. */
+static int run_large_frame_client(void) {
+  char header[16];
+  char buf[64];
+  int fd = node_connect(0);
+  if (fd == -1)
+    return 1;
+  frame_write(header, 0, 0, 0, 1024 * 1024);
+  int ret = (write(fd, header, 16) != 16);
+  while (!ret && frame_read(fd, buf, sizeof(buf)) != -1)
+    ;
+  /* the connection must be closed, not just quiet */
+  if (!ret && recv(fd, buf, 1, MSG_DONTWAIT) != 0) {
+    fprintf(stderr, "FAILED: large frame client wasn't disconnected.\n");
+    ret = 1;
+  }
+  close(fd);
+  return ret;
+}
+
+/* *****************************************************************************
+Main
+***************************************************************************** */
+
+int main(int argc, char const *argv[]) {
+  pid_t pids[TEST_NODES + 1];
+  int failed = 0;
+  FIO_LOG_LEVEL = FIO_LOG_LEVEL_ERROR;
+  if (argc == 2) {
+    /* a node process (the node engine requires a fresh Root process) */
+    size_t i = (size_t)atol(argv[1]);
+    return run_node(i, (i < TEST_NODES ? TEST_SECRET : "wrong secret"));
+  }
+  for (size_t i = 0; i <= TEST_NODES; ++i) {
+    pids[i] = fork();
+    if (pids[i] == -1) {
+      perror("FAILED: couldn't fork");
+      return 1;
+    }
+    if (!pids[i]) {
+      char index[16];
+      snprintf(index, 16, "%zu", i);
+      /* facil.io signals its process group when stopping */
+      setpgid(0, 0);
+      execl(argv[0], argv[0], index, (char *)NULL);
+      perror("FAILED: couldn't start node");
+      exit(1);
+    }
+  }
+  usleep(500000);
+  failed |= run_raw_client();
+  failed |= run_relay_client();
+  failed |= run_large_frame_client();
+  for (size_t i = 0; i <= TEST_NODES; ++i) {
+    int status = 0;
+    waitpid(pids[i], &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      failed = 1;
+  }
+  fprintf(stderr, "%s: %d nodes, an intruder, a raw and a relay client.\n",
+          (failed ? "FAILED" : "PASSED"), TEST_NODES);
+  return failed;
+}